@@ -0,0 +1,152 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+/*
+    The CMake build target for this is "bench_notify_mr", do "make help" in the
+    _library's_ build directory to see that.
+
+    It times CipMessageRouterClass::NotifyMR() on requests already parsed,
+    i.e. the message router's per request overhead of finding the class,
+    service and instance plus a small service, without any networking.
+    Parsing the same requests with DeserializeMRReq() is timed separately.
+    Usage: bench_notify_mr [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "test_common.h"
+
+
+//-----<Application>------------------------------------------------------------
+
+#define INPUT_ASSEMBLY      100
+
+static uint8_t  s_input[32];
+
+
+static void createAssembly()
+{
+    CreateAssemblyInstance( INPUT_ASSEMBLY, ByteBuf( s_input, sizeof s_input ) );
+}
+
+//-----</Application>-----------------------------------------------------------
+
+
+struct Case
+{
+    const char*     name;
+    CIPServiceCode  service;
+    int             class_id;
+    int             instance_id;
+    int             attribute_id;
+};
+
+
+static const Case s_cases[] = {
+    { "identity product name",  kGetAttributeSingle,    kCipIdentityClass,      1, 7 },
+    { "identity class revision",kGetAttributeSingle,    kCipIdentityClass,      0, 1 },
+    { "assembly data",          kGetAttributeSingle,    kCipAssemblyClass,      INPUT_ASSEMBLY, 3 },
+    { "unsupported service",    CIPServiceCode( 0x7f ), kCipIdentityClass,      1, 0 },
+    { "unknown class",          kGetAttributeSingle,    0x3ff,                  1, 1 },
+};
+
+
+static uint64_t now_nsecs()
+{
+    timespec    now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return uint64_t( now.tv_sec ) * 1000000000 + now.tv_nsec;
+}
+
+
+int main( int argc, char** argv )
+{
+    int iterations = argc > 1 ? atoi( argv[1] ) : 1000000;
+
+    if( iterations <= 0 )
+    {
+        fprintf( stderr, "usage: %s [iterations]\n", argv[0] );
+        return 2;
+    }
+
+    CipStackInit( 0x4321 );
+
+    createAssembly();
+
+    uint8_t     reply[600];
+    uint64_t    total = 0;
+
+    for( unsigned c = 0; c < DIM( s_cases ); ++c )
+    {
+        const Case& k = s_cases[c];
+
+        uint8_t     command[16];
+        BufWriter   w( command, sizeof command );
+
+        // service, path size in words and 16 bit logical segments
+        w.put8( k.service ).put8( k.attribute_id ? 6 : 4 );
+        w.put8( 0x21 ).put8( 0 ).put16( k.class_id );
+        w.put8( 0x25 ).put8( 0 ).put16( k.instance_id );
+
+        if( k.attribute_id )
+            w.put8( 0x31 ).put8( 0 ).put16( k.attribute_id );
+
+        BufReader                   serialized( command, w.data() - command );
+        CipMessageRouterRequest     request;
+        CipMessageRouterResponse    response( NULL, BufWriter( reply, sizeof reply ) );
+
+        if( request.DeserializeMRReq( serialized ) <= 0 )
+        {
+            fprintf( stderr, "%s: unable to parse the request\n", k.name );
+            return 1;
+        }
+
+        CipError    status = kCipErrorSuccess;
+        uint64_t    parse_start = now_nsecs();
+
+        for( int i = 0; i < iterations; ++i )
+            request.DeserializeMRReq( serialized );
+
+        double      parse_nsecs = double( now_nsecs() - parse_start ) / iterations;
+
+        for( int pass = 0; pass < 2; ++pass )
+        {
+            // the first pass warms up caches and lazily built state
+            int         count = pass ? iterations : iterations / 10 + 1;
+            uint64_t    start = now_nsecs();
+
+            for( int i = 0; i < count; ++i )
+            {
+                response.Clear();
+                response.SetWriter( BufWriter( reply, sizeof reply ) );
+
+                CipMessageRouterClass::NotifyMR( &request, &response );
+            }
+
+            if( pass )
+            {
+                uint64_t elapsed = now_nsecs() - start;
+
+                total += elapsed;
+                status = response.GenStatus();
+
+                printf( "%-24s %8.1f ns/request %6.1f ns/parse  status:0x%02x\n",
+                    k.name, double( elapsed ) / count, parse_nsecs, status );
+            }
+        }
+    }
+
+    printf( "%-24s %8.1f ns/request\n", "mean",
+        double( total ) / ( double( iterations ) * DIM( s_cases ) ) );
+
+    ShutdownCipStack();
+
+    return 0;
+}
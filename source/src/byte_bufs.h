@@ -130,6 +130,14 @@ public:
 
     BufWriter& fill( size_t aCount, uint8_t aValue = 0 );
 
+    /**
+     * Function reserve
+     * skips over @a aCount bytes and returns a BufWriter for just those, so a
+     * field whose value depends on what follows it, e.g. a length, can be
+     * back-patched once that is serialized rather than counted beforehand.
+     */
+    BufWriter reserve( size_t aCount );
+
 protected:
     uint8_t*    start;
     uint8_t*    limit;          // points to one past last byte
@@ -48,9 +48,9 @@ public:
      */
     static bool AddExpectation( int output_assembly, int input_assembly, int config_assembly )
     {
-        if( s_exclusive_owner.size() < CIPSTER_CIP_NUM_EXCLUSIVE_OWNER_CONNS )
+        if( expectations().size() < CIPSTER_CIP_NUM_EXCLUSIVE_OWNER_CONNS )
         {
-            s_exclusive_owner.push_back(
+            expectations().push_back(
                 ExclusiveOwner( output_assembly, input_assembly, config_assembly ) );
             return true;
         }
@@ -58,7 +58,7 @@ public:
         return false;
     }
 
-    static void Clear()    { s_exclusive_owner.clear(); }
+    static void Clear()    { expectations().clear(); }
 
     typedef std::vector<ExclusiveOwner>::iterator     iterator;
 
@@ -68,7 +68,8 @@ private:
     int     config_assembly;    ///< the config point for the connection
     CipConn connection;         ///< the connection data, only one connection is allowed per O-to-T point
 
-    static std::vector<ExclusiveOwner>  s_exclusive_owner;
+    /// Return the current stack's expectations.
+    static std::vector<ExclusiveOwner>& expectations();
 };
 
 
@@ -97,9 +98,9 @@ public:
 
     static bool AddExpectation( int output_assembly, int input_assembly, int config_assembly )
     {
-        if( s_input_only.size() < CIPSTER_CIP_NUM_INPUT_ONLY_CONNS )
+        if( expectations().size() < CIPSTER_CIP_NUM_INPUT_ONLY_CONNS )
         {
-            s_input_only.push_back(
+            expectations().push_back(
                     InputOnlyConnSet( output_assembly, input_assembly, config_assembly ) );
             return true;
         }
@@ -109,7 +110,7 @@ public:
 
     static CipConn* GetConnection( ConnectionData* aConnData, ConnMgrStatus* aExtError );
 
-    static void Clear()     { s_input_only.clear(); }
+    static void Clear()     { expectations().clear(); }
 
     typedef std::vector<InputOnlyConnSet>::iterator     iterator;
 
@@ -120,7 +121,8 @@ private:
 
     CipConn connection[CIPSTER_CIP_NUM_INPUT_ONLY_CONNS_PER_CON_PATH]; ///< the connection data
 
-    static std::vector<InputOnlyConnSet>    s_input_only;
+    /// Return the current stack's expectations.
+    static std::vector<InputOnlyConnSet>& expectations();
 };
 
 
@@ -154,9 +156,9 @@ public:
 
     static bool AddExpectation( int output_assembly, int input_assembly, int config_assembly )
     {
-        if( s_listen_only.size() < CIPSTER_CIP_NUM_LISTEN_ONLY_CONNS )
+        if( expectations().size() < CIPSTER_CIP_NUM_LISTEN_ONLY_CONNS )
         {
-            s_listen_only.push_back(
+            expectations().push_back(
                 ListenOnlyConnSet( output_assembly, input_assembly, config_assembly ) );
             return true;
         }
@@ -164,7 +166,7 @@ public:
         return false;
     }
 
-    static void Clear()     { s_listen_only.clear(); }
+    static void Clear()     { expectations().clear(); }
 
     static CipConn* GetConnection( ConnectionData* aConnData, ConnMgrStatus* aExtError );
 
@@ -177,18 +179,52 @@ private:
 
     CipConn connection[CIPSTER_CIP_NUM_LISTEN_ONLY_CONNS_PER_CON_PATH];    ///< the connection data
 
-    static std::vector<ListenOnlyConnSet>       s_listen_only;
+    /// Return the current stack's expectations.
+    static std::vector<ListenOnlyConnSet>& expectations();
 };
 
 
-std::vector<ExclusiveOwner>         ExclusiveOwner::s_exclusive_owner;
-std::vector<InputOnlyConnSet>       InputOnlyConnSet::s_input_only;
-std::vector<ListenOnlyConnSet>      ListenOnlyConnSet::s_listen_only;
+/**
+ * Struct AppConnTypeState
+ * is the application connection types' share of a StackContext.
+ */
+struct AppConnTypeState : public StackState
+{
+    std::vector<ExclusiveOwner>     exclusive_owner;
+    std::vector<InputOnlyConnSet>   input_only;
+    std::vector<ListenOnlyConnSet>  listen_only;
+};
+
+
+static StackStateType<AppConnTypeState> s_app_conn_type_state( kStackStateAppConnTypes );
+
+static inline AppConnTypeState& appConnTypes()
+{
+    return StackContext::Current().State<AppConnTypeState>( kStackStateAppConnTypes );
+}
+
+
+std::vector<ExclusiveOwner>& ExclusiveOwner::expectations()
+{
+    return appConnTypes().exclusive_owner;
+}
+
+
+std::vector<InputOnlyConnSet>& InputOnlyConnSet::expectations()
+{
+    return appConnTypes().input_only;
+}
+
+
+std::vector<ListenOnlyConnSet>& ListenOnlyConnSet::expectations()
+{
+    return appConnTypes().listen_only;
+}
 
 
 CipConn* ExclusiveOwner::GetConnection( ConnectionData* aConnData, ConnMgrStatus* aExtError )
 {
-    for( ExclusiveOwner::iterator it = s_exclusive_owner.begin();  it != s_exclusive_owner.end();  ++it )
+    for( ExclusiveOwner::iterator it = expectations().begin();  it != expectations().end();  ++it )
     {
         if( it->output_assembly == aConnData->ConsumingPath().GetInstanceOrConnPt()
          && it->input_assembly  == aConnData->ProducingPath().GetInstanceOrConnPt()
@@ -216,7 +252,7 @@ CipConn* ExclusiveOwner::GetConnection( ConnectionData* aConnData, ConnMgrStatus
 
 CipConn* InputOnlyConnSet::GetConnection( ConnectionData* aConnData, ConnMgrStatus* aExtError )
 {
-    for( InputOnlyConnSet::iterator it = s_input_only.begin();  it != s_input_only.end();  ++it )
+    for( InputOnlyConnSet::iterator it = expectations().begin();  it != expectations().end();  ++it )
     {
         // we have the same output assembly?
         if( it->output_assembly == aConnData->ConsumingPath().GetInstanceOrConnPt() )
@@ -257,7 +293,7 @@ CipConn* ListenOnlyConnSet::GetConnection( ConnectionData* aConnData, ConnMgrSta
         return NULL;
     }
 
-    for( ListenOnlyConnSet::iterator it = s_listen_only.begin();  it != s_listen_only.end(); ++it )
+    for( ListenOnlyConnSet::iterator it = expectations().begin();  it != expectations().end(); ++it )
     {
                 // we have the same output assembly?
         if( it->output_assembly == aConnData->ConsumingPath().GetInstanceOrConnPt() )
@@ -379,9 +415,9 @@ CipConn* GetIoConnectionForConnectionData( ConnectionData* aConnData, ConnMgrSta
 
 CipConn* GetExistingProducerMulticastConnection( int input_point )
 {
-    CipConnBox::iterator producer_multicast_connection = g_active_conns.begin();
+    CipConnBox::iterator producer_multicast_connection = ActiveConnections().begin();
 
-    while( producer_multicast_connection != g_active_conns.end() )
+    while( producer_multicast_connection != ActiveConnections().end() )
     {
         if( producer_multicast_connection->InstanceType() == kConnInstanceTypeIoExclusiveOwner
          || producer_multicast_connection->InstanceType() == kConnInstanceTypeIoInputOnly )
@@ -405,9 +441,9 @@ CipConn* GetExistingProducerMulticastConnection( int input_point )
 
 CipConn* GetNextNonControlMasterConnection( int input_point )
 {
-    CipConnBox::iterator c = g_active_conns.begin();
+    CipConnBox::iterator c = ActiveConnections().begin();
 
-    for( ;  c != g_active_conns.end();  ++c )
+    for( ;  c != ActiveConnections().end();  ++c )
     {
         if( c->InstanceType() == kConnInstanceTypeIoExclusiveOwner
          || c->InstanceType() == kConnInstanceTypeIoInputOnly )
@@ -430,9 +466,9 @@ CipConn* GetNextNonControlMasterConnection( int input_point )
 void CloseAllConnectionsForInputWithSameType(
         int input_point,  ConnInstanceType instance_type )
 {
-    CipConnBox::iterator c = g_active_conns.begin();
+    CipConnBox::iterator c = ActiveConnections().begin();
 
-    while( c != g_active_conns.end() )
+    while( c != ActiveConnections().end() )
     {
         if( instance_type == c->InstanceType() &&
             input_point   == c->ProducingPath().GetInstanceOrConnPt() )
@@ -455,19 +491,19 @@ void CloseAllConnectionsForInputWithSameType(
 
 void CloseAllConnections()
 {
-    while( g_active_conns.begin() != g_active_conns.end() )
+    while( ActiveConnections().begin() != ActiveConnections().end() )
     {
         // Close() removes the connection from the list.
-        g_active_conns.begin()->Close();
+        ActiveConnections().begin()->Close();
     }
 }
 
 
 bool ConnectionWithSameConfigPointExists( int config_point )
 {
-    CipConnBox::iterator c = g_active_conns.begin();
+    CipConnBox::iterator c = ActiveConnections().begin();
 
-    for( ; c != g_active_conns.end(); ++c )
+    for( ; c != ActiveConnections().end(); ++c )
     {
         if( config_point == c->ConfigPath().GetInstanceOrConnPt() )
         {
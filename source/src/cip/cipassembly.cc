@@ -5,6 +5,7 @@
  ******************************************************************************/
 
 //#include <string.h>    //needed for memcpy
+#include <thread>
 
 #include "cipassembly.h"
 
@@ -18,11 +19,117 @@
 
 AssemblyInstance::AssemblyInstance( int aInstanceId, ByteBuf aBuffer ) :
     CipInstance( aInstanceId ),
-    byte_array( aBuffer )
+    byte_array( aBuffer ),
+    rx_time_nsecs( 0 ),
+    seq_locked( false ),
+    seq( 0 ),
+    image_role( kImageNone ),
+    image_other( NULL ),
+    image_latched( 0 )
 {
 }
 
 
+/**
+ * Struct AssemblyState
+ * is the assembly class's share of a StackContext.
+ */
+struct AssemblyState : public StackState
+{
+    std::vector<AssemblyInstance*>  consumed_image;
+    std::vector<AssemblyInstance*>  produced_image;
+};
+
+
+static StackStateType<AssemblyState> s_assembly_state( kStackStateAssemblies );
+
+static inline AssemblyState& assemblies()
+{
+    return StackContext::Current().State<AssemblyState>( kStackStateAssemblies );
+}
+
+
+CipAssemblyClass::Assemblies& CipAssemblyClass::consumedImage()
+{
+    return assemblies().consumed_image;
+}
+
+
+CipAssemblyClass::Assemblies& CipAssemblyClass::producedImage()
+{
+    return assemblies().produced_image;
+}
+
+
+bool AssemblyInstance::JoinProcessImage( ImageRole aRole, uint8_t* aSecondBuffer )
+{
+    if( image_role != kImageNone || seq_locked || aRole == kImageNone )
+        return false;
+
+    image_role  = aRole;
+    image_other = aSecondBuffer;
+
+    if( aRole == kImageConsumed )
+        CipAssemblyClass::consumedImage().push_back( this );
+    else
+        CipAssemblyClass::producedImage().push_back( this );
+
+    return true;
+}
+
+
+unsigned AssemblyInstance::Snapshot( uint8_t* aDst ) const
+{
+    if( !IsSeqAccessed() )
+    {
+        memcpy( aDst, byte_array.data(), SizeBytes() );
+        return seq.load( std::memory_order_relaxed ) / 2;
+    }
+
+    for( int tries = 0;  ;  ++tries )
+    {
+        // Writers keep overlapping, or one was preempted mid copy: let it run.
+        if( tries >= CIPSTER_SNAPSHOT_RETRIES )
+            std::this_thread::yield();
+
+        unsigned before = seq.load( std::memory_order_acquire );
+
+        if( !( before & 1 ) )
+        {
+            memcpy( aDst, byte_array.data(), SizeBytes() );
+
+            std::atomic_thread_fence( std::memory_order_acquire );
+
+            if( seq.load( std::memory_order_relaxed ) == before )
+                return before / 2;
+        }
+    }
+}
+
+
+void AssemblyInstance::Publish( const uint8_t* aSrc, unsigned aCount )
+{
+    CIPSTER_ASSERT( aCount <= SizeBytes() );
+
+    if( !IsSeqAccessed() )
+    {
+        memcpy( byte_array.data(), aSrc, aCount );
+        seq.store( seq.load( std::memory_order_relaxed ) + 2, std::memory_order_relaxed );
+        return;
+    }
+
+    // Only one thread writes, see the header, so this takes no lock.
+    unsigned count = seq.load( std::memory_order_relaxed );
+
+    seq.store( count + 1, std::memory_order_relaxed );      // now odd, readers retry
+    std::atomic_thread_fence( std::memory_order_release );
+
+    memcpy( byte_array.data(), aSrc, aCount );
+
+    seq.store( count + 2, std::memory_order_release );
+}
+
+
 EipStatus AssemblyInstance::RecvData( CipConn* aConn, BufReader aBuffer )
 {
     if( ( aConn->ConsumingNCP().IsFixed() && SizeBytes() != aBuffer.size()) ||
@@ -34,7 +141,16 @@ EipStatus AssemblyInstance::RecvData( CipConn* aConn, BufReader aBuffer )
         return kEipStatusError;
     }
 
-    memcpy( Buffer().data(), aBuffer.data(), aBuffer.size() );
+    if( image_role == kImageProduced )
+    {
+        CIPSTER_TRACE_ERR( "%s: assembly id: %d is written by EndScan()\n",
+            __func__, Id() );
+        return kEipStatusError;
+    }
+
+    Publish( aBuffer.data(), aBuffer.size() );
+
+    rx_time_nsecs = aConn->RxTimeNSecs();
 
     // notify application that new data arrived
     return AfterAssemblyDataReceived( this, aConn->Mode(), aBuffer.size() );
@@ -98,6 +214,44 @@ EipStatus CipAssemblyClass::Init()
 }
 
 
+int CipAssemblyClass::BeginScan()
+{
+    int count = 0;
+
+    Assemblies& consumed = consumedImage();
+
+    for( Assemblies::iterator it = consumed.begin();  it != consumed.end();  ++it )
+    {
+        AssemblyInstance* a = *it;
+
+        // Odd while the stack writes Buffer(), then this is the count before
+        // that write, which the next call latches.
+        unsigned published = a->seq.load( std::memory_order_acquire ) / 2;
+
+        if( published != a->image_latched )
+        {
+            a->image_latched = a->Snapshot( a->image_other );
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+
+void CipAssemblyClass::EndScan()
+{
+    Assemblies& produced = producedImage();
+
+    for( Assemblies::iterator it = produced.begin();  it != produced.end();  ++it )
+    {
+        AssemblyInstance* a = *it;
+
+        a->Publish( a->image_other, a->SizeBytes() );
+    }
+}
+
+
 EipStatus CipAssemblyClass::get_assembly_data_attr( CipInstance* aInstance, CipAttribute* attr,
         CipMessageRouterRequest* request, CipMessageRouterResponse* response )
 {
@@ -107,6 +261,19 @@ EipStatus CipAssemblyClass::get_assembly_data_attr( CipInstance* aInstance, CipA
     {
         // assembly has no length, my be for a heartbeat connection, nothing to do.
     }
+    else if( assembly->IsSeqAccessed() )
+    {
+        BeforeAssemblyDataSend( assembly );
+
+        BufWriter out = response->Writer();
+
+        uint8_t* image = out.data();
+
+        out += assembly->SizeBytes();   // overrun check
+        assembly->Snapshot( image );
+
+        response->SetWrittenSize( assembly->SizeBytes() );
+    }
     else
     {
         BeforeAssemblyDataSend( assembly );
@@ -128,6 +295,12 @@ EipStatus CipAssemblyClass::set_assembly_data_attr( CipInstance* aInstance, CipA
         CIPSTER_TRACE_WARN( "%s: received data for connected input assembly\n", __func__ );
         response->SetGenStatus( kCipErrorAttributeNotSetable );
     }
+    else if( assembly->Role() == kImageProduced )
+    {
+        // the application's EndScan() is its only writer
+        CIPSTER_TRACE_WARN( "%s: received data for process image output\n", __func__ );
+        response->SetGenStatus( kCipErrorAttributeNotSetable );
+    }
     else if( request->Data().size() < assembly->byte_array.size() )
     {
         CIPSTER_TRACE_INFO( "%s: not enough data received.\n", __func__ );
@@ -151,8 +324,7 @@ EipStatus CipAssemblyClass::set_assembly_data_attr( CipInstance* aInstance, CipA
             assembly->Id()
             );
 
-        memcpy( assembly->byte_array.data(), request->Data().data(),
-                assembly->byte_array.size() );
+        assembly->Publish( request->Data().data(), assembly->byte_array.size() );
 
         if( AfterAssemblyDataReceived( assembly,
                 kOpModeUnknown, request->Data().size() ) != kEipStatusOk )
@@ -6,11 +6,32 @@
 #ifndef CIPSTER_CIPASSEMBLY_H_
 #define CIPSTER_CIPASSEMBLY_H_
 
+#include <atomic>
+#include <vector>
+
 #include <typedefs.h>
 #include "ciptypes.h"
 #include "cipclass.h"
 
 
+#ifndef CIPSTER_SNAPSHOT_RETRIES
+/// Copies AssemblyInstance::Snapshot() tries before it yields to the writer between them.
+#define CIPSTER_SNAPSHOT_RETRIES    8
+#endif
+
+/**
+ * Enum ImageRole
+ * tells how an assembly takes part in the process image, see
+ * AssemblyInstance::JoinProcessImage().
+ */
+enum ImageRole
+{
+    kImageNone,         ///< updated as frames arrive, the default
+    kImageConsumed,     ///< O->T data, latched by CipAssemblyClass::BeginScan()
+    kImageProduced,     ///< T->O data, published by CipAssemblyClass::EndScan()
+};
+
+
 /**
  * Class AssemblyInstance
  * is extended from CipInstance with an extra kCipByteArray at the end.
@@ -27,6 +48,14 @@ public:
     unsigned SizeBytes() const      { return byte_array.size(); }
     const ByteBuf& Buffer() const   { return byte_array; }
 
+    /**
+     * Function RxTimeNSecs
+     * returns the arrival time of the frame which last wrote this assembly
+     * through an I/O connection, see CipConn::RxTimeNSecs().  Valid inside
+     * AfterAssemblyDataReceived().
+     */
+    uint64_t RxTimeNSecs() const    { return rx_time_nsecs; }
+
     /**
      * Function RecvData
      * notifies an AssemblyInstance that data has been received for it.
@@ -44,8 +73,90 @@ public:
      */
     EipStatus RecvData( CipConn* aConn, BufReader aInput );
 
+    /**
+     * Function SetSeqLocked
+     * opts this assembly into sequence locked access, for an application
+     * which reads or writes it from another thread than the stack's.  Then
+     * the application must read with Snapshot() and write with
+     * PostAssemblyWrite(), never through the buffer it gave
+     * CreateAssemblyInstance().  So only the stack writes it and neither
+     * side takes a lock.  A Snapshot() which overlaps a Publish() copies
+     * again, yielding between tries after CIPSTER_SNAPSHOT_RETRIES of them.
+     * Set it before NetworkHandlerInitialize().
+     *
+     * @return bool - false for a process image assembly, see JoinProcessImage().
+     */
+    bool SetSeqLocked( bool isEnabled )
+    {
+        if( image_role != kImageNone )
+            return false;
+
+        seq_locked = isEnabled;
+        return true;
+    }
+
+    bool IsSeqLocked() const                { return seq_locked; }
+
+    /**
+     * Function IsSeqAccessed
+     * returns true if the stack must read this assembly with Snapshot() and
+     * write it with Publish(): it is seq locked or in the process image.
+     */
+    bool IsSeqAccessed() const              { return seq_locked || image_role != kImageNone; }
+
+    /**
+     * Function Snapshot
+     * copies a complete image of SizeBytes() into @a aDst.
+     *
+     * @return unsigned - the publication count of that image, it changes with
+     *  every Publish() so a reader can tell whether anything new arrived.
+     */
+    unsigned Snapshot( uint8_t* aDst ) const;
+
+    /**
+     * Function Publish
+     * writes @a aCount bytes, not more than SizeBytes(), as one image.  It
+     * takes no lock, so a given assembly has one writing thread: the stack's
+     * for received data, Set_Attribute_Single and PostAssemblyWrite(), or
+     * the application's EndScan() for a kImageProduced one.
+     */
+    void Publish( const uint8_t* aSrc, unsigned aCount );
+
+    /**
+     * Function JoinProcessImage
+     * double buffers this assembly for scan synchronous access.  The stack
+     * keeps using Buffer() while the application works on Image(), which
+     * is @a aSecondBuffer of SizeBytes().  The two sides meet through
+     * Snapshot() and Publish(), never a lock.  The stack refuses to write a
+     * kImageProduced one, EndScan() does.  Not for a seq locked assembly.
+     *
+     * @return bool - false if already joined or seq locked.
+     */
+    bool JoinProcessImage( ImageRole aRole, uint8_t* aSecondBuffer );
+
+    ImageRole Role() const                  { return image_role; }
+
+    /**
+     * Function Image
+     * returns the application's side of a process image assembly: the
+     * inputs latched by the last BeginScan(), or the outputs which the next
+     * EndScan() publishes.  Outputs keep what the last scan wrote.
+     */
+    ByteBuf Image() const
+    {
+        return image_role == kImageNone ? byte_array : ByteBuf( image_other, SizeBytes() );
+    }
+
 protected:
     ByteBuf     byte_array;
+    uint64_t    rx_time_nsecs;
+
+    bool                    seq_locked;
+    std::atomic<unsigned>   seq;        // odd while a Publish() is in progress
+
+    ImageRole   image_role;
+    uint8_t*    image_other;    // the application's side, see Image()
+    unsigned    image_latched;  // kImageConsumed: publication count Image() holds
 };
 
 
@@ -54,6 +165,8 @@ protected:
 
 class CipAssemblyClass : public CipClass
 {
+    friend class AssemblyInstance;
+
 public:
     CipAssemblyClass();
 
@@ -72,7 +185,32 @@ public:
      */
     static EipStatus Init();
 
+    /**
+     * Function BeginScan
+     * latches the inputs of a scan: every kImageConsumed assembly which
+     * received data since the last call copies it into Image() with
+     * Snapshot(), while the stack keeps receiving into Buffer().  The
+     * others keep their Image(), as does one the stack is writing right
+     * now, which is latched by the next call.
+     *
+     * @return int - how many assemblies had new data.
+     */
+    static int BeginScan();
+
+    /**
+     * Function EndScan
+     * publishes the outputs of a scan: every kImageProduced assembly copies
+     * Image() into Buffer() with Publish(), so the next productions send
+     * what the scan wrote and Image() keeps it.
+     */
+    static void EndScan();
+
 protected:
+    typedef std::vector<AssemblyInstance*>  Assemblies;
+
+    /// Return the current stack's assemblies of each process image role.
+    static Assemblies&  consumedImage();
+    static Assemblies&  producedImage();
 
     static EipStatus get_assembly_data_attr( CipInstance* aInstance, CipAttribute* attr,
         CipMessageRouterRequest* request, CipMessageRouterResponse* response );
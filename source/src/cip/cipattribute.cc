@@ -25,7 +25,8 @@ CipAttribute::CipAttribute(
     owning_class( 0 ),
     getter( aGetter ),
     setter( aSetter ),
-    is_offset_from_instance_start( isDataAnInstanceOffset )
+    is_offset_from_instance_start( isDataAnInstanceOffset ),
+    is_cacheable( false )
 {
     /*
         Is there a problem with one of the calls to CipClass::AttributeInsert()?
@@ -114,6 +115,15 @@ EipStatus CipAttribute::Set( CipInstance* aInstance,
     }
     else
     {
-        return setter( aInstance, this, request, response );
+        EipStatus ret = setter( aInstance, this, request, response );
+
+        // Even a failed setter may have stored part of the value.  Data
+        // which is not in the instance is shared by the whole class.
+        if( is_offset_from_instance_start )
+            aInstance->Changed();
+        else
+            aInstance->Class()->Changed();
+
+        return ret;
     }
 }
@@ -102,6 +102,20 @@ public:
     bool    IsGetableSingle()           { return getter != NULL; }
     bool    IsSetableSingle()           { return setter != NULL; }
     bool    IsGetableAll()              { return is_getable_all; }
+    bool    IsCacheable() const         { return is_cacheable; }
+
+    /**
+     * Function SetCacheable
+     * lets the message router answer reads of this attribute from a copy of
+     * an earlier reply until CipInstance::Version() of its instance or class
+     * changes.  Only for data which changes solely by SetAttributeSingle or
+     * by code which calls CipInstance::Changed().
+     */
+    CipAttribute* SetCacheable( bool aCacheable = true )
+    {
+        is_cacheable = aCacheable;
+        return this;
+    }
 
     /**
      * Function Get
@@ -141,6 +155,7 @@ protected:
     CipDataType     type;
     bool            is_getable_all;
     bool            is_offset_from_instance_start;  // or pointer to static or global
+    bool            is_cacheable;
     uintptr_t       where;
     CipClass*       owning_class;
 
@@ -4,6 +4,8 @@
  *
  ******************************************************************************/
 
+#include <string.h>
+#include <algorithm>
 #include <unordered_map>
 
 #include <cipclass.h>
@@ -15,21 +17,37 @@
 static uint16_t Zero = 0;
 
 
+#ifndef CIPSTER_CLASS_TABLE_SIZE
+/// Class ids below this are found by direct index, the rest by hashing.
+#define CIPSTER_CLASS_TABLE_SIZE    0x100
+#endif
+
+
 
 /**
  * Class CipClassRegistry
  * is a container for the defined CipClass()es, which in turn hold all
  * the CipInstance()s.  This container takes ownership of the CipClasses.
  * (Ownership means having the obligation to delete upon destruction.)
+ * Each StackContext has its own.
  */
-class CipClassRegistry
+class CipClassRegistry : public StackState
 {
     // hashtable from C++ std library.
     typedef std::unordered_map< int, CipClass* >    ClassHash;
 
 public:
+    CipClassRegistry() :
+        generation( 1 )
+    {
+        memset( by_id, 0, sizeof by_id );
+    }
+
     CipClass*   FindClass( int aClassId )
     {
+        if( aClassId >= 0 && aClassId < CIPSTER_CLASS_TABLE_SIZE )
+            return by_id[aClassId];
+
         ClassHash::iterator it = container.find( aClassId );
 
         if( it != container.end() )
@@ -49,11 +67,21 @@ public:
 
         std::pair< ClassHash::iterator, bool > r = container.insert( e );
 
+        if( r.second && aClass->ClassId() >= 0 &&
+                aClass->ClassId() < CIPSTER_CLASS_TABLE_SIZE )
+            by_id[aClass->ClassId()] = aClass;
+
+        ++generation;
+
         return r.second;
     }
 
     void DeleteAll()
     {
+        memset( by_id, 0, sizeof by_id );
+
+        ++generation;
+
         while( container.size() )
         {
             delete container.begin()->second;       // Delete the first of remaining classes
@@ -66,13 +94,27 @@ public:
         DeleteAll();
     }
 
+    /// See CipClass::Generation()
+    unsigned    Generation() const      { return generation; }
+    void        Changed()               { ++generation; }
+
 private:
 
-    ClassHash   container;
+    ClassHash   container;              ///< owns every class
+
+    /// The common class ids, looked up without hashing.
+    CipClass*   by_id[CIPSTER_CLASS_TABLE_SIZE];
+
+    unsigned    generation;             ///< never 0
 };
 
 
-static CipClassRegistry registry;
+static StackStateType<CipClassRegistry> s_registry_state( kStackStateClasses );
+
+static inline CipClassRegistry& registry()
+{
+    return StackContext::Current().State<CipClassRegistry>( kStackStateClasses );
+}
 
 
 
@@ -91,8 +133,11 @@ CipClass::CipClass(
 {
     owning_class = this;
 
+    memset( service_slots, 0, sizeof service_slots );
+
     ServiceInsert( _C, kGetAttributeSingle, GetAttributeSingle, "GetAttributeSingle" );
     ServiceInsert( _C, kGetAttributeAll,    GetAttributeAll,    "GetAttributeAll" );
+    ServiceInsert( _C, kGetAttributeList,   GetAttributeList,   "GetAttributeList" );
     ServiceInsert( _C, kReset,              Reset,              "Reset" );
 
     // Create the standard class attributes as requested.
@@ -128,6 +173,8 @@ CipClass::CipClass(
     // create the standard instance services
     ServiceInsert( _I, kGetAttributeSingle, GetAttributeSingle, "GetAttributeSingle" );
     ServiceInsert( _I, kSetAttributeSingle, SetAttributeSingle, "SetAttributeSingle" );
+    ServiceInsert( _I, kGetAttributeList,   GetAttributeList,   "GetAttributeList" );
+    ServiceInsert( _I, kSetAttributeList,   SetAttributeList,   "SetAttributeList" );
 
     if( inst_getable_all_mask )
         ServiceInsert( _I, kGetAttributeAll, GetAttributeAll, "GetAttributeAll" );
@@ -171,7 +218,7 @@ CipClass::~CipClass()
 
 EipStatus CipClass::Register( CipClass* cip_class )
 {
-    if( registry.RegisterClass( cip_class ) )
+    if( registry().RegisterClass( cip_class ) )
         return kEipStatusOk;
     else
         return kEipStatusError;
@@ -180,13 +227,19 @@ EipStatus CipClass::Register( CipClass* cip_class )
 
 CipClass* CipClass::Get( int aClassId )
 {
-    return registry.FindClass( aClassId );
+    return registry().FindClass( aClassId );
 }
 
 
 void CipClass::DeleteAll()
 {
-    registry.DeleteAll();
+    registry().DeleteAll();
+}
+
+
+unsigned CipClass::Generation()
+{
+    return registry().Generation();
 }
 
 
@@ -216,6 +269,58 @@ int CipClass::FindUniqueFreeId() const
 }
 
 
+/// Whether a dense_instances of @a aSize slots is worth it for @a aCount
+/// instances, a slot costs a pointer whereas an instance is far bigger.
+static inline bool denseEnough( unsigned aSize, unsigned aCount )
+{
+    return aSize <= 4 * aCount + 16;
+}
+
+
+void CipClass::denseAdd( CipInstance* aInstance )
+{
+    unsigned id   = aInstance->Id();
+    unsigned size = dense_instances.size();
+
+    if( id >= size )
+    {
+        if( !denseEnough( id + 1, instances.size() ) )
+            return;
+
+        dense_instances.resize( id + 1, NULL );
+
+        // pick up the sparse ones which now fall inside
+        for( CipInstances::const_iterator it = InstanceNext( size );
+                it != instances.end() && unsigned( (*it)->Id() ) <= id;  ++it )
+        {
+            dense_instances[ (*it)->Id() ] = *it;
+        }
+    }
+
+    dense_instances[id] = aInstance;
+}
+
+
+void CipClass::denseRebuild()
+{
+    unsigned size = 0;
+
+    // the most slots which stay dense enough for the instances they cover
+    for( unsigned i = 0; i < instances.size(); ++i )
+    {
+        unsigned id = instances[i]->Id();
+
+        if( denseEnough( id + 1, i + 1 ) )
+            size = id + 1;
+    }
+
+    dense_instances.assign( size, NULL );
+
+    for( unsigned i = 0; i < instances.size() && unsigned( instances[i]->Id() ) < size; ++i )
+        dense_instances[ instances[i]->Id() ] = instances[i];
+}
+
+
 bool CipClass::InstanceInsert( CipInstance* aInstance )
 {
     CIPSTER_ASSERT( aInstance->Id() > 0 && aInstance->Id() <= 65535 );
@@ -228,15 +333,14 @@ bool CipClass::InstanceInsert( CipInstance* aInstance )
         return false;
     }
 
-    CipInstances::iterator it;
+    // Keep instances sorted by Id(), typically they come in ascending order.
+    CipInstances::iterator it = instances.end();
 
-    // Keep instances sorted by Id()
-    for( it = instances.begin();  it != instances.end();  ++it )
+    if( instances.size() && aInstance->Id() <= instances.back()->Id() )
     {
-        if( aInstance->Id() < (*it)->Id() )
-            break;
+        it = vec_search_gte( instances.begin(), instances.end(), aInstance->Id() );
 
-        else if( aInstance->Id() == (*it)->Id() )
+        if( aInstance->Id() == (*it)->Id() )
         {
             CIPSTER_TRACE_ERR( "class '%s' already has instance %d\n",
                 class_name.c_str(), aInstance->Id()
@@ -248,28 +352,97 @@ bool CipClass::InstanceInsert( CipInstance* aInstance )
 
     instances.insert( it, aInstance );
 
+    unsigned count = instances.size();
+
+    // Each time the count doubles, take in the ids which arrived too sparse
+    // earlier, e.g. in descending order.  Amortized that is O(1) too.
+    if( !( count & ( count - 1 ) ) )
+        denseRebuild();
+    else
+        denseAdd( aInstance );
+
     // it's official, instance is a member of this class as of now.
     aInstance->setClass( this );
 
+    registry().Changed();
+
     return true;
 }
 
 
-CipInstance* CipClass::InstanceRemove( int aInstanceId )
+static bool lessId( const CipInstance* a, const CipInstance* b )
 {
-    CipInstance* ret = NULL;
+    return a->Id() < b->Id();
+}
+
+
+bool CipClass::InstanceInsert( CipInstance* const* aInstances, int aCount )
+{
+    CipInstances merged;
 
-    for( CipInstances::iterator it = instances.begin();  it != instances.end();  ++it )
+    merged.reserve( instances.size() + aCount );
+    merged.insert( merged.end(), instances.begin(), instances.end() );
+
+    for( int i = 0; i < aCount; ++i )
     {
-        if( aInstanceId == (*it)->Id() )
+        CIPSTER_ASSERT( aInstances[i]->Id() > 0 && aInstances[i]->Id() <= 65535 );
+
+        if( aInstances[i]->Class() )
         {
-            CIPSTER_TRACE_INFO(
-                "%s: removing instance '%d'.\n", __func__, aInstanceId );
+            CIPSTER_TRACE_ERR( "%s: aInstance id:%d is already owned\n",
+                __func__, aInstances[i]->Id() );
 
-            ret = *it;                  // pass ownership to ret
-            instances.erase( it );      // close gap
-            break;
+            return false;
         }
+
+        merged.push_back( aInstances[i] );
+    }
+
+    std::stable_sort( merged.begin(), merged.end(), lessId );
+
+    for( unsigned i = 1; i < merged.size(); ++i )
+    {
+        if( merged[i]->Id() == merged[i-1]->Id() )
+        {
+            CIPSTER_TRACE_ERR( "class '%s' already has instance %d\n",
+                class_name.c_str(), merged[i]->Id()
+                );
+
+            return false;
+        }
+    }
+
+    instances.swap( merged );
+
+    denseRebuild();
+
+    for( int i = 0; i < aCount; ++i )
+        aInstances[i]->setClass( this );
+
+    registry().Changed();
+
+    return true;
+}
+
+
+CipInstance* CipClass::InstanceRemove( int aInstanceId )
+{
+    CipInstance* ret = NULL;
+
+    CipInstances::iterator it = vec_search( instances.begin(), instances.end(), aInstanceId );
+
+    if( it != instances.end() )
+    {
+        CIPSTER_TRACE_INFO(
+            "%s: removing instance '%d'.\n", __func__, aInstanceId );
+
+        ret = *it;                  // pass ownership to ret
+        instances.erase( it );      // close gap
+
+        if( unsigned( aInstanceId ) < dense_instances.size() )
+            dense_instances[aInstanceId] = NULL;
+
+        registry().Changed();
     }
 
     return ret;
@@ -281,13 +454,21 @@ CipInstance* CipClass::Instance( int aInstanceId ) const
     if( aInstanceId == 0 )
         return (CipInstance*)  this;        // cast away const-ness
 
-    CipInstances::const_iterator  it;
+    if( aInstanceId > 0 && unsigned( aInstanceId ) < dense_instances.size() )
+    {
+        if( CipInstance* instance = dense_instances[aInstanceId] )
+            return instance;
+    }
+    else
+    {
+        CipInstances::const_iterator  it;
 
-    // binary search thru the vector of pointers looking for id
-    it = vec_search( instances.begin(), instances.end(), aInstanceId );
+        // binary search thru the vector of pointers looking for id
+        it = vec_search( instances.begin(), instances.end(), aInstanceId );
 
-    if( it != instances.end() )
-        return *it;
+        if( it != instances.end() )
+            return *it;
+    }
 
     CIPSTER_TRACE_WARN( "instance %d not in class '%s'\n",
         aInstanceId, class_name.c_str() );
@@ -303,12 +484,43 @@ CipInstances::const_iterator CipClass::InstanceNext( int aInstanceId ) const
 }
 
 
-CipService* CipClass::Service( _CI aCI, int aServiceId ) const
+void CipClass::updateServiceSlots( _CI aCI )
 {
-    CipServices::const_iterator  it;
+    const CipServices& slist = services[aCI];
+
+    memset( service_slots[aCI], 0, sizeof service_slots[aCI] );
+
+    // only as many as fit in a uint8_t, the rest are searched for
+    for( unsigned i = 0; i < slist.size() && i < 255; ++i )
+    {
+        int id = slist[i]->Id();
+
+        if( id >= 0 && id < DIM( service_slots[aCI] ) )
+            service_slots[aCI][id] = i + 1;
+    }
+}
+
 
+CipService* CipClass::Service( _CI aCI, int aServiceId ) const
+{
     const CipServices& slist = services[aCI];
 
+    if( aServiceId >= 0 && aServiceId < DIM( service_slots[aCI] ) )
+    {
+        int slot = service_slots[aCI][aServiceId];
+
+        if( slot )
+            return slist[slot - 1];
+
+        if( slist.size() < 255 )
+        {
+            CIPSTER_TRACE_WARN( "service %d not defined\n", aServiceId );
+            return NULL;
+        }
+    }
+
+    CipServices::const_iterator  it;
+
     // binary search thru vector of pointers looking for attribute_id
     it = vec_search( slist.begin(), slist.end(), aServiceId );
 
@@ -348,6 +560,8 @@ bool CipClass::ServiceInsert( _CI aCI, CipService* aService )
 
     s.insert( it, aService );
 
+    updateServiceSlots( aCI );
+
     return true;
 }
 
@@ -385,6 +599,8 @@ CipService* CipClass::ServiceRemove( _CI aCI, int aServiceId )
 
             ret = *it;              // pass ownership to ret
             s.erase( it );      // close gap
+
+            updateServiceSlots( aCI );
             break;
         }
     }
@@ -430,6 +646,8 @@ bool CipClass::AttributeInsert(  _CI aCI, CipAttribute* aAttribute )
 
     aAttribute->owning_class = this; // until now there was no owner of this attribute.
 
+    registry().Changed();     // an overridden one was just deleted
+
     if( aAttribute->Id() < 32 )
     {
         if( aAttribute->IsGetableAll() )
@@ -802,6 +1020,252 @@ EipStatus CipClass::SetAttributeSingle( CipInstance* instance,
 }
 
 
+EipStatus CipClass::GetAttributeList( CipInstance* instance,
+        CipMessageRouterRequest* request,
+        CipMessageRouterResponse* response )
+{
+    CipService* service = instance->Service( kGetAttributeSingle );
+
+    if( !service )
+    {
+        response->SetGenStatus( kCipErrorServiceNotSupported );
+        return kEipStatusOkSend;
+    }
+
+    BufReader   in = request->Data();
+    unsigned    count = in.size() >= 2 ? in.get16() : 0;
+
+    if( !count || 2 * count > in.size() )
+    {
+        response->SetGenStatus( kCipErrorNotEnoughData );
+        return kEipStatusOkSend;
+    }
+
+    BufWriter   start = response->Writer();
+    BufWriter   out = start;
+    bool        list_error = false;
+
+    try
+    {
+        out.put16( count );
+
+        for( unsigned i = 0; i < count; ++i )
+        {
+            int attribute_id = in.get16();
+
+            out.put16( attribute_id );
+
+            BufWriter   status = out.reserve( 2 );
+
+            request->SetPathAttribute( attribute_id );
+
+            response->SetWriter( out );
+            response->SetWrittenSize( 0 );
+            response->SetGenStatus( kCipErrorSuccess );
+
+            EipStatus result = service->service_function( instance, request, response );
+
+            CipError sts = response->GenStatus();
+
+            if( result != kEipStatusOkSend && sts == kCipErrorSuccess )
+                sts = kCipErrorAttributeNotGettable;
+
+            status.put16( sts );
+
+            if( sts == kCipErrorSuccess )
+                out += response->WrittenSize();
+            else
+                list_error = true;
+        }
+    }
+    catch( const std::runtime_error& e )
+    {
+        // a BufWriter overflow
+        response->SetWriter( start );
+        response->SetWrittenSize( 0 );
+        response->SetGenStatus( kCipErrorReplyDataTooLarge );
+        return kEipStatusOkSend;
+    }
+
+    response->SetWriter( start );
+    response->SetWrittenSize( out.data() - start.data() );
+    response->SetGenStatus( list_error ? kCipErrorAttributeListError : kCipErrorSuccess );
+
+    return kEipStatusOkSend;
+}
+
+
+/**
+ * Function set_value_size
+ * returns how many bytes at the start of @a aIn are a value for @a aAttribute,
+ * as DecodeData() would take them, or -1 if its CipDataType does not tell.
+ */
+static int set_value_size( CipInstance* aInstance, CipAttribute* aAttribute,
+        const BufReader& aIn )
+{
+    switch( aAttribute->Type() )
+    {
+    case kCipBool:
+    case kCipSint:
+    case kCipUsint:
+    case kCipByte:
+        return 1;
+
+    case kCipInt:
+    case kCipUint:
+    case kCipWord:
+    case kCipUsintUsint:
+    case kCipByteArrayLength:
+        return 2;
+
+    case kCipDint:
+    case kCipUdint:
+    case kCipDword:
+    case kCipReal:
+        return 4;
+
+    case kCip6Usint:
+        return 6;
+
+    case kCipLint:
+    case kCipUlint:
+    case kCipLword:
+    case kCipLreal:
+        return 8;
+
+    case kCipByteArray:
+        return ((ByteBuf*) aInstance->Data( aAttribute ))->size();
+
+    case kCipShortString:
+        if( aIn.size() >= 1 )
+        {
+            int len = aIn.data()[0];
+
+            return 1 + len + !(len & 1);
+        }
+        return -1;
+
+    case kCipString:
+    case kCipString2:
+        if( aIn.size() >= 2 )
+        {
+            int len = aIn.data()[0] | ( aIn.data()[1] << 8 );
+
+            return aAttribute->Type() == kCipString ?
+                    2 + len + (len & 1) : 2 + 2 * len;
+        }
+        return -1;
+
+    default:
+        return -1;
+    }
+}
+
+
+EipStatus CipClass::SetAttributeList( CipInstance* instance,
+        CipMessageRouterRequest* request,
+        CipMessageRouterResponse* response )
+{
+    CipService* service = instance->Service( kSetAttributeSingle );
+
+    if( !service )
+    {
+        response->SetGenStatus( kCipErrorServiceNotSupported );
+        return kEipStatusOkSend;
+    }
+
+    BufReader   data = request->Data();
+    BufReader   in = data;
+    unsigned    count = in.size() >= 2 ? in.get16() : 0;
+
+    if( !count )
+    {
+        response->SetGenStatus( kCipErrorNotEnoughData );
+        return kEipStatusOkSend;
+    }
+
+    BufWriter   start = response->Writer();
+    BufWriter   out = start;
+    unsigned    done = 0;
+    bool        list_error = false;
+
+    try
+    {
+        BufWriter   reply_count = out.reserve( 2 );
+
+        while( done < count && in.size() >= 2 )
+        {
+            int             attribute_id = in.get16();
+            CipAttribute*   attribute = instance->Attribute( attribute_id );
+            int             size = attribute ? set_value_size( instance, attribute, in ) : -1;
+            CipError        sts;
+
+            if( ++done == count && size < 0 )
+                size = in.size();       // the rest of the request is its value
+
+            out.put16( attribute_id );
+
+            if( !attribute )
+                sts = kCipErrorAttributeNotSupported;
+            else if( size < 0 )
+                sts = kCipErrorInvalidParameter;
+            else if( size > in.size() )
+                sts = kCipErrorNotEnoughData;
+            else
+            {
+                request->SetPathAttribute( attribute_id );
+                request->SetData( BufReader( in.data(), size ) );
+
+                response->SetWriter( out );
+                response->SetWrittenSize( 0 );
+                response->SetGenStatus( kCipErrorSuccess );
+
+                EipStatus result = service->service_function( instance, request, response );
+
+                sts = response->GenStatus();
+
+                if( result != kEipStatusOkSend && sts == kCipErrorSuccess )
+                    sts = kCipErrorInvalidAttributeValue;
+
+                out.put16( sts );
+
+                if( sts != kCipErrorSuccess )
+                    list_error = true;
+
+                in += size;
+                continue;
+            }
+
+            // without this value's length the next attribute cannot be found
+            out.put16( sts );
+            list_error = true;
+            break;
+        }
+
+        if( done < count )
+            list_error = true;
+
+        reply_count.put16( done );
+    }
+    catch( const std::runtime_error& e )
+    {
+        // a BufWriter overflow
+        request->SetData( data );
+        response->SetWriter( start );
+        response->SetWrittenSize( 0 );
+        response->SetGenStatus( kCipErrorReplyDataTooLarge );
+        return kEipStatusOkSend;
+    }
+
+    request->SetData( data );
+    response->SetWriter( start );
+    response->SetWrittenSize( out.data() - start.data() );
+    response->SetGenStatus( list_error ? kCipErrorAttributeListError : kCipErrorSuccess );
+
+    return kEipStatusOkSend;
+}
+
+
 EipStatus CipClass::Reset( CipInstance* instance,
         CipMessageRouterRequest* request,
         CipMessageRouterResponse* response )
@@ -62,6 +62,15 @@ public:
 
     static CipClass* Get( int aClassId );
 
+    /**
+     * Function Generation
+     * returns a number, never 0, which changes whenever a class is registered
+     * or deleted, or an instance or attribute is inserted into or removed
+     * from any class of the stack.  Pointers resolved from a path stay good
+     * while it does not change.
+     */
+    static unsigned Generation();
+
     //-----</Class Registry Support>--------------------------------------------
 
 
@@ -101,6 +110,27 @@ public:
             CipMessageRouterRequest* request,
             CipMessageRouterResponse* response );
 
+    /**
+     * Function GetAttributeList
+     * is a CipService function which gets the attributes listed in the
+     * request, Vol1 A-4.3.  Each one is answered by the instance's
+     * GetAttributeSingle service and gets its own status in the reply.
+     */
+    static EipStatus GetAttributeList( CipInstance* instance,
+            CipMessageRouterRequest* request,
+            CipMessageRouterResponse* response );
+
+    /**
+     * Function SetAttributeList
+     * is a CipService function which sets the attributes listed in the
+     * request, Vol1 A-4.4, each by the instance's SetAttributeSingle
+     * service.  Processing stops at an attribute whose value length cannot
+     * be told from its CipDataType, unless it is the last one.
+     */
+    static EipStatus SetAttributeList( CipInstance* instance,
+            CipMessageRouterRequest* request,
+            CipMessageRouterResponse* response );
+
     /**
      * Function Reset (ServiceId = kReset )
      * is a common service which is a dummy place holder so the proper
@@ -176,6 +206,17 @@ public:
      */
     bool InstanceInsert( CipInstance* aInstance );
 
+    /**
+     * Function InstanceInsert
+     * inserts @a aCount instances at once, e.g. thousands of assemblies or
+     * tags at startup, in O(n log n) rather than one at a time.
+     *
+     * @return bool - true if all were inserted, else false and none were, then
+     *  ownership of all remains with the caller.  Failure happens when one is
+     *  already in a class or an instance id is not unique.
+     */
+    bool InstanceInsert( CipInstance* const* aInstances, int aCount );
+
     /**
      * Function InstanceRemove
      * removes an instance and returns it if success, else NULL.
@@ -324,6 +365,12 @@ protected:
 
     CipServices     services[2];            ///< collection of services
 
+    /// services[][] index + 1 by 7 bit service code, 0 for none, to dispatch
+    /// without a search.  Rebuilt by ServiceInsert() and ServiceRemove().
+    uint8_t         service_slots[2][128];
+
+    void updateServiceSlots( _CI aCI );
+
     CipAttributes   attributes[2];          ///< sorted pointer array to CipAttribute
 
     int             inst_getable_all_mask;
@@ -331,6 +378,15 @@ protected:
 
     CipInstances    instances;              ///< collection of instances
 
+    /// The instances again, indexed by id below its size() and NULL where
+    /// there is none, so Instance() need not search.  Only grown while at
+    /// least about a quarter of its slots are used, sparse ids are only in
+    /// instances.
+    CipInstances    dense_instances;
+
+    void denseAdd( CipInstance* aInstance );
+    void denseRebuild();
+
     void ShowServicesI()
     {
         for( CipServices::const_iterator it = services[_I].begin();
@@ -12,6 +12,7 @@
 #include "cipidentity.h"
 #include "ciptcpipinterface.h"
 #include "cipethernetlink.h"
+#include "cipqos.h"
 #include "cipconnectionmanager.h"
 #include "cipconnection.h"
 #include "byte_bufs.h"
@@ -47,6 +48,9 @@ void CipStackInit( uint16_t unique_connection_id )
     eip_status = CipEthernetLinkClass::Init();
     CIPSTER_ASSERT( kEipStatusOk == eip_status );
 
+    eip_status = CipQosClass::Init();
+    CIPSTER_ASSERT( kEipStatusOk == eip_status );
+
     eip_status = ConnectionManagerInit();
     CIPSTER_ASSERT( kEipStatusOk == eip_status );
 
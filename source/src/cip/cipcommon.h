@@ -13,6 +13,8 @@
 #include <typedefs.h>
 #include "ciptypes.h"
 #include <byte_bufs.h>
+#include <stackcontext.h>
+#include "../utils/fixedstr.h"
 
 
 /// Binary search function template, dedicated for classes with Id() member func
@@ -80,14 +82,11 @@ extern uint8_t g_message_data_reply_buffer[CIPSTER_MESSAGE_DATA_REPLY_BUFFER];
 /// messages on other than the standard port number.
 extern int g_my_io_udp_port;
 
-extern uint64_t g_current_usecs;
+/// Return the current stack's clock in usecs, see StackContext::current_usecs
+inline uint64_t CurrentUSecs()      { return StackContext::Current().current_usecs; }
 
-/// The run/idle mode sent when our producing half is kRealTimeFmt32BitHeader,
-/// which is likely only when we are acting as a scanner.
-extern uint32_t g_run_idle_state;
-
-/// Return the least significant 32 bits of uint64_t g_current_usecs
-inline uint32_t CurrentUSecs32()    { return uint32_t( g_current_usecs ); }
+/// Return the least significant 32 bits of CurrentUSecs()
+inline uint32_t CurrentUSecs32()    { return uint32_t( CurrentUSecs() ); }
 
 
 #endif    // CIPSTER_CIPCOMMON_H_
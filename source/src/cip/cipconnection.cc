@@ -15,6 +15,7 @@
 #include "cpf.h"
 #include "cipassembly.h"
 #include "cipcommon.h"
+#include "cipqos.h"
 
 
 //-----<ConnectionPath>---------------------------------------------------------
@@ -179,9 +180,9 @@ int ConnectionPath::SerializedCount( int aCtl ) const
 }
 
 
-std::string ConnectionPath::Format() const
+FixedStr<256> ConnectionPath::Format() const
 {
-    std::string dest;
+    FixedStr<256> dest;
 
     if( ConfigPath().HasAny() )
     {
@@ -212,9 +213,44 @@ std::string ConnectionPath::Format() const
 CipAppPath ConnectionPath::HasAny_No;
 
 
+/**
+ * Struct ConnectionState
+ * is the connection objects' share of a StackContext.
+ */
+struct ConnectionState : public StackState
+{
+    ConnectionState() :
+        serial_number_allocator( 0 ),
+        incarnation_id( 0 ),
+        connection_id( 18 )
+    {}
+
+    CipUint     serial_number_allocator;
+
+    // Holds the connection ID's "incarnation ID" in upper 16 bits
+    CipUdint    incarnation_id;
+
+    CipUint     connection_id;
+
+    // what SendConnectedData() produces into, one per I/O shard
+    uint8_t     shard_bufs[CIPSTER_MAX_IO_SHARDS][CIPSTER_MESSAGE_DATA_REPLY_BUFFER];
+};
+
+
+static StackStateType<ConnectionState> s_connection_state( kStackStateConnections );
+
+static inline ConnectionState& connections()
+{
+    return StackContext::Current().State<ConnectionState>( kStackStateConnections );
+}
+
+
 //-----<ConnectionData>---------------------------------------------------------
 
-CipUint ConnectionData::serial_number_allocator;
+CipUint ConnectionData::nextSerialNumber()
+{
+    return ++connections().serial_number_allocator;
+}
 
 ConnectionData::ConnectionData(
         uint8_t aPriorityTimeTick,
@@ -1032,6 +1068,9 @@ int CipConn::constructed_count;         // CipConn::instance_id is only for debu
 CipConn::CipConn() :
     instance_id( ++constructed_count )
 {
+    // Clear() sets the timers, which look at this first
+    on_list = false;
+
     Clear( false );
 }
 
@@ -1071,10 +1110,22 @@ void CipConn::Clear( bool doConnectionDataToo )
 
     encap_session = 0;
 
+    rx_time_nsecs = 0;
+    launch_start_nsecs = 0;
+    launch_count = 0;
+    frame_ring = NULL;
+
+    shard = 0;
+    load_pps = 0;
+
     next = NULL;
     prev = NULL;
     on_list = false;
 
+    shard_next = NULL;
+    shard_prev = NULL;
+    id_next = NULL;
+
     expected_packet_rate_usecs = 0;
 }
 
@@ -1150,16 +1201,13 @@ ConnMgrStatus CipConn::handleConfigData()
 }
 
 
-// Holds the connection ID's "incarnation ID" in upper 16 bits
-static CipUdint s_incarnation_id;
-
 uint32_t CipConn::NewConnectionId()
 {
-    static CipUint connection_id = 18;
+    ConnectionState& c = connections();
 
-    ++connection_id;
+    ++c.connection_id;
 
-    return s_incarnation_id | connection_id;
+    return c.incarnation_id | c.connection_id;
 }
 
 
@@ -1215,6 +1263,9 @@ void CipConn::GeneralConfiguration( ConnectionData* aConnData, ConnInstanceType
         // With the 0 here we will produce with the next timer tick
         // which should be sufficiently soon.
         SetTransmissionTriggerTimerUSecs( 0 );
+
+        // and anchor the launch times there
+        launch_start_nsecs = 0;
     }
 
     // Server Type Connection requested
@@ -1307,11 +1358,20 @@ void CipConn::Close()
 
     encap_session = 0;
 
-    g_active_conns.Remove( this );
+    CipConnMgrClass::RemoveShardLoad( this );
+
+    ActiveConnections().Remove( this );
     SetState( kConnStateNonExistent );
 }
 
 
+void CipConn::dueBy( uint32_t aUSecs )
+{
+    if( on_list )
+        ActiveConnections().ShardDueBy( shard, aUSecs );
+}
+
+
 CipError CipConn::Activate( Cpf* aCpf, ConnMgrStatus* aExtError )
 {
     // If config data is present in forward_open request
@@ -1338,7 +1398,9 @@ CipError CipConn::Activate( Cpf* aCpf, ConnMgrStatus* aExtError )
         return result;
     }
 
-    g_active_conns.Insert( this );
+    ActiveConnections().Insert( this );
+
+    CipConnMgrClass::AddShardLoad( this );
     SetState( kConnStateEstablished );
 
     NotifyIoConnectionEvent( this, kIoConnectionEventOpened );
@@ -1347,7 +1409,37 @@ CipError CipConn::Activate( Cpf* aCpf, ConnMgrStatus* aExtError )
 }
 
 
-EipStatus CipConn::SendConnectedData()
+uint64_t CipConn::NextLaunchNSecs( int32_t aDueUSecs )
+{
+    // Only a cyclic connection produces on a fixed grid.
+    if( trigger.Trigger() != kConnTriggerTypeCyclic || !ProducingRPI() )
+        return TxTimeLaunchNSecs( aDueUSecs );
+
+    uint64_t now = TxTimeLaunchNSecs( 0 );
+
+    uint64_t rpi_nsecs = uint64_t( ProducingRPI() ) * 1000u;
+    uint64_t launch    = launch_start_nsecs + launch_count * rpi_nsecs;
+
+    // Anchor at the first production, and again when the grid has fallen an
+    // RPI behind now or runs an RPI ahead of the tick timer, as after the
+    // clock was stepped.
+    if( !launch_start_nsecs
+     || launch + rpi_nsecs <= now
+     || launch > now + uint64_t( aDueUSecs > 0 ? aDueUSecs : 0 ) * 1000u + rpi_nsecs )
+    {
+        launch_start_nsecs = TxTimeLaunchNSecs( aDueUSecs );
+        launch_count = 0;
+        launch = launch_start_nsecs;
+    }
+
+    ++launch_count;
+
+    // etf drops a launch time in the past, a late frame goes out now.
+    return launch < now ? now : launch;
+}
+
+
+EipStatus CipConn::SendConnectedData( uint64_t aLaunchNSecs )
 {
     /*
         TODO think of adding an own send buffer to each connection object in
@@ -1359,7 +1451,10 @@ EipStatus CipConn::SendConnectedData()
 
     EipStatus result;
 
-    BufWriter out( g_message_data_reply_buffer, sizeof g_message_data_reply_buffer );
+    // Shards produce at the same time, each into its own buffer.
+    uint8_t* buf = connections().shard_bufs[shard];
+
+    BufWriter out( buf, CIPSTER_MESSAGE_DATA_REPLY_BUFFER );
 
     /*
         For class 0 and class 1 connections over EtherNet/IP, devices shall
@@ -1431,10 +1526,19 @@ EipStatus CipConn::SendConnectedData()
 
     if( producing_fmt == kRealTimeFmt32BitHeader && data_len )
     {
-        out.put32( g_run_idle_state );
+        out.put32( StackContext::Current().run_idle_state );
     }
 
-    out.append( attr3 );
+    if( assembly->IsSeqAccessed() )
+    {
+        // copy a complete image straight into the frame
+        uint8_t* image = out.data();
+
+        out += attr3.size();            // overrun check
+        assembly->Snapshot( image );
+    }
+    else
+        out.append( attr3 );
 
     length += data_len;
 
@@ -1442,23 +1546,36 @@ EipStatus CipConn::SendConnectedData()
         "%s[%d]@%u PID:0x%08x len:%-3d dst:%s:%d\n",
         __func__,
         ProducingUdp()->h(),
-        (uint32_t)g_current_usecs,
+        (uint32_t) CurrentUSecs(),
         producing_connection_id,
         length,
         send_address.AddrStr().c_str(),
         send_address.Port()
         );
 
+    // mark by the priority the originator asked for in the T->O parameters
+    int tos = CipQosClass::TOS( CipQosClass::DSCP( producing_ncp.Priority() ) );
+
+    if( UdpGsoMode() && !aLaunchNSecs )
+    {
+        // ManageConnections() calls UdpGsoFlush() after its pass
+        return UdpGsoQueue( ProducingUdp(), tos, send_address,
+                BufReader( buf, length ), shard );
+    }
+
+    ProducingUdp()->SetTOS( tos );
+
     // send out onto UDP wire
     result = ProducingUdp()->Send( send_address,
-                BufReader( g_message_data_reply_buffer, length )
+                BufReader( buf, length ),
+                aLaunchNSecs
                 );
 
     return result;
 }
 
 
-EipStatus CipConn::HandleReceivedIoConnectionData( BufReader aInput )
+EipStatus CipConn::HandleReceivedIoConnectionData( BufReader aInput, uint64_t aRxNSecs )
 {
     if( trigger.Class() == kConnTransportClass1 )
     {
@@ -1475,6 +1592,10 @@ EipStatus CipConn::HandleReceivedIoConnectionData( BufReader aInput )
         sequence_count_consuming = sequence;
     }
 
+    rx_time_nsecs = aRxNSecs;
+
+    uint32_t new_run_idle = 0;
+
     // we may have consumed 2 bytes above, what is left is without sequence count
     if( aInput.size() )
     {
@@ -1482,7 +1603,7 @@ EipStatus CipConn::HandleReceivedIoConnectionData( BufReader aInput )
         // may not contain a run_idle header.
         if( consuming_fmt == kRealTimeFmt32BitHeader )
         {
-            uint32_t new_run_idle = aInput.get32();
+            new_run_idle = aInput.get32();
 
             //-----<new logic>---------------------------------------
             // saves mode in each connection.
@@ -1490,12 +1611,12 @@ EipStatus CipConn::HandleReceivedIoConnectionData( BufReader aInput )
 
             //-----<old logic>---------------------------------------
             // has no ability to track multiple scanner's modes.
-            if( g_run_idle_state != new_run_idle )
+            if( StackContext::Current().run_idle_state != new_run_idle )
             {
                 RunIdleChanged( new_run_idle );
             }
 
-            g_run_idle_state = new_run_idle;
+            StackContext::Current().run_idle_state = new_run_idle;
             //-----</old logic>---------------------------------------
         }
         else
@@ -1503,6 +1624,12 @@ EipStatus CipConn::HandleReceivedIoConnectionData( BufReader aInput )
             // It is kRealTimeFmtModeless
         }
 
+        if( frame_ring )
+        {
+            frame_ring->Push( aRxNSecs, eip_level_sequence_count_consuming,
+                sequence_count_consuming, new_run_idle, aInput.data(), aInput.size() );
+        }
+
         AssemblyInstance* assembly = static_cast<AssemblyInstance*>( consuming_instance );
 
         EipStatus status = assembly->RecvData( this, aInput );
@@ -1602,10 +1729,12 @@ CipError CipConn::openConsumingPointToPointConnection( Cpf* aCpf, ConnMgrStatus*
     // For point-point connections, the point-point consumer shall choose
     // a UDP port number on which it will receive the connected data.
 
-    // User may adjust g_my_io_udp_port to other than kEIP_IoUdpPort for this.
+    // User may adjust g_my_io_udp_port to other than kEIP_IoUdpPort for this,
+    // and each I/O shard uses the port after the previous shard's.
+    int port = g_my_io_udp_port + shard;
 
     SockAddr peers_destination(     // a.k.a "me"
-                g_my_io_udp_port,
+                port,
                 DEFAULT_BIND_IPADDR
                 );
 
@@ -1623,7 +1752,7 @@ CipError CipConn::openConsumingPointToPointConnection( Cpf* aCpf, ConnMgrStatus*
 
     // Vol2 3-3.9.6 return O->T Saii in the forward_open reply if I am
     // using a port different than the 0x08AE.
-    if( g_my_io_udp_port != kEIP_IoUdpPort )
+    if( port != kEIP_IoUdpPort )
     {
         // See Vol1 table 3-3.3.
         // Originator ignores the IP address portion of peers_destination
@@ -1671,7 +1800,7 @@ CipError CipConn::openProducingPointToPointConnection( Cpf* aCpf, ConnMgrStatus*
             );
 
     SockAddr source(
-            g_my_io_udp_port,    // I chose my source port consistently for non-multicast producing
+            g_my_io_udp_port + shard,   // I chose my source port consistently for non-multicast producing
             DEFAULT_BIND_IPADDR
             );
 
@@ -1790,9 +1919,10 @@ CipError CipConn::openMulticastConnection( UdpDirection aDirection,
         // must be the registered port.
         remotes_destination.SetPort( kEIP_IoUdpPort );
 
+        // Bound to a unicast address it would receive no group traffic.
         SockAddr base_multicast_socket(
             kEIP_IoUdpPort,
-            DEFAULT_BIND_IPADDR
+            INADDR_ANY
             );
 
         UdpSocket* socket = UdpSocketMgr::GrabSocket( base_multicast_socket, &remotes_destination );
@@ -1862,6 +1992,13 @@ CipError CipConn::openCommunicationChannels( Cpf* aCpf, ConnMgrStatus* aExtError
 
     // one, both, or no consuming/producing ends based on IOConnType for each
 
+    // Multicast sockets are shared by several connections, which keeps those
+    // on shard 0.
+    shard = 0;
+
+    if( IsIOConnection() && o_t != kIOConnTypeMulticast && t_o != kIOConnTypeMulticast )
+        shard = CipConnMgrClass::LeastLoadedShard();
+
     //----<Consuming End>-------------------------------------------------------
 
     if( o_t == kIOConnTypeMulticast )
@@ -1987,7 +2124,7 @@ EipStatus CipConn::Init( uint16_t unique_connection_id )
         if( !unique_connection_id )
             unique_connection_id = 0xc0de;
 
-        s_incarnation_id = unique_connection_id << 16;
+        connections().incarnation_id = unique_connection_id << 16;
     }
 
     return kEipStatusOk;
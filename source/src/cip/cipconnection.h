@@ -7,7 +7,8 @@
 #define CIPCONNECTION_H_
 
 #include "../enet_encap/sockaddr.h"
-#include "cipidentity.h"            // serial_number_
+#include "cipidentity.h"            // Identity()
+#include "framering.h"
 
 /**
  * @file cipconnection.h
@@ -538,7 +539,7 @@ public:
     int SerializedCount( int aCtl = 0 ) const;
     //-----</Serializeable>-----------------------------------------------------
 
-    std::string Format() const;
+    FixedStr<256> Format() const;
 
    // They arrive in this order when all are present in a forward_open request:
     CipPortSegmentGroup     port_segs;      // has optional electronic key.
@@ -626,13 +627,13 @@ public:
             CipUdint aProducingConnectionId = 0,
             CipUint aConnectionSerialNumber = 0,
             CipUint aOriginatorVendorId = CIPSTER_DEVICE_VENDOR_ID,
-            CipUdint aOriginatorSerialNumber = serial_number_,
+            CipUdint aOriginatorSerialNumber = Identity().serial_number,
             ConnTimeoutMultiplier aConnectionTimeoutMultiplier = kConnTimeoutMultiplier4,
             CipUdint aConsumingRPI_usecs = 0,
             CipUdint aProcudingRPI_usecs = 0
             );
 
-    std::string Format() const                              { return conn_path.Format(); }
+    FixedStr<256> Format() const                            { return conn_path.Format(); }
 
     TransportTrigger&   Transport() const                   { return (TransportTrigger&) trigger; }
 
@@ -707,7 +708,7 @@ public:
     CipAppPath& ProducingPath() const   { return conn_path.ProducingPath(); }
 
     CipUint ConnectionSerialNumber() const  { return connection_serial_number; }
-    void SetConnectionSerialNumber( CipUint aNumber = ++serial_number_allocator )
+    void SetConnectionSerialNumber( CipUint aNumber = nextSerialNumber() )
     {
         connection_serial_number = aNumber;
     }
@@ -780,7 +781,7 @@ public:
         producing_connection_id = 0;
         connection_serial_number = 0;
         originator_vendor_id = CIPSTER_DEVICE_VENDOR_ID;
-        originator_serial_number = serial_number_;
+        originator_serial_number = Identity().serial_number;
         connection_timeout_multiplier_value = 0;
         remaining_path_size = 0;
 
@@ -805,7 +806,8 @@ public:
 
 protected:
 
-    static CipUint      serial_number_allocator;
+    /// Return the current stack's next connection serial number.
+    static CipUint      nextSerialNumber();
 
     //-----<ConnectionTriad>----------------------------------------------------
     // The Connection Triad used in the Connection Manager specification includes
@@ -997,6 +999,7 @@ public:
     {
         inactivity_watchdog_timer_usecs = CurrentUSecs32() + aFuture;
         //CIPSTER_TRACE_INFO( "%s<%d>( %d )\n", __func__, instance_id, inactivity_watchdog_timer_usecs );
+        dueBy( inactivity_watchdog_timer_usecs );
         return *this;
     }
 
@@ -1012,10 +1015,61 @@ public:
      * Function SndConnectedData
      * sends the data from the producing CIP object of the connection via the socket
      * of the connection instance on UDP.
+     *
+     * @param aLaunchNSecs if not 0 is when the kernel is to put the frame on
+     *  the wire, see SetTxTimeMode().
+     */
+    EipStatus SendConnectedData( uint64_t aLaunchNSecs = 0 );
+
+    /**
+     * Function NextLaunchNSecs
+     * returns the launch time of the production due @a aDueUSecs from now,
+     * see SetTxTimeMode().  A cyclic connection launches at its first
+     * production's instant plus a whole number of its RPIs, so the loop's
+     * lateness and the tick timer's rounding do not move its phase.
+     */
+    uint64_t NextLaunchNSecs( int32_t aDueUSecs );
+
+    /**
+     * Function HandleReceivedIoConnectionData
+     * consumes the data item of a class 0/1 frame which passed the address and
+     * encapsulation sequence checks.
+     *
+     * @param aInput is the connected data item.
+     * @param aRxNSecs is the arrival time of the frame, see RxTimeNSecs().
      */
-    EipStatus SendConnectedData();
+    EipStatus HandleReceivedIoConnectionData( BufReader aInput, uint64_t aRxNSecs = 0 );
 
-    EipStatus HandleReceivedIoConnectionData( BufReader aInput );
+    /**
+     * Function RxTimeNSecs
+     * returns the arrival time of the last consumed frame which carried new
+     * data, in nanoseconds since the epoch (CLOCK_REALTIME).  On linux this is
+     * the kernel's receive timestamp, so comparing it to the current time
+     * measures how long the frame waited in the stack.  0 means not yet or not
+     * available.
+     */
+    uint64_t RxTimeNSecs() const                { return rx_time_nsecs; }
+
+    /**
+     * Function SetFrameRing
+     * attaches @a aRing, owned by the application, to receive a copy of every
+     * consumed frame which carries new data.  Call it from
+     * NotifyIoConnectionEvent() with kIoConnectionEventOpened, the connection
+     * lets go of it when closed.  NULL detaches.
+     */
+    void SetFrameRing( FrameRing* aRing )       { frame_ring = aRing; }
+    FrameRing* GetFrameRing() const             { return frame_ring; }
+
+    /**
+     * Function Shard
+     * returns the I/O worker which serves this connection, see
+     * SetIoShardCount().  Its point to point frames use UDP port
+     * g_my_io_udp_port + Shard().
+     */
+    int Shard() const                           { return shard; }
+
+    /// Return the frames per second this connection adds to its shard's load.
+    unsigned LoadPps() const                    { return load_pps; }
 
     /**
      * Function Close
@@ -1122,6 +1176,7 @@ protected:
     {
         //CIPSTER_TRACE_INFO( "%s<%d>( %d ) CID:0x%08x PID:0x%08x\n", __func__, instance_id, aUSecs, consuming_connection_id, producing_connection_id );
         transmission_trigger_timer_usecs = aUSecs;
+        dueBy( aUSecs );
         return *this;
     }
 
@@ -1185,11 +1240,29 @@ protected:
     UdpSocket*  producing_socket;
     CipUdint    encap_session;          // session_handle, 0 is not used.
 
+    uint64_t    rx_time_nsecs;          // arrival of last new consumed data
+
+    uint64_t    launch_start_nsecs;     // launch time of production 0, 0 if not yet
+    uint64_t    launch_count;           // productions since launch_start_nsecs
+
+    FrameRing*  frame_ring;             // not owned, may be NULL
+
+    int         shard;                  // I/O worker serving this connection
+    unsigned    load_pps;               // counted in its shard's load while not 0
+
 private:
-    // for active connection doubly linked list at g_active_conns
+    /// Make ManageConnections() look at this connection's shard by @a aUSecs.
+    void dueBy( uint32_t aUSecs );
+
+    // for active connection doubly linked list at ActiveConnections()
     CipConn*    next;
     CipConn*    prev;
     bool        on_list;
+
+    // for the list of its shard and the index by consuming id, both there too
+    CipConn*    shard_next;
+    CipConn*    shard_prev;
+    CipConn*    id_next;
 };
 
 
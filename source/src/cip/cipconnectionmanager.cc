@@ -23,14 +23,48 @@
 #include "../enet_encap/cpf.h"
 
 
-/// List holding all currently active connections
-CipConnBox g_active_conns;
+/**
+ * Struct ConnMgrState
+ * is the connection manager's share of a StackContext.
+ */
+struct ConnMgrState : public StackState
+{
+    ConnMgrState()
+    {
+        memset( shard_pps, 0, sizeof shard_pps );
+        memset( shard_conns, 0, sizeof shard_conns );
+        memset( timeouts_pending, 0, sizeof timeouts_pending );
+    }
+
+    /// List holding all currently active connections
+    CipConnBox  active_conns;
+
+    unsigned    shard_pps[CIPSTER_MAX_IO_SHARDS];
+    unsigned    shard_conns[CIPSTER_MAX_IO_SHARDS];
+
+    // Set by a shard's ManageConnections(), read back by the same worker.
+    bool        timeouts_pending[CIPSTER_MAX_IO_SHARDS];
+};
+
+
+static StackStateType<ConnMgrState> s_conn_mgr_state( kStackStateConnMgr );
+
+static inline ConnMgrState& connMgr()
+{
+    return StackContext::Current().State<ConnMgrState>( kStackStateConnMgr );
+}
+
+
+CipConnBox& ActiveConnections()
+{
+    return connMgr().active_conns;
+}
 
 
 CipConn* CipConnMgrClass::FindExistingMatchingConnection( const ConnectionData& params )
 {
-    for( CipConnBox::iterator active = g_active_conns.begin();
-            active != g_active_conns.end();  ++active )
+    for( CipConnBox::iterator active = ActiveConnections().begin();
+            active != ActiveConnections().end();  ++active )
     {
         if( active->State() == kConnStateEstablished )
         {
@@ -46,7 +80,7 @@ CipConn* CipConnMgrClass::FindExistingMatchingConnection( const ConnectionData&
 
 
 EipStatus CipConnMgrClass::RecvConnectedData( UdpSocket* aSocket,
-        const SockAddr& aFromAddress, BufReader aCommand )
+        const SockAddr& aFromAddress, BufReader aCommand, uint64_t aRxNSecs )
 {
     Cpf cpfd( aFromAddress, 0 );
     int result;
@@ -100,6 +134,14 @@ EipStatus CipConnMgrClass::RecvConnectedData( UdpSocket* aSocket,
                 return kEipStatusError;
             }
 
+            // Another shard's worker may be using this connection right now.
+            if( conn->Shard() != aSocket->Shard() )
+            {
+                CIPSTER_TRACE_WARN( "%s[%d]: CID:0x%x belongs to shard %d\n",
+                    __func__, aSocket->h(), cpfd.AddrConnId(), conn->Shard() );
+                return kEipStatusError;
+            }
+
             /*
             CIPSTER_TRACE_INFO( "%s: got consuming connection for conn_id 0x%x\n",
                 __func__, cpfd.AddrConnId()
@@ -159,7 +201,8 @@ EipStatus CipConnMgrClass::RecvConnectedData( UdpSocket* aSocket,
 
                 conn->eip_level_sequence_count_consuming = cpfd.AddrEncapSeqNum();
 
-                return conn->HandleReceivedIoConnectionData( BufReader( cpfd.DataRange() ) );
+                return conn->HandleReceivedIoConnectionData(
+                        BufReader( cpfd.DataRange() ), aRxNSecs );
             }
             else
             {
@@ -181,89 +224,263 @@ EipStatus CipConnMgrClass::RecvConnectedData( UdpSocket* aSocket,
 }
 
 
-EipStatus CipConnMgrClass::ManageConnections()
+//-----<IoShards>---------------------------------------------------------------
+
+int CipConnMgrClass::LeastLoadedShard()
+{
+    int best = 0;
+
+    for( int i = 1; i < IoShardCount(); ++i )
+    {
+        if( connMgr().shard_pps[i] < connMgr().shard_pps[best] )
+            best = i;
+    }
+
+    return best;
+}
+
+
+void CipConnMgrClass::AddShardLoad( CipConn* aConn )
+{
+    if( !aConn->IsIOConnection() || aConn->load_pps )
+        return;
+
+    unsigned pps = 0;
+
+    if( aConn->ConsumingRPI() )
+        pps += 1000000 / aConn->ConsumingRPI();
+
+    if( aConn->ProducingRPI() )
+        pps += 1000000 / aConn->ProducingRPI();
+
+    // a connection is counted while its load_pps is not 0
+    aConn->load_pps = pps ? pps : 1;
+
+    connMgr().shard_pps[aConn->shard] += aConn->load_pps;
+    ++connMgr().shard_conns[aConn->shard];
+}
+
+
+void CipConnMgrClass::RemoveShardLoad( CipConn* aConn )
+{
+    if( !aConn->load_pps )
+        return;
+
+    connMgr().shard_pps[aConn->shard] -= aConn->load_pps;
+    --connMgr().shard_conns[aConn->shard];
+
+    aConn->load_pps = 0;
+}
+
+
+unsigned CipConnMgrClass::ShardLoadPps( int aShard )
+{
+    return connMgr().shard_pps[aShard];
+}
+
+
+unsigned CipConnMgrClass::ShardConnections( int aShard )
+{
+    return connMgr().shard_conns[aShard];
+}
+
+
+bool CipConnMgrClass::TimeOutsPending( int aShard )
+{
+    return connMgr().timeouts_pending[aShard];
+}
+
+
+void CipConnMgrClass::HandlePendingTimeOuts( int aShard )
+{
+    connMgr().timeouts_pending[aShard] = false;
+
+    CipConnBox::iterator it = ActiveConnections().ShardBegin( aShard );
+
+    while( it != ActiveConnections().end() )
+    {
+        // timeOut() takes it off the list
+        CipConnBox::iterator active = it++;
+
+        // A frame may have arrived meanwhile, so check the watchdog again.
+        if( active->State() == kConnStateEstablished
+         && active->HasInactivityWatchDogTimer()
+         && active->InactivityWatchDogTimerUSecs() <= 0 )
+        {
+            CIPSTER_TRACE_INFO( "%s<%d>: >>> c-class:%d timeOut@%u shard:%d\n",
+                __func__,
+                active->instance_id,
+                active->trigger.Class(),
+                CurrentUSecs32(),
+                aShard
+                );
+
+            active->timeOut();
+        }
+    }
+}
+
+//-----</IoShards>--------------------------------------------------------------
+
+
+int32_t CipConnMgrClass::ConnectionsDueInUSecs( int aShard )
+{
+    CipConnBox& box = ActiveConnections();
+    uint32_t    now = CurrentUSecs32();
+
+    int first = aShard >= 0 ? aShard : 0;
+    int last  = aShard >= 0 ? aShard : CIPSTER_MAX_IO_SHARDS - 1;
+
+    int32_t due = 1000000;
+
+    for( int shard = first;  shard <= last;  ++shard )
+    {
+        int32_t in = box.ShardDueUSecs( shard ) - now;
+
+        if( in < due )
+            due = in;
+    }
+
+    return due - int32_t( TxTimeLeadUSecs() );
+}
+
+
+EipStatus CipConnMgrClass::ManageConnections( int aShard, bool isTick )
 {
     EipStatus eip_status;
 
-    // Check for application message triggers
-    HandleApplication();
+    if( isTick )
+    {
+        // Check for application message triggers, once per tick.
+        if( aShard <= 0 )
+            HandleApplication();
+
+        // In the two thread mode NetworkHandlerProcessExplicit() does this.
+        if( !NetworkHandlerIsThreaded() )
+            ManageEncapsulationMessages();
+    }
+
+    // A shard worker must not close a connection, see HandlePendingTimeOuts().
+    bool defer_timeouts = aShard >= 0 && IoShardCount() > 1;
 
-    ManageEncapsulationMessages();
+    // With SetTxTimeMode() on, produce up to this early and let the kernel
+    // hold the frame until it is due.
+    int32_t lead_usecs = TxTimeLeadUSecs();
 
-    for( CipConnBox::iterator active = g_active_conns.begin();
-            active != g_active_conns.end();  ++active )
+    CipConnBox& box = ActiveConnections();
+    uint32_t    now = CurrentUSecs32();
+
+    int first = aShard >= 0 ? aShard : 0;
+    int last  = aShard >= 0 ? aShard : CIPSTER_MAX_IO_SHARDS - 1;
+
+    for( int shard = first;  shard <= last;  ++shard )
     {
-        if( active->State() == kConnStateEstablished )
+        // No timer of this shard runs out yet, skip the walk.
+        if( box.ShardIdleUntil( shard, now + lead_usecs ) )
+            continue;
+
+        // The walk pulls this in to the soonest timer it finds, and so do
+        // the timers it sets.  A second at most keeps the compare in range.
+        box.SetShardDue( shard, now + 1000000 );
+
+        for( CipConnBox::iterator active = box.ShardBegin( shard );
+                active != box.end();  ++active )
         {
-            // maybe check inactivity watchdog timer.
-            if( active->HasInactivityWatchDogTimer() )
+            if( active->State() == kConnStateEstablished )
             {
-                if( active->InactivityWatchDogTimerUSecs() <= 0 )
+                // maybe check inactivity watchdog timer.
+                if( active->HasInactivityWatchDogTimer() )
                 {
-                    // we have a timed out connection while performing watchdog check
-
-                    if( active->trigger.Class() == kConnTransportClass3 )
+                    if( active->InactivityWatchDogTimerUSecs() <= 0 && defer_timeouts )
                     {
-                        CIPSTER_TRACE_INFO(
-                            "%s<%d>: >>> c-class:%d timeOut@%u on session id:%d\n",
-                            __func__,
-                            active->instance_id,
-                            active->trigger.Class(),
-                            CurrentUSecs32(),
-                            active->SessionHandle()
-                            );
+                        connMgr().timeouts_pending[aShard] = true;
+                        box.ShardDueBy( shard, now );
+                        continue;
                     }
-                    else
+
+                    if( active->InactivityWatchDogTimerUSecs() <= 0 )
                     {
-                        // If this shows -1 as socket values, its because the other end
-                        // closed the transport and we closed it in response already.
-                        CIPSTER_TRACE_INFO(
-                            "%s<%d>: >>> c-class:%d timeOut@%u\n",
-                            __func__,
-                            active->instance_id,
-                            active->trigger.Class(),
-                            CurrentUSecs32()
-                            );
-                    }
+                        // we have a timed out connection while performing watchdog check
 
-                    active->timeOut();
-                }
-            }
+                        if( active->trigger.Class() == kConnTransportClass3 )
+                        {
+                            CIPSTER_TRACE_INFO(
+                                "%s<%d>: >>> c-class:%d timeOut@%u on session id:%d\n",
+                                __func__,
+                                active->instance_id,
+                                active->trigger.Class(),
+                                CurrentUSecs32(),
+                                active->SessionHandle()
+                                );
+                        }
+                        else
+                        {
+                            // If this shows -1 as socket values, its because the other end
+                            // closed the transport and we closed it in response already.
+                            CIPSTER_TRACE_INFO(
+                                "%s<%d>: >>> c-class:%d timeOut@%u\n",
+                                __func__,
+                                active->instance_id,
+                                active->trigger.Class(),
+                                CurrentUSecs32()
+                                );
+                        }
 
-            // only if the connection has not timed out check if data is to be sent
-            if( active->State() == kConnStateEstablished )
-            {
-                // client connection, not server
-                if( !active->trigger.IsServer()
+                        active->timeOut();
 
-                    && active->ExpectedPacketRateUSecs() != 0
+                        // Closing may take others off the list too, walk again next tick.
+                        box.ShardDueBy( shard, now );
+                        break;
+                    }
+
+                    box.ShardDueBy( shard, now + active->InactivityWatchDogTimerUSecs() );
+                }
 
-                    // only produce for the master connection
-                    && active->ProducingUdp() )
+                // only if the connection has not timed out check if data is to be sent
+                if( active->State() == kConnStateEstablished )
                 {
-                    if( active->TransmissionTriggerTimerUSecs() <= 0 ) // need to send packet
-                    {
-                        eip_status = active->SendConnectedData();
+                    // client connection, not server
+                    if( !active->trigger.IsServer()
 
-                        if( eip_status == kEipStatusError )
-                        {
-                            CIPSTER_TRACE_ERR( "%s<%d>: ERROR sending UDP\n",
-                                __func__, active->instance_id );
-                        }
+                        && active->ExpectedPacketRateUSecs() != 0
 
-                        active->BumpTransmissionTriggerTimerUSecs( active->ProducingRPI() );
+                        // only produce for the master connection
+                        && active->ProducingUdp() )
+                    {
+                        int32_t due_usecs = active->TransmissionTriggerTimerUSecs();
 
-                        if( active->trigger.Trigger() != kConnTriggerTypeCyclic )
+                        if( due_usecs <= lead_usecs ) // need to send packet
                         {
-                            // non cyclic connections have to reload the production inhibit timer
-                            active->SetProductionInhibitTimerUSecs( active->GetPIT_USecs() );
+                            eip_status = active->SendConnectedData(
+                                    lead_usecs ? active->NextLaunchNSecs( due_usecs ) : 0 );
+
+                            if( eip_status == kEipStatusError )
+                            {
+                                CIPSTER_TRACE_ERR( "%s<%d>: ERROR sending UDP\n",
+                                    __func__, active->instance_id );
+                            }
+
+                            active->BumpTransmissionTriggerTimerUSecs( active->ProducingRPI() );
+
+                            if( active->trigger.Trigger() != kConnTriggerTypeCyclic )
+                            {
+                                // non cyclic connections have to reload the production inhibit timer
+                                active->SetProductionInhibitTimerUSecs( active->GetPIT_USecs() );
+                            }
                         }
+                        else
+                            box.ShardDueBy( shard, now + due_usecs );
                     }
                 }
             }
         }
     }
 
+    // Send what SendConnectedData() batched when UdpGsoMode() is on, into
+    // the pool of each connection's shard, so all of them for an all shards pass.
+    for( int shard = first;  shard <= last && shard < IoShardCount();  ++shard )
+        UdpGsoFlush( shard );
+
     return kEipStatusOk;
 }
 
@@ -272,12 +489,12 @@ void CipConnMgrClass::CheckForTimedOutConnectionsAndCloseTCPConnections( CipUdin
 {
     bool another_active_with_same_session_found = false;
 
-    for( CipConnBox::iterator it = g_active_conns.begin();
-                it != g_active_conns.end();  ++it )
+    for( CipConnBox::iterator it = ActiveConnections().begin();
+                it != ActiveConnections().end();  ++it )
     {
         // This test assumes that caller first CipConn::Close()d the CIP connection
         // that timed out, so we do not have to exclude it from comparison here
-        // because it is no longer in g_active_conns.
+        // because it is no longer in ActiveConnections().
         if( it->SessionHandle() == aSessionHandle )
         {
             another_active_with_same_session_found = true;
@@ -288,16 +505,23 @@ void CipConnMgrClass::CheckForTimedOutConnectionsAndCloseTCPConnections( CipUdin
     if( !another_active_with_same_session_found )
     {
         CIPSTER_TRACE_INFO( "%s: killing session:%d\n", __func__, aSessionHandle );
-        SessionMgr::CloseBySessionHandle( aSessionHandle );
+
+        // Sessions belong to the explicit messaging thread when there is one.
+        if( NetworkHandlerIsThreaded() )
+            NetworkHandlerDeferSessionClose( aSessionHandle );
+        else
+            SessionMgr::CloseBySessionHandle( aSessionHandle );
     }
 }
 
 
 void CipConnMgrClass::CloseClass3Connections( CipUdint aSessionHandle )
 {
-    CipConnBox::iterator it = g_active_conns.begin();
+    IoLock  lock;
+
+    CipConnBox::iterator it = ActiveConnections().begin();
 
-    while( it != g_active_conns.end() )
+    while( it != ActiveConnections().end() )
     {
         if( it->trigger.Class() == kConnTransportClass3 &&
             it->SessionHandle() == aSessionHandle )
@@ -318,30 +542,15 @@ void CipConnMgrClass::CloseClass3Connections( CipUdint aSessionHandle )
 
 CipConn* GetConnectionByConsumingId( int aConnectionId )
 {
-    CipConnBox::iterator c = g_active_conns.begin();
-
-    while( c != g_active_conns.end() )
-    {
-        if( c->State() == kConnStateEstablished )
-        {
-            if( c->ConsumingConnectionId() == aConnectionId )
-            {
-                return c;
-            }
-        }
-
-        ++c;
-    }
-
-    return NULL;
+    return ActiveConnections().FindConsuming( aConnectionId );
 }
 
 
 CipConn* GetConnectedOutputAssembly( int output_assembly_id )
 {
-    CipConnBox::iterator active = g_active_conns.begin();
+    CipConnBox::iterator active = ActiveConnections().begin();
 
-    for(  ; active != g_active_conns.end(); ++active )
+    for(  ; active != ActiveConnections().end(); ++active )
     {
         if( active->State() == kConnStateEstablished )
         {
@@ -354,6 +563,15 @@ CipConn* GetConnectedOutputAssembly( int output_assembly_id )
 }
 
 
+CipConnBox::CipConnBox() :
+    head( NULL )
+{
+    memset( shard_heads, 0, sizeof shard_heads );
+    memset( shard_due, 0, sizeof shard_due );
+    memset( id_buckets, 0, sizeof id_buckets );
+}
+
+
 bool CipConnBox::Insert( CipConn* aConn )
 {
     if( aConn->on_list )
@@ -379,6 +597,24 @@ bool CipConnBox::Insert( CipConn* aConn )
     head = aConn;
     aConn->on_list = true;
 
+    CipConn*& shard_head = shard_heads[aConn->shard];
+
+    aConn->shard_prev = NULL;
+    aConn->shard_next = shard_head;
+
+    if( shard_head )
+        shard_head->shard_prev = aConn;
+
+    shard_head = aConn;
+
+    CipConn*& bucket = id_buckets[idBucket( aConn->ConsumingConnectionId() )];
+
+    aConn->id_next = bucket;
+    bucket = aConn;
+
+    // its timers are not yet in shard_due
+    ShardDueBy( aConn->shard, CurrentUSecs32() );
+
     return true;
 }
 
@@ -411,18 +647,48 @@ bool CipConnBox::Remove( CipConn* aConn )
         aConn->next->prev = aConn->prev;
     }
 
+    if( aConn->shard_prev )
+        aConn->shard_prev->shard_next = aConn->shard_next;
+    else
+        shard_heads[aConn->shard] = aConn->shard_next;
+
+    if( aConn->shard_next )
+        aConn->shard_next->shard_prev = aConn->shard_prev;
+
+    CipConn** link = &id_buckets[idBucket( aConn->ConsumingConnectionId() )];
+
+    while( *link != aConn )
+        link = &(*link)->id_next;
+
+    *link = aConn->id_next;
+
     aConn->prev  = NULL;
     aConn->next  = NULL;
+    aConn->shard_prev = NULL;
+    aConn->shard_next = NULL;
+    aConn->id_next = NULL;
     aConn->on_list = false;
     return true;
 }
 
 
+CipConn* CipConnBox::FindConsuming( CipUdint aConnectionId ) const
+{
+    for( CipConn* c = id_buckets[idBucket( aConnectionId )];  c;  c = c->id_next )
+    {
+        if( c->ConsumingConnectionId() == aConnectionId && c->State() == kConnStateEstablished )
+            return c;
+    }
+
+    return NULL;
+}
+
+
 bool IsConnectedInputAssembly( int aInstanceId )
 {
-    CipConn* c = g_active_conns.begin();
+    CipConn* c = ActiveConnections().begin();
 
-    for(  ; c != g_active_conns.end();  ++c )
+    for(  ; c != ActiveConnections().end();  ++c )
     {
         if( aInstanceId == c->ProducingPath().GetInstanceOrConnPt() )
             return true;
@@ -434,9 +700,9 @@ bool IsConnectedInputAssembly( int aInstanceId )
 
 bool IsConnectedOutputAssembly( int aInstanceId )
 {
-    CipConnBox::iterator c = g_active_conns.begin();
+    CipConnBox::iterator c = ActiveConnections().begin();
 
-    for( ; c != g_active_conns.end(); ++c )
+    for( ; c != ActiveConnections().end(); ++c )
     {
         if( aInstanceId == c->ConsumingPath().GetInstanceOrConnPt() )
             return true;
@@ -450,9 +716,9 @@ EipStatus TriggerConnections( int aOutputAssembly, int aInputAssembly )
 {
     EipStatus ret = kEipStatusError;
 
-    CipConnBox::iterator c = g_active_conns.begin();
+    CipConnBox::iterator c = ActiveConnections().begin();
 
-    for(  ; c != g_active_conns.end(); ++c )
+    for(  ; c != ActiveConnections().end(); ++c )
     {
         if( aOutputAssembly == c->ConsumingPath().GetInstanceOrConnPt()
          && aInputAssembly  == c->ProducingPath().GetInstanceOrConnPt() )
@@ -486,7 +752,22 @@ EipStatus CipConnMgrClass::forward_open( CipInstance* instance,
     uint32_t        producing_API_usecs = 0;
 
     unsigned        conn_path_byte_count;
-    ConnectionData  params;
+
+    // Over a kilobyte, and an unconnected_send nests this below other frames.
+    // Given back on return, so a frame may carry any number of these.
+    ArenaScope      temporary( CipMessageRouterRequest::RequestArena() );
+
+    ConnectionData* arena_params =
+        CipMessageRouterRequest::RequestArena().New<ConnectionData>();
+
+    if( !arena_params )
+    {
+        CIPSTER_TRACE_ERR( "%s: request arena exhausted\n", __func__ );
+        response->SetGenStatus( kCipErrorResourceUnavailable );
+        return kEipStatusOkSend;
+    }
+
+    ConnectionData& params = *arena_params;
 
     BufReader  in = request->Data();
 
@@ -792,7 +1073,20 @@ EipStatus CipConnMgrClass::forward_close_service( CipInstance* instance,
     ConnMgrStatus   ext_status  = kConnMgrStatusSuccess;
 
     unsigned        conn_path_byte_count;
-    ConnectionData  params;
+
+    ArenaScope      temporary( CipMessageRouterRequest::RequestArena() );
+
+    ConnectionData* arena_params =
+        CipMessageRouterRequest::RequestArena().New<ConnectionData>();
+
+    if( !arena_params )
+    {
+        CIPSTER_TRACE_ERR( "%s: request arena exhausted\n", __func__ );
+        response->SetGenStatus( kCipErrorResourceUnavailable );
+        return kEipStatusOkSend;
+    }
+
+    ConnectionData& params = *arena_params;
 
     BufReader  in = request->Data();
 
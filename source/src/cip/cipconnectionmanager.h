@@ -11,6 +11,13 @@
 #include "ciptypes.h"
 #include "cipmessagerouter.h"
 #include "cipconnection.h"
+#include "../enet_encap/networkhandler.h"      // CIPSTER_MAX_IO_SHARDS
+
+
+#ifndef CIPSTER_CONN_ID_BUCKETS
+/// Buckets of the index of active connections by consuming id, a power of 2.
+#define CIPSTER_CONN_ID_BUCKETS     64
+#endif
 
 
 class CipConnMgrClass : public CipClass
@@ -20,7 +27,58 @@ public:
 
     CipInstance* CreateInstance( int aInstanceId );
 
-    static EipStatus ManageConnections();
+    /**
+     * Function ManageConnections
+     * does one timer tick of the connections: watchdogs and productions.
+     *
+     * @param aShard limits this to the connections of one I/O shard, whose
+     *  worker holds its ShardLock, or is -1 for all of them under IoLock.
+     *  With more than one shard a timeout found here is left for
+     *  HandlePendingTimeOuts(), since closing touches what all shards share.
+     * @param isTick is false for a pass between ticks, which the network
+     *  handler makes when ConnectionsDueInUSecs() has run out.  It serves the
+     *  watchdogs and productions which came due but leaves out
+     *  HandleApplication() and the encapsulation messages, which go by ticks.
+     */
+    static EipStatus ManageConnections( int aShard = -1, bool isTick = true );
+
+    /**
+     * Function ConnectionsDueInUSecs
+     * returns how many usecs of CurrentUSecs32() from now a watchdog or a
+     * production, taken TxTimeLeadUSecs() early, of I/O shard @a aShard comes
+     * due, or of any shard for -1.  0 or less when one is due now.  At most
+     * one second, because an idle shard is looked at that often.
+     */
+    static int32_t ConnectionsDueInUSecs( int aShard = -1 );
+
+    /// Return true if ManageConnections( @a aShard ) left timeouts to handle.
+    static bool TimeOutsPending( int aShard );
+
+    /**
+     * Function HandlePendingTimeOuts
+     * times out the connections of @a aShard whose watchdog ran out, the
+     * caller holding IoLock.
+     */
+    static void HandlePendingTimeOuts( int aShard );
+
+    //-----<IoShards>-----------------------------------------------------------
+
+    /// Return the I/O shard with the least load in frames per second.
+    static int LeastLoadedShard();
+
+    /// Count @a aConn, once active, into the load of its shard.
+    static void AddShardLoad( CipConn* aConn );
+
+    /// Take @a aConn out of the load of its shard.
+    static void RemoveShardLoad( CipConn* aConn );
+
+    /// Return the consumed plus produced frames per second of @a aShard.
+    static unsigned ShardLoadPps( int aShard );
+
+    /// Return how many I/O connections @a aShard serves.
+    static unsigned ShardConnections( int aShard );
+
+    //-----</IoShards>----------------------------------------------------------
 
     /**
      * Function CloseClass3Connections
@@ -65,11 +123,11 @@ public:
      *           connection hijacking
      * @param aCommand received data buffer pointing just past the
      *   encapsulation header and a byte count remaining in frame.
-     * @param aReply where to put the reply and tells its maximum length.
+     * @param aRxNSecs is the frame's arrival time from UdpSocket::Recv().
      * @return EipStatus
      */
     static EipStatus RecvConnectedData( UdpSocket* aSocket,
-        const SockAddr& aFromAddress, BufReader aCommand );
+        const SockAddr& aFromAddress, BufReader aCommand, uint64_t aRxNSecs = 0 );
 
     //-----<CipServiceFunctions>------------------------------------------------
     static EipStatus forward_open_service( CipInstance* instance,
@@ -179,32 +237,37 @@ bool IsConnectedOutputAssembly( int aInstanceId );
  * Class CipConnBox
  * is a containter for CipConns (likely to be replace with std::vector some day).
  * Used to hold an active list of CipConns, using CipConn->prev and ->next.
+ * Each connection is also on the list of its I/O shard, using
+ * CipConn->shard_prev and ->shard_next, and in an index by consuming
+ * connection id, so a shard's worker walks only its own connections and a
+ * consumed frame finds its connection without a walk.
  */
 class CipConnBox
 {
 public:
 
-    CipConnBox() :
-        head( NULL )
-    {}
+    CipConnBox();
 
     /// Class CipConnBox::iterator walks the linked list and mimics a pointer
     /// when the dereferencing operators and cast are used.
     class iterator
     {
     public:
-        iterator( CipConn* aConn ) : p( aConn ) {}
+        iterator( CipConn* aConn, bool aByShard = false ) :
+            p( aConn ),
+            by_shard( aByShard )
+        {}
 
         iterator& operator ++()
         {
-            p = p->next;
+            p = by_shard ? p->shard_next : p->next;
             return *this;
         }
 
         iterator operator ++( int ) // post-increment and return initial position
         {
-            iterator ret( p );
-            p = p->next;
+            iterator ret( *this );
+            ++*this;
             return ret;
         }
 
@@ -224,6 +287,7 @@ public:
 
     private:
         CipConn*    p;
+        bool        by_shard;   // walk the shard's list
     };
 
     /**
@@ -232,7 +296,8 @@ public:
      *
      * By adding a connection to the active connection list the connection manager
      * will perform the supervision and handle the timing (e.g., timeout,
-     * production inhibit, etc).
+     * production inhibit, etc).  Its shard and consuming connection id must
+     * be set before and stay put while it is on the list.
      *
      * @param aConn the connection to be added at the beginning.
      * @return bool - true if it was successfully inserted, else false because
@@ -250,10 +315,54 @@ public:
     iterator end()      const   { return iterator( NULL ); }
     iterator begin()    const   { return iterator( head ); }
 
+    /// Return the first connection of I/O shard @a aShard, walking only that shard.
+    iterator ShardBegin( int aShard ) const
+    {
+        return iterator( shard_heads[aShard], true );
+    }
+
+    /// Return the established connection consuming @a aConnectionId, or NULL.
+    CipConn* FindConsuming( CipUdint aConnectionId ) const;
+
+    /**
+     * Function ShardIdleUntil
+     * returns true if no timer of a connection of @a aShard runs out before
+     * @a aUSecs, as found by the last walk of ManageConnections() and told by
+     * ShardDueBy() since.
+     */
+    bool ShardIdleUntil( int aShard, uint32_t aUSecs ) const
+    {
+        return int32_t( shard_due[aShard] - aUSecs ) > 0;
+    }
+
+    /// Return when the timers of @a aShard run out next, in CurrentUSecs32() units.
+    uint32_t ShardDueUSecs( int aShard ) const          { return shard_due[aShard]; }
+
+    /// Set when the timers of @a aShard run out next, before a walk finds it.
+    void SetShardDue( int aShard, uint32_t aUSecs )     { shard_due[aShard] = aUSecs; }
+
+    /// Pull the next walk of @a aShard forward to @a aUSecs if that is sooner.
+    void ShardDueBy( int aShard, uint32_t aUSecs )
+    {
+        if( int32_t( aUSecs - shard_due[aShard] ) < 0 )
+            shard_due[aShard] = aUSecs;
+    }
+
 protected:
-    CipConn* head;
+    static unsigned idBucket( CipUdint aConnectionId )
+    {
+        return ( aConnectionId ^ ( aConnectionId >> 16 ) ) & ( CIPSTER_CONN_ID_BUCKETS - 1 );
+    }
+
+    CipConn*    head;
+
+    CipConn*    shard_heads[CIPSTER_MAX_IO_SHARDS];
+    uint32_t    shard_due[CIPSTER_MAX_IO_SHARDS];   // CurrentUSecs32() units
+
+    CipConn*    id_buckets[CIPSTER_CONN_ID_BUCKETS];
 };
 
-extern CipConnBox g_active_conns;
+/// Return the current stack's list of active connections.
+CipConnBox& ActiveConnections();
 
 #endif // CIPSTER_CIPCONNECTIONMANAGER_H_
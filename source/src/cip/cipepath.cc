@@ -489,25 +489,71 @@ logical_exit:
 }
 
 
-std::string CipAppPath::Format() const
+bool CipAppPath::DeserializeCompact( const BufReader& aPath )
 {
-    std::string dest;
+    static const int    seg_types[] = {
+        kLogicalSegmentClassId,
+        kLogicalSegmentInstanceId,
+        kLogicalSegmentAttributeId,
+    };
+
+    const uint8_t*  p   = aPath.data();
+    const uint8_t*  end = p + aPath.size();
+    int             values[3];
+    int             count = 0;
+
+    while( p < end )
+    {
+        if( count == 3 || end - p < 2 || (*p & 0xfc) != seg_types[count] )
+            return false;
+
+        if( (*p & 3) == 0 )
+        {
+            values[count++] = p[1];
+            p += 2;
+        }
+        else if( (*p & 3) == 1 && end - p >= 4 )
+        {
+            values[count++] = p[2] | ( p[3] << 8 );     // p[1] is the pad
+            p += 4;
+        }
+        else
+            return false;
+    }
+
+    if( count < 2 )
+        return false;
+
+    Clear();
+    SetClass( values[0] );
+    SetInstance( values[1] );
+
+    if( count == 3 )
+        SetAttribute( values[2] );
+
+    return true;
+}
+
+
+FixedStr<80> CipAppPath::Format() const
+{
+    FixedStr<80> dest;
 
     if( HasClass() )
     {
         if( GetClass() == kCipAssemblyClass )
         {
-            StrPrintf( &dest, "assembly %d", GetInstanceOrConnPt() );
+            dest.Printf( "assembly %d", GetInstanceOrConnPt() );
         }
         else
         {
-            StrPrintf( &dest, "Class:%d", GetClass() );
+            dest.Printf( "Class:%d", GetClass() );
 
             if( HasInstance() )
-                StrPrintf( &dest, " Instance:%d", GetInstance() );
+                dest.Printf( " Instance:%d", GetInstance() );
 
             if( HasConnPt() )
-                StrPrintf( &dest, " ConnPt:%d", GetConnPt() );
+                dest.Printf( " ConnPt:%d", GetConnPt() );
         }
     }
     else if( HasSymbol() )
@@ -517,14 +563,14 @@ std::string CipAppPath::Format() const
 
         if( HasMember1() )
         {
-            StrPrintf( &dest, "[%d]", GetMember1() );
+            dest.Printf( "[%d]", GetMember1() );
 
             if( HasMember2() )
             {
-                StrPrintf( &dest, "[%d]", GetMember2() );
+                dest.Printf( "[%d]", GetMember2() );
 
                 if( HasMember3() )
-                    StrPrintf( &dest, "[%d]", GetMember3() );
+                    dest.Printf( "[%d]", GetMember3() );
             }
         }
     }
@@ -714,14 +760,16 @@ int CipElectronicKeySegment::SerializedCount( int aCtl ) const
 
 ConnMgrStatus CipElectronicKeySegment::Check() const
 {
+    const CipIdentity& id = Identity();
+
     bool compatiblity_mode = major_revision & 0x80;
 
     // Remove compatibility bit
     int mjr_revision = major_revision & 0x7f;
 
     // Check VendorID and ProductCode, must match, or be 0
-    if( ( vendor_id != 0     && vendor_id    != vendor_id_ )
-     || ( product_code != 0  && product_code != product_code_ ) )
+    if( ( vendor_id != 0     && vendor_id    != id.vendor_id )
+     || ( product_code != 0  && product_code != id.product_code ) )
     {
         return kConnMgrStatusVendorIdOrProductcodeError;
     }
@@ -729,7 +777,7 @@ ConnMgrStatus CipElectronicKeySegment::Check() const
     // VendorID and ProductCode are correct
 
     // Check DeviceType, must match or 0
-    if( device_type != 0 && device_type != device_type_ )
+    if( device_type != 0 && device_type != id.device_type )
     {
         return kConnMgrStatusDeviceTypeError;
     }
@@ -737,8 +785,8 @@ ConnMgrStatus CipElectronicKeySegment::Check() const
     // VendorID, ProductCode and DeviceType are correct
     if( !compatiblity_mode )
     {
-        if( ( mjr_revision   != 0 && mjr_revision   != revision_.major_revision )
-         || ( minor_revision != 0 && minor_revision != revision_.minor_revision ) )
+        if( ( mjr_revision   != 0 && mjr_revision   != id.revision.major_revision )
+         || ( minor_revision != 0 && minor_revision != id.revision.minor_revision ) )
         {
             return kConnMgrStatusRevisionMismatch;
         }
@@ -747,9 +795,9 @@ ConnMgrStatus CipElectronicKeySegment::Check() const
     else    // compatibility_mode
     {
         // mjr_revision must match, minor_revision must be <= my revision_.minor
-        if( mjr_revision != revision_.major_revision
+        if( mjr_revision != id.revision.major_revision
          || minor_revision == 0
-         || minor_revision > revision_.minor_revision )
+         || minor_revision > id.revision.minor_revision )
         {
             return kConnMgrStatusRevisionMismatch;
         }
@@ -5,11 +5,48 @@
 #ifndef CIPEPATH_H_
 #define CIPEPATH_H_
 
+#include <stdexcept>
+
 #include "ciptypes.h"
 #include "cipcommon.h"
 
-typedef std::vector<uint8_t>    Bytes;
-typedef std::vector<CipWord>    Words;
+
+/**
+ * Class FixedVec
+ * is a vector of at most N elements held in place, so decoding a segment on
+ * each request never touches the heap.
+ */
+template< typename T, int N >
+class FixedVec
+{
+public:
+    FixedVec() :
+        count( 0 )
+    {}
+
+    void        clear()                 { count = 0; }
+    size_t      size() const            { return count; }
+    bool        empty() const           { return !count; }
+    const T*    data() const            { return elems; }
+
+    const T& operator[]( size_t aIndex ) const  { return elems[aIndex]; }
+
+    void push_back( const T& aValue )
+    {
+        if( count >= N )
+            throw std::runtime_error( "FixedVec::push_back() capacity exceeded" );
+
+        elems[count++] = aValue;
+    }
+
+private:
+    unsigned    count;
+    T           elems[N];
+};
+
+// Both lengths are encoded in a byte.
+typedef FixedVec<uint8_t, 255>  Bytes;
+typedef FixedVec<CipWord, 255>  Words;
 
 
 /**
@@ -157,6 +194,19 @@ public:
      */
     int DeserializeAppPath( BufReader aInput, CipAppPath* aPreviousToInheritFrom = NULL, int aCtl = 0 );
 
+    /**
+     * Function DeserializeCompact
+     * decodes a padded @a aPath which consists of exactly a class, an instance
+     * and optionally an attribute logical segment of 8 or 16 bits, in that
+     * order, which is how most explicit requests address their target.  It
+     * gives the same result as DeserializeAppPath() for those, without the
+     * electronic key, symbol and inheritance handling.
+     *
+     * @return bool - true if decoded, false if @a aPath has another form and
+     *  this is unchanged.
+     */
+    bool DeserializeCompact( const BufReader& aPath );
+
     //-----<Serializeable>------------------------------------------------------
     int Serialize( BufWriter aOutput, int aCtl = 0 ) const;
     int SerializedCount( int aCtl = 0 ) const;
@@ -299,7 +349,7 @@ public:
 
     CipAppPath& operator = ( const CipAppPath& other );
 
-    std::string Format() const;
+    FixedStr<80> Format() const;
 
 private:
 
@@ -34,9 +34,9 @@ CipEthernetLinkClass::CipEthernetLinkClass() :
               1                     // version
               )
 {
-    AttributeInsert( _I, 1, kCipUdint,  memb_offs(interface_speed) );
-    AttributeInsert( _I, 2, kCipDword,  memb_offs(interface_flags) );
-    AttributeInsert( _I, 3, kCip6Usint, memb_offs(physical_address) );
+    AttributeInsert( _I, 1, kCipUdint,  memb_offs(interface_speed) )->SetCacheable();
+    AttributeInsert( _I, 2, kCipDword,  memb_offs(interface_flags) )->SetCacheable();
+    AttributeInsert( _I, 3, kCip6Usint, memb_offs(physical_address) )->SetCacheable();
 }
 
 
@@ -67,6 +67,7 @@ void CipEthernetLinkClass::ConfigureMacAddress( int aInstanceId, const uint8_t*
         if( i )
         {
             memcpy( &i->physical_address, mac_address, sizeof i->physical_address );
+            i->Changed();
         }
     }
 }
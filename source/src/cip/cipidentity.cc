@@ -36,38 +36,41 @@
 
 
 
-// attributes in CIP Identity Object, some are public so they can be examined
-// when testing electronic key validity.
+CipIdentity::CipIdentity() :
+    vendor_id( CIPSTER_DEVICE_VENDOR_ID ),
+    device_type( CIPSTER_DEVICE_TYPE ),
+    product_code( CIPSTER_DEVICE_PRODUCT_CODE ),
+    revision( CIPSTER_DEVICE_MAJOR_REVISION, CIPSTER_DEVICE_MINOR_REVISION ),
+    status( 0 ),
+    serial_number( 0 ),
+    product_name( CIPSTER_DEVICE_NAME )
+{
+}
 
-uint16_t vendor_id_ = CIPSTER_DEVICE_VENDOR_ID;         //*< Attribute 1: Vendor ID
 
-uint16_t device_type_ = CIPSTER_DEVICE_TYPE;            //*< Attribute 2: Device Type
+static StackStateType<CipIdentity> s_identity_state( kStackStateIdentity );
 
-uint16_t product_code_ = CIPSTER_DEVICE_PRODUCT_CODE;   //*< Attribute 3: Product Code
 
-/// Attribute 4: Revision / USINT Major, USINT Minor
-CipRevision revision_
+static void identity_changed()
 {
-    CIPSTER_DEVICE_MAJOR_REVISION,
-    CIPSTER_DEVICE_MINOR_REVISION
-};
-
-uint16_t status_ = 0;               //*< Attribute 5: Status
-
-uint32_t serial_number_ = 0;        //*< Attribute 6: Serial Number, has to be set prior to CIPster initialization
+    CipClass* clazz = GetCipClass( kCipIdentityClass );
 
-std::string product_name_ = CIPSTER_DEVICE_NAME;
+    if( clazz )
+        clazz->Changed();
+}
 
 
 void SetDeviceSerialNumber( uint32_t serial_number )
 {
-    serial_number_ = serial_number;
+    Identity().serial_number = serial_number;
+    identity_changed();
 }
 
 
 void SetDeviceStatus( uint16_t status )
 {
-    status_ = status;
+    Identity().status = status;
+    identity_changed();
 }
 
 
@@ -183,13 +186,17 @@ CipIdentityClass::CipIdentityClass() :
 
     ServiceInsert( _I, kReset, reset_service, "Reset" );
 
-    AttributeInsert( _I, 1, kCipUint, &vendor_id_ );
-    AttributeInsert( _I, 2, kCipUint, &device_type_ );
-    AttributeInsert( _I, 3, kCipUint, &product_code_ );
-    AttributeInsert( _I, 4, kCipUsintUsint, &revision_ );
-    AttributeInsert( _I, 5, kCipWord, &status_ );
-    AttributeInsert( _I, 6, kCipUdint, &serial_number_ );
-    AttributeInsert( _I, 7, kCipShortString, &product_name_ );
+    // the attributes of the stack this class is constructed in, shared by
+    // the instances so a change is announced through the class
+    CipIdentity& id = Identity();
+
+    AttributeInsert( _I, 1, kCipUint, &id.vendor_id )->SetCacheable();
+    AttributeInsert( _I, 2, kCipUint, &id.device_type )->SetCacheable();
+    AttributeInsert( _I, 3, kCipUint, &id.product_code )->SetCacheable();
+    AttributeInsert( _I, 4, kCipUsintUsint, &id.revision )->SetCacheable();
+    AttributeInsert( _I, 5, kCipWord, &id.status )->SetCacheable();
+    AttributeInsert( _I, 6, kCipUdint, &id.serial_number )->SetCacheable();
+    AttributeInsert( _I, 7, kCipShortString, &id.product_name )->SetCacheable();
 }
 
 
@@ -6,8 +6,11 @@
 #ifndef CIPSTER_CIPIDENTITY_H_
 #define CIPSTER_CIPIDENTITY_H_
 
+#include <string>
+
 #include "typedefs.h"
 #include "ciptypes.h"
+#include "../stackcontext.h"
 
 /// Status of the CIP Identity object
 enum CipIdentityStatus
@@ -52,14 +55,35 @@ enum CipIdentityExtendedStatus
 EipStatus CipIdentityInit();
 
 
-// Publics from the CIP identity object
-extern uint16_t         vendor_id_;
-extern uint16_t         device_type_;
-extern uint16_t         product_code_;
-extern CipRevision      revision_;
-extern uint16_t         status_;
-extern uint32_t         serial_number_;
-extern std::string      product_name_;
+/**
+ * Struct CipIdentity
+ * holds the attributes of a stack's CIP Identity object, they are public so
+ * they can be examined when testing electronic key validity.  Replies on them
+ * are cached, so code changing one directly must then call Changed() on the
+ * Identity class, as SetDeviceStatus() does.
+ */
+struct CipIdentity : public StackState
+{
+    CipIdentity();
+
+    uint16_t        vendor_id;          ///< Attribute 1: Vendor ID
+    uint16_t        device_type;        ///< Attribute 2: Device Type
+    uint16_t        product_code;       ///< Attribute 3: Product Code
+    CipRevision     revision;           ///< Attribute 4: Revision / USINT Major, USINT Minor
+    uint16_t        status;             ///< Attribute 5: Status
+
+    /// Attribute 6: Serial Number, has to be set prior to CIPster initialization
+    uint32_t        serial_number;
+
+    std::string     product_name;       ///< Attribute 7: Product Name
+};
+
+
+/// Return the current stack's Identity attributes.
+inline CipIdentity& Identity()
+{
+    return StackContext::Current().State<CipIdentity>( kStackStateIdentity );
+}
 
 
 #endif    // CIPSTER_CIPIDENTITY_H_
@@ -8,11 +8,25 @@
 #include <cipclass.h>
 #include <cipcommon.h>
 
+#include <atomic>
+
+
+// Versions come from one sequence so an instance allocated where a deleted
+// one lived never repeats that one's version.
+static std::atomic<uint32_t>    s_versions;
+
 
 CipInstance::CipInstance( int aInstanceId ) :
     instance_id( aInstanceId ),
-    owning_class( 0 )      // NULL (not owned) until I am inserted into a CipClass
+    owning_class( 0 ),     // NULL (not owned) until I am inserted into a CipClass
+    version( ++s_versions )
+{
+}
+
+
+void CipInstance::Changed()
 {
+    version = ++s_versions;
 }
 
 
@@ -79,10 +79,27 @@ public:
      */
     CipService* Service( int aServiceId ) const;
 
+    /**
+     * Function Version
+     * returns a number which differs from every earlier one of this instance
+     * once any of its attribute data has changed, see Changed().
+     */
+    uint32_t Version() const        { return version; }
+
+    /**
+     * Function Changed
+     * must be called after changing attribute data of this instance other
+     * than by SetAttributeSingle, so cached replies holding the old values
+     * are no longer used.  Data shared by all instances of a class is
+     * announced by calling this on the CipClass.
+     */
+    void Changed();
+
 protected:
 
     int             instance_id;    ///< this instance's number (unique within the class)
     CipClass*       owning_class;   ///< class the instance belongs to or NULL if none.
+    uint32_t        version;        ///< see Version()
 
     void setClass( CipClass* aClass )       { owning_class = aClass; }
 
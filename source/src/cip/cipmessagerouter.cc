@@ -14,10 +14,149 @@
 #include "byte_bufs.h"
 #include "ciperror.h"
 #include "trace.h"
+#include "../enet_encap/cpf.h"
 
 
-/// Array of the available explicit connections
-static CipConn g_explicit_connections[CIPSTER_CIP_NUM_EXPLICIT_CONNS];
+#ifndef CIPSTER_REPLY_CACHE_ENTRIES
+/// Count of remembered attribute replies, 0 for none.
+#define CIPSTER_REPLY_CACHE_ENTRIES     16
+#endif
+
+#ifndef CIPSTER_REPLY_CACHE_BYTES
+/// Longest attribute reply which is remembered.
+#define CIPSTER_REPLY_CACHE_BYTES       256
+#endif
+
+
+#ifndef CIPSTER_PATH_CACHE_ENTRIES
+/// Count of remembered request path resolutions, 0 for none.
+#define CIPSTER_PATH_CACHE_ENTRIES      16
+#endif
+
+
+/**
+ * Struct PathCacheEntry
+ * remembers what a class, instance and attribute path resolved to, good for
+ * as long as CipClass::Generation() does not change.
+ */
+struct PathCacheEntry
+{
+    unsigned        generation;     ///< of CipClass::Generation() when made, 0 if unused
+    int             class_id;
+    int             instance_id;
+    int             attribute_id;   ///< 0 if the path had none
+    CipClass*       clazz;
+    CipInstance*    instance;
+    CipAttribute*   attribute;      ///< NULL if the path had none or it was not found
+};
+
+
+/**
+ * Struct ReplyCacheEntry
+ * holds the data of a successful GetAttributeSingle or GetAttributeAll reply
+ * on attributes marked CipAttribute::SetCacheable(), good for as long as the
+ * instance and its class keep the versions it was made under.
+ */
+struct ReplyCacheEntry
+{
+    const CipInstance*  instance;       ///< NULL if unused
+    uint32_t            version;        ///< of instance when made
+    uint32_t            class_version;  ///< of instance->Class() when made
+    int                 service;
+    int                 attribute;      ///< 0 for GetAttributeAll
+    int                 size;
+    uint8_t             data[CIPSTER_REPLY_CACHE_BYTES];
+};
+
+
+/**
+ * Struct MessageRouterState
+ * is the message router's share of a StackContext.
+ */
+struct MessageRouterState : public StackState
+{
+    /// Array of the available explicit connections
+    CipConn     explicit_connections[CIPSTER_CIP_NUM_EXPLICIT_CONNS];
+
+    uint8_t     mmr_temp[CIPSTER_MESSAGE_DATA_REPLY_BUFFER];
+
+    FixedArena<CIPSTER_REQUEST_ARENA_SIZE>  request_arena;
+
+#if CIPSTER_PATH_CACHE_ENTRIES
+    PathCacheEntry  path_cache[CIPSTER_PATH_CACHE_ENTRIES];
+#endif
+
+#if CIPSTER_REPLY_CACHE_ENTRIES
+    ReplyCacheEntry reply_cache[CIPSTER_REPLY_CACHE_ENTRIES];
+#endif
+};
+
+
+static StackStateType<MessageRouterState> s_router_state( kStackStateMessageRouter );
+
+static inline MessageRouterState& router()
+{
+    return StackContext::Current().State<MessageRouterState>( kStackStateMessageRouter );
+}
+
+
+#if CIPSTER_REPLY_CACHE_ENTRIES
+
+/**
+ * Function cacheable_attribute
+ * returns the attribute id keying a cached reply of @a aService on
+ * @a aInstance, 0 for GetAttributeAll, or -1 if such a reply is not cached.
+ * @a aAttribute is the request path's attribute, NULL if none or not found.
+ */
+static int cacheable_attribute( const CipInstance* aInstance, int aService,
+        const CipAttribute* aAttribute )
+{
+    if( aService == kGetAttributeSingle )
+    {
+        return aAttribute && aAttribute->IsCacheable() ? aAttribute->Id() : -1;
+    }
+
+    if( aService == kGetAttributeAll )
+    {
+        const CipAttributes& all = aInstance->Attributes();
+
+        if( all.empty() )
+            return -1;
+
+        for( CipAttributes::const_iterator it = all.begin(); it != all.end(); ++it )
+        {
+            if( !(*it)->IsCacheable() )
+                return -1;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+
+static ReplyCacheEntry& reply_cache_slot( const CipInstance* aInstance,
+        int aService, int aAttribute )
+{
+    uintptr_t hash = ( uintptr_t( aInstance ) >> 4 ) ^ ( aService << 3 ) ^ aAttribute;
+
+    return router().reply_cache[hash % CIPSTER_REPLY_CACHE_ENTRIES];
+}
+
+#endif  // CIPSTER_REPLY_CACHE_ENTRIES
+
+
+#if CIPSTER_PATH_CACHE_ENTRIES
+
+static PathCacheEntry& path_cache_slot( const CipAppPath& aPath )
+{
+    unsigned hash = aPath.GetClass() * 31 + aPath.GetInstance() * 7 + aPath.GetAttribute();
+
+    return router().path_cache[hash % CIPSTER_PATH_CACHE_ENTRIES];
+}
+
+#endif  // CIPSTER_PATH_CACHE_ENTRIES
 
 
 //-----<CipMessageRounterRequest>-----------------------------------------------
@@ -63,6 +202,12 @@ int CipMessageRouterRequest::DeserializeMRReq( BufReader aRequest )
     // limit the length of the request input so it pertains only to request path
     BufReader rpath( in.data(), byte_count );
 
+    if( path.DeserializeCompact( rpath ) )
+    {
+        data = in + byte_count;
+        return 2 + byte_count;
+    }
+
     // Vol1 2-4.1.1
     CipElectronicKeySegment key;
 
@@ -88,10 +233,21 @@ int CipMessageRouterRequest::DeserializeMRReq( BufReader aRequest )
 }
 
 
+Arena& CipMessageRouterRequest::RequestArena()
+{
+    return router().request_arena;
+}
+
+
 
 //-----<CipMessageRounterResponse>----------------------------------------------
 
-std::vector<uint8_t> CipMessageRouterResponse::mmr_temp( CIPSTER_MESSAGE_DATA_REPLY_BUFFER );
+BufWriter CipMessageRouterResponse::mmr_temp()
+{
+    MessageRouterState& r = router();
+
+    return BufWriter( r.mmr_temp, sizeof r.mmr_temp );
+}
 
 CipMessageRouterResponse::CipMessageRouterResponse( Cpf* aCpf, BufWriter aOutput ) :
     data ( aOutput ),
@@ -152,7 +308,22 @@ int CipMessageRouterResponse::SerializedCount( int aCtl ) const
 
 int CipMessageRouterResponse::Serialize( BufWriter aOutput, int aCtl ) const
 {
-    BufWriter out = aOutput;
+    BufWriter   out = aOutput;
+    BufReader   reply = Reader();
+
+    int header = 4 + 2 * size_of_additional_status;
+
+    if( reply.data() >= aOutput.data() && reply.data() < aOutput.data() + header )
+    {
+        // Written in place by Cpf's replyInPlace(), which left no room for
+        // the additional status words but did leave it behind the data.
+        BufWriter dest = out + header;
+
+        dest += reply.size();   // throws if there is no room after all
+
+        memmove( aOutput.data() + header, reply.data(), reply.size() );
+        reply = BufReader( aOutput.data() + header, reply.size() );
+    }
 
     out.put8( reply_service | 0x80 );
     out.put8( 0 );                      // reserved
@@ -162,7 +333,10 @@ int CipMessageRouterResponse::Serialize( BufWriter aOutput, int aCtl ) const
     for( int i = 0;  i < size_of_additional_status;  ++i )
         out.put16( additional_status[i] );
 
-    out.append( Reader() );
+    if( reply.data() == out.data() )
+        out += reply.size();            // already in place, no copy
+    else
+        out.append( reply );
 
     return out.data() - aOutput.data();
 }
@@ -180,15 +354,20 @@ CipMessageRouterClass::CipMessageRouterClass() :
     // Also, conformance test tool does not like SetAttributeSingle on this class,
     // delete the service which was established in CipClass constructor.
     delete ServiceRemove( _I, kSetAttributeSingle );
+
+    ServiceInsert( _I, kMultipleServicePacket, multiple_service_packet_service,
+        "MultipleServicePacket" );
 }
 
 
 static CipConn* getFreeExplicitConnection()
 {
-    for( int i = 0; i < DIM( g_explicit_connections );  ++i )
+    CipConn* conns = router().explicit_connections;
+
+    for( int i = 0; i < CIPSTER_CIP_NUM_EXPLICIT_CONNS;  ++i )
     {
-        if( g_explicit_connections[i].State() == kConnStateNonExistent )
-            return &g_explicit_connections[i];
+        if( conns[i].State() == kConnStateNonExistent )
+            return &conns[i];
     }
 
     return NULL;
@@ -218,7 +397,7 @@ CipError CipMessageRouterClass::OpenConnection( ConnectionData* aConnData,
         // Save TCP connection session_handle for TCP inactivity timeouts.
         new_explicit->SetSessionHandle( aCpf->SessionHandle() );
 
-        g_active_conns.Insert( new_explicit );
+        ActiveConnections().Insert( new_explicit );
         new_explicit->SetState( kConnStateEstablished );
     }
 
@@ -263,11 +442,16 @@ EipStatus CipMessageRouterClass::NotifyMR(
 
     aResponse->SetService( aRequest->Service() );
 
-    CipClass* clazz = NULL;
+    const CipAppPath& path = aRequest->Path();
+
+    CipClass*       clazz = NULL;
+    CipInstance*    instance = NULL;
+    CipAttribute*   attribute = NULL;
+    bool            resolved = false;   // instance and attribute too
 
     int instance_id;
 
-    if( aRequest->Path().HasSymbol() )
+    if( path.HasSymbol() )
     {
         // Per Rockwell Automation Publication 1756-PM020D-EN-P - June 2016:
         // Symbol Class Id is 0x6b.  Forward this request to that class.
@@ -280,10 +464,26 @@ EipStatus CipMessageRouterClass::NotifyMR(
 
         clazz = GetCipClass( 0x6b );
     }
-    else if( aRequest->Path().HasInstance() )
+    else if( path.HasInstance() )
     {
-        instance_id = aRequest->Path().GetInstance();
-        clazz = GetCipClass( aRequest->Path().GetClass() );
+        instance_id = path.GetInstance();
+
+#if CIPSTER_PATH_CACHE_ENTRIES
+        PathCacheEntry& e = path_cache_slot( path );
+
+        if( e.generation == CipClass::Generation() &&
+            e.class_id == path.GetClass() &&
+            e.instance_id == instance_id &&
+            e.attribute_id == path.GetAttribute() )
+        {
+            clazz     = e.clazz;
+            instance  = e.instance;
+            attribute = e.attribute;
+            resolved  = true;
+        }
+        else
+#endif
+            clazz = GetCipClass( path.GetClass() );
     }
     else
     {
@@ -299,7 +499,7 @@ EipStatus CipMessageRouterClass::NotifyMR(
         CIPSTER_TRACE_ERR(
             "%s: un-registered class in request path:'%s'\n",
             __func__,
-            aRequest->Path().Format().c_str()
+            path.Format().c_str()
             );
 
         aResponse->SetGenStatus( kCipErrorPathDestinationUnknown );
@@ -334,13 +534,35 @@ EipStatus CipMessageRouterClass::NotifyMR(
         return kEipStatusOkSend;
     }
 
-    CipInstance* instance = clazz->Instance( instance_id );
-    if( !instance )
+    if( !resolved )
     {
-        CIPSTER_TRACE_WARN( "%s: instance %d does not exist\n", __func__, instance_id );
+        instance = clazz->Instance( instance_id );
 
-        aResponse->SetGenStatus( kCipErrorPathDestinationUnknown );
-        return kEipStatusOkSend;
+        if( !instance )
+        {
+            CIPSTER_TRACE_WARN( "%s: instance %d does not exist\n", __func__, instance_id );
+
+            aResponse->SetGenStatus( kCipErrorPathDestinationUnknown );
+            return kEipStatusOkSend;
+        }
+
+        if( path.HasAttribute() )
+            attribute = instance->Attribute( path.GetAttribute() );
+
+#if CIPSTER_PATH_CACHE_ENTRIES
+        if( !path.HasSymbol() )
+        {
+            PathCacheEntry& e = path_cache_slot( path );
+
+            e.generation    = CipClass::Generation();
+            e.class_id      = path.GetClass();
+            e.instance_id   = instance_id;
+            e.attribute_id  = path.GetAttribute();
+            e.clazz         = clazz;
+            e.instance      = instance;
+            e.attribute     = attribute;
+        }
+#endif
     }
 
     CIPSTER_TRACE_INFO(
@@ -353,15 +575,209 @@ EipStatus CipMessageRouterClass::NotifyMR(
 
     CIPSTER_ASSERT( service->service_function );
 
+    // These classes share their connections and assemblies with the I/O
+    // thread of NetworkHandlerProcessIo().
+    IoLock  lock( clazz->ClassId() == kCipConnectionManagerClass ||
+                  clazz->ClassId() == kCipConnectionClass ||
+                  clazz->ClassId() == kCipAssemblyClass );
+
+#if CIPSTER_REPLY_CACHE_ENTRIES
+    // Taken before the call, GetAttributeAll rewrites the path's attribute.
+    int cache_attr = cacheable_attribute( instance, aRequest->Service(), attribute );
+
+    if( cache_attr >= 0 )
+    {
+        ReplyCacheEntry& e = reply_cache_slot( instance, aRequest->Service(), cache_attr );
+
+        if( e.instance == instance &&
+            e.service == aRequest->Service() &&
+            e.attribute == cache_attr &&
+            e.version == instance->Version() &&
+            e.class_version == clazz->Version() &&
+            e.size <= (int) aResponse->Writer().capacity() )
+        {
+            memcpy( aResponse->Writer().data(), e.data, e.size );
+            aResponse->SetWrittenSize( e.size );
+            return kEipStatusOkSend;
+        }
+    }
+#endif
+
     EipStatus status = service->service_function( instance, aRequest, aResponse );
 
-    CIPSTER_TRACE_ERR(
-            "%s: service %s of class '%s' returned %d\n",
-            __func__,
-            service->ServiceName().c_str(),
-            clazz->ClassName().c_str(),
-            status
-            );
+#if CIPSTER_REPLY_CACHE_ENTRIES
+    if( cache_attr >= 0 &&
+        ( status == kEipStatusOkSend || status == kEipStatusOk ) &&
+        aResponse->GenStatus() == kCipErrorSuccess &&
+        !aResponse->AdditionalStsCount() &&
+        aResponse->WrittenSize() <= CIPSTER_REPLY_CACHE_BYTES )
+    {
+        ReplyCacheEntry& e = reply_cache_slot( instance, aRequest->Service(), cache_attr );
+
+        e.instance      = instance;
+        e.version       = instance->Version();
+        e.class_version = clazz->Version();
+        e.service       = aRequest->Service();
+        e.attribute     = cache_attr;
+        e.size          = aResponse->WrittenSize();
+
+        memcpy( e.data, aResponse->Writer().data(), e.size );
+    }
+#endif
+
+    if( status == kEipStatusError )
+    {
+        CIPSTER_TRACE_ERR(
+                "%s: service %s of class '%s' returned %d\n",
+                __func__,
+                service->ServiceName().c_str(),
+                clazz->ClassName().c_str(),
+                status
+                );
+    }
 
     return status;
 }
+
+
+EipStatus CipMessageRouterClass::multiple_service_packet_service( CipInstance* instance,
+        CipMessageRouterRequest* request, CipMessageRouterResponse* response )
+{
+    (void) instance;
+
+    // Offsets of embedded requests count from the start of the request
+    // data, those of embedded replies from the start of the reply data.
+    const uint8_t*  base = request->Data().data();
+    unsigned        size = request->Data().size();
+
+    BufReader       in = request->Data();
+    unsigned        count = size >= 2 ? in.get16() : 0;
+    unsigned        table_end = 2 + 2 * count;
+
+    if( !count || table_end > size )
+    {
+        response->SetGenStatus( kCipErrorNotEnoughData );
+        return kEipStatusOkSend;
+    }
+
+    // One pass over the table checks that the requests follow it in order
+    // and lie within the data, then each one's length is the distance to
+    // the next one's offset.  Two equal offsets would make an empty request.
+    BufReader   offsets( base + 2, 2 * count );
+    unsigned    prev = table_end - 1;
+
+    for( unsigned i = 0; i < count; ++i )
+    {
+        unsigned offset = offsets.get16();
+
+        if( offset <= prev || offset >= size )
+        {
+            CIPSTER_TRACE_ERR( "%s: bad offset %u of embedded request %u\n",
+                __func__, offset, i );
+
+            response->SetGenStatus( kCipErrorInvalidParameter );
+            return kEipStatusOkSend;
+        }
+
+        prev = offset;
+    }
+
+    BufWriter   start = response->Writer();
+    BufWriter   out = start;
+    bool        embedded_error = false;
+
+    // Embedded services see the outer Cpf, a Forward_Open needs its peer
+    // address and session, but none of them may defer: all reply here.
+    Cpf*        cpf = response->CPF();
+    bool        was_blocked = cpf && cpf->DeferBlocked();
+
+    if( cpf )
+        cpf->SetDeferBlocked( true );
+
+    try
+    {
+        out.put16( count );
+
+        BufWriter   reply_offsets = out.reserve( 2 * count );
+
+        offsets = BufReader( base + 2, 2 * count );
+
+        unsigned    offset = offsets.get16();
+
+        for( unsigned i = 0; i < count; ++i )
+        {
+            unsigned    next = i + 1 < count ? offsets.get16() : size;
+            BufReader   embedded( base + offset, next - offset );
+
+            reply_offsets.put16( out.data() - start.data() );
+
+            // The embedded reply's data goes right behind its status, where
+            // CipMessageRouterResponse::Serialize() finds it in place.
+            CipMessageRouterRequest     req;
+            CipMessageRouterResponse    rsp( cpf, out + 4 );
+            EipStatus                   status;
+
+            if( embedded.size() < 2 || req.DeserializeMRReq( embedded ) <= 0 )
+            {
+                rsp.SetService( CIPServiceCode( embedded.data()[0] ) );
+                rsp.SetGenStatus( kCipErrorPathSegmentError );
+                status = kEipStatusOkSend;
+            }
+            else if( !cpf && req.Path().GetClass() == kCipConnectionManagerClass )
+            {
+                // Connection Manager services need the peer from a Cpf.
+                rsp.SetService( req.Service() );
+                rsp.SetGenStatus( kCipErrorServiceNotSupported );
+                status = kEipStatusOkSend;
+            }
+            else
+                status = NotifyMR( &req, &rsp );
+
+            if( status == kEipStatusPending )
+            {
+                CIPSTER_TRACE_ERR( "%s: embedded service 0x%02x went pending\n",
+                    __func__, req.Service() );
+
+                rsp.SetWrittenSize( 0 );
+                rsp.SetGenStatus( kCipErrorServiceNotSupported );
+            }
+            else if( status == kEipStatusError )
+            {
+                // alone it would get no reply, here it needs one
+                rsp.SetWrittenSize( 0 );
+
+                if( rsp.GenStatus() == kCipErrorSuccess )
+                    rsp.SetGenStatus( kCipErrorInvalidParameter );
+            }
+
+            if( rsp.GenStatus() != kCipErrorSuccess )
+                embedded_error = true;
+
+            out += rsp.Serialize( out );
+
+            offset = next;
+        }
+    }
+    catch( const std::runtime_error& e )
+    {
+        if( cpf )
+            cpf->SetDeferBlocked( was_blocked );
+
+        // a BufWriter overflow
+        CIPSTER_TRACE_ERR( "%s: replies to %u services do not fit\n",
+            __func__, count );
+
+        response->SetGenStatus( kCipErrorReplyDataTooLarge );
+        return kEipStatusOkSend;
+    }
+
+    if( cpf )
+        cpf->SetDeferBlocked( was_blocked );
+
+    if( embedded_error )
+        response->SetGenStatus( kCipErrorEmbeddedServiceError );
+
+    response->SetWrittenSize( out.data() - start.data() );
+
+    return kEipStatusOkSend;
+}
@@ -11,6 +11,13 @@
 #include "cipepath.h"
 #include "cipclass.h"
 #include "cipcommon.h"
+#include "../utils/arena.h"
+
+
+#ifndef CIPSTER_REQUEST_ARENA_SIZE
+/// Bytes of per frame temporaries, see CipMessageRouterRequest::RequestArena().
+#define CIPSTER_REQUEST_ARENA_SIZE      4096
+#endif
 
 
 /**
@@ -53,6 +60,17 @@ public:
      */
     int DeserializeMRReq( BufReader aCommand );
 
+    /**
+     * Function RequestArena
+     * returns the current StackContext's arena for temporaries which are too
+     * big for the stack of a nested request, e.g. forward_open's ConnectionData.
+     * A service gives back what it took with an ArenaScope of its own, and
+     * all of it goes at the latest once the encapsulation frame which carried
+     * the request has been answered, so nothing from it may outlive the
+     * reply, e.g. in a deferred service.
+     */
+    static Arena& RequestArena();
+
     //-----<Serializeable>------------------------------------------------------
     int Serialize( BufWriter aOutput, int aCtl = 0 ) const;
     int SerializedCount( int aCtl = 0) const;
@@ -76,7 +94,7 @@ class CipMessageRouterResponse : public Serializeable
 {
 public:
     CipMessageRouterResponse( Cpf* aCpf,
-        BufWriter aOutput = BufWriter( mmr_temp.data(), mmr_temp.size() ) );
+        BufWriter aOutput = mmr_temp() );
 
     void Clear();
 
@@ -193,16 +211,15 @@ protected:
 
     Cpf*            cpf;
 
-    // The common packet format makes it difficult to avoid copying the
-    // reply data payload because SockAddrInfo can trail it and getting
-    // accurate length info early enough is tough.
-    // So for now the message router response is sometimes generated into a temporary location
-    // and then copied to the final buffer for sending on the wire.  Since we
-    // are single threaded, we can use a common temporary buffer for all
-    // messages.  However, hide that strategy so it can be easily changed in
-    // the future.
+    // Cpf::NotifyCommonPacketFormat() and NotifyConnectedCommonPacketFormat()
+    // aim the writer at the reply frame itself, where Serialize() finds the
+    // data already in place, and the length fields ahead of it are
+    // back-patched.  Only when the reply frame overlaps the request is the
+    // response generated into this temporary location and copied.  Since a
+    // stack serves explicit messages on one thread, each StackContext has one
+    // common temporary buffer for all messages.
 
-    static std::vector<uint8_t>     mmr_temp;
+    static BufWriter    mmr_temp();
 };
 
 
@@ -228,6 +245,7 @@ public:
      * @return EipStatus - kEipStatusError if error and caller is not to send any reply.
      *                     kEipStatusOkSend if caller is to send reply, which may contain
      *                      an error indication in general status field.
+     *                     kEipStatusPending if the service called DeferService().
      */
     static EipStatus NotifyMR(  CipMessageRouterRequest*  aRequest,
                                 CipMessageRouterResponse* aResponse );
@@ -241,6 +259,14 @@ public:
 
     CipInstance* CreateInstance( int aInstanceId );
 
+    /**
+     * Function multiple_service_packet_service
+     * serves Multiple Service Packet, Vol1 2-4.4.  The embedded requests
+     * are routed by NotifyMR() one after the other and their replies are
+     * serialized straight into this reply, each offset back-patched into
+     * the table ahead of them.  Embedded requests share the frame's
+     * RequestArena() and Cpf, and cannot be deferred.
+     */
     static EipStatus multiple_service_packet_service( CipInstance* instance,
         CipMessageRouterRequest*  request,
         CipMessageRouterResponse* response );
@@ -0,0 +1,150 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+/**
+ * @file cipqos.cc
+ *
+ * CIP QoS Object
+ * ==============
+ *
+ * Implemented Attributes
+ * ----------------------
+ * - Attribute 1: 802.1Q Tag Enable, get only, always 0
+ * - Attribute 2: DSCP PTP Event
+ * - Attribute 3: DSCP PTP General
+ * - Attribute 4: DSCP Urgent
+ * - Attribute 5: DSCP Scheduled
+ * - Attribute 6: DSCP High
+ * - Attribute 7: DSCP Low
+ * - Attribute 8: DSCP Explicit
+ *
+ * The spec says new values take effect at the next device reset.  Here produced
+ * class 0/1 frames pick up a change on their next production and explicit
+ * messaging sockets pick it up when they are opened.
+ */
+
+#include <cipqos.h>
+
+#include <trace.h>
+#include <cipcommon.h>
+#include <cipmessagerouter.h>
+#include <ciperror.h>
+#include <byte_bufs.h>
+#include <cipster_api.h>
+
+#undef  INSTANCE_CLASS
+#define INSTANCE_CLASS  CipQosInstance
+
+
+/**
+ * Struct QosState
+ * is the QoS class's share of a StackContext.
+ */
+struct QosState : public StackState
+{
+    QosState() : qos( NULL ) {}
+
+    // A pointer to the only instance, this avoids Registry lookup
+    // on every production.
+    CipQosInstance* qos;
+};
+
+
+static StackStateType<QosState> s_qos_state( kStackStateQos );
+
+static inline CipQosInstance*& qosInstance()
+{
+    return StackContext::Current().State<QosState>( kStackStateQos ).qos;
+}
+
+
+CipQosInstance::CipQosInstance( int aInstanceId ) :
+    CipInstance( aInstanceId ),
+    q_frames_enable( 0 ),
+
+    // defaults from Vol2 Table 5-7.3
+    dscp_ptp_event( 59 ),
+    dscp_ptp_general( 47 ),
+    dscp_urgent( 55 ),
+    dscp_scheduled( 47 ),
+    dscp_high( 43 ),
+    dscp_low( 31 ),
+    dscp_explicit( 27 )
+{
+}
+
+
+EipStatus CipQosInstance::set_dscp( CipInstance* aInstance,
+        CipAttribute* attribute,
+        CipMessageRouterRequest* aRequest,
+        CipMessageRouterResponse* aResponse )
+{
+    uint8_t dscp = BufReader( aRequest->Data() ).get8();
+
+    if( dscp > 63 )
+        aResponse->SetGenStatus( kCipErrorInvalidAttributeValue );
+    else
+        *(uint8_t*) aInstance->Data( attribute ) = dscp;
+
+    // [write it to disk here?]
+
+    return kEipStatusOkSend;
+}
+
+
+CipQosClass::CipQosClass() :
+    CipClass( kCipQoSClass,
+        "QoS",
+        MASK2(1,2),             // common class attributes mask
+        1                       // version
+        )
+{
+    AttributeInsert( _I, 1, kCipUsint, memb_offs(q_frames_enable) );
+
+    AttributeInsert( _I, 2, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_ptp_event), true, kCipUsint );
+    AttributeInsert( _I, 3, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_ptp_general), true, kCipUsint );
+    AttributeInsert( _I, 4, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_urgent), true, kCipUsint );
+    AttributeInsert( _I, 5, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_scheduled), true, kCipUsint );
+    AttributeInsert( _I, 6, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_high), true, kCipUsint );
+    AttributeInsert( _I, 7, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_low), true, kCipUsint );
+    AttributeInsert( _I, 8, CipAttribute::GetAttrData, true, CipQosInstance::set_dscp, memb_offs(dscp_explicit), true, kCipUsint );
+}
+
+
+EipStatus CipQosClass::Init()
+{
+    if( !GetCipClass( kCipQoSClass ) )
+    {
+        CipQosClass* clazz = new CipQosClass();
+
+        RegisterCipClass( clazz );
+
+        qosInstance() = new CipQosInstance( 1 );
+
+        clazz->InstanceInsert( qosInstance() );
+    }
+
+    return kEipStatusOk;
+}
+
+
+uint8_t CipQosClass::DSCP( ConnPriority aPriority )
+{
+    const CipQosInstance* qos = qosInstance();
+
+    switch( aPriority )
+    {
+    case kPriorityUrgent:   return qos->dscp_urgent;
+    case kPrioritySched:    return qos->dscp_scheduled;
+    case kPriorityHigh:     return qos->dscp_high;
+    default:                return qos->dscp_low;
+    }
+}
+
+
+uint8_t CipQosClass::DSCP_Explicit()
+{
+    return qosInstance()->dscp_explicit;
+}
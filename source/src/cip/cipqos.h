@@ -0,0 +1,78 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_CIPQOS_H_
+#define CIPSTER_CIPQOS_H_
+
+/** @file cipqos.h
+ * @brief Public interface of the QoS Object
+ *
+ * The DSCP values held here are used to mark the IP header of outgoing
+ * class 0/1 frames by connection priority, and of explicit messaging traffic.
+ * @see Vol2 5-7 QoS Object
+ */
+
+#include <typedefs.h>
+#include "ciptypes.h"
+#include "cipclass.h"
+#include "cipconnection.h"      // ConnPriority
+
+
+class CipQosInstance : public CipInstance
+{
+    friend class CipQosClass;
+
+public:
+    CipQosInstance( int aInstanceId );
+
+protected:
+    // Attributes of a QoS instance are numbered #
+
+    CipUsint    q_frames_enable;    ///< #1 802.1Q tagging, always 0 here
+    CipUsint    dscp_ptp_event;     ///< #2
+    CipUsint    dscp_ptp_general;   ///< #3
+    CipUsint    dscp_urgent;        ///< #4 class 0/1 with kPriorityUrgent
+    CipUsint    dscp_scheduled;     ///< #5 class 0/1 with kPrioritySched
+    CipUsint    dscp_high;          ///< #6 class 0/1 with kPriorityHigh
+    CipUsint    dscp_low;           ///< #7 class 0/1 with kPriorityLow
+    CipUsint    dscp_explicit;      ///< #8 UCMM, class 2/3 and encapsulation
+
+    //-----<AttrubuteFuncs>-----------------------------------------------------
+
+    // DSCP is a 6 bit field, reject anything larger.
+    static EipStatus set_dscp( CipInstance* aInstance,
+            CipAttribute* aAttribute,
+            CipMessageRouterRequest* aRequest,
+            CipMessageRouterResponse* aResponse );
+
+    //-----</AttrubuteFuncs>----------------------------------------------------
+};
+
+
+class CipQosClass : public CipClass
+{
+public:
+    CipQosClass();
+
+    /**
+     * Function Init
+     * initializes the QoS object, class 0x48, and its only instance.
+     */
+    static EipStatus Init();
+
+    /**
+     * Function DSCP
+     * returns the DSCP value for class 0/1 traffic of @a aPriority, taken
+     * from a connection's network connection parameters.
+     */
+    static uint8_t DSCP( ConnPriority aPriority );
+
+    /// Return the DSCP value for explicit messaging traffic.
+    static uint8_t DSCP_Explicit();
+
+    /// Return the IP_TOS byte for a DSCP value, ECN bits are left zero.
+    static int TOS( uint8_t aDSCP )     { return aDSCP << 2; }
+};
+
+#endif // CIPSTER_CIPQOS_H_
@@ -63,7 +63,7 @@ enum CIPServiceCode
  *  defined.  Upon completions update data_length to how many bytes were filled in.
  *
  * @return EipStatus - EipOKSend if service could be executed successfully
- *    and a response should be sent.
+ *    and a response should be sent, or kEipStatusPending after DeferService().
  */
 typedef EipStatus (*CipServiceFunction)( CipInstance* aInstance,
         CipMessageRouterRequest* aRequest, CipMessageRouterResponse* aResponse );
@@ -20,13 +20,44 @@
 #define INSTANCE_CLASS  CipTCPIPInterfaceInstance
 
 
-// A static pointer to the only class object, this avoids Registry lookup,
-// thus improving speed in the API Functions.
-static CipTCPIPInterfaceClass* s_tcp;
+/**
+ * Struct TcpIpState
+ * is the TCP/IP Interface class's share of a StackContext.
+ */
+struct TcpIpState : public StackState
+{
+    TcpIpState() :
+        tcp( NULL ),
+        inactivity_timeout_secs( 120 )  // spec default
+    {}
+
+    // A pointer to the only class object, this avoids Registry lookup,
+    // thus improving speed in the API Functions.
+    CipTCPIPInterfaceClass* tcp;
+
+    CipUint     inactivity_timeout_secs;
+    std::string hostname;
+};
+
+
+static StackStateType<TcpIpState> s_tcpip_state( kStackStateTcpIp );
+
+static inline TcpIpState& tcpip()
+{
+    return StackContext::Current().State<TcpIpState>( kStackStateTcpIp );
+}
+
+
+CipUint& CipTCPIPInterfaceInstance::InactivityTimeoutSecs()
+{
+    return tcpip().inactivity_timeout_secs;
+}
 
-CipUint CipTCPIPInterfaceInstance::inactivity_timeout_secs = 120;  // spec default
 
-std::string CipTCPIPInterfaceInstance::hostname;
+std::string& CipTCPIPInterfaceInstance::hostname()
+{
+    return tcpip().hostname;
+}
 
 
 CipTCPIPInterfaceInstance::CipTCPIPInterfaceInstance( int aInstanceId ) :
@@ -162,7 +193,7 @@ EipStatus CipTCPIPInterfaceInstance::set_attr_13( CipInstance* aInstance,
         CipMessageRouterResponse* aResponse )
 {
     // all instances are sharing a common value for this attribute so ignore instance
-    inactivity_timeout_secs = BufReader( aRequest->Data() ).get16();
+    InactivityTimeoutSecs() = BufReader( aRequest->Data() ).get16();
 
     // [write it to disk here?]
 
@@ -249,7 +280,7 @@ EipStatus CipTCPIPInterfaceInstance::get_all( CipInstance* aInstance,
     .put_STRING( c.domain_name, true );
 
     // attribute 6
-    out.put_STRING( i->hostname, true );
+    out.put_STRING( i->hostname(), true );
 
     // attribute 7, 6 zeros
     out.fill( 6 );
@@ -274,7 +305,7 @@ EipStatus CipTCPIPInterfaceInstance::get_all( CipInstance* aInstance,
     out.put8( 0 );
 
     // attribute 13
-    out.put16( i->inactivity_timeout_secs );
+    out.put16( i->InactivityTimeoutSecs() );
 
     aResponse->SetWrittenSize( out.data() - aResponse->Writer().data() );
 
@@ -305,23 +336,24 @@ CipTCPIPInterfaceClass::CipTCPIPInterfaceClass() :
     // overload an instance service
     ServiceInsert( _I, kGetAttributeAll, CipTCPIPInterfaceInstance::get_all, "GetAttributeAll" );
 
-    AttributeInsert( _I, 1, kCipDword, memb_offs(status) );
-    AttributeInsert( _I, 2, kCipDword, memb_offs(configuration_capability) );
-    AttributeInsert( _I, 3, kCipDword, memb_offs(configuration_control) );
-    AttributeInsert( _I, 4, CipTCPIPInterfaceInstance::get_attr_4 );
-    AttributeInsert( _I, 5, CipTCPIPInterfaceInstance::get_attr_5 );
-    AttributeInsert( _I, 6, kCipString, &CipTCPIPInterfaceInstance::hostname );
+    AttributeInsert( _I, 1, kCipDword, memb_offs(status) )->SetCacheable();
+    AttributeInsert( _I, 2, kCipDword, memb_offs(configuration_capability) )->SetCacheable();
+    AttributeInsert( _I, 3, kCipDword, memb_offs(configuration_control) )->SetCacheable();
+    AttributeInsert( _I, 4, CipTCPIPInterfaceInstance::get_attr_4 )->SetCacheable();
+    AttributeInsert( _I, 5, CipTCPIPInterfaceInstance::get_attr_5 )->SetCacheable();
+    // 6 and 13 are shared by the instances of this stack, see TcpIpState.
+    AttributeInsert( _I, 6, kCipString, &CipTCPIPInterfaceInstance::hostname() )->SetCacheable();
 
     //AttributeInsert( _I, 7, get_attr_7 );
 
     // Use a standard method to Get the attribute, but a custom one to Set it.
-    AttributeInsert( _I, 8, CipAttribute::GetAttrData, true, CipTCPIPInterfaceInstance::set_TTL, memb_offs(time_to_live), true, kCipUsint );
+    AttributeInsert( _I, 8, CipAttribute::GetAttrData, true, CipTCPIPInterfaceInstance::set_TTL, memb_offs(time_to_live), true, kCipUsint )->SetCacheable();
 
-    AttributeInsert( _I, 9, CipTCPIPInterfaceInstance::get_multicast_config, true, CipTCPIPInterfaceInstance::set_multicast_config );
+    AttributeInsert( _I, 9, CipTCPIPInterfaceInstance::get_multicast_config, true, CipTCPIPInterfaceInstance::set_multicast_config )->SetCacheable();
 
     // Use a standard method to Get the attribute, but a custom one to Set it.
     // This would also be a good place to read it from disk or non volatile storage.
-    AttributeInsert( _I, 13, CipAttribute::GetAttrData, true, CipTCPIPInterfaceInstance::set_attr_13, (uintptr_t) &CipTCPIPInterfaceInstance::inactivity_timeout_secs, false, kCipUint );
+    AttributeInsert( _I, 13, CipAttribute::GetAttrData, true, CipTCPIPInterfaceInstance::set_attr_13, (uintptr_t) &CipTCPIPInterfaceInstance::InactivityTimeoutSecs(), false, kCipUint )->SetCacheable();
 }
 
 
@@ -344,7 +376,7 @@ CipTCPIPInterfaceInstance* CipTCPIPInterfaceClass::Instance( int aInstanceId )
 //----<API Funcs>---------------------------------------------------------------
 const MulticastAddressConfiguration& CipTCPIPInterfaceClass::MultiCast( int aInstanceId )
 {
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
 
     return inst->multicast_configuration;
 }
@@ -352,7 +384,7 @@ const MulticastAddressConfiguration& CipTCPIPInterfaceClass::MultiCast( int aIns
 
 const CipTcpIpInterfaceConfiguration& CipTCPIPInterfaceClass::InterfaceConf( int aInstanceId )
 {
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
 
     return inst->interface_configuration;
 }
@@ -360,14 +392,14 @@ const CipTcpIpInterfaceConfiguration& CipTCPIPInterfaceClass::InterfaceConf( int
 
 uint8_t CipTCPIPInterfaceClass::TTL( int aInstanceId )
 {
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
     return inst->time_to_live;
 }
 
 
 CipUdint CipTCPIPInterfaceClass::IpAddress( int aInstanceId )
 {
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
     return inst->interface_configuration.ip_address;
 }
 
@@ -377,27 +409,34 @@ EipStatus CipTCPIPInterfaceClass::ConfigureNetworkInterface( int aInstanceId,
         const char* subnet_mask,
         const char* gateway )
 {
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
 
-    return inst->configureNetworkInterface( ip_address, subnet_mask, gateway );
+    EipStatus status = inst->configureNetworkInterface( ip_address, subnet_mask, gateway );
+
+    inst->Changed();
+
+    return status;
 }
 
 
 void CipTCPIPInterfaceClass::ConfigureDomainName( int aInstanceId, const char* aDomainName )
 {
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
 
     inst->interface_configuration.domain_name = aDomainName;
+    inst->Changed();
 }
 
 
 void CipTCPIPInterfaceClass::ConfigureHostName( int aInstanceId, const char* aHostName )
 {
-    // hostname is actually static here, but code it as an instance variable.
-    // Compiler figures it out either way.
-    CipTCPIPInterfaceInstance* inst = s_tcp->Instance( aInstanceId );
+    // hostname is actually per stack here, but code it as an instance variable.
+    CipTCPIPInterfaceInstance* inst = tcpip().tcp->Instance( aInstanceId );
+
+    inst->hostname() = aHostName;
 
-    inst->hostname = aHostName;
+    // and so is shared by all the instances of the class
+    tcpip().tcp->Changed();
 }
 
 
@@ -407,7 +446,7 @@ EipStatus CipTCPIPInterfaceClass::Init()
     {
         CipTCPIPInterfaceClass* clazz = new CipTCPIPInterfaceClass();
 
-        s_tcp = clazz;
+        tcpip().tcp = clazz;
 
         RegisterCipClass( clazz );
 
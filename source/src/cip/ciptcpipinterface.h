@@ -74,7 +74,8 @@ class CipTCPIPInterfaceInstance : public CipInstance
 public:
     CipTCPIPInterfaceInstance( int aInstanceId );
 
-    static CipUint inactivity_timeout_secs;
+    /// Return the current stack's encapsulation inactivity timeout, attribute #13.
+    static CipUint& InactivityTimeoutSecs();
 
 protected:
     // Attributes of a TCP/IP Interface instance are numbered #
@@ -94,8 +95,8 @@ protected:
     /// #5 IP, network mask, gateway, name server 1 & 2, domain name
     CipTcpIpInterfaceConfiguration interface_configuration;
 
-    /// #6 Hostname, static so its shared betweeen instances of this class.
-    static std::string hostname;
+    /// #6 Hostname, per stack so its shared betweeen instances of this class.
+    static std::string& hostname();
 
     /**
     * #8 the time to live value to be used for multi-cast connections
@@ -0,0 +1,186 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_FRAMERING_H_
+#define CIPSTER_FRAMERING_H_
+
+/** @file framering.h
+ * @brief Stream of every consumed I/O frame of a connection
+ *
+ * An assembly holds only the latest data.  A FrameRing attached to a
+ * connection with CipConn::SetFrameRing() also gets a copy of every frame
+ * which carried new data, with its sequence count and arrival time, for a
+ * logger or analysis thread which drains it at its own pace.
+ */
+
+#include <atomic>
+#include <string.h>
+
+#include <typedefs.h>
+#include <cipster_user_conf.h>      // CIPSTER_ASSERT
+
+
+#ifndef CIPSTER_CACHE_LINE_BYTES
+/// Bytes kept between data written by different threads, so each is on its own cache line.
+#define CIPSTER_CACHE_LINE_BYTES    64
+#endif
+
+
+/**
+ * Struct ConsumedFrame
+ * is one slot of a FrameRing.
+ */
+struct ConsumedFrame
+{
+    uint64_t    rx_nsecs;           ///< arrival time, see CipConn::RxTimeNSecs()
+    uint32_t    eip_sequence;       ///< encapsulation sequence number
+    uint32_t    run_idle;           ///< 32 bit header, 0 if the format has none
+    uint16_t    sequence;           ///< class 1 sequence count, 0 for class 0
+    uint16_t    byte_count;         ///< of data
+    uint8_t     data[1];            ///< assembly data, FrameRing's max bytes long
+};
+
+
+/**
+ * Class FrameRing
+ * is a single producer, single consumer ring of ConsumedFrames with a fixed
+ * capacity allocated once by the constructor.  The stack is the producer,
+ * one application thread is the consumer, neither takes a lock.  When the
+ * ring is full a new frame is dropped and counted, frames already queued are
+ * never overwritten.
+ */
+class FrameRing
+{
+public:
+    /**
+     * Constructor FrameRing
+     * @param aSlotCount is the capacity in frames, a power of 2.
+     * @param aMaxBytes is the largest assembly data a slot holds.
+     */
+    FrameRing( unsigned aSlotCount, unsigned aMaxBytes ) :
+        slot_count( aSlotCount ),
+        slot_size( ( offsetof( ConsumedFrame, data ) + aMaxBytes + 7 ) & ~7u ),
+        max_bytes( aMaxBytes ),
+        slots( new uint64_t[aSlotCount * slot_size / 8] ),
+        head( 0 ),
+        tail( 0 ),
+        pushed( 0 ),
+        overflows( 0 ),
+        oversized( 0 )
+    {
+        CIPSTER_ASSERT( aSlotCount && !( aSlotCount & ( aSlotCount - 1 ) ) );
+
+        // ConsumedFrame::byte_count must hold any frame which fits
+        CIPSTER_ASSERT( aMaxBytes <= 0xffff );
+    }
+
+    ~FrameRing()    { delete[] slots; }
+
+    //-----<Producer>-----------------------------------------------------------
+
+    /// Called by the stack for each consumed frame, returns false if dropped.
+    bool Push( uint64_t aRxNSecs, uint32_t aEipSequence, uint16_t aSequence,
+            uint32_t aRunIdle, const uint8_t* aData, unsigned aByteCount )
+    {
+        // before anything of the ring is touched
+        if( aByteCount > max_bytes )
+        {
+            oversized.store( oversized.load( std::memory_order_relaxed ) + 1,
+                    std::memory_order_relaxed );
+            return false;
+        }
+
+        unsigned t = tail.load( std::memory_order_relaxed );
+
+        if( t - head.load( std::memory_order_acquire ) == slot_count )
+        {
+            overflows.store( overflows.load( std::memory_order_relaxed ) + 1,
+                    std::memory_order_relaxed );
+            return false;
+        }
+
+        ConsumedFrame* f = slot( t );
+
+        f->rx_nsecs     = aRxNSecs;
+        f->eip_sequence = aEipSequence;
+        f->run_idle     = aRunIdle;
+        f->sequence     = aSequence;
+        f->byte_count   = aByteCount;
+
+        memcpy( f->data, aData, aByteCount );
+
+        tail.store( t + 1, std::memory_order_release );
+        pushed.store( pushed.load( std::memory_order_relaxed ) + 1,
+                std::memory_order_relaxed );
+        return true;
+    }
+
+    //-----</Producer>----------------------------------------------------------
+
+    //-----<Consumer>-----------------------------------------------------------
+
+    /// Return the oldest queued frame, or NULL if none.  It stays valid until Pop().
+    const ConsumedFrame* Front() const
+    {
+        unsigned h = head.load( std::memory_order_relaxed );
+
+        if( h == tail.load( std::memory_order_acquire ) )
+            return NULL;
+
+        return slot( h );
+    }
+
+    /// Release the frame returned by Front().
+    void Pop()
+    {
+        head.store( head.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+    }
+
+    //-----</Consumer>----------------------------------------------------------
+
+    unsigned Capacity() const   { return slot_count; }
+    unsigned MaxBytes() const   { return max_bytes; }
+
+    /// Frames queued so far, including those already popped.
+    uint64_t Pushed() const     { return pushed.load( std::memory_order_relaxed ); }
+
+    /// Frames dropped because the ring was full.
+    uint64_t Overflows() const  { return overflows.load( std::memory_order_relaxed ); }
+
+    /// Frames dropped because they were larger than MaxBytes().
+    uint64_t Oversized() const  { return oversized.load( std::memory_order_relaxed ); }
+
+private:
+    ConsumedFrame* slot( unsigned aIndex ) const
+    {
+        return (ConsumedFrame*) ( (uint8_t*) slots + ( aIndex & ( slot_count - 1 ) ) * slot_size );
+    }
+
+    const unsigned  slot_count;
+    const unsigned  slot_size;      // bytes, a multiple of 8
+    const unsigned  max_bytes;
+    uint64_t*       slots;
+
+    // The consumer's and the producer's fields each have cache lines of their
+    // own, else every Push() and Pop() would steal the other side's line.
+    uint8_t                 pad0[CIPSTER_CACHE_LINE_BYTES];
+
+    std::atomic<unsigned>   head;   // written by the consumer only
+
+    uint8_t                 pad1[CIPSTER_CACHE_LINE_BYTES - sizeof(std::atomic<unsigned>)];
+
+    std::atomic<unsigned>   tail;   // written by the producer only, as are the counts
+
+    std::atomic<uint64_t>   pushed;
+    std::atomic<uint64_t>   overflows;
+    std::atomic<uint64_t>   oversized;
+
+    uint8_t                 pad2[CIPSTER_CACHE_LINE_BYTES];
+
+    // not copyable
+    FrameRing( const FrameRing& );
+    FrameRing& operator=( const FrameRing& );
+};
+
+#endif // CIPSTER_FRAMERING_H_
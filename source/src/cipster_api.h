@@ -18,9 +18,13 @@
 #include "cip/ciptcpipinterface.h"
 #include "cip/cipconnectionmanager.h"
 #include "enet_encap/encap.h"
+#include "enet_encap/cmdqueue.h"
+#include "enet_encap/deferred.h"
 #include "enet_encap/cpf.h"
 #include "enet_encap/networkhandler.h"
+#include "enet_encap/realtime.h"
 #include "byte_bufs.h"
+#include "stackcontext.h"
 
 
 /**  @defgroup CIP_API CIPster User interface
@@ -86,7 +90,8 @@ inline void ConfigureHostName( const char* host_name )
 void SetDeviceSerialNumber( uint32_t serial_number );
 
 /** @ingroup CIP_API
- * @brief Set the current status of the device.
+ * @brief Set the current status of the device.  Other threads than the
+ * stack's use PostSetDeviceStatus().
  *
  * @param device_status the new status value
  */
@@ -182,6 +187,26 @@ inline AssemblyInstance* CreateAssemblyInstance( int aInstanceId, ByteBuf aByteB
     return CipAssemblyClass::CreateInstance( aInstanceId, aByteBuf );
 }
 
+/**
+ * Function BeginScan
+ * latches the inputs of every assembly in the process image, see
+ * AssemblyInstance::JoinProcessImage().  Safe from any thread.
+ */
+inline int BeginScan()
+{
+    return CipAssemblyClass::BeginScan();
+}
+
+/**
+ * Function EndScan
+ * publishes the outputs of every assembly in the process image for the
+ * next productions.  Safe from any thread.
+ */
+inline void EndScan()
+{
+    CipAssemblyClass::EndScan();
+}
+
 class CipConn;
 
 
@@ -259,7 +284,8 @@ inline EipStatus ManageConnections()
  * inhibit timer. The application is informed via the
  * bool BeforeAssemblyDataSend( CipInstance* aInstance )
  * callback function when the production will happen. This function should only
- * be invoked from void HandleApplication().
+ * be invoked from void HandleApplication().  Other threads use
+ * PostTriggerConnections().
  *
  * The connection can only be triggered if the application is established and it
  * is of application triggered type.
@@ -382,6 +408,7 @@ void RunIdleChanged( uint32_t run_idle_value );
 /** @ingroup CIP_API
  * Function CloseSession
  * deletes any session associated with the aSocket and closes the socket connection.
+ * Other threads than the stack's use PostCloseSession().
  *
  * @param aSocket the socket of the session to close.
  * @return bool - true if aSocket was found in an open session (in which case), else false.
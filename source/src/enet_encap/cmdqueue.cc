@@ -0,0 +1,293 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#include "cmdqueue.h"
+
+#include <string.h>
+#include <atomic>
+
+#include <cipster_api.h>
+#include <trace.h>
+
+
+struct StackCommand
+{
+    enum Kind
+    {
+        kTrigger,
+        kAssemblyWrite,
+        kDeviceStatus,
+        kCloseSession,
+        kCall,
+    };
+
+    Kind                kind;
+    int                 arg1;       // assembly id, socket or status
+    int                 arg2;
+    const uint8_t*      data;
+    unsigned            byte_count;
+    StackCommandFunc    func;
+    StackCommandDone    done;
+    void*               context;
+};
+
+
+/**
+ * Class CommandQueue
+ * is a bounded multiple producer, single consumer queue after Dmitry Vyukov.
+ * Each cell carries a sequence number telling whose turn it is, producers
+ * claim a cell with one compare and swap on the tail and publish it by
+ * storing its sequence number, so neither side ever takes a lock.
+ */
+class CommandQueue
+{
+public:
+    CommandQueue() :
+        tail( 0 ),
+        head( 0 )
+    {
+        for( unsigned i = 0; i < DIM( cells ); ++i )
+            cells[i].seq.store( i, std::memory_order_relaxed );
+    }
+
+    bool Push( const StackCommand& aCmd )
+    {
+        unsigned pos = tail.load( std::memory_order_relaxed );
+        Cell*    cell;
+
+        for(;;)
+        {
+            cell = &cells[pos & MASK];
+
+            int dif = int( cell->seq.load( std::memory_order_acquire ) - pos );
+
+            if( dif == 0 )
+            {
+                if( tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                    break;
+            }
+            else if( dif < 0 )
+                return false;       // full
+            else
+                pos = tail.load( std::memory_order_relaxed );
+        }
+
+        cell->cmd = aCmd;
+        cell->seq.store( pos + 1, std::memory_order_release );
+        return true;
+    }
+
+    /// Single consumer only.
+    bool Pop( StackCommand* aCmd )
+    {
+        Cell* cell = &cells[head & MASK];
+
+        if( int( cell->seq.load( std::memory_order_acquire ) - ( head + 1 ) ) < 0 )
+            return false;           // empty, or a producer has not published yet
+
+        *aCmd = cell->cmd;
+        cell->seq.store( head + CIPSTER_COMMAND_QUEUE_SIZE, std::memory_order_release );
+        ++head;
+        return true;
+    }
+
+private:
+    static const unsigned MASK = CIPSTER_COMMAND_QUEUE_SIZE - 1;
+
+    struct Cell
+    {
+        std::atomic<unsigned>   seq;
+        StackCommand            cmd;
+    };
+
+    Cell                    cells[CIPSTER_COMMAND_QUEUE_SIZE];
+    std::atomic<unsigned>   tail;
+    unsigned                head;
+};
+
+
+/**
+ * Struct CommandState
+ * is the command queues' share of a StackContext.
+ */
+struct CommandState : public StackState
+{
+    CommandQueue    io_cmds;        // connections, assemblies, identity
+    CommandQueue    explicit_cmds;  // sessions
+};
+
+
+static StackStateType<CommandState> s_command_state( kStackStateCommands );
+
+static inline CommandState& commands()
+{
+    return StackContext::Current().State<CommandState>( kStackStateCommands );
+}
+
+
+static bool post( bool isExplicit, const StackCommand& aCmd )
+{
+    CommandState& cs = commands();
+
+    if( ( isExplicit ? cs.explicit_cmds : cs.io_cmds ).Push( aCmd ) )
+    {
+        NetworkHandlerWake( isExplicit );
+        return true;
+    }
+
+    CIPSTER_TRACE_WARN( "%s: command queue full, kind:%d dropped\n", __func__, aCmd.kind );
+    return false;
+}
+
+
+static StackCommand command( StackCommand::Kind aKind,
+        StackCommandDone aDone, void* aContext )
+{
+    StackCommand cmd;
+
+    memset( &cmd, 0, sizeof cmd );
+
+    cmd.kind    = aKind;
+    cmd.done    = aDone;
+    cmd.context = aContext;
+
+    return cmd;
+}
+
+
+bool PostTriggerConnections( int aOutputAssembly, int aInputAssembly,
+        StackCommandDone aDone, void* aContext )
+{
+    StackCommand cmd = command( StackCommand::kTrigger, aDone, aContext );
+
+    cmd.arg1 = aOutputAssembly;
+    cmd.arg2 = aInputAssembly;
+
+    return post( false, cmd );
+}
+
+
+bool PostAssemblyWrite( int aInstanceId, const uint8_t* aData, unsigned aByteCount,
+        StackCommandDone aDone, void* aContext )
+{
+    StackCommand cmd = command( StackCommand::kAssemblyWrite, aDone, aContext );
+
+    cmd.arg1       = aInstanceId;
+    cmd.data       = aData;
+    cmd.byte_count = aByteCount;
+
+    return post( false, cmd );
+}
+
+
+bool PostSetDeviceStatus( uint16_t aStatus )
+{
+    StackCommand cmd = command( StackCommand::kDeviceStatus, NULL, NULL );
+
+    cmd.arg1 = aStatus;
+
+    return post( false, cmd );
+}
+
+
+bool PostCloseSession( int aSocket, StackCommandDone aDone, void* aContext )
+{
+    StackCommand cmd = command( StackCommand::kCloseSession, aDone, aContext );
+
+    cmd.arg1 = aSocket;
+
+    return post( true, cmd );
+}
+
+
+bool PostStackCall( StackCommandFunc aFunc, void* aContext, StackCommandDone aDone )
+{
+    StackCommand cmd = command( StackCommand::kCall, aDone, aContext );
+
+    cmd.func = aFunc;
+
+    return post( false, cmd );
+}
+
+
+static EipStatus writeAssembly( int aInstanceId, const uint8_t* aData, unsigned aByteCount )
+{
+    CipClass* clazz = GetCipClass( kCipAssemblyClass );
+
+    AssemblyInstance* inst = clazz ?
+            static_cast<AssemblyInstance*>( clazz->Instance( aInstanceId ) ) : NULL;
+
+    if( !inst || inst->SizeBytes() != aByteCount )
+    {
+        CIPSTER_TRACE_ERR( "%s: no assembly %d of %u bytes\n",
+            __func__, aInstanceId, aByteCount );
+        return kEipStatusError;
+    }
+
+    // the application's EndScan() is its only writer
+    if( inst->Role() == kImageProduced )
+    {
+        CIPSTER_TRACE_ERR( "%s: assembly %d is written by EndScan()\n",
+            __func__, aInstanceId );
+        return kEipStatusError;
+    }
+
+    inst->Publish( aData, aByteCount );
+    return kEipStatusOk;
+}
+
+
+static int run( CommandQueue& aQueue )
+{
+    StackCommand    cmd;
+    int             count = 0;
+
+    while( aQueue.Pop( &cmd ) )
+    {
+        EipStatus result = kEipStatusOk;
+
+        switch( cmd.kind )
+        {
+        case StackCommand::kTrigger:
+            result = TriggerConnections( cmd.arg1, cmd.arg2 );
+            break;
+
+        case StackCommand::kAssemblyWrite:
+            result = writeAssembly( cmd.arg1, cmd.data, cmd.byte_count );
+            break;
+
+        case StackCommand::kDeviceStatus:
+            SetDeviceStatus( uint16_t( cmd.arg1 ) );
+            break;
+
+        case StackCommand::kCloseSession:
+            result = CloseSession( cmd.arg1 ) ? kEipStatusOk : kEipStatusError;
+            break;
+
+        case StackCommand::kCall:
+            result = cmd.func( cmd.context );
+            break;
+        }
+
+        if( cmd.done )
+            cmd.done( cmd.context, result );
+
+        ++count;
+    }
+
+    return count;
+}
+
+
+int RunIoCommands()
+{
+    return run( commands().io_cmds );
+}
+
+
+int RunExplicitCommands()
+{
+    return run( commands().explicit_cmds );
+}
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_CMDQUEUE_H_
+#define CIPSTER_CMDQUEUE_H_
+
+/** @file cmdqueue.h
+ * @brief Thread safe entry into the stack for application threads
+ *
+ * The stack is single threaded, or two threaded with NetworkHandlerProcessIo(),
+ * and nothing it owns may be touched from another thread.  An application
+ * control thread instead posts a command here.  Posting is lock free and never
+ * blocks, the stack runs the command at the start of its next loop pass and
+ * then calls the optional StackCommandDone with the result, on the stack's
+ * thread.  A stack thread waiting on its sockets is woken for it, see
+ * NetworkHandlerWake().  Any number of threads may post.
+ */
+
+#include <typedefs.h>
+#include "../cip/ciptypes.h"
+
+
+#ifndef CIPSTER_COMMAND_QUEUE_SIZE
+/// Commands which can be pending at once, must be a power of 2.
+#define CIPSTER_COMMAND_QUEUE_SIZE      64
+#endif
+
+
+/// Completion callback of a posted command, runs on the stack's thread.
+typedef void (*StackCommandDone)( void* aContext, EipStatus aResult );
+
+/// A function posted by PostStackCall(), runs on the stack's thread.
+typedef EipStatus (*StackCommandFunc)( void* aContext );
+
+
+/**
+ * Function PostTriggerConnections
+ * is the thread safe form of TriggerConnections().
+ *
+ * @return bool - false if the queue is full, the command was not posted.
+ */
+bool PostTriggerConnections( int aOutputAssembly, int aInputAssembly,
+        StackCommandDone aDone = NULL, void* aContext = NULL );
+
+/**
+ * Function PostAssemblyWrite
+ * copies @a aData into the assembly instance @a aInstanceId on the stack's
+ * thread, between productions.  @a aData must stay valid until @a aDone is
+ * called, or until the next loop pass when there is no @a aDone.  The result
+ * is kEipStatusError if there is no such assembly, @a aByteCount is not its
+ * size, or it is a process image output, which only EndScan() writes.  This is
+ * how an application thread writes a seq locked assembly.
+ *
+ * @return bool - false if the queue is full, the command was not posted.
+ */
+bool PostAssemblyWrite( int aInstanceId, const uint8_t* aData, unsigned aByteCount,
+        StackCommandDone aDone = NULL, void* aContext = NULL );
+
+/**
+ * Function PostSetDeviceStatus
+ * is the thread safe form of SetDeviceStatus().
+ */
+bool PostSetDeviceStatus( uint16_t aStatus );
+
+/**
+ * Function PostCloseSession
+ * is the thread safe form of CloseSession().  The result is kEipStatusError
+ * if @a aSocket had no session.
+ */
+bool PostCloseSession( int aSocket,
+        StackCommandDone aDone = NULL, void* aContext = NULL );
+
+/**
+ * Function PostStackCall
+ * runs @a aFunc( @a aContext ) on the stack's I/O thread, for anything not
+ * covered above, e.g. reading connection state.
+ */
+bool PostStackCall( StackCommandFunc aFunc, void* aContext,
+        StackCommandDone aDone = NULL );
+
+
+/**
+ * Function RunIoCommands
+ * runs the pending commands which touch connections and assemblies.  The
+ * network handler calls it at the start of each pass of the thread that
+ * calls ManageConnections().
+ *
+ * @return int - how many commands were run.
+ */
+int RunIoCommands();
+
+/**
+ * Function RunExplicitCommands
+ * runs the pending commands which touch sessions.  The network handler calls
+ * it at the start of each pass of the thread that serves TCP.
+ */
+int RunExplicitCommands();
+
+#endif // CIPSTER_CMDQUEUE_H_
@@ -6,6 +6,7 @@
 //#include <string.h>
 
 #include "cpf.h"
+#include "deferred.h"
 
 #include "cipster_api.h"
 #include "cipcommon.h"
@@ -16,10 +17,13 @@
 #include "trace.h"
 
 
-Cpf::Cpf( const SockAddr& aTcpPeer, CipUdint aSessionHandle ) :
+Cpf::Cpf( const SockAddr& aTcpPeer, CipUdint aSessionHandle, int aTcpSocket ) :
     payload( 0 ),
+    session_handle( aSessionHandle ),
     tcp_peer( aTcpPeer ),
-    session_handle( aSessionHandle )
+    tcp_socket( aTcpSocket ),
+    deferred( 0 ),
+    defer_blocked( false )
 {
     Clear();
 }
@@ -29,7 +33,10 @@ Cpf::Cpf( CpfId aAddrType, CpfId aDataType, Serializeable* aPayload ) :
     address_item( aAddrType, aDataType ),
     data_item( aDataType ),
     payload( aPayload ),
-    session_handle( 0 )
+    session_handle( 0 ),
+    tcp_socket( kSocketInvalid ),
+    deferred( 0 ),
+    defer_blocked( false )
 {
     ClearRx_O_T();
     ClearRx_T_O();
@@ -42,7 +49,10 @@ Cpf::Cpf( const AddressItem& aAddr, CpfId aDataType ) :
     address_item( aAddr ),
     data_item( aDataType ),
     payload( 0 ),
-    session_handle( 0 )
+    session_handle( 0 ),
+    tcp_socket( kSocketInvalid ),
+    deferred( 0 ),
+    defer_blocked( false )
 {
     ClearRx_O_T();
     ClearRx_T_O();
@@ -65,6 +75,40 @@ const SockAddr* Cpf::TcpPeerAddr() const
 }
 */
 
+/**
+ * Function replyInPlace
+ * aims @a aResponse's writer at where Cpf::Serialize() will put the response
+ * data within @a aReply, so the service writes it straight into the reply
+ * frame and Serialize() need not copy it.  Room is left for the additional
+ * status words and the sockaddr info items which follow.  If @a aReply
+ * overlaps @a aCommand, whose data the service still reads, the response
+ * keeps its temporary buffer.
+ */
+static void replyInPlace( const Cpf& aCpf, CipMessageRouterResponse* aResponse,
+        BufReader aCommand, BufWriter aReply )
+{
+    if( aReply.data() < aCommand.end() && aCommand.data() < aReply.end() )
+        return;
+
+    const int trailer = 2 * 2       // at most two additional status words
+                      + 2 * 20;     // O->T and T->O sockaddr info items
+
+    // after the message router response's reply service, reserved,
+    // general status and additional status count
+    int offset = aCpf.PayloadOffset() + 4;
+
+    ssize_t room = aReply.capacity() - offset - trailer;
+
+    if( room <= 0 )
+        return;
+
+    if( room > CIPSTER_MESSAGE_DATA_REPLY_BUFFER )
+        room = CIPSTER_MESSAGE_DATA_REPLY_BUFFER;
+
+    aResponse->SetWriter( BufWriter( aReply.data() + offset, room ) );
+}
+
+
 int Cpf::NotifyCommonPacketFormat( BufReader aCommand, BufWriter aReply )
 {
     CipMessageRouterResponse    response( this );
@@ -82,6 +126,8 @@ int Cpf::NotifyCommonPacketFormat( BufReader aCommand, BufWriter aReply )
         {
             CipMessageRouterRequest request;
 
+            replyInPlace( *this, &response, aCommand, aReply );
+
             int consumed = request.DeserializeMRReq( DataItemPayload() );
 
             if( consumed <= 0 )
@@ -93,7 +139,17 @@ int Cpf::NotifyCommonPacketFormat( BufReader aCommand, BufWriter aReply )
             {
                 EipStatus s = CipMessageRouterClass::NotifyMR( &request, &response );
 
-                if( s == kEipStatusError )
+                // HandleReceivedExplicitTcpData() binds the deferred reply.
+                if( s == kEipStatusPending && deferred )
+                    return 0;
+
+                // a service which deferred but replied now gives its slot back
+                if( deferred )
+                    ReleaseDeferredService( deferred );
+
+                deferred = NULL;
+
+                if( s == kEipStatusError || s == kEipStatusPending )
                     return -kEncapErrorIncorrectData;
             }
 
@@ -138,13 +194,27 @@ int Cpf::NotifyConnectedCommonPacketFormat( BufReader aCommand, BufWriter aReply
         return -kEncapErrorIncorrectData;
     }
 
+    CipUdint producing_id = 0;
+
     // ConnectedAddressItem item
-    CipConn* conn = GetConnectionByConsumingId( address_item.connection_identifier );
+    CipConn* conn;
+
+    {
+        IoLock  lock;   // the I/O thread ages and closes connections
+
+        conn = GetConnectionByConsumingId( address_item.connection_identifier );
+
+        if( conn )
+        {
+            // reset the watchdog timer
+            conn->SetInactivityWatchDogTimerUSecs( conn->RxTimeoutUSecs() );
+
+            producing_id = conn->ProducingConnectionId();
+        }
+    }
 
     if( conn )
     {
-        // reset the watchdog timer
-        conn->SetInactivityWatchDogTimerUSecs( conn->RxTimeoutUSecs() );
 
         // TODO check connection id  and sequence count
         if( DataType() == kCpfIdConnectedDataItem )
@@ -157,6 +227,8 @@ int Cpf::NotifyConnectedCommonPacketFormat( BufReader aCommand, BufWriter aReply
             CipMessageRouterResponse response( this );  // give Cpf to response
             CipMessageRouterRequest  request;
 
+            replyInPlace( *this, &response, aCommand, aReply );
+
             // command is advanced by 2 here because of above get16().
             int consumed = request.DeserializeMRReq( command );
 
@@ -169,10 +241,20 @@ int Cpf::NotifyConnectedCommonPacketFormat( BufReader aCommand, BufWriter aReply
             {
                 EipStatus s = CipMessageRouterClass::NotifyMR( &request, &response );
 
-                if( s == kEipStatusError )
-                    return -kEncapErrorIncorrectData;
+                address_item.connection_identifier = producing_id;
+
+                // HandleReceivedExplicitTcpData() binds the deferred reply.
+                if( s == kEipStatusPending && deferred )
+                    return 0;
 
-                address_item.connection_identifier = conn->ProducingConnectionId();
+                // a service which deferred but replied now gives its slot back
+                if( deferred )
+                    ReleaseDeferredService( deferred );
+
+                deferred = NULL;
+
+                if( s == kEipStatusError || s == kEipStatusPending )
+                    return -kEncapErrorIncorrectData;
             }
 
             SetPayload( &response );
@@ -326,6 +408,37 @@ int Cpf::SerializedCount( int aCtl ) const
 }
 
 
+int Cpf::PayloadOffset() const
+{
+    int offset = 2;     // item_count
+
+    switch( address_item.type_id )
+    {
+    case kCpfIdNullAddress:
+        offset += 4;
+        break;
+
+    case kCpfIdConnectedAddress:
+        offset += 8;
+        break;
+
+    case kCpfIdSequencedAddress:
+        offset += 12;
+        break;
+
+    default:
+        ;   // maybe no address
+    }
+
+    offset += 4;        // data item's type_id and length
+
+    if( data_item.type_id == kCpfIdConnectedDataItem )
+        offset += 2;    // sequence number
+
+    return offset;
+}
+
+
 int Cpf::Serialize( BufWriter aDst, int aCtl ) const
 {
     BufWriter   out = aDst;
@@ -369,21 +482,22 @@ int Cpf::Serialize( BufWriter aDst, int aCtl ) const
         {
             out.put16( data_item.type_id );
 
+            // back-patched below once the payload is serialized
+            BufWriter   length = out.reserve( 2 );
+            int         count  = 0;
+
             if( data_item.type_id == kCpfIdConnectedDataItem ) // Connected Item
             {
-                // +2 for the sequence number, supplied just below here.
-                out.put16( payload->SerializedCount() + 2 );
-
                 // sequence number
                 out.put16( address_item.encap_sequence_number );
-            }
-            else // Unconnected Item
-            {
-                out.put16( payload->SerializedCount() );
+                count = 2;
             }
 
             // serialize payload, either message router response or reply
-            out += payload->Serialize( out );
+            int payloadz = payload->Serialize( out );
+
+            out += payloadz;
+            length.put16( count + payloadz );
         }
         else // connected IO Message to send
         {
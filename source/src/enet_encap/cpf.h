@@ -115,6 +115,8 @@ struct SaiiPair
 };
 
 
+class DeferredService;
+
 /**
  * Class Cpf
  * helps serializing and deserializing Common Packet Format packet payload wrappers.
@@ -127,9 +129,11 @@ public:
      * Constructor
      * that takes @a aSessionHandle.  This information is simply
      * saved in this instance for use by stack functions which need to know
-     * from which TCP peer that this request originated from.
+     * from which TCP peer that this request originated from.  @a aTcpSocket
+     * is the connection it arrived on, only then can its service defer.
      */
-    Cpf( const SockAddr& aPeer, CipUdint aSessionHandle );
+    Cpf( const SockAddr& aPeer, CipUdint aSessionHandle,
+            int aTcpSocket = kSocketInvalid );
 
     Cpf( CpfId aAddrType, CpfId aDataType, Serializeable* aPayload = NULL );
 
@@ -153,6 +157,13 @@ public:
     int Serialize( BufWriter aDst, int aCtl = 0 ) const;
     //-----</Serializeable>-----------------------------------------------------
 
+    /**
+     * Function PayloadOffset
+     * returns how many bytes Serialize() will put ahead of the payload, given
+     * the current address and data item types.
+     */
+    int PayloadOffset() const;
+
     /**
      * Function NotifyConnectedCommonPacketFormat
      * parses the CPF data in @a aCommand which is a connected explicit message, checks
@@ -338,6 +349,18 @@ public:
     CipUdint  SessionHandle() const             { return session_handle; }
     Cpf& SetSessionHandle( CipUdint aHndl )     { session_handle = aHndl;  return *this; }
 
+    /// Return the TCP socket the request arrived on, or kSocketInvalid.
+    int TcpSocket() const                       { return tcp_socket; }
+
+    /// Return the DeferredService of the request being served, if it was deferred.
+    DeferredService* Deferred() const           { return deferred; }
+    void SetDeferred( DeferredService* aService )   { deferred = aService; }
+
+    /// Return true while DeferService() must refuse, as for requests embedded
+    /// in a Multiple Service Packet which all reply in the outer frame.
+    bool DeferBlocked() const                   { return defer_blocked; }
+    void SetDeferBlocked( bool aBlocked )       { defer_blocked = aBlocked; }
+
 protected:
     static int serialize_sockaddr( const SockAddr& aSockAddr, BufWriter aOutput );
     static int deserialize_sockaddr( SockAddr* aSockAddr, BufReader aInput );
@@ -352,6 +375,10 @@ protected:
 
     CipUdint            session_handle;
     SockAddr            tcp_peer;
+    int                 tcp_socket;
+
+    DeferredService*    deferred;
+    bool                defer_blocked;
 
 private:
     /*
@@ -0,0 +1,444 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#include "deferred.h"
+
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdexcept>
+
+#include <cipster_api.h>
+#include <trace.h>
+
+
+/**
+ * Struct DeferredState
+ * is the deferred services' share of a StackContext.  The workers are
+ * shared by all stacks.
+ */
+struct DeferredState : public StackState
+{
+    DeferredService services[CIPSTER_DEFERRED_SERVICES];
+
+    bool            started;    // counted in s_stacks
+
+    // the serialized reply, only used by the thread which serves TCP
+    uint8_t         reply_buf[CIPSTER_MESSAGE_DATA_REPLY_BUFFER + 64];
+};
+
+
+static StackStateType<DeferredState> s_deferred_state( kStackStateDeferred );
+
+static inline DeferredService* deferredServices()
+{
+    return StackContext::Current().State<DeferredState>( kStackStateDeferred ).services;
+}
+
+
+DeferredService::DeferredService() :
+    state( kFree ),
+    stack( NULL ),
+    socket( kSocketInvalid ),
+    data_type( kCpfIdEmpty ),
+    response( NULL, BufWriter( reply_data, sizeof reply_data ) ),
+    func( NULL ),
+    context( NULL ),
+    next_job( NULL )
+{
+}
+
+
+void DeferredService::Complete()
+{
+    state.store( kDone, std::memory_order_release );
+}
+
+
+DeferredService* DeferService( CipMessageRouterRequest* aRequest,
+        CipMessageRouterResponse* aResponse )
+{
+    Cpf* cpf = aResponse->CPF();
+
+    // Only a request out of Cpf::NotifyCommonPacketFormat() or
+    // Cpf::NotifyConnectedCommonPacketFormat() knows where to reply, and
+    // RunDeferredCompletions() can only reply on TCP.
+    if( !cpf || cpf->Deferred() || cpf->DeferBlocked() ||
+        cpf->TcpSocket() == kSocketInvalid )
+        return NULL;
+
+    const BufReader& data = aRequest->Data();
+
+    DeferredService* services = deferredServices();
+
+    if( data.size() > sizeof services[0].request_data )
+    {
+        CIPSTER_TRACE_ERR( "%s: request data of %zd bytes is too large\n",
+            __func__, data.size() );
+        return NULL;
+    }
+
+    // Only the thread which serves TCP takes and frees these.
+    for( int i = 0; i < CIPSTER_DEFERRED_SERVICES; ++i )
+    {
+        DeferredService& s = services[i];
+
+        if( s.state.load( std::memory_order_acquire ) != DeferredService::kFree )
+            continue;
+
+        memcpy( s.request_data, data.data(), data.size() );
+
+        s.request = CipMessageRouterRequest( aRequest->Service(), aRequest->Path(),
+                        BufReader( s.request_data, data.size() ) );
+
+        s.response.Clear();
+        s.response.SetService( aResponse->Service() );
+        s.response.SetWriter( BufWriter( s.reply_data, sizeof s.reply_data ) );
+
+        s.stack   = &StackContext::Current();
+        s.socket  = kSocketInvalid;
+        s.func    = NULL;
+        s.context = NULL;
+
+        s.state.store( DeferredService::kBusy, std::memory_order_relaxed );
+
+        cpf->SetDeferred( &s );
+        return &s;
+    }
+
+    CIPSTER_TRACE_WARN( "%s: all %d deferred services outstanding\n",
+        __func__, CIPSTER_DEFERRED_SERVICES );
+    return NULL;
+}
+
+
+void ReleaseDeferredService( DeferredService* aService )
+{
+    int busy = DeferredService::kBusy;
+
+    // One handed to RunDeferred() is dropped unbound once it completes.
+    if( aService->func )
+        return;
+
+    aService->state.compare_exchange_strong( busy, DeferredService::kFree,
+            std::memory_order_release );
+}
+
+
+void BindDeferredService( DeferredService* aService, int aSocket,
+        const Encapsulation& aEncap, const Cpf& aCpf )
+{
+    aService->socket    = aSocket;
+    aService->encap     = aEncap;
+    aService->address   = AddressItem( aCpf.AddrType(), aCpf.AddrConnId(),
+                                aCpf.AddrEncapSeqNum() );
+    aService->data_type = aCpf.DataType();
+}
+
+
+int DeferredServicesOutstanding()
+{
+    DeferredState* state = StackContext::Current().Find<DeferredState>( kStackStateDeferred );
+    int count = 0;
+
+    for( int i = 0; state && i < CIPSTER_DEFERRED_SERVICES; ++i )
+    {
+        if( state->services[i].state.load( std::memory_order_relaxed ) != DeferredService::kFree )
+            ++count;
+    }
+
+    return count;
+}
+
+
+int RunDeferredCompletions()
+{
+    DeferredState* state = StackContext::Current().Find<DeferredState>( kStackStateDeferred );
+    int count = 0;
+
+    for( int i = 0; state && i < CIPSTER_DEFERRED_SERVICES; ++i )
+    {
+        DeferredService& s = state->services[i];
+
+        if( s.state.load( std::memory_order_acquire ) != DeferredService::kDone )
+            continue;
+
+        if( s.socket == kSocketInvalid )
+        {
+            // the service deferred but then replied at once
+            CIPSTER_TRACE_WARN( "%s: dropping the reply of an unbound service\n", __func__ );
+        }
+        else if( !SessionMgr::CheckRegisteredSession( s.encap.SessionHandle(), s.socket ) )
+        {
+            CIPSTER_TRACE_INFO( "%s[%d]: session %d closed, reply dropped\n",
+                __func__, s.socket, s.encap.SessionHandle() );
+        }
+        else
+        {
+            Cpf cpf( s.address, s.data_type );
+
+            cpf.SetPayload( &s.response );
+            s.encap.SetPayload( &cpf );
+
+            try
+            {
+                int replyz = s.encap.Serialize( BufWriter( state->reply_buf, sizeof state->reply_buf ) );
+
+                int sent_count = send( s.socket, (char*) state->reply_buf, replyz, 0 );
+
+                if( sent_count != replyz )
+                {
+                    CIPSTER_TRACE_WARN( "%s[%d]: TCP response was not fully sent\n",
+                        __func__, s.socket );
+                }
+
+                ++count;
+            }
+            catch( const std::runtime_error& e )
+            {
+                CIPSTER_TRACE_ERR( "%s[%d]: reply overrun: %s\n",
+                    __func__, s.socket, e.what() );
+            }
+
+            s.encap.SetPayload( NULL );
+        }
+
+        s.state.store( DeferredService::kFree, std::memory_order_release );
+    }
+
+    return count;
+}
+
+
+//-----<Workers>----------------------------------------------------------------
+
+static std::mutex               s_job_mutex;
+static std::condition_variable  s_job_ready;
+
+// Every stack's services share this queue.  Each is queued at most once and
+// linked through DeferredService::next_job, so it never fills up.
+static DeferredService*         s_job_head;
+static DeferredService*         s_job_tail;
+static bool                     s_stopping;
+
+static std::thread              s_workers[CIPSTER_DEFERRED_WORKERS_MAX];
+static int                      s_worker_count;
+
+static int                      s_stacks;   // which called StartDeferredServices()
+
+
+/**
+ * Class DeferredPool
+ * is the worker threads' access to a DeferredService and their queue,
+ * always under s_job_mutex.
+ */
+class DeferredPool
+{
+public:
+    static void Prepare( DeferredService* aService, DeferredServiceFunc aFunc, void* aContext )
+    {
+        aService->func    = aFunc;
+        aService->context = aContext;
+    }
+
+    static void Run( DeferredService* aService )
+    {
+        // a worker serves every stack, so drive this service's one meanwhile
+        StackContext& previous = StackContext::Current();
+
+        aService->stack->Select();
+
+        aService->func( aService, aService->context );
+        aService->Complete();
+
+        previous.Select();
+    }
+
+    static void Push( DeferredService* aService )
+    {
+        aService->next_job = NULL;
+
+        if( s_job_tail )
+            s_job_tail->next_job = aService;
+        else
+            s_job_head = aService;
+
+        s_job_tail = aService;
+    }
+
+    static DeferredService* Pop()
+    {
+        DeferredService* s = s_job_head;
+
+        s_job_head = s->next_job;
+
+        if( !s_job_head )
+            s_job_tail = NULL;
+
+        s->next_job = NULL;
+        return s;
+    }
+};
+
+
+static void worker()
+{
+    std::unique_lock<std::mutex> lock( s_job_mutex );
+
+    for(;;)
+    {
+        while( !s_stopping && !s_job_head )
+            s_job_ready.wait( lock );
+
+        if( s_stopping )
+            return;
+
+        DeferredService* s = DeferredPool::Pop();
+
+        lock.unlock();
+
+        DeferredPool::Run( s );
+
+        lock.lock();
+    }
+}
+
+
+void RunDeferred( DeferredService* aService, DeferredServiceFunc aFunc, void* aContext )
+{
+    DeferredPool::Prepare( aService, aFunc, aContext );
+
+    {
+        std::lock_guard<std::mutex> lock( s_job_mutex );
+
+        if( s_worker_count )
+        {
+            DeferredPool::Push( aService );
+            s_job_ready.notify_one();
+            return;
+        }
+    }
+
+    DeferredPool::Run( aService );
+}
+
+
+bool SetDeferredWorkerCount( int aCount )
+{
+    if( aCount < 0 || aCount > CIPSTER_DEFERRED_WORKERS_MAX )
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock( s_job_mutex );
+        s_stopping = true;
+    }
+
+    s_job_ready.notify_all();
+
+    for( int i = 0; i < s_worker_count; ++i )
+        s_workers[i].join();
+
+    std::lock_guard<std::mutex> lock( s_job_mutex );
+
+    s_stopping = false;
+    s_worker_count = aCount;
+
+    // Jobs still queued are taken up by the new workers, or run here.
+    if( !s_worker_count )
+    {
+        while( s_job_head )
+        {
+            DeferredPool::Run( DeferredPool::Pop() );
+        }
+    }
+
+    for( int i = 0; i < s_worker_count; ++i )
+        s_workers[i] = std::thread( worker );
+
+    return true;
+}
+
+
+void StartDeferredServices()
+{
+    DeferredState& state = StackContext::Current().State<DeferredState>( kStackStateDeferred );
+
+    std::lock_guard<std::mutex> lock( s_job_mutex );
+
+    if( !state.started )
+    {
+        state.started = true;
+        ++s_stacks;
+    }
+}
+
+
+void StopDeferredServices()
+{
+    DeferredState* state = StackContext::Current().Find<DeferredState>( kStackStateDeferred );
+
+    if( !state )
+        return;
+
+    std::unique_lock<std::mutex> lock( s_job_mutex );
+
+    if( !state->started )
+        return;
+
+    state->started = false;
+
+    if( !--s_stacks )
+    {
+        lock.unlock();
+        SetDeferredWorkerCount( 0 );
+        return;
+    }
+
+    // Other stacks keep the workers, take this one's jobs off their queue.
+    DeferredService*    mine = NULL;
+    DeferredService**   link = &s_job_head;
+
+    s_job_tail = NULL;
+
+    while( *link )
+    {
+        DeferredService* s = *link;
+
+        if( s >= state->services && s < state->services + CIPSTER_DEFERRED_SERVICES )
+        {
+            *link = s->next_job;
+            s->next_job = mine;
+            mine = s;
+        }
+        else
+        {
+            s_job_tail = s;
+            link = &s->next_job;
+        }
+    }
+
+    lock.unlock();
+
+    while( mine )
+    {
+        DeferredService* s = mine;
+
+        mine = s->next_job;
+        s->next_job = NULL;
+        DeferredPool::Run( s );
+    }
+
+    // and wait for those a worker is running
+    for( int i = 0; i < CIPSTER_DEFERRED_SERVICES; ++i )
+    {
+        DeferredService& s = state->services[i];
+
+        while( s.func && s.state.load( std::memory_order_acquire ) == DeferredService::kBusy )
+            std::this_thread::yield();
+    }
+}
+
+//-----</Workers>---------------------------------------------------------------
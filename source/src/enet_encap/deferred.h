@@ -0,0 +1,193 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_DEFERRED_H_
+#define CIPSTER_DEFERRED_H_
+
+/** @file deferred.h
+ * @brief Explicit services which reply later
+ *
+ * A CipServiceFunction normally fills in its reply before it returns.  One
+ * which waits on a slow back end, e.g. an application's tag server behind
+ * class 0x6b, instead calls DeferService(), hands the returned
+ * DeferredService to a worker with RunDeferred() or to its own machinery, and
+ * returns kEipStatusPending.  The stack goes on serving other requests.  Once
+ * DeferredService::Complete() is called, from any thread, the thread which
+ * serves TCP sends the reply on the request's session with the request's
+ * sender context, or drops it if the session has closed meanwhile.
+ *
+ * Replies may then leave in another order than their requests arrived,
+ * originators match them by sender context or connected sequence number.
+ * Only requests which arrived by SendRRData or SendUnitData on TCP can be
+ * deferred.
+ */
+
+#include <atomic>
+
+#include <typedefs.h>
+#include "encap.h"
+#include "cpf.h"
+#include "../cip/cipmessagerouter.h"
+
+
+#ifndef CIPSTER_DEFERRED_SERVICES
+/// Deferred services which can be outstanding at once.
+#define CIPSTER_DEFERRED_SERVICES       8
+#endif
+
+#ifndef CIPSTER_DEFERRED_WORKERS_MAX
+/// Most threads SetDeferredWorkerCount() will start.
+#define CIPSTER_DEFERRED_WORKERS_MAX    8
+#endif
+
+
+class DeferredService;
+
+/// Does the slow part of a deferred service, see RunDeferred().
+typedef void (*DeferredServiceFunc)( DeferredService* aService, void* aContext );
+
+
+/**
+ * Class DeferredService
+ * holds one deferred request and its reply from DeferService() until the
+ * reply is sent.  It is owned by the service between those two points.
+ */
+class DeferredService
+{
+    friend DeferredService* DeferService( CipMessageRouterRequest* aRequest,
+                CipMessageRouterResponse* aResponse );
+    friend void BindDeferredService( DeferredService* aService, int aSocket,
+                const Encapsulation& aEncap, const Cpf& aCpf );
+    friend void ReleaseDeferredService( DeferredService* aService );
+    friend int RunDeferredCompletions();
+    friend int DeferredServicesOutstanding();
+    friend void StopDeferredServices();
+    friend class DeferredPool;
+
+public:
+    DeferredService();
+
+    /// Return the request, its data copied so it outlives the receive buffer.
+    const CipMessageRouterRequest& Request() const  { return request; }
+
+    /// Return the reply to fill in, as a CipServiceFunction would.
+    CipMessageRouterResponse& Response()            { return response; }
+
+    /**
+     * Function Complete
+     * hands the filled in Response() back to the stack, which sends it on
+     * its next pass.  Safe from any thread, the service must not touch this
+     * object afterwards.
+     */
+    void Complete();
+
+private:
+    enum State
+    {
+        kFree,
+        kBusy,          // owned by the service
+        kDone,          // completed, waiting to be sent
+    };
+
+    std::atomic<int>            state;
+
+    StackContext*               stack;      // the one the request arrived on
+    int                         socket;     // kSocketInvalid until bound
+    Encapsulation               encap;      // header of the request
+    AddressItem                 address;
+    CpfId                       data_type;
+
+    CipMessageRouterRequest     request;
+    CipMessageRouterResponse    response;
+
+    DeferredServiceFunc         func;       // for RunDeferred()
+    void*                       context;
+    DeferredService*            next_job;   // in the workers' queue
+
+    uint8_t     request_data[CIPSTER_MESSAGE_DATA_REPLY_BUFFER];
+    uint8_t     reply_data[CIPSTER_MESSAGE_DATA_REPLY_BUFFER];
+
+    // not copyable
+    DeferredService( const DeferredService& );
+    DeferredService& operator=( const DeferredService& );
+};
+
+
+/**
+ * Function DeferService
+ * is called by a CipServiceFunction which will reply later.  The service
+ * then returns kEipStatusPending.
+ *
+ * @return DeferredService* - the request's holder, or NULL if all
+ *  CIPSTER_DEFERRED_SERVICES are outstanding or this request cannot be
+ *  deferred, e.g. because it did not arrive on TCP.  The service must then
+ *  reply now, e.g. with kCipErrorResourceUnavailable.
+ */
+DeferredService* DeferService( CipMessageRouterRequest* aRequest,
+        CipMessageRouterResponse* aResponse );
+
+/**
+ * Function RunDeferred
+ * queues @a aFunc( @a aService, @a aContext ) for the worker pool, which
+ * calls DeferredService::Complete() after it.  Without workers it runs now,
+ * on the calling thread.  Either way the StackContext the request arrived on
+ * is selected while @a aFunc runs, so it may call into that stack.
+ */
+void RunDeferred( DeferredService* aService, DeferredServiceFunc aFunc, void* aContext );
+
+/**
+ * Function SetDeferredWorkerCount
+ * stops the worker threads of RunDeferred(), waiting for any running
+ * function, and starts @a aCount new ones.  Zero stops them for good, which
+ * ShutdownCipStack() of the last running stack does.
+ *
+ * @return bool - false if @a aCount is more than CIPSTER_DEFERRED_WORKERS_MAX.
+ */
+bool SetDeferredWorkerCount( int aCount );
+
+/**
+ * Function StartDeferredServices
+ * counts the current stack among those sharing the workers.  The
+ * encapsulation layer calls it from Encapsulation::Init().
+ */
+void StartDeferredServices();
+
+/**
+ * Function StopDeferredServices
+ * runs the current stack's queued RunDeferred() functions here and waits for
+ * those the workers are running.  The last stack to stop also stops the
+ * workers.  The encapsulation layer calls it from Encapsulation::ShutDown().
+ */
+void StopDeferredServices();
+
+/// Return how many deferred services are outstanding.
+int DeferredServicesOutstanding();
+
+/**
+ * Function BindDeferredService
+ * is called by the encapsulation layer once the service returned
+ * kEipStatusPending, to record where the reply goes.
+ */
+void BindDeferredService( DeferredService* aService, int aSocket,
+        const Encapsulation& aEncap, const Cpf& aCpf );
+
+/**
+ * Function ReleaseDeferredService
+ * is called by the encapsulation layer when a service which called
+ * DeferService() returned other than kEipStatusPending.  Its reply went out
+ * at once, so the slot is freed unless the service already passed it to
+ * RunDeferred().
+ */
+void ReleaseDeferredService( DeferredService* aService );
+
+/**
+ * Function RunDeferredCompletions
+ * sends the replies of completed deferred services.  The network handler
+ * calls it on the thread which serves TCP.
+ *
+ * @return int - how many replies were sent.
+ */
+int RunDeferredCompletions();
+
+#endif // CIPSTER_DEFERRED_H_
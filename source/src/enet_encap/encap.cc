@@ -15,6 +15,7 @@
 
 #include "../cip/cipcommon.h"
 #include "../cip/cipmessagerouter.h"
+#include "deferred.h"
 #include "../cip/cipconnectionmanager.h"
 #include "../cip/cipidentity.h"
 #include "../cip/ciptcpipinterface.h"
@@ -57,15 +58,37 @@ struct DelayedMsg
         return BufReader( message, message_size );
     }
 
-    static DelayedMsg messages[ENCAP_NUMBER_OF_SUPPORTED_DELAYED_ENCAP_MESSAGES];
 };
 
-DelayedMsg DelayedMsg::messages[ENCAP_NUMBER_OF_SUPPORTED_DELAYED_ENCAP_MESSAGES];
+
+/**
+ * Struct EncapState
+ * is the encapsulation layer's share of a StackContext.
+ */
+struct EncapState : public StackState
+{
+    EncapState() : next_session( 0 ) {}
+
+    int                     next_session;   // where RegisterTcpConnection() looks first
+    SessionMgr::Sessions    sessions;
+    DelayedMsg  messages[ENCAP_NUMBER_OF_SUPPORTED_DELAYED_ENCAP_MESSAGES];
+};
+
+
+static StackStateType<EncapState> s_encap_state( kStackStateEncap );
+
+static inline EncapState& encap()
+{
+    return StackContext::Current().State<EncapState>( kStackStateEncap );
+}
 
 
 //-----<SessionMgr>-------------------------------------------------------
 
-EncapSession SessionMgr::sessions[CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS];
+SessionMgr::Sessions& SessionMgr::sessions()
+{
+    return encap().sessions;
+}
 
 
 void SessionMgr::Init()
@@ -84,7 +107,7 @@ inline int inc_wrap( int index )
 {
     int r = index + 1;
 
-    if( r >= DIM(SessionMgr::sessions) )
+    if( r >= DIM(SessionMgr::sessions()) )
         r = 0;
 
     return r;
@@ -92,22 +115,22 @@ inline int inc_wrap( int index )
 
 EncapError SessionMgr::RegisterTcpConnection( int aSocket, CipUdint* aSessionHandleResult )
 {
-    static int index;
+    int& index = encap().next_session;
     int i;
 
     for( i=0, index = inc_wrap(index);
-        i < DIM(sessions); index = inc_wrap(index), ++i )
+        i < DIM(sessions()); index = inc_wrap(index), ++i )
     {
-        if( sessions[index].m_socket == kSocketInvalid )
+        if( sessions()[index].m_socket == kSocketInvalid )
             break;
     }
 
-    if( i == DIM(sessions) )
+    if( i == DIM(sessions()) )
     {
         return kEncapErrorInsufficientMemory;
     }
 
-    EncapSession& ses = sessions[index];
+    EncapSession& ses = sessions()[index];
 
     ses.m_socket = aSocket;
 
@@ -145,22 +168,22 @@ EncapError SessionMgr::RegisterSession(
 {
     int index;
 
-    for( index = 0; index < DIM(sessions); ++index )
+    for( index = 0; index < DIM(sessions()); ++index )
     {
-        if( sessions[index].m_socket == aSocket )
+        if( sessions()[index].m_socket == aSocket )
             break;
     }
 
     // A bug because any TCP socket should be in sessions[] as unregistered by now
-    CIPSTER_ASSERT( index < DIM(sessions) );
+    CIPSTER_ASSERT( index < DIM(sessions()) );
 
-    if( index == DIM(sessions) )
+    if( index == DIM(sessions()) )
     {
         // should never happen in Debug build because of ASSERT above
         return kEncapErrorInsufficientMemory;
     }
 
-    EncapSession& ses = sessions[index];
+    EncapSession& ses = sessions()[index];
 
     if( ses.m_is_registered )
     {
@@ -185,21 +208,21 @@ EncapSession* SessionMgr::UpdateRegisteredTcpConnection( int aSocket )
 {
     int index;
 
-    for( index = 0; index < DIM(sessions); ++index )
+    for( index = 0; index < DIM(sessions()); ++index )
     {
-        if( sessions[index].m_socket == aSocket )
+        if( sessions()[index].m_socket == aSocket )
             break;
     }
 
-    if( index == DIM(sessions) )
+    if( index == DIM(sessions()) )
     {
         CIPSTER_TRACE_INFO( "%s[%d]: no socket match\n", __func__, aSocket );
         return NULL;
     }
 
-    sessions[index].NoteTcpActivity();
+    sessions()[index].NoteTcpActivity();
 
-    return &sessions[index];
+    return &sessions()[index];
 }
 
 
@@ -210,11 +233,11 @@ EncapSession* SessionMgr::CheckRegisteredSession(
 
     unsigned index = aSessionHandle - 1;    // goes very large posive at 0
 
-    if( index < UDIM( sessions )
-     && sessions[index].m_socket == aSocket
-     && sessions[index].m_is_registered )
+    if( index < UDIM( sessions() )
+     && sessions()[index].m_socket == aSocket
+     && sessions()[index].m_is_registered )
     {
-        return &sessions[index];
+        return &sessions()[index];
     }
 
     return NULL;
@@ -223,25 +246,25 @@ EncapSession* SessionMgr::CheckRegisteredSession(
 
 bool SessionMgr::CloseBySessionHandle( CipUdint aSessionHandle )
 {
-    CIPSTER_ASSERT( aSessionHandle && aSessionHandle <= UDIM(sessions) );
+    CIPSTER_ASSERT( aSessionHandle && aSessionHandle <= UDIM(sessions()) );
 
     unsigned index = aSessionHandle - 1;
 
-    if( index >= UDIM(sessions) )
+    if( index >= UDIM(sessions()) )
     {
         CIPSTER_TRACE_INFO( "%s: BAD aSessionHandle:%d\n",
             __func__, aSessionHandle );
         return false;
     }
 
-    if( sessions[index].m_socket == kSocketInvalid )
+    if( sessions()[index].m_socket == kSocketInvalid )
     {
         CIPSTER_TRACE_INFO( "%s: inactive aSessionHandle:%d\n",
             __func__, aSessionHandle );
         return false;
     }
 
-    sessions[index].Close();
+    sessions()[index].Close();
     return true;
 }
 
@@ -250,11 +273,11 @@ bool SessionMgr::CloseBySocket( int aSocket )
 {
     CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, aSocket );
 
-    for( int i = 0; i < DIM(sessions); ++i )
+    for( int i = 0; i < DIM(sessions()); ++i )
     {
-        if( sessions[i].m_socket == aSocket )
+        if( sessions()[i].m_socket == aSocket )
         {
-            sessions[i].Close();
+            sessions()[i].Close();
             return true;
         }
     }
@@ -270,11 +293,11 @@ EncapError SessionMgr::UnregisterSession( CipUdint aSessionHandle, int aSocket )
 
     unsigned index = aSessionHandle - 1;
 
-    if( index < UDIM(sessions) )
+    if( index < UDIM(sessions()) )
     {
-        if( sessions[index].m_socket == aSocket  )
+        if( sessions()[index].m_socket == aSocket  )
         {
-            sessions[index].Close();
+            sessions()[index].Close();
             return kEncapErrorSuccess;
         }
     }
@@ -290,18 +313,18 @@ void SessionMgr::AgeInactivity()
 
     // User can effectively defeat the inactivity timer by setting the attribute
     // to a large number of seconds.
-    uint64_t timeout_usecs = CipTCPIPInterfaceInstance::inactivity_timeout_secs * 1000000;
+    uint64_t timeout_usecs = CipTCPIPInterfaceInstance::InactivityTimeoutSecs() * 1000000;
 
-    EncapSession* it  = sessions;
-    EncapSession* end = it + DIM(sessions);
+    EncapSession* it  = sessions();
+    EncapSession* end = it + DIM(sessions());
 
     for( ; it != end; ++it )
     {
         if( it->m_socket != kSocketInvalid )
         {
-            // This is positive and valid for all values of g_current_usecs, even
+            // This is positive and valid for all values of CurrentUSecs(), even
             // if it has wrapped since setting it->m_last_activity_usecs.
-            uint64_t age_usecs = g_current_usecs - it->m_last_activity_usecs;
+            uint64_t age_usecs = CurrentUSecs() - it->m_last_activity_usecs;
 
             if( age_usecs >= timeout_usecs )
             {
@@ -309,7 +332,7 @@ void SessionMgr::AgeInactivity()
                 if( it->m_is_registered )
                 {
                     // close any class3 connections associated with this TCP socket.
-                    CipUdint session_handle = (it - sessions) + 1;
+                    CipUdint session_handle = (it - sessions()) + 1;
 
                     CipConnMgrClass::CloseClass3Connections( session_handle );
                 }
@@ -324,8 +347,8 @@ void SessionMgr::AgeInactivity()
 
 void SessionMgr::Shutdown()
 {
-    EncapSession* it  = sessions;
-    EncapSession* end = it + DIM(sessions);
+    EncapSession* it  = sessions();
+    EncapSession* end = it + DIM(sessions());
 
     for( ; it != end; ++it )
     {
@@ -368,11 +391,15 @@ void Encapsulation::Init()
     srand( (unsigned) (uintptr_t) &stack_var );
 
     SessionMgr::Init();
+
+    StartDeferredServices();
 }
 
 
 void Encapsulation::ShutDown()
 {
+    StopDeferredServices();
+
     SessionMgr::Shutdown();
 }
 
@@ -600,6 +627,8 @@ int Encapsulation::registerSession( int socket, BufReader aCommand, BufWriter aR
 
 int Encapsulation::serializeListIdentityResponse( BufWriter aReply )
 {
+    const CipIdentity& id = Identity();
+
     BufWriter out = aReply;
 
     out.put16( 1 );       // Item count: one item
@@ -618,14 +647,14 @@ int Encapsulation::serializeListIdentityResponse( BufWriter aReply )
 
     .fill( 8 )
 
-    .put16( vendor_id_ ).put16( device_type_ ).put16( product_code_ )
+    .put16( id.vendor_id ).put16( id.device_type ).put16( id.product_code )
 
-    .put8( revision_.major_revision ).put8( revision_.minor_revision )
+    .put8( id.revision.major_revision ).put8( id.revision.minor_revision )
 
-    .put16( status_ )
-    .put32( serial_number_ )
+    .put16( id.status )
+    .put32( id.serial_number )
 
-    .put_SHORT_STRING( product_name_, false )
+    .put_SHORT_STRING( id.product_name, false )
 
     .put8( 0xff );      // optional STATE, not supported indicated by 0xff.
 
@@ -648,11 +677,11 @@ int Encapsulation::handleReceivedListIdentityCommandDelayed(
 {
     DelayedMsg* delayed = NULL;
 
-    for( unsigned i = 0; i < UDIM( DelayedMsg::messages );  ++i )
+    for( unsigned i = 0; i < UDIM( encap().messages );  ++i )
     {
-        if( kSocketInvalid == DelayedMsg::messages[i].socket )
+        if( kSocketInvalid == encap().messages[i].socket )
         {
-            delayed = &DelayedMsg::messages[i];
+            delayed = &encap().messages[i];
             break;
         }
     }
@@ -738,6 +767,9 @@ int Encapsulation::HandleReceivedExplicitTcpData( int aSocket,
     // kick the TCP inactivity watchdog timer for this socket
     SessionMgr::UpdateRegisteredTcpConnection( aSocket );
 
+    // the frame's temporaries go once it is answered
+    ArenaScope  temporaries( CipMessageRouterRequest::RequestArena() );
+
     Encapsulation encap;
 
     int headerz = encap.DeserializeEncap( aCommand );
@@ -837,13 +869,20 @@ int Encapsulation::HandleReceivedExplicitTcpData( int aSocket,
 
             if( ses )
             {
-                Cpf cpf( ses->m_peeraddr, encap.SessionHandle() ) ;
+                Cpf cpf( ses->m_peeraddr, encap.SessionHandle(), aSocket );
 
                 result = cpf.NotifyCommonPacketFormat(
                             command,    // past encap header (headerz)
                             reply       // past encap header (headerz)
                             );
 
+                if( cpf.Deferred() )
+                {
+                    // RunDeferredCompletions() replies once the service completes.
+                    BindDeferredService( cpf.Deferred(), aSocket, encap, cpf );
+                    return 0;
+                }
+
                 if( result < 0 )
                 {
                     encap.SetStatus( -result );
@@ -871,12 +910,18 @@ int Encapsulation::HandleReceivedExplicitTcpData( int aSocket,
 
             if( ses )
             {
-                Cpf cpf( ses->m_peeraddr, encap.SessionHandle() ) ;
+                Cpf cpf( ses->m_peeraddr, encap.SessionHandle(), aSocket );
 
                 result = cpf.NotifyConnectedCommonPacketFormat(
                             command,    // past encap header
                             reply       // past encap header
                             );
+
+                if( cpf.Deferred() )
+                {
+                    BindDeferredService( cpf.Deferred(), aSocket, encap, cpf );
+                    return 0;
+                }
             }
             else    // received a packet with non registered session handle
             {
@@ -922,6 +967,8 @@ int Encapsulation::HandleReceivedExplicitUdpData( int aSocket,
         return -1;
     }
 
+    ArenaScope  temporaries( CipMessageRouterRequest::RequestArena() );
+
     Encapsulation encap;
 
     int result = encap.DeserializeEncap( aCommand );
@@ -1056,19 +1103,13 @@ int Encapsulation::SerializedCount( int aCtl ) const
 int Encapsulation::Serialize( BufWriter aDst, int aCtl ) const
 {
     BufWriter out = aDst;
-    CipUint   len = length; // plan to adjust length based on payload
 
-    if( payload )
-    {
-        len = payload->SerializedCount( aCtl );
+    out.put16( command );
 
-        if( IsBigHdr() )
-            len += 6;
-    }
+    // back-patched below once any payload is serialized
+    BufWriter len = out.reserve( 2 );
 
-    out.put16( command )
-    .put16( len )
-    .put32( session_handle )
+    out.put32( session_handle )
     .put32( status )
     .append( (uint8_t*) sender_context, 8 )
     .put32( options );
@@ -1081,8 +1122,13 @@ int Encapsulation::Serialize( BufWriter aDst, int aCtl ) const
 
     if( payload )
     {
-        out += payload->Serialize( out, aCtl );
+        int payloadz = payload->Serialize( out, aCtl );
+
+        out += payloadz;
+        len.put16( IsBigHdr() ? payloadz + 6 : payloadz );
     }
+    else
+        len.put16( length );
 
     return out.data() - aDst.data();
 }
@@ -1133,20 +1179,20 @@ int ListIdentity::DeserializeListIdendityResponse( BufReader aInput )
 
 void ManageEncapsulationMessages()
 {
-    for( int i = 0; i < DIM( DelayedMsg::messages );  ++i )
+    for( int i = 0; i < DIM( encap().messages );  ++i )
     {
-        if( kSocketInvalid != DelayedMsg::messages[i].socket )
+        if( kSocketInvalid != encap().messages[i].socket )
         {
-            DelayedMsg::messages[i].time_out_usecs -= kCIPsterTimerTickInMicroSeconds;
+            encap().messages[i].time_out_usecs -= kCIPsterTimerTickInMicroSeconds;
 
-            if( DelayedMsg::messages[i].time_out_usecs < 0 )
+            if( encap().messages[i].time_out_usecs < 0 )
             {
                 // If delay is reached or passed, send the UDP message
-                SendUdpData( DelayedMsg::messages[i].receiver,
-                        DelayedMsg::messages[i].socket,
-                        DelayedMsg::messages[i].Payload() );
+                SendUdpData( encap().messages[i].receiver,
+                        encap().messages[i].socket,
+                        encap().messages[i].Payload() );
 
-                DelayedMsg::messages[i].socket = kSocketInvalid;
+                encap().messages[i].socket = kSocketInvalid;
             }
         }
     }
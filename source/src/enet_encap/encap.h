@@ -213,6 +213,8 @@ public:
 
     CipUint     TimeoutMS() const   { return sender_context[0] | (sender_context[1] << 8); }
 
+    void SetPayload( Cpf* aPayload )    { payload = aPayload; }
+
 protected:
 
     static int handleReceivedListServicesCommand( BufWriter aReply );
@@ -344,7 +346,7 @@ struct EncapSession
     void NoteTcpActivity()
     {
         CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, m_socket );
-        m_last_activity_usecs = g_current_usecs;    // last activity
+        m_last_activity_usecs = CurrentUSecs();    // last activity
     }
 
     int         m_socket;
@@ -441,7 +443,7 @@ public:
      * Function AgeInactivity
      * scans all open TCP connections, some of which are also registered sessions,
      * and closes those which have been inactive for greater than the
-     * CipTCPIPInterfaceInstance::inactivity_timeout_secs setting.
+     * CipTCPIPInterfaceInstance::InactivityTimeoutSecs() setting.
      * @see Vol2 2-5.5.2
      */
     static void AgeInactivity();
@@ -451,16 +453,19 @@ public:
     {
         unsigned ndx = aSessionHandle - 1;
 
-        if( ndx < UDIM(sessions) && sessions[ndx].m_socket != kSocketInvalid )
-            return &sessions[ndx];
+        if( ndx < UDIM( sessions() ) && sessions()[ndx].m_socket != kSocketInvalid )
+            return &sessions()[ndx];
 
         return NULL;
     }
 
+    typedef EncapSession Sessions[CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS];
+
 private:
 
     friend int inc_wrap( int index );
-    static EncapSession sessions[CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS];
+    /// Return the current stack's sessions.
+    static Sessions& sessions();
 };
 
 
@@ -11,42 +11,39 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <mutex>
 
 #if defined(__linux__)
  #include <unistd.h>
+ #include <sys/socket.h>
  #include <sys/time.h>
  #include <time.h>
+ #include <linux/net_tstamp.h>     // sock_txtime
+ #include <netinet/udp.h>           // UDP_SEGMENT
+ #include <sys/eventfd.h>
 #endif
 
 
 #include <cipster_api.h>
 #include <trace.h>
 #include "encap.h"
+#include "cmdqueue.h"
+#include "deferred.h"
 #include "cip/cipconnectionmanager.h"
 #include "cip/ciptcpipinterface.h"
+#include "cip/cipqos.h"
 
 
-/**
- * The number of bytes used for the Ethernet message buffer on
- * the PC port. For different platforms it may make sense to
- * have more than one buffer.
- *
- *  This buffer size will be used for any received message.
- *  The same buffer is used for the replied explicit message.
- */
-static uint8_t s_buf[CIPSTER_ETHERNET_BUFFER_SIZE];
-#define S_BUFZ                      sizeof(s_buf)
-
 #define MAX_NO_OF_TCP_SOCKETS       10
 
-static fd_set master_set;
-static fd_set read_set;
 
-// temporary file descriptor for select()
-static int highest_socket_handle;
-
-uint64_t    g_current_usecs;
-unsigned    s_last_usecs;       // only 32 needed bits here.
+// Time keeping of an I/O shard, only 32 bits needed here.  Shard 0 also
+// advances the stack's current_usecs.
+struct ShardTimer
+{
+    unsigned    last_usecs;
+    unsigned    elapsed_usecs;
+};
 
 
 struct NetworkStatus
@@ -55,17 +52,205 @@ struct NetworkStatus
     int         udp_unicast_listener;
     int         udp_local_broadcast_listener;
     int         udp_global_broadcast_listener;
-    unsigned    elapsed_time_usecs;
     unsigned    tcp_inactivity_usecs;
+    unsigned    explicit_last_usecs;        // two thread mode only
+    unsigned    explicit_elapsed_usecs;     // two thread mode only
+    int         next_tcp_socket;            // where the explicit pass resumes
+};
+
+
+/**
+ * Struct NetworkState
+ * is the network handler's share of a StackContext.
+ */
+struct NetworkState : public StackState
+{
+    NetworkState() :
+        highest_socket_handle( 0 ),
+        threaded( false ),
+        shard_count( 1 ),
+        deferred_close_count( 0 ),
+        fd_watcher( NULL ),
+        fd_watcher_context( NULL ),
+        txtime_lead_usecs( 0 ),
+        txtime_clock( 0 ),
+        gso_enabled( false )
+    {
+        for( int i = 0; i < 2; ++i )
+        {
+            wake_fds[i] = -1;
+            wake_pending[i].store( false, std::memory_order_relaxed );
+        }
+
+        FD_ZERO( &master_set );
+        FD_ZERO( &read_set );
+        memset( timers, 0, sizeof timers );
+        memset( &sockets, 0, sizeof sockets );
+    }
+
+    ~NetworkState()
+    {
+        UdpSocketMgr::DeleteAll();
+    }
+
+    /**
+     * The number of bytes used for the Ethernet message buffer on
+     * the PC port. For different platforms it may make sense to
+     * have more than one buffer.
+     *
+     *  This buffer size will be used for any received message.
+     *  The same buffer is used for the replied UDP explicit message.
+     */
+    uint8_t     buf[CIPSTER_ETHERNET_BUFFER_SIZE];
+
+    // The TCP reply, apart from the request so the message router can write
+    // a service's reply data straight into it while the request is read.
+    uint8_t     tcp_reply[CIPSTER_ETHERNET_BUFFER_SIZE];
+
+    // Each I/O shard's own receive buffer in the threaded mode, buf then
+    // belongs to the explicit messaging thread.
+    uint8_t     io_bufs[CIPSTER_MAX_IO_SHARDS][CIPSTER_ETHERNET_BUFFER_SIZE];
+
+    fd_set      master_set;
+    fd_set      read_set;
+
+    // temporary file descriptor for select()
+    int         highest_socket_handle;
+
+    ShardTimer  timers[CIPSTER_MAX_IO_SHARDS];
+
+    NetworkStatus       sockets;
+
+    ExplicitBudget      budget;
+    NetworkLoopStats    loop_stats;
+
+    // One per shard, IoLock takes all of them in index order.
+    std::recursive_mutex    io_mutex[CIPSTER_MAX_IO_SHARDS];
+
+    // Set by each thread entering ProcessShard() or ProcessExplicit() and
+    // read by all of them, so atomic.
+    std::atomic<bool>   threaded;
+    int         shard_count;
+
+    // Sessions the I/O thread wants closed, guarded by IoLock.  A session
+    // handle is an index + 1 into SessionMgr's array, so this cannot overflow.
+    CipUdint    deferred_closes[CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS];
+    int         deferred_close_count;
+
+    UdpSocketMgr::sockets   udp_sockets;
+    UdpSocketMgr::sockets   udp_multicast;  // these piggyback on a udp_sockets entry
+    UdpSocketMgr::sockets   udp_free;       // recycling bin
+
+    NetworkFdWatcher    fd_watcher;     // of an external event loop
+    void*               fd_watcher_context;
+
+    // Woken by NetworkHandlerWake(): [0] the thread which runs the I/O
+    // commands, [1] the one which runs the explicit ones.  -1 if none.
+    int                 wake_fds[2];
+    std::atomic<bool>   wake_pending[2];    // written, not yet drained
+
+    // This stack's socket tuning, see SetSocketProfile(), SetTxTimeMode() and
+    // SetUdpGsoMode().  The atomics are written from any thread and read by
+    // every I/O worker.
+    SocketProfile           profiles[2];        // indexed by SocketClass
+    std::atomic<unsigned>   txtime_lead_usecs;  // 0 when off
+    std::atomic<int>        txtime_clock;
+    std::atomic<bool>       gso_enabled;        // cleared by a worker whose send is refused
 };
 
 
-static NetworkStatus s_sockets;
+static StackStateType<NetworkState> s_network_state( kStackStateNetwork );
+
+static inline NetworkState& net()
+{
+    return StackContext::Current().State<NetworkState>( kStackStateNetwork );
+}
+
+#define S_BUFZ                      CIPSTER_ETHERNET_BUFFER_SIZE
+
+
+//-----<Threading>--------------------------------------------------------------
+
+IoLock::IoLock( bool isLocking ) :
+    m_count( isLocking ? net().shard_count : 0 )
+{
+    for( int i = 0; i < m_count; ++i )
+        net().io_mutex[i].lock();
+}
+
+
+IoLock::~IoLock()
+{
+    for( int i = m_count - 1; i >= 0; --i )
+        net().io_mutex[i].unlock();
+}
+
+
+ShardLock::ShardLock( int aShard ) :
+    m_shard( aShard )
+{
+    net().io_mutex[m_shard].lock();
+}
+
+
+ShardLock::~ShardLock()
+{
+    net().io_mutex[m_shard].unlock();
+}
+
+
+bool NetworkHandlerIsThreaded()
+{
+    return net().threaded.load( std::memory_order_relaxed );
+}
+
+
+bool SetIoShardCount( int aCount )
+{
+    if( aCount < 1 || aCount > CIPSTER_MAX_IO_SHARDS || net().threaded )
+        return false;
+
+    net().shard_count = aCount;
+    return true;
+}
+
+
+int IoShardCount()
+{
+    return net().shard_count;
+}
+
+
+int UdpSocket::Shard() const
+{
+    int shard = m_sockaddr.Port() - g_my_io_udp_port;
+
+    return shard > 0 && shard < net().shard_count ? shard : 0;
+}
+
+
+void NetworkHandlerDeferSessionClose( CipUdint aSessionHandle )
+{
+    NetworkState& n = net();
+
+    IoLock  lock;
+
+    for( int i = 0; i < n.deferred_close_count; ++i )
+    {
+        if( n.deferred_closes[i] == aSessionHandle )
+            return;
+    }
+
+    if( n.deferred_close_count < DIM( n.deferred_closes ) )
+        n.deferred_closes[n.deferred_close_count++] = aSessionHandle;
+}
+
+//-----</Threading>-------------------------------------------------------------
 
 
-std::string strerrno()
+FixedStr<128> strerrno()
 {
-    char    buf[256];
+    char    buf[128];
 
     buf[0] = 0;
 
@@ -74,7 +259,7 @@ std::string strerrno()
     // and handle both of them with this:
     uintptr_t result = (uintptr_t) strerror_r( errno, buf, sizeof buf );
 
-    return buf[0] ? buf : (char*) result;
+    return FixedStr<128>( buf[0] ? buf : (char*) result );
 
 #elif defined(_WIN32)
 
@@ -90,23 +275,23 @@ std::string strerrno()
     if( !buf[0] )
         len = snprintf( buf, sizeof buf, "%d", WSAGetLastError() );
 
-    return std::string( buf, len );
+    (void) len;
+
+    return FixedStr<128>( buf );
 #endif
 }
 
 
-/// Return a monotonically increasing usecs time that wraps around
-/// after overflow.  Just use 32 bits here, 64 bits are kept in
-/// g_current_usecs which is global.  This a cross platform concern which
-/// will make implementing this function easier under other OS's.
-static unsigned usecs_now()
+/// Return a monotonically increasing usecs time which does not wrap, the time
+/// base of NetworkHandlerNextDeadline().
+static uint64_t monotonic_usecs()
 {
 #if defined(__linux__)
     struct timespec	now;
 
     clock_gettime( CLOCK_MONOTONIC, &now );
 
-    unsigned usecs = unsigned( (unsigned long) now.tv_nsec/1000u + now.tv_sec * 1000000 );
+    return uint64_t( now.tv_sec ) * 1000000u + now.tv_nsec / 1000u;
 
 #elif defined(_WIN32)
 
@@ -131,39 +316,85 @@ static unsigned usecs_now()
 
     QueryPerformanceCounter( &performance_counter );
 
-    unsigned usecs = unsigned( performance_counter.QuadPart * 1000000 / clock.frequency );
+    uint64_t ticks = performance_counter.QuadPart;
+
+    // split so the product cannot overflow after a long uptime
+    return ticks / clock.frequency * 1000000 +
+           ticks % clock.frequency * 1000000 / clock.frequency;
 #endif
+}
 
-    return usecs;
+
+/// Return a monotonically increasing usecs time that wraps around
+/// after overflow.  Just use 32 bits here, 64 bits are kept in
+/// each StackContext's current_usecs.
+static unsigned usecs_now()
+{
+    return unsigned( monotonic_usecs() );
+}
+
+
+/// Return CLOCK_REALTIME in nanoseconds, the time base of SO_TIMESTAMPNS.
+static uint64_t realtime_nsecs()
+{
+#if defined(__linux__)
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    return uint64_t( now.tv_sec ) * 1000000000u + now.tv_nsec;
+#else
+    return 0;
+#endif
 }
 
 
 static void master_set_add( const char* aType, int aSocket )
 {
+    NetworkState& n = net();
+
     //CIPSTER_TRACE_INFO( "%s[%d]: %s socket\n", __func__, aSocket, aType );
 
     (void) aType;
 
-    FD_SET( aSocket, &master_set );
-
-    if( aSocket > highest_socket_handle )
     {
-        highest_socket_handle = aSocket;
+        // UdpSocketMgr sockets come and go on either thread in the two thread mode.
+        IoLock  lock;
+
+        FD_SET( aSocket, &n.master_set );
+
+        if( aSocket > n.highest_socket_handle )
+        {
+            n.highest_socket_handle = aSocket;
+        }
     }
+
+    if( n.fd_watcher )
+        n.fd_watcher( n.fd_watcher_context, aSocket, kNetworkFdReadable );
 }
 
 
 static void master_set_rem( int aSocket )
 {
+    NetworkState& n = net();
+
     CIPSTER_ASSERT( aSocket >= 0 );
     //CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, aSocket );
 
-    FD_CLR( aSocket, &master_set );
-
-    if( aSocket == highest_socket_handle && aSocket > 0 )
     {
-        --highest_socket_handle;
+        IoLock  lock;
+
+        FD_CLR( aSocket, &n.master_set );
+
+        if( aSocket == n.highest_socket_handle && aSocket > 0 )
+        {
+            --n.highest_socket_handle;
+        }
     }
+
+    // before the caller closes it, epoll wants it open for EPOLL_CTL_DEL
+    if( n.fd_watcher )
+        n.fd_watcher( n.fd_watcher_context, aSocket, 0 );
 }
 
 
@@ -187,611 +418,1778 @@ bool SocketAsync( int aSocket, bool isAsync )
 }
 
 
-void CloseSocket( int aSocket )
+//-----<SocketProfile>----------------------------------------------------------
+
+static bool setIntOpt( int aSocket, int aLevel, int aOption, int aValue, const char* aName )
 {
-    if( aSocket >= 0 )
+    if( setsockopt( aSocket, aLevel, aOption, (char*) &aValue, sizeof aValue ) )
     {
-        CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, aSocket );
+        CIPSTER_TRACE_WARN( "%s[%d]: %s=%d rejected: '%s'\n",
+            __func__, aSocket, aName, aValue, strerrno().c_str() );
+        return false;
+    }
 
-        master_set_rem( aSocket );
+    return true;
+}
 
-#if defined(__linux__)
-        shutdown( aSocket, SHUT_RDWR );
-        close( aSocket );
-#elif defined(_WIN32)
-        closesocket( aSocket );
-#endif
-    }
+
+static int getIntOpt( int aSocket, int aLevel, int aOption )
+{
+    int         value = -1;
+    socklen_t   len = sizeof value;
+
+    if( getsockopt( aSocket, aLevel, aOption, (char*) &value, &len ) )
+        return -1;
+
+    return value;
+}
+
+
+/// Return the IP_TOS byte for sockets of @a aClass, explicit messaging is
+/// marked with the QoS object's DSCP Explicit.
+static int profileTOS( SocketClass aClass )
+{
+    if( aClass == kSocketClassExplicit )
+        return CipQosClass::TOS( CipQosClass::DSCP_Explicit() );
+
+    return net().profiles[aClass].tos;
 }
 
 
 /**
- * Function checkSocketSet
- * checks if the given socket is set in 'read_set' and 'master_set'.
+ * Function setTOS
+ * is the only writer of IP_TOS and SO_PRIORITY.  It sets @a aTOS unless
+ * negative, then the SO_PRIORITY of @a aClass's profile, which setting
+ * IP_TOS resets on linux.
+ *
+ * @return bool - true if every option was accepted.
  */
-static bool checkSocketSet( int aSocket )
+static bool setTOS( int aSocket, int aTOS, SocketClass aClass )
 {
-    if( FD_ISSET( aSocket, &read_set ) )
-    {
-        // remove it from the read set so that later checks will not find it
-        FD_CLR( aSocket, &read_set );
+    bool ok = true;
 
-        if( FD_ISSET( aSocket, &master_set ) )
-        {
-            //CIPSTER_TRACE_INFO( "%s[%d]: true\n", __func__, aSocket );
-            return true;
-        }
+    if( aTOS >= 0 )
+        ok &= setIntOpt( aSocket, IPPROTO_IP, IP_TOS, aTOS, "IP_TOS" );
 
-        CIPSTER_TRACE_INFO( "%s[%d]: closed with pending message\n",
-            __func__, aSocket );
-    }
+#if defined(__linux__)
+    int priority = net().profiles[aClass].priority;
 
-    return false;
+    if( priority >= 0 )
+        ok &= setIntOpt( aSocket, SOL_SOCKET, SO_PRIORITY, priority, "SO_PRIORITY" );
+#endif
+
+    return ok;
 }
 
 
-void CheckAndHandleUdpUnicastSocket()
+bool ApplySocketProfile( int aSocket, SocketClass aClass )
 {
-    SockAddr    from_addr;
-    socklen_t   from_addr_length;
-
-    // see if this is an unsolicited inbound UDP message
-    if( checkSocketSet( s_sockets.udp_unicast_listener ) )
-    {
-        from_addr_length = sizeof(from_addr);
-
-        CIPSTER_TRACE_STATE(
-                "%s[%d]: unsolicited UDP message on EIP unicast socket\n",
-                __func__, s_sockets.udp_unicast_listener );
+    const SocketProfile& p = net().profiles[aClass];
 
-        // Handle UDP broadcast messages
-        int received_size = recvfrom( s_sockets.udp_unicast_listener,
-                (char*) s_buf, S_BUFZ,
-                0, from_addr,  &from_addr_length );
+    bool ok = true;
 
-        if( received_size <= 0 ) // got error
-        {
-            CIPSTER_TRACE_ERR(
-                    "%s[%d]: error on recvfrom UDP unicast socket: '%s'\n",
-                    __func__,
-                    s_sockets.udp_unicast_listener,
-                    strerrno().c_str() );
-            return;
-        }
+    if( p.rcvbuf >= 0 )
+        ok &= setIntOpt( aSocket, SOL_SOCKET, SO_RCVBUF, p.rcvbuf, "SO_RCVBUF" );
 
-        int reply_length = Encapsulation::HandleReceivedExplicitUdpData(
-                s_sockets.udp_unicast_listener, from_addr,
-                BufReader( s_buf, received_size ),
-                BufWriter( s_buf, S_BUFZ ), true );
+    if( p.sndbuf >= 0 )
+        ok &= setIntOpt( aSocket, SOL_SOCKET, SO_SNDBUF, p.sndbuf, "SO_SNDBUF" );
 
-        if( reply_length > 0 )
-        {
-            // if the active socket matches a registered UDP callback, handle a UDP packet
-            int sent_count = sendto( s_sockets.udp_unicast_listener,
-                        (char*) s_buf, reply_length, 0,
-                        from_addr, sizeof(from_addr) );
+#if defined(__linux__)
+ #if defined(SO_BUSY_POLL)
+    if( p.busy_poll_usecs >= 0 )
+        ok &= setIntOpt( aSocket, SOL_SOCKET, SO_BUSY_POLL, p.busy_poll_usecs, "SO_BUSY_POLL" );
+ #endif
+#endif
 
-            CIPSTER_TRACE_INFO( "%s[%d]: sent %d reply bytes\n",
-                __func__, s_sockets.udp_unicast_listener,  sent_count );
+    ok &= setTOS( aSocket, profileTOS( aClass ), aClass );
 
-            if( sent_count != reply_length )
-            {
-                CIPSTER_TRACE_INFO(
-                        "%s[%d]: UDP unicast response was not fully sent\n",
-                        __func__, s_sockets.udp_unicast_listener );
-            }
-        }
-    }
+    return ok;
 }
 
 
-/**
- * Function CheckAndHandlTcpListernetSocket
- * handles any connection request coming in the TCP server socket.
- */
-void CheckAndHandleTcpListenerSocket()
+bool ReadSocketProfile( int aSocket, SocketProfile* aResult )
 {
-    int new_socket;
+    if( aSocket < 0 )
+        return false;
 
-    // see if this is a connection request to the dedicated "tcp_listener"
-    if( checkSocketSet( s_sockets.tcp_listener ) )
-    {
-        new_socket = accept( s_sockets.tcp_listener, NULL, NULL );
+    *aResult = SocketProfile();
 
-        CIPSTER_TRACE_INFO( "%s[%d]: new TCP connection\n", __func__, new_socket );
+    aResult->rcvbuf = getIntOpt( aSocket, SOL_SOCKET, SO_RCVBUF );
+    aResult->sndbuf = getIntOpt( aSocket, SOL_SOCKET, SO_SNDBUF );
 
-        if( new_socket == kSocketInvalid )
-        {
-            CIPSTER_TRACE_ERR( "%s[%d]: error on accept: %s\n",
-                    __func__, s_sockets.tcp_listener, strerrno().c_str() );
-            return;
-        }
+#if defined(__linux__)
+ #if defined(SO_BUSY_POLL)
+    aResult->busy_poll_usecs = getIntOpt( aSocket, SOL_SOCKET, SO_BUSY_POLL );
+ #endif
+#endif
 
-        EncapError result = SessionMgr::RegisterTcpConnection( new_socket );
+    aResult->tos = getIntOpt( aSocket, IPPROTO_IP, IP_TOS );
 
-        if( result != kEncapErrorSuccess )
-        {
-            CIPSTER_TRACE_ERR(
-                "%s[%d]: rejecting incoming TCP connection since count exceeds\n"
-                " CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS (= %d)\n",
-                __func__, new_socket,
-                CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS
-                );
-            return;
-        }
+#if defined(__linux__)
+    aResult->priority = getIntOpt( aSocket, SOL_SOCKET, SO_PRIORITY );
+#endif
 
-        master_set_add( "TCP", new_socket );
-    }
+    return true;
 }
 
 
-/*
+bool UdpSocket::SetTOS( int aTOS )
+{
+    // multicast groups share the fd of their underlying socket, so cache there.
+    UdpSocket* s = m_underlying ? m_underlying : this;
 
-    Vol2 2-2:
-    Whenever UDP is used to send an encapsulated message, the entire
-    message shall be sent in a single UDP packet. Only one encapsulated
-    message shall be present in a single UDP packet destined to UDP port
-    0xAF12.
+    if( s->m_tos == aTOS )
+        return true;
 
-*/
+    if( !setTOS( m_socket, aTOS, kSocketClassIo ) )
+        return false;
 
+    s->m_tos = aTOS;
+    return true;
+}
 
-/**
- * Function CheckAndHandleUdpLocalBroadcastSocket
- * checks if data has been received on the UDP broadcast socket and if
- * yes handles it correctly.
- */
-void CheckAndHandleUdpLocalBroadcastSocket()
-{
-    SockAddr    from_addr;
-    socklen_t   from_addr_length;
 
-    // see if this is an unsolicited inbound UDP message
-    if( checkSocketSet( s_sockets.udp_local_broadcast_listener ) )
+int UdpSocket::Recv( SockAddr* aAddr, const BufWriter& aWriter, uint64_t* aRxNSecs )
+{
+#if defined(__linux__)
+    if( aRxNSecs )
     {
-        from_addr_length = sizeof(from_addr);
+        iovec   iov;
+        msghdr  msg;
 
-        CIPSTER_TRACE_STATE(
-            "%s[%d]: unsolicited UDP on local broadcast socket\n",
-            __func__,
-            s_sockets.udp_local_broadcast_listener
-            );
+        union {
+            cmsghdr align;
+            uint8_t buf[CMSG_SPACE( sizeof(timespec) )];
+        } control;
 
-        // Handle UDP broadcast messages
-        int received_size = recvfrom( s_sockets.udp_local_broadcast_listener,
-                (char*) s_buf,  S_BUFZ, 0,
-                from_addr, &from_addr_length );
+        iov.iov_base = aWriter.data();
+        iov.iov_len  = aWriter.capacity();
 
-        if( received_size <= 0 ) // got error
-        {
-            CIPSTER_TRACE_ERR(
-                    "%s[%d]: error on recvfrom UDP local broadcast socket: '%s'\n",
-                    __func__,
-                    s_sockets.udp_local_broadcast_listener,
-                    strerrno().c_str() );
-            return;
-        }
+        memset( &msg, 0, sizeof msg );
+        msg.msg_name       = (sockaddr*) *aAddr;
+        msg.msg_namelen    = SADDRZ;
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof control.buf;
 
-        int reply_length = Encapsulation::HandleReceivedExplicitUdpData(
-                s_sockets.udp_local_broadcast_listener, from_addr,
-                BufReader( s_buf, received_size ),
-                BufWriter( s_buf, S_BUFZ ), false );
+        int byte_count = recvmsg( m_socket, &msg, 0 );
 
-        if( reply_length > 0 )
+        if( byte_count > 0 )
         {
-            // if the active socket matches a registered UDP callback, handle a UDP packet
-            int sent_count = sendto( s_sockets.udp_local_broadcast_listener,
-                        (char*) s_buf, reply_length, 0,
+            *aRxNSecs = 0;
+
+            for( cmsghdr* c = CMSG_FIRSTHDR( &msg );  c;  c = CMSG_NXTHDR( &msg, c ) )
+            {
+                if( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPNS )
+                {
+                    timespec ts;
+                    memcpy( &ts, CMSG_DATA( c ), sizeof ts );
+                    *aRxNSecs = uint64_t( ts.tv_sec ) * 1000000000u + ts.tv_nsec;
+                    break;
+                }
+            }
+
+            if( !*aRxNSecs )
+                *aRxNSecs = realtime_nsecs();
+        }
+
+        return byte_count;
+    }
+#endif
+
+    socklen_t   from_addr_length = SADDRZ;
+
+    int byte_count = recvfrom( m_socket, (char*) aWriter.data(), aWriter.capacity(), 0,
+                *aAddr, &from_addr_length );
+
+    if( aRxNSecs )
+        *aRxNSecs = realtime_nsecs();
+
+    return byte_count;
+}
+
+
+const SocketProfile& GetSocketProfile( SocketClass aClass )
+{
+    return net().profiles[aClass];
+}
+
+
+void SetSocketProfile( SocketClass aClass, const SocketProfile& aProfile )
+{
+    NetworkState& n = net();
+
+    // the I/O workers open and close these sockets under their ShardLock
+    IoLock  lock;
+
+    n.profiles[aClass] = aProfile;
+
+    if( aClass == kSocketClassIo )
+    {
+        UdpSocketMgr::sockets& all = UdpSocketMgr::GetAllSockets();
+
+        for( UdpSocketMgr::sock_iter it = all.begin();  it != all.end();  ++it )
+        {
+            ApplySocketProfile( (*it)->h(), aClass );
+            (*it)->ForgetTOS();
+        }
+    }
+    else
+    {
+        // skip listeners not yet opened by NetworkHandlerInitialize()
+        int listeners[] = {
+            n.sockets.tcp_listener,
+            n.sockets.udp_unicast_listener,
+            n.sockets.udp_local_broadcast_listener,
+            n.sockets.udp_global_broadcast_listener,
+        };
+
+        for( unsigned i = 0;  i < sizeof(listeners)/sizeof(listeners[0]);  ++i )
+        {
+            if( listeners[i] > 0 )
+                ApplySocketProfile( listeners[i], aClass );
+        }
+    }
+}
+
+//-----</SocketProfile>---------------------------------------------------------
+
+
+//-----<TxTime>-----------------------------------------------------------------
+
+static bool enableTxTime( int aSocket )
+{
+#if defined(__linux__) && defined(SO_TXTIME)
+    sock_txtime cfg;
+
+    cfg.clockid = net().txtime_clock.load( std::memory_order_relaxed );
+    cfg.flags   = 0;
+
+    if( setsockopt( aSocket, SOL_SOCKET, SO_TXTIME, &cfg, sizeof cfg ) )
+    {
+        CIPSTER_TRACE_ERR( "%s[%d]: SO_TXTIME errno: '%s'\n",
+            __func__, aSocket, strerrno().c_str() );
+        return false;
+    }
+
+    return true;
+#else
+    (void) aSocket;
+    return false;
+#endif
+}
+
+
+bool SetTxTimeMode( bool isEnabled, unsigned aLeadUSecs, bool isClockTai )
+{
+    NetworkState& n = net();
+
+    n.txtime_lead_usecs.store( 0, std::memory_order_relaxed );
+
+    if( !isEnabled )
+    {
+        // Sockets keep SO_TXTIME, but without SCM_TXTIME on a send the
+        // kernel does not delay the frame.
+        return true;
+    }
+
+#if defined(__linux__) && defined(SO_TXTIME)
+    n.txtime_clock.store( isClockTai ? CLOCK_TAI : CLOCK_MONOTONIC,
+            std::memory_order_relaxed );
+
+    // the I/O workers open and close these sockets under their ShardLock
+    IoLock  lock;
+
+    UdpSocketMgr::sockets& all = UdpSocketMgr::GetAllSockets();
+
+    for( UdpSocketMgr::sock_iter it = all.begin();  it != all.end();  ++it )
+    {
+        if( !enableTxTime( (*it)->h() ) )
+            return false;
+    }
+
+    // after the clock, which TxTimeLaunchNSecs() reads once this is on
+    n.txtime_lead_usecs.store( aLeadUSecs ? aLeadUSecs : kCIPsterTimerTickInMicroSeconds,
+            std::memory_order_release );
+    return true;
+#else
+    (void) aLeadUSecs;
+    (void) isClockTai;
+    return false;
+#endif
+}
+
+
+unsigned TxTimeLeadUSecs()
+{
+    return net().txtime_lead_usecs.load( std::memory_order_acquire );
+}
+
+
+uint64_t TxTimeLaunchNSecs( int32_t aDueUSecs )
+{
+#if defined(__linux__)
+    struct timespec now;
+
+    clock_gettime( net().txtime_clock.load( std::memory_order_relaxed ), &now );
+
+    uint64_t nsecs = uint64_t( now.tv_sec ) * 1000000000u + now.tv_nsec;
+
+    // a launch time in the past is dropped by etf, so never go before now.
+    if( aDueUSecs > 0 )
+        nsecs += uint64_t( aDueUSecs ) * 1000u;
+
+    return nsecs;
+#else
+    (void) aDueUSecs;
+    return 0;
+#endif
+}
+
+//-----</TxTime>----------------------------------------------------------------
+
+
+//-----<UdpGso>-----------------------------------------------------------------
+
+// Linux kernels before 5.x accept at most 64 segments per GSO send.
+#define GSO_MAX_SEGMENTS            64
+#define GSO_MAX_BYTES               65507
+
+struct UdpGsoBatch
+{
+    UdpSocket*  socket;
+    int         tos;
+    SockAddr    addr;
+    unsigned    segment_size;
+    unsigned    count;
+    uint16_t    offsets[GSO_MAX_SEGMENTS];  // of its frames in UdpGsoShard::pool
+};
+
+// The open batches of one producing thread, their frames share one pool.
+struct UdpGsoShard
+{
+    UdpGsoBatch batches[CIPSTER_GSO_BATCHES];
+    unsigned    batch_count;
+    unsigned    pool_used;
+    uint8_t     pool[GSO_MAX_BYTES];
+};
+
+// A StackState of its own so stacks which never batch do not carry it.
+struct UdpGsoState : public StackState
+{
+    UdpGsoShard shards[CIPSTER_MAX_IO_SHARDS];
+};
+
+
+static StackStateType<UdpGsoState> s_udp_gso_state( kStackStateUdpGso );
+
+static inline UdpGsoShard* gsos()
+{
+    return StackContext::Current().State<UdpGsoState>( kStackStateUdpGso ).shards;
+}
+
+bool SetUdpGsoMode( bool isEnabled )
+{
+    // the workers queue into their shard's pool under its ShardLock
+    IoLock  lock;
+
+    for( int i = 0; i < net().shard_count; ++i )
+        UdpGsoFlush( i );
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    net().gso_enabled.store( isEnabled, std::memory_order_relaxed );
+    return true;
+#else
+    net().gso_enabled.store( false, std::memory_order_relaxed );
+    return !isEnabled;
+#endif
+}
+
+
+bool UdpGsoMode()
+{
+    return net().gso_enabled.load( std::memory_order_relaxed );
+}
+
+
+EipStatus UdpGsoQueue( UdpSocket* aSocket, int aTOS, const SockAddr& aAddr,
+        BufReader aFrame, int aShard )
+{
+    UdpGsoShard& gso = gsos()[aShard];
+
+    if( gso.pool_used + aFrame.size() > sizeof gso.pool )
+        UdpGsoFlush( aShard );
+
+    UdpGsoBatch* b = NULL;
+
+    for( unsigned i = 0;  i < gso.batch_count;  ++i )
+    {
+        UdpGsoBatch& open = gso.batches[i];
+
+        if( open.socket == aSocket
+         && open.tos == aTOS
+         && open.addr == aAddr
+         && open.segment_size == aFrame.size()
+         && open.count < GSO_MAX_SEGMENTS
+         && (open.count + 1) * aFrame.size() <= GSO_MAX_BYTES )
+        {
+            b = &open;
+            break;
+        }
+    }
+
+    if( !b )
+    {
+        if( gso.batch_count == CIPSTER_GSO_BATCHES )
+            UdpGsoFlush( aShard );
+
+        b = &gso.batches[gso.batch_count++];
+
+        b->socket = aSocket;
+        b->tos    = aTOS;
+        b->addr   = aAddr;
+        b->segment_size = aFrame.size();
+        b->count  = 0;
+    }
+
+    b->offsets[b->count++] = gso.pool_used;
+
+    memcpy( gso.pool + gso.pool_used, aFrame.data(), aFrame.size() );
+    gso.pool_used += aFrame.size();
+
+    return kEipStatusOk;
+}
+
+
+/// Send the frames of @a aBatch, which lie in @a aPool.
+static EipStatus sendBatch( const UdpGsoBatch& aBatch, const uint8_t* aPool )
+{
+    unsigned    count = aBatch.count;
+    unsigned    size  = aBatch.segment_size;
+    UdpSocket*  s     = aBatch.socket;
+
+    s->SetTOS( aBatch.tos );
+
+    if( count == 1 )
+        return s->Send( aBatch.addr, BufReader( aPool + aBatch.offsets[0], size ) );
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    if( UdpGsoMode() )
+    {
+        iovec   iov[GSO_MAX_SEGMENTS];
+        msghdr  msg;
+
+        union {
+            cmsghdr align;
+            uint8_t buf[CMSG_SPACE( sizeof(uint16_t) )];
+        } control;
+
+        for( unsigned i = 0;  i < count;  ++i )
+        {
+            iov[i].iov_base = (void*) ( aPool + aBatch.offsets[i] );
+            iov[i].iov_len  = size;
+        }
+
+        memset( &msg, 0, sizeof msg );
+        msg.msg_name       = (sockaddr*) aBatch.addr;
+        msg.msg_namelen    = SADDRZ;
+        msg.msg_iov        = iov;
+        msg.msg_iovlen     = count;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+
+        cmsghdr* c = CMSG_FIRSTHDR( &msg );
+
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type  = UDP_SEGMENT;
+        c->cmsg_len   = CMSG_LEN( sizeof(uint16_t) );
+
+        uint16_t gso_size = size;
+        memcpy( CMSG_DATA( c ), &gso_size, sizeof gso_size );
+
+        int sent_count = sendmsg( s->h(), &msg, 0 );
+
+        if( sent_count == int( count * size ) )
+            return kEipStatusOk;
+
+        int error = errno;
+
+        // Only these say the kernel or NIC cannot segment, others pass.
+        if( error == EINVAL || error == EOPNOTSUPP || error == EIO )
+        {
+            CIPSTER_TRACE_ERR( "%s[%d]: UDP_SEGMENT send of %u x %u refused: '%s', GSO off\n",
+                __func__, s->h(), count, size, strerrno().c_str() );
+
+            net().gso_enabled.store( false, std::memory_order_relaxed );
+        }
+        else
+        {
+            CIPSTER_TRACE_WARN( "%s[%d]: UDP_SEGMENT send of %u x %u failed: '%s'\n",
+                __func__, s->h(), count, size, strerrno().c_str() );
+        }
+    }
+#endif
+
+    // send them one at a time
+    EipStatus result = kEipStatusOk;
+
+    for( unsigned i = 0;  i < count;  ++i )
+    {
+        if( s->Send( aBatch.addr, BufReader( aPool + aBatch.offsets[i], size ) ) != kEipStatusOk )
+            result = kEipStatusError;
+    }
+
+    return result;
+}
+
+
+EipStatus UdpGsoFlush( int aShard )
+{
+    UdpGsoState* state = StackContext::Current().Find<UdpGsoState>( kStackStateUdpGso );
+
+    if( !state || !state->shards[aShard].batch_count )
+        return kEipStatusOk;
+
+    UdpGsoShard& gso = state->shards[aShard];
+
+    EipStatus result = kEipStatusOk;
+
+    for( unsigned i = 0;  i < gso.batch_count;  ++i )
+    {
+        if( sendBatch( gso.batches[i], gso.pool ) != kEipStatusOk )
+            result = kEipStatusError;
+    }
+
+    gso.batch_count = 0;
+    gso.pool_used   = 0;
+
+    return result;
+}
+
+//-----</UdpGso>----------------------------------------------------------------
+
+
+void CloseSocket( int aSocket )
+{
+    if( aSocket >= 0 )
+    {
+        CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, aSocket );
+
+        master_set_rem( aSocket );
+
+#if defined(__linux__)
+        shutdown( aSocket, SHUT_RDWR );
+        close( aSocket );
+#elif defined(_WIN32)
+        closesocket( aSocket );
+#endif
+    }
+}
+
+
+/**
+ * Function checkSocketSet
+ * checks if the given socket is set in @a aReadSet and 'master_set'.
+ */
+static bool checkSocketSet( int aSocket, fd_set* aReadSet = &net().read_set )
+{
+    if( FD_ISSET( aSocket, aReadSet ) )
+    {
+        // remove it from the read set so that later checks will not find it
+        FD_CLR( aSocket, aReadSet );
+
+        if( FD_ISSET( aSocket, &net().master_set ) )
+        {
+            //CIPSTER_TRACE_INFO( "%s[%d]: true\n", __func__, aSocket );
+            return true;
+        }
+
+        CIPSTER_TRACE_INFO( "%s[%d]: closed with pending message\n",
+            __func__, aSocket );
+    }
+
+    return false;
+}
+
+
+void CheckAndHandleUdpUnicastSocket()
+{
+    NetworkState& n = net();
+
+    SockAddr    from_addr;
+    socklen_t   from_addr_length;
+
+    // see if this is an unsolicited inbound UDP message
+    if( checkSocketSet( n.sockets.udp_unicast_listener ) )
+    {
+        from_addr_length = sizeof(from_addr);
+
+        CIPSTER_TRACE_STATE(
+                "%s[%d]: unsolicited UDP message on EIP unicast socket\n",
+                __func__, n.sockets.udp_unicast_listener );
+
+        // Handle UDP broadcast messages
+        int received_size = recvfrom( n.sockets.udp_unicast_listener,
+                (char*) n.buf, S_BUFZ,
+                0, from_addr,  &from_addr_length );
+
+        if( received_size <= 0 ) // got error
+        {
+            CIPSTER_TRACE_ERR(
+                    "%s[%d]: error on recvfrom UDP unicast socket: '%s'\n",
+                    __func__,
+                    n.sockets.udp_unicast_listener,
+                    strerrno().c_str() );
+            return;
+        }
+
+        int reply_length = Encapsulation::HandleReceivedExplicitUdpData(
+                n.sockets.udp_unicast_listener, from_addr,
+                BufReader( n.buf, received_size ),
+                BufWriter( n.buf, S_BUFZ ), true );
+
+        if( reply_length > 0 )
+        {
+            // if the active socket matches a registered UDP callback, handle a UDP packet
+            int sent_count = sendto( n.sockets.udp_unicast_listener,
+                        (char*) n.buf, reply_length, 0,
                         from_addr, sizeof(from_addr) );
 
             CIPSTER_TRACE_INFO( "%s[%d]: sent %d reply bytes\n",
-                __func__, s_sockets.udp_local_broadcast_listener, sent_count );
+                __func__, n.sockets.udp_unicast_listener,  sent_count );
 
             if( sent_count != reply_length )
             {
                 CIPSTER_TRACE_INFO(
-                    "%s[%d]: UDP response was not fully sent\n",
-                    __func__, s_sockets.udp_local_broadcast_listener );
+                        "%s[%d]: UDP unicast response was not fully sent\n",
+                        __func__, n.sockets.udp_unicast_listener );
+            }
+        }
+    }
+}
+
+
+/**
+ * Function CheckAndHandlTcpListernetSocket
+ * handles any connection request coming in the TCP server socket.
+ */
+void CheckAndHandleTcpListenerSocket()
+{
+    NetworkState& n = net();
+
+    int new_socket;
+
+    // see if this is a connection request to the dedicated "tcp_listener"
+    if( checkSocketSet( n.sockets.tcp_listener ) )
+    {
+        new_socket = accept( n.sockets.tcp_listener, NULL, NULL );
+
+        CIPSTER_TRACE_INFO( "%s[%d]: new TCP connection\n", __func__, new_socket );
+
+        if( new_socket == kSocketInvalid )
+        {
+            CIPSTER_TRACE_ERR( "%s[%d]: error on accept: %s\n",
+                    __func__, n.sockets.tcp_listener, strerrno().c_str() );
+            return;
+        }
+
+        EncapError result = SessionMgr::RegisterTcpConnection( new_socket );
+
+        if( result != kEncapErrorSuccess )
+        {
+            CIPSTER_TRACE_ERR(
+                "%s[%d]: rejecting incoming TCP connection since count exceeds\n"
+                " CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS (= %d)\n",
+                __func__, new_socket,
+                CIPSTER_NUMBER_OF_SUPPORTED_SESSIONS
+                );
+            return;
+        }
+
+        ApplySocketProfile( new_socket, kSocketClassExplicit );
+
+        master_set_add( "TCP", new_socket );
+    }
+}
+
+
+/*
+
+    Vol2 2-2:
+    Whenever UDP is used to send an encapsulated message, the entire
+    message shall be sent in a single UDP packet. Only one encapsulated
+    message shall be present in a single UDP packet destined to UDP port
+    0xAF12.
+
+*/
+
+
+/**
+ * Function CheckAndHandleUdpLocalBroadcastSocket
+ * checks if data has been received on the UDP broadcast socket and if
+ * yes handles it correctly.
+ */
+void CheckAndHandleUdpLocalBroadcastSocket()
+{
+    NetworkState& n = net();
+
+    SockAddr    from_addr;
+    socklen_t   from_addr_length;
+
+    // see if this is an unsolicited inbound UDP message
+    if( checkSocketSet( n.sockets.udp_local_broadcast_listener ) )
+    {
+        from_addr_length = sizeof(from_addr);
+
+        CIPSTER_TRACE_STATE(
+            "%s[%d]: unsolicited UDP on local broadcast socket\n",
+            __func__,
+            n.sockets.udp_local_broadcast_listener
+            );
+
+        // Handle UDP broadcast messages
+        int received_size = recvfrom( n.sockets.udp_local_broadcast_listener,
+                (char*) n.buf,  S_BUFZ, 0,
+                from_addr, &from_addr_length );
+
+        if( received_size <= 0 ) // got error
+        {
+            CIPSTER_TRACE_ERR(
+                    "%s[%d]: error on recvfrom UDP local broadcast socket: '%s'\n",
+                    __func__,
+                    n.sockets.udp_local_broadcast_listener,
+                    strerrno().c_str() );
+            return;
+        }
+
+        int reply_length = Encapsulation::HandleReceivedExplicitUdpData(
+                n.sockets.udp_local_broadcast_listener, from_addr,
+                BufReader( n.buf, received_size ),
+                BufWriter( n.buf, S_BUFZ ), false );
+
+        if( reply_length > 0 )
+        {
+            // if the active socket matches a registered UDP callback, handle a UDP packet
+            int sent_count = sendto( n.sockets.udp_local_broadcast_listener,
+                        (char*) n.buf, reply_length, 0,
+                        from_addr, sizeof(from_addr) );
+
+            CIPSTER_TRACE_INFO( "%s[%d]: sent %d reply bytes\n",
+                __func__, n.sockets.udp_local_broadcast_listener, sent_count );
+
+            if( sent_count != reply_length )
+            {
+                CIPSTER_TRACE_INFO(
+                    "%s[%d]: UDP response was not fully sent\n",
+                    __func__, n.sockets.udp_local_broadcast_listener );
+            }
+        }
+    }
+}
+
+
+void CheckAndHandleUdpGlobalBroadcastSocket()
+{
+    NetworkState& n = net();
+
+    SockAddr    from_addr;
+    socklen_t   from_addr_length;
+
+    // see if this is an unsolicited inbound UDP message
+    if( checkSocketSet( n.sockets.udp_global_broadcast_listener ) )
+    {
+        from_addr_length = sizeof(from_addr);
+
+        CIPSTER_TRACE_STATE(
+            "%s[%d]: unsolicited UDP on global broadcast socket\n",
+            __func__, n.sockets.udp_global_broadcast_listener );
+
+        // Handle UDP broadcast messages
+        int received_size = recvfrom( n.sockets.udp_global_broadcast_listener,
+                (char*) n.buf, S_BUFZ, 0,
+                from_addr, &from_addr_length );
+
+        if( received_size <= 0 ) // got error
+        {
+            CIPSTER_TRACE_ERR(
+                "%s[%d]: error on recvfrom UDP global broadcast socket: '%s'\n",
+                __func__,
+                n.sockets.udp_global_broadcast_listener,
+                strerrno().c_str() );
+
+            return;
+        }
+
+        CIPSTER_TRACE_INFO( "%s[%d]: %d bytes received on global broadcast UDP\n",
+            __func__, n.sockets.udp_global_broadcast_listener, received_size );
+
+        int reply_length = Encapsulation::HandleReceivedExplicitUdpData(
+                n.sockets.udp_global_broadcast_listener, from_addr,
+                BufReader( n.buf, received_size ),
+                BufWriter( n.buf, S_BUFZ ), false );
+
+        if( reply_length > 0 )
+        {
+            // if the active socket matches a registered UDP callback, handle a UDP packet
+            int sent_count = sendto( n.sockets.udp_global_broadcast_listener,
+                        (char*) n.buf, reply_length, 0,
+                        from_addr, SADDRZ );
+
+            CIPSTER_TRACE_INFO( "%s[%d]: sent %d reply bytes\n",
+                __func__, n.sockets.udp_global_broadcast_listener, sent_count );
+
+            if( sent_count != reply_length )
+            {
+                CIPSTER_TRACE_INFO(
+                        "%s[%d]: UDP response was not fully sent\n",
+                        __func__, n.sockets.udp_global_broadcast_listener );
+            }
+        }
+    }
+}
+
+
+/**
+ * Function checkAndHandleUdpSockets
+ * checks all open UDP sockets for inbound data, and passes any packets
+ * up to RecvConnectedData() for filtering.
+ *
+ * @param aReadSet is what select() returned.
+ * @param aBuf is a CIPSTER_ETHERNET_BUFFER_SIZE receive buffer.
+ */
+static void checkAndHandleUdpSockets( fd_set* aReadSet, uint8_t* aBuf )
+{
+    /*
+        We can get garbage in on any open UDP socket and it must be dealt with
+        by draining it and perhaps tossing it. Merely accepting data from
+        sockets associated with consuming connections is not correct, this will
+        screw up the caller's assumption that anything still in read_set is a
+        TCP connection.
+
+        Also, unless we drain what we've received, TCP stack buffers can get
+        exhausted.
+    */
+
+    UdpSocketMgr::sockets& all = UdpSocketMgr::GetAllSockets(); // UDP only
+
+    SockAddr    from_addr;
+    uint64_t    rx_nsecs;
+
+    for( UdpSocketMgr::sock_iter it = all.begin();  it != all.end();  ++it )
+    {
+        UdpSocket*  s = *it;
+
+        if( checkSocketSet( s->h(), aReadSet ) )
+        {
+            //CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, s->h() );
+
+            // Since it is non-blocking, call Recv() until
+            // byte_count is <= 0.  Keep socket open for every case.
+
+            // Drain each UDP socket up to some limit you can choose.
+            // This strategy contemplates that somebody might be bombing us,
+            // maybe even maliciously.  Anything we don't fetch out now
+            // will likely still be there on the next call to
+            // NetworkHandlerProcessOnce().
+            int limit = 64 * s->RefCount();
+
+            int attempt;
+            for( attempt = 0;  attempt < limit;  ++attempt )
+            {
+                int byte_count = s->Recv( &from_addr,
+                        BufWriter( aBuf, CIPSTER_ETHERNET_BUFFER_SIZE ), &rx_nsecs );
+
+                if( byte_count <= 0 )
+                {
+                    if( errno != EAGAIN && errno != EWOULDBLOCK )
+                    {
+                        CIPSTER_TRACE_ERR( "%s[%d]: errno: '%s'\n",
+                            __func__, s->h(), strerrno().c_str() );
+                    }
+
+                    break;
+                }
+
+                CipConnMgrClass::RecvConnectedData(
+                    s, from_addr, BufReader( aBuf, byte_count ), rx_nsecs );
             }
+
+            if( attempt && attempt == limit )
+            {
+                CIPSTER_TRACE_ERR( "%s[%d]: too much inbound UDP traffic\n",
+                    __func__, s->h() );
+            }
+        }
+    }
+}
+
+
+/**
+ * Function HandleDataOnTcpSocket
+ */
+EipStatus HandleDataOnTcpSocket( int aSocket )
+{
+    NetworkState& n = net();
+
+    int num_read = Encapsulation::ReceiveTcpMsg( aSocket,
+                        BufWriter( n.buf, sizeof n.buf ) );
+
+    //CIPSTER_TRACE_INFO( "%s[%d]: num_read:%d\n", __func__, aSocket, num_read );
+
+    if( num_read < ENCAPSULATION_HEADER_LENGTH )
+    {
+        return kEipStatusError;
+    }
+
+    int replyz = Encapsulation::HandleReceivedExplicitTcpData( aSocket,
+                        BufReader( n.buf, num_read ),
+                        BufWriter( n.tcp_reply, sizeof n.tcp_reply ) );
+
+    if( replyz > 0 )
+    {
+#if defined(DEBUG) && 0
+        byte_dump( "sTCP", n.tcp_reply, replyz );
+#endif
+        int sent_count = send( aSocket, (char*) n.tcp_reply, replyz, 0 );
+
+        CIPSTER_TRACE_INFO( "%s[%d]: replied with %d bytes\n",
+                __func__, aSocket, sent_count );
+
+        if( sent_count != replyz )
+        {
+            CIPSTER_TRACE_WARN( "%s[%d]: TCP response was not fully sent\n",
+                    __func__, aSocket );
+        }
+
+        return kEipStatusOk;
+    }
+
+    else if( replyz == 0 )
+    {
+        CIPSTER_TRACE_INFO(
+            "%s[%d]: 0 length reply from HandleReceivedExplicitTcpData()\n",
+            __func__, aSocket );
+
+        return kEipStatusOk;
+    }
+
+    else
+    {
+        CIPSTER_TRACE_INFO(
+            "%s[%d]: < 0 length reply from HandleReceivedExplicitTcpData()\n",
+            __func__, aSocket );
+
+        return kEipStatusError;
+    }
+}
+
+
+//-----<Wake>-------------------------------------------------------------------
+
+/// Open the descriptor of NetworkHandlerWake(), -1 where there is none and
+/// posted commands wait for the next timer tick.
+static int openWakeFd()
+{
+#if defined(__linux__)
+    int fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+    if( fd < 0 )
+    {
+        CIPSTER_TRACE_ERR( "%s: eventfd errno: '%s'\n", __func__, strerrno().c_str() );
+    }
+
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+
+void NetworkHandlerWake( bool isExplicit )
+{
+    // Any thread may post, so do not create the state here.
+    NetworkState* n = StackContext::Current().Find<NetworkState>( kStackStateNetwork );
+
+    int which = isExplicit ? 1 : 0;
+
+    if( !n || n->wake_fds[which] < 0 )
+        return;
+
+    // One write until the waiter drains it, however many commands follow.
+    if( n->wake_pending[which].exchange( true ) )
+        return;
+
+#if defined(__linux__)
+    uint64_t one = 1;
+
+    if( write( n->wake_fds[which], &one, sizeof one ) != sizeof one )
+    {
+        CIPSTER_TRACE_ERR( "%s: write errno: '%s'\n", __func__, strerrno().c_str() );
+    }
+#endif
+}
+
+
+/// Return the index into NetworkState::wake_fds of @a aSocket, or -1.
+static int wakeIndex( const NetworkState& n, int aSocket )
+{
+    for( int i = 0; i < 2; ++i )
+    {
+        if( aSocket >= 0 && aSocket == n.wake_fds[i] )
+            return i;
+    }
+
+    return -1;
+}
+
+
+/// Consume wake fd @a aWhich, before running what was posted to its queue.
+static void drainWake( NetworkState& n, int aWhich )
+{
+    n.wake_pending[aWhich].store( false );
+
+#if defined(__linux__)
+    uint64_t count;
+
+    if( read( n.wake_fds[aWhich], &count, sizeof count ) < 0 && errno != EAGAIN )
+    {
+        CIPSTER_TRACE_ERR( "%s: read errno: '%s'\n", __func__, strerrno().c_str() );
+    }
+#endif
+}
+
+//-----</Wake>------------------------------------------------------------------
+
+
+EipStatus NetworkHandlerInitialize()
+{
+    NetworkState& n = net();
+
+#if defined(_WIN32)
+    WORD    wVersionRequested;
+    WSADATA wsaData;
+
+    wVersionRequested = MAKEWORD(2, 2);
+
+    WSAStartup( wVersionRequested, &wsaData );
+#endif
+
+    static const int one = 1;
+
+    const CipTcpIpInterfaceConfiguration& c = CipTCPIPInterfaceClass::InterfaceConf(1);
+
+    // clear the master and temp sets
+    FD_ZERO( &n.master_set );
+    FD_ZERO( &n.read_set );
+
+    n.sockets.tcp_listener = -1;
+    n.sockets.udp_unicast_listener = -1;
+    n.sockets.udp_local_broadcast_listener = -1;
+    n.sockets.udp_global_broadcast_listener = -1;
+
+    for( int i = 0; i < 2; ++i )
+    {
+        if( n.wake_fds[i] < 0 )
+            n.wake_fds[i] = openWakeFd();
+
+        if( n.wake_fds[i] >= 0 && n.fd_watcher )
+            n.fd_watcher( n.fd_watcher_context, n.wake_fds[i], kNetworkFdReadable );
+    }
+
+    //-----<tcp_listener>-------------------------------------------
+
+    // create a new TCP socket
+    n.sockets.tcp_listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+
+    CIPSTER_TRACE_INFO( "n.sockets.tcp_listener == %d\n", n.sockets.tcp_listener );
+
+    if( n.sockets.tcp_listener == -1 )
+    {
+        CIPSTER_TRACE_ERR( "error allocating socket stream listener, %d\n", errno );
+        goto error;
+    }
+
+    // Activates address reuse
+    if( setsockopt( n.sockets.tcp_listener, SOL_SOCKET, SO_REUSEADDR,
+                (char*) &one, sizeof(one) ) )
+    {
+        CIPSTER_TRACE_ERR(
+                "error setting socket option SO_REUSEADDR on tcp_listener\n" );
+        goto error;
+    }
+
+    {
+        SockAddr address( kEIP_Reserved_Port, ntohl( c.ip_address ) );
+
+        // bind the new socket to port 0xAF12 (CIP)
+        if( bind( n.sockets.tcp_listener, address, SADDRZ ) )
+        {
+            CIPSTER_TRACE_ERR( "%s: bind(%s) error for tcp_listener: %s\n",
+                __func__, address.AddrStr().c_str(), strerrno().c_str() );
+            goto error;
+        }
+    }
+
+    //-----<udp_global_broadcast_listner>--------------------------------------
+    // create a new UDP socket
+    n.sockets.udp_global_broadcast_listener = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if( n.sockets.udp_global_broadcast_listener == -1 )
+    {
+        CIPSTER_TRACE_ERR( "%s: error allocating UDP broadcast listener socket, %d\n",
+                __func__, errno );
+        goto error;
+    }
+
+    // Activates address reuse
+    if( setsockopt( n.sockets.udp_global_broadcast_listener, SOL_SOCKET, SO_REUSEADDR,
+            (char*) &one, sizeof(one) ) )
+    {
+        CIPSTER_TRACE_ERR(
+                "error setting socket option SO_REUSEADDR on udp_broadcast_listener\n" );
+        goto error;
+    }
+
+    // enable the UDP socket to receive broadcast messages
+    if( setsockopt( n.sockets.udp_global_broadcast_listener,
+            SOL_SOCKET, SO_BROADCAST, (char*) &one, sizeof(one) ) )
+    {
+        CIPSTER_TRACE_ERR(
+                "error with setting broadcast receive for UDP socket: %s\n",
+                strerrno().c_str() );
+        goto error;
+    }
+
+    {
+        SockAddr address( kEIP_Reserved_Port, INADDR_BROADCAST );
+
+        if( bind( n.sockets.udp_global_broadcast_listener, address, SADDRZ ) )
+        {
+            CIPSTER_TRACE_ERR(
+                    "error with global broadcast UDP bind: %s\n",
+                    strerrno().c_str() );
+            goto error;
+        }
+    }
+
+    //-----<udp_local_broadcast_listener>---------------------------------------
+    // create a new UDP socket
+    n.sockets.udp_local_broadcast_listener = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if( n.sockets.udp_local_broadcast_listener == -1 )
+    {
+        CIPSTER_TRACE_ERR( "error allocating UDP broadcast listener socket, %d\n",
+                errno );
+
+        goto error;
+    }
+
+    // Activates address reuse
+    if( setsockopt( n.sockets.udp_local_broadcast_listener,
+            SOL_SOCKET, SO_REUSEADDR, (char*) &one, sizeof(one) ) )
+    {
+        CIPSTER_TRACE_ERR(
+                "error setting socket option SO_REUSEADDR on udp_broadcast_listener\n" );
+        goto error;
+    }
+
+    {
+        SockAddr address(   kEIP_Reserved_Port,
+                            ntohl( c.ip_address | ~c.network_mask ) );
+
+        if( bind( n.sockets.udp_local_broadcast_listener, address, SADDRZ ) )
+        {
+            CIPSTER_TRACE_ERR(
+                    "error with udp_local_broadcast_listener bind: %s\n",
+                    strerrno().c_str() );
+            goto error;
+        }
+    }
+
+    //-----<udp_unicast_listener>----------------------------------------------
+    // create a new UDP socket
+    n.sockets.udp_unicast_listener = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if( n.sockets.udp_unicast_listener == -1 )
+    {
+        CIPSTER_TRACE_ERR( "error allocating UDP unicast listener socket, %d\n",
+                errno );
+        goto error;
+    }
+
+    // Activates address reuse
+    if( setsockopt( n.sockets.udp_unicast_listener, SOL_SOCKET, SO_REUSEADDR,
+            (char*) &one, sizeof(one) ) )
+    {
+        CIPSTER_TRACE_ERR(
+                "error setting socket option SO_REUSEADDR on udp_unicast_listener\n" );
+        goto error;
+    }
+
+    {
+        SockAddr address( kEIP_Reserved_Port, ntohl( c.ip_address ) );
+
+        if( bind( n.sockets.udp_unicast_listener, address, SADDRZ ) )
+        {
+            CIPSTER_TRACE_ERR(
+                "error with udp_unicast_listener bind: %s\n",
+                strerrno().c_str() );
+            goto error;
         }
     }
-}
 
+    //-----</udp_unicast_listener>---------------------------------------------
+
+    // switch socket in listen mode
+    if( listen( n.sockets.tcp_listener, MAX_NO_OF_TCP_SOCKETS ) )
+    {
+        CIPSTER_TRACE_ERR( "%s: error with listen: %s\n",
+                __func__, strerrno().c_str() );
+        goto error;
+    }
+
+    // tuning failures are traced by ApplySocketProfile() but are not fatal.
+    ApplySocketProfile( n.sockets.tcp_listener, kSocketClassExplicit );
+    ApplySocketProfile( n.sockets.udp_unicast_listener, kSocketClassExplicit );
+    ApplySocketProfile( n.sockets.udp_local_broadcast_listener, kSocketClassExplicit );
+    ApplySocketProfile( n.sockets.udp_global_broadcast_listener, kSocketClassExplicit );
 
-void CheckAndHandleUdpGlobalBroadcastSocket()
-{
-    SockAddr    from_addr;
-    socklen_t   from_addr_length;
+    // add the listener socket to the master set
+    master_set_add( "TCP", n.sockets.tcp_listener );
+    master_set_add( "UDP", n.sockets.udp_unicast_listener );
+    master_set_add( "UDP", n.sockets.udp_local_broadcast_listener );
+    master_set_add( "UDP", n.sockets.udp_global_broadcast_listener );
 
-    // see if this is an unsolicited inbound UDP message
-    if( checkSocketSet( s_sockets.udp_global_broadcast_listener ) )
+    CIPSTER_TRACE_INFO( "%s:\n"
+        " tcp_listener                 :%d\n"
+        " udp_unicast_listener         :%d\n"
+        " udp_local_broadcast_listener :%d\n"
+        " udp_global_broadcast_listener:%d\n"
+        " added to n.master_set\n",
+        __func__,
+        n.sockets.tcp_listener,
+        n.sockets.udp_unicast_listener,
+        n.sockets.udp_local_broadcast_listener,
+        n.sockets.udp_global_broadcast_listener
+        );
+
+    n.sockets.explicit_last_usecs = usecs_now();    // initialize time keeping
+
+    for( int i = 0; i < CIPSTER_MAX_IO_SHARDS; ++i )
     {
-        from_addr_length = sizeof(from_addr);
+        n.timers[i].last_usecs = n.sockets.explicit_last_usecs;
+        n.timers[i].elapsed_usecs = 0;
+    }
 
-        CIPSTER_TRACE_STATE(
-            "%s[%d]: unsolicited UDP on global broadcast socket\n",
-            __func__, s_sockets.udp_global_broadcast_listener );
+    n.sockets.tcp_inactivity_usecs = 0;
 
-        // Handle UDP broadcast messages
-        int received_size = recvfrom( s_sockets.udp_global_broadcast_listener,
-                (char*) s_buf, S_BUFZ, 0,
-                from_addr, &from_addr_length );
+    return kEipStatusOk;
 
-        if( received_size <= 0 ) // got error
-        {
-            CIPSTER_TRACE_ERR(
-                "%s[%d]: error on recvfrom UDP global broadcast socket: '%s'\n",
-                __func__,
-                s_sockets.udp_global_broadcast_listener,
-                strerrno().c_str() );
+error:
+    NetworkHandlerFinish();
+    return kEipStatusError;
+}
 
-            return;
-        }
 
-        CIPSTER_TRACE_INFO( "%s[%d]: %d bytes received on global broadcast UDP\n",
-            __func__, s_sockets.udp_global_broadcast_listener, received_size );
+void SetExplicitBudget( const ExplicitBudget& aBudget )
+{
+    net().budget = aBudget;
+}
 
-        int reply_length = Encapsulation::HandleReceivedExplicitUdpData(
-                s_sockets.udp_global_broadcast_listener, from_addr,
-                BufReader( s_buf, received_size ),
-                BufWriter( s_buf, S_BUFZ ), false );
 
-        if( reply_length > 0 )
-        {
-            // if the active socket matches a registered UDP callback, handle a UDP packet
-            int sent_count = sendto( s_sockets.udp_global_broadcast_listener,
-                        (char*) s_buf, reply_length, 0,
-                        from_addr, SADDRZ );
+const ExplicitBudget& GetExplicitBudget()
+{
+    return net().budget;
+}
 
-            CIPSTER_TRACE_INFO( "%s[%d]: sent %d reply bytes\n",
-                __func__, s_sockets.udp_global_broadcast_listener, sent_count );
 
-            if( sent_count != reply_length )
-            {
-                CIPSTER_TRACE_INFO(
-                        "%s[%d]: UDP response was not fully sent\n",
-                        __func__, s_sockets.udp_global_broadcast_listener );
-            }
-        }
-    }
+const NetworkLoopStats& GetNetworkLoopStats()
+{
+    return net().loop_stats;
+}
+
+
+void ResetNetworkLoopStats()
+{
+    net().loop_stats = NetworkLoopStats();
 }
 
 
 /**
- * Function checkAndHandleUdpSockets
- * checks all open UDP sockets for inbound data, and passes any packets
- * up to RecvConnectedData() for filtering.
+ * Function serviceTimers
+ * advances the time keeping and calls ManageConnections() once for every
+ * timer tick which has come due, so productions and watchdogs are handled
+ * as soon as they are due.
+ *
+ * @param aShard is the I/O shard whose connections to manage, the caller
+ *  holding its ShardLock, or -1 for all of them under IoLock.
+ * @return unsigned - the usecs elapsed since the previous call.
  */
-static void checkAndHandleUdpSockets()
+static unsigned serviceTimers( int aShard = -1 )
 {
-    /*
-        We can get garbage in on any open UDP socket and it must be dealt with
-        by draining it and perhaps tossing it. Merely accepting data from
-        sockets associated with consuming connections is not correct, this will
-        screw up the caller's assumption that anything still in read_set is a
-        TCP connection.
+    ShardTimer& timer = net().timers[aShard > 0 ? aShard : 0];
 
-        Also, unless we drain what we've received, TCP stack buffers can get
-        exhausted.
-    */
+    unsigned now = usecs_now();
+    unsigned elapsed_usecs = now - timer.last_usecs;
 
-    UdpSocketMgr::sockets& all = UdpSocketMgr::GetAllSockets(); // UDP only
+    timer.last_usecs = now;
 
-    SockAddr    from_addr;
+    timer.elapsed_usecs += elapsed_usecs;
 
-    for( UdpSocketMgr::sock_iter it = all.begin();  it != all.end();  ++it )
-    {
-        UdpSocket*  s = *it;
+    if( aShard <= 0 )
+        StackContext::Current().current_usecs += elapsed_usecs;   // accumulate into 64 bits.
 
-        if( checkSocketSet( s->h() ) )
-        {
-            //CIPSTER_TRACE_INFO( "%s[%d]\n", __func__, s->h() );
+    /*  Call ManageConnections() if the elapsed_usecs is greater than
+        kCIPsterTimerTickInMicroSeconds.  If more than once cycle
+        was missed, call it more than once so internal time management
+        functions can expect each call to represent kCIPsterTimerTickInMicroSeconds.
+        This will compensate for jitter in how frequently NetworkHandlerProcessOnce()
+        is called.  But please try and call it at least slightly more frequently
+        than every kCIPsterTimerTickInMicroSeconds.
+    */
+    if( aShard <= 0 && timer.elapsed_usecs >= 2 * kCIPsterTimerTickInMicroSeconds )
+        ++net().loop_stats.late_ticks;
 
-            // Since it is non-blocking, call Recv() until
-            // byte_count is <= 0.  Keep socket open for every case.
+    bool ticked = false;
 
-            // Drain each UDP socket up to some limit you can choose.
-            // This strategy contemplates that somebody might be bombing us,
-            // maybe even maliciously.  Anything we don't fetch out now
-            // will likely still be there on the next call to
-            // NetworkHandlerProcessOnce().
-            int limit = 64 * s->RefCount();
+    while( timer.elapsed_usecs >= kCIPsterTimerTickInMicroSeconds )
+    {
+        IoLock  lock( aShard < 0 );
 
-            int attempt;
-            for( attempt = 0;  attempt < limit;  ++attempt )
-            {
-                int byte_count = s->Recv( &from_addr, BufWriter( s_buf, S_BUFZ ) );
+        CipConnMgrClass::ManageConnections( aShard );
 
-                if( byte_count <= 0 )
-                {
-                    if( errno != EAGAIN && errno != EWOULDBLOCK )
-                    {
-                        CIPSTER_TRACE_ERR( "%s[%d]: errno: '%s'\n",
-                            __func__, s->h(), strerrno().c_str() );
-                    }
+        // Since we qualified this in the while() test, this will never go
+        // below zero.
+        timer.elapsed_usecs -= kCIPsterTimerTickInMicroSeconds;
 
-                    break;
-                }
+        ticked = true;
+    }
 
-                CipConnMgrClass::RecvConnectedData(
-                    s, from_addr, BufReader( s_buf, byte_count ) );
-            }
+    // A watchdog or production which came due between ticks is served now
+    // rather than at the next tick.
+    if( !ticked )
+    {
+        IoLock  lock( aShard < 0 );
 
-            if( attempt && attempt == limit )
-            {
-                CIPSTER_TRACE_ERR( "%s[%d]: too much inbound UDP traffic\n",
-                    __func__, s->h() );
-            }
-        }
+        if( CipConnMgrClass::ConnectionsDueInUSecs( aShard ) <= 0 )
+            CipConnMgrClass::ManageConnections( aShard, false );
     }
+
+    return elapsed_usecs;
+}
+
+
+/// Return true if the explicit budget of a pass which began at @a aStartUSecs
+/// and has served @a aCount requests so far allows one more.
+static bool budgetLeft( unsigned aStartUSecs, unsigned aCount )
+{
+    NetworkState& n = net();
+
+    if( n.budget.max_requests && aCount >= n.budget.max_requests )
+        return false;
+
+    if( n.budget.max_usecs && usecs_now() - aStartUSecs >= n.budget.max_usecs )
+        return false;
+
+    return true;
 }
 
 
 /**
- * Function HandleDataOnTcpSocket
+ * Function handleExplicitSockets
+ * serves the listeners and TCP sessions marked in read_set, which must no
+ * longer hold any UdpSocketMgr socket, within the ExplicitBudget.  Whatever
+ * the budget leaves is still readable in the kernel and is served by the
+ * next pass, which starts with the TCP socket where this one stopped.
+ *
+ * @param isServicingTimers tells to call serviceTimers() after each request,
+ *  which the single thread mode wants.
+ * @return unsigned - the usecs serviceTimers() reported, if any.
  */
-EipStatus HandleDataOnTcpSocket( int aSocket )
+static unsigned handleExplicitSockets( bool isServicingTimers )
 {
-    int num_read = Encapsulation::ReceiveTcpMsg( aSocket,
-                        BufWriter( s_buf, sizeof s_buf ) );
+    NetworkState& n = net();
 
-    //CIPSTER_TRACE_INFO( "%s[%d]: num_read:%d\n", __func__, aSocket, num_read );
+    unsigned    start_usecs = usecs_now();
+    unsigned    count = 0;
+    unsigned    deferred = 0;
+    unsigned    elapsed_usecs = 0;
 
-    if( num_read < ENCAPSULATION_HEADER_LENGTH )
+    // Accepting is cheap and not a request, never defer it.
+    CheckAndHandleTcpListenerSocket();
+
+    static void (* const handlers[])() =
     {
-        return kEipStatusError;
-    }
+        CheckAndHandleUdpUnicastSocket,
+        CheckAndHandleUdpLocalBroadcastSocket,
+        CheckAndHandleUdpGlobalBroadcastSocket,
+    };
 
-    int replyz = Encapsulation::HandleReceivedExplicitTcpData( aSocket,
-                        BufReader( s_buf, num_read ),
-                        BufWriter( s_buf, sizeof s_buf ) );
+    const int listeners[] =
+    {
+        n.sockets.udp_unicast_listener,
+        n.sockets.udp_local_broadcast_listener,
+        n.sockets.udp_global_broadcast_listener,
+    };
 
-    if( replyz > 0 )
+    for( int i = 0; i < DIM( handlers ); ++i )
     {
-#if defined(DEBUG) && 0
-        byte_dump( "sTCP", s_buf, replyz );
-#endif
-        int sent_count = send( aSocket, (char*) s_buf, replyz, 0 );
+        if( !FD_ISSET( listeners[i], &n.read_set ) )
+            continue;
 
-        CIPSTER_TRACE_INFO( "%s[%d]: replied with %d bytes\n",
-                __func__, aSocket, sent_count );
+        if( budgetLeft( start_usecs, count ) )
+        {
+            handlers[i]();
 
-        if( sent_count != replyz )
+            ++count;
+
+            if( isServicingTimers )
+                elapsed_usecs += serviceTimers();
+        }
+        else
         {
-            CIPSTER_TRACE_WARN( "%s[%d]: TCP response was not fully sent\n",
-                    __func__, aSocket );
+            // keep the TCP loop below from taking it for a TCP socket.
+            FD_CLR( listeners[i], &n.read_set );
+            ++deferred;
         }
-
-        return kEipStatusOk;
     }
 
-    else if( replyz == 0 )
-    {
-        CIPSTER_TRACE_INFO(
-            "%s[%d]: 0 length reply from HandleReceivedExplicitTcpData()\n",
-            __func__, aSocket );
+    int socket_count = n.highest_socket_handle + 1;
+    int first = n.sockets.next_tcp_socket < socket_count ? n.sockets.next_tcp_socket : 0;
 
-        return kEipStatusOk;
-    }
+    n.sockets.next_tcp_socket = 0;
 
-    else
+    // if it is still checked it is a TCP receive
+    for( int i = 0; i < socket_count;  ++i )
     {
-        CIPSTER_TRACE_INFO(
-            "%s[%d]: < 0 length reply from HandleReceivedExplicitTcpData()\n",
-            __func__, aSocket );
+        int socket = ( first + i ) % socket_count;
 
-        return kEipStatusError;
+        if( !FD_ISSET( socket, &n.read_set ) )
+            continue;
+
+        if( !budgetLeft( start_usecs, count ) )
+        {
+            // the next pass starts with the first one left over
+            if( !n.sockets.next_tcp_socket )
+                n.sockets.next_tcp_socket = socket;
+
+            FD_CLR( socket, &n.read_set );
+            ++deferred;
+            continue;
+        }
+
+        if( checkSocketSet( socket ) )
+        {
+            if( kEipStatusError == HandleDataOnTcpSocket( socket ) )
+            {
+                CIPSTER_TRACE_INFO( "%s[%d]: calling CloseBySocket()\n",
+                    __func__, socket );
+                SessionMgr::CloseBySocket( socket );
+            }
+
+            ++count;
+
+            if( isServicingTimers )
+                elapsed_usecs += serviceTimers();
+        }
     }
+
+    n.loop_stats.explicit_handled  += count;
+    n.loop_stats.explicit_deferred += deferred;
+
+    if( deferred )
+        ++n.loop_stats.budget_exhausted;
+
+    return elapsed_usecs;
 }
 
 
-EipStatus NetworkHandlerInitialize()
+/// Wait up to @a aTimeoutUSecs for any socket of @a aSet up to @a aHighest.
+static int selectRead( int aHighest, fd_set* aSet, unsigned aTimeoutUSecs )
 {
-#if defined(_WIN32)
-    WORD    wVersionRequested;
-    WSADATA wsaData;
+    timeval tv;
 
-    wVersionRequested = MAKEWORD(2, 2);
+    tv.tv_sec  = aTimeoutUSecs / 1000000;
+    tv.tv_usec = aTimeoutUSecs % 1000000;
 
-    WSAStartup( wVersionRequested, &wsaData );
+#if defined(_WIN32)
+    // winsock refuses a select() without sockets
+    if( aHighest < 0 )
+    {
+        Sleep( aTimeoutUSecs / 1000 );
+        return 0;
+    }
 #endif
 
-    static const int one = 1;
+    int ready_count = select( aHighest + 1, aSet, 0, 0, &tv );
 
-    const CipTcpIpInterfaceConfiguration& c = CipTCPIPInterfaceClass::InterfaceConf(1);
+    if( ready_count == -1 )
+    {
+        if( errno == EINTR )
+            return 0;
 
-    // clear the master and temp sets
-    FD_ZERO( &master_set );
-    FD_ZERO( &read_set );
+        CIPSTER_TRACE_ERR( "%s: error with select: '%s'\n",
+                __func__, strerrno().c_str() );
+    }
 
-    s_sockets.tcp_listener = -1;
-    s_sockets.udp_unicast_listener = -1;
-    s_sockets.udp_local_broadcast_listener = -1;
-    s_sockets.udp_global_broadcast_listener = -1;
+    return ready_count;
+}
 
-    //-----<tcp_listener>-------------------------------------------
 
-    // create a new TCP socket
-    s_sockets.tcp_listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+EipStatus NetworkHandlerProcessIo( unsigned aTimeoutUSecs )
+{
+    return NetworkHandlerProcessShard( 0, aTimeoutUSecs );
+}
 
-    CIPSTER_TRACE_INFO( "s_sockets.tcp_listener == %d\n", s_sockets.tcp_listener );
 
-    if( s_sockets.tcp_listener == -1 )
-    {
-        CIPSTER_TRACE_ERR( "error allocating socket stream listener, %d\n", errno );
-        goto error;
-    }
+EipStatus NetworkHandlerProcessShard( int aShard, unsigned aTimeoutUSecs )
+{
+    NetworkState& n = net();
 
-    // Activates address reuse
-    if( setsockopt( s_sockets.tcp_listener, SOL_SOCKET, SO_REUSEADDR,
-                (char*) &one, sizeof(one) ) )
+    CIPSTER_ASSERT( aShard >= 0 && aShard < n.shard_count );
+
+    n.threaded.store( true, std::memory_order_relaxed );
+
+    fd_set  io_set;
+    int     highest = -1;
+    int32_t due_usecs;
+
+    FD_ZERO( &io_set );
+
+    if( aShard == 0 )
     {
-        CIPSTER_TRACE_ERR(
-                "error setting socket option SO_REUSEADDR on tcp_listener\n" );
-        goto error;
+        IoLock  lock;
+
+        RunIoCommands();
     }
 
     {
-        SockAddr address( kEIP_Reserved_Port, ntohl( c.ip_address ) );
+        ShardLock   lock( aShard );
 
-        // bind the new socket to port 0xAF12 (CIP)
-        if( bind( s_sockets.tcp_listener, address, SADDRZ ) )
+        UdpSocketMgr::sockets& all = UdpSocketMgr::GetAllSockets();
+
+        for( UdpSocketMgr::sock_iter it = all.begin();  it != all.end();  ++it )
         {
-            CIPSTER_TRACE_ERR( "%s: bind(%s) error for tcp_listener: %s\n",
-                __func__, address.AddrStr().c_str(), strerrno().c_str() );
-            goto error;
+            if( (*it)->Shard() != aShard )
+                continue;
+
+            FD_SET( (*it)->h(), &io_set );
+
+            if( (*it)->h() > highest )
+                highest = (*it)->h();
         }
+
+        due_usecs = CipConnMgrClass::ConnectionsDueInUSecs( aShard );
     }
 
-    //-----<udp_global_broadcast_listner>--------------------------------------
-    // create a new UDP socket
-    s_sockets.udp_global_broadcast_listener = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
-    if( s_sockets.udp_global_broadcast_listener == -1 )
+    // shard 0 runs the I/O commands, let a post cut its wait short
+    int wake = aShard == 0 ? n.wake_fds[0] : -1;
+
+    if( wake >= 0 )
     {
-        CIPSTER_TRACE_ERR( "%s: error allocating UDP broadcast listener socket, %d\n",
-                __func__, errno );
-        goto error;
+        FD_SET( wake, &io_set );
+
+        if( wake > highest )
+            highest = wake;
     }
 
-    // Activates address reuse
-    if( setsockopt( s_sockets.udp_global_broadcast_listener, SOL_SOCKET, SO_REUSEADDR,
-            (char*) &one, sizeof(one) ) )
+    ShardTimer& timer = n.timers[aShard];
+
+    // Do not sleep past the next timer tick.
+    unsigned pending = timer.elapsed_usecs + ( usecs_now() - timer.last_usecs );
+    unsigned wait = pending >= kCIPsterTimerTickInMicroSeconds ? 0 :
+                        kCIPsterTimerTickInMicroSeconds - pending;
+
+    if( wait > aTimeoutUSecs )
+        wait = aTimeoutUSecs;
+
+    // Nor past a connection coming due before it.  The stack clock is
+    // shard 0's, its other shards wait at most one of shard 0's passes late.
+    if( aShard == 0 )
+        due_usecs -= int32_t( usecs_now() - timer.last_usecs );
+
+    if( due_usecs < int32_t( wait ) )
+        wait = due_usecs > 0 ? due_usecs : 0;
+
+    int ready_count = selectRead( highest, &io_set, wait );
+
+    if( ready_count < 0 )
+        return kEipStatusError;
+
+    if( ready_count > 0 && wake >= 0 && FD_ISSET( wake, &io_set ) )
     {
-        CIPSTER_TRACE_ERR(
-                "error setting socket option SO_REUSEADDR on udp_broadcast_listener\n" );
-        goto error;
-    }
+        drainWake( n, 0 );
+
+        IoLock  lock;
+
+        RunIoCommands();
+    }
 
-    // enable the UDP socket to receive broadcast messages
-    if( setsockopt( s_sockets.udp_global_broadcast_listener,
-            SOL_SOCKET, SO_BROADCAST, (char*) &one, sizeof(one) ) )
     {
-        CIPSTER_TRACE_ERR(
-                "error with setting broadcast receive for UDP socket: %s\n",
-                strerrno().c_str() );
-        goto error;
+        ShardLock   lock( aShard );
+
+        if( ready_count > 0 )
+            checkAndHandleUdpSockets( &io_set, n.io_bufs[aShard] );
+
+        serviceTimers( aShard );
     }
 
+    // Closing a connection touches what all shards share, so timeouts
+    // found above are handled here, under IoLock.
+    if( CipConnMgrClass::TimeOutsPending( aShard ) )
     {
-        SockAddr address( kEIP_Reserved_Port, INADDR_BROADCAST );
+        IoLock  lock;
 
-        if( bind( s_sockets.udp_global_broadcast_listener, address, SADDRZ ) )
-        {
-            CIPSTER_TRACE_ERR(
-                    "error with global broadcast UDP bind: %s\n",
-                    strerrno().c_str() );
-            goto error;
-        }
+        CipConnMgrClass::HandlePendingTimeOuts( aShard );
     }
 
-    //-----<udp_local_broadcast_listener>---------------------------------------
-    // create a new UDP socket
-    s_sockets.udp_local_broadcast_listener = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
-    if( s_sockets.udp_local_broadcast_listener == -1 )
+    return kEipStatusOk;
+}
+
+
+EipStatus NetworkHandlerProcessExplicit( unsigned aTimeoutUSecs )
+{
+    NetworkState& n = net();
+
+    n.threaded.store( true, std::memory_order_relaxed );
+
+    RunExplicitCommands();
+
+    int highest;
+
     {
-        CIPSTER_TRACE_ERR( "error allocating UDP broadcast listener socket, %d\n",
-                errno );
+        IoLock  lock;
 
-        goto error;
+        n.read_set = n.master_set;
+        highest  = n.highest_socket_handle;
+
+        // Those are the I/O thread's.
+        UdpSocketMgr::sockets& all = UdpSocketMgr::GetAllSockets();
+
+        for( UdpSocketMgr::sock_iter it = all.begin();  it != all.end();  ++it )
+            FD_CLR( (*it)->h(), &n.read_set );
     }
 
-    // Activates address reuse
-    if( setsockopt( s_sockets.udp_local_broadcast_listener,
-            SOL_SOCKET, SO_REUSEADDR, (char*) &one, sizeof(one) ) )
+    int wake = n.wake_fds[1];
+
+    if( wake >= 0 )
     {
-        CIPSTER_TRACE_ERR(
-                "error setting socket option SO_REUSEADDR on udp_broadcast_listener\n" );
-        goto error;
+        FD_SET( wake, &n.read_set );
+
+        if( wake > highest )
+            highest = wake;
     }
 
+    // Nothing wakes us when a deferred service completes, so poll each tick.
+    if( DeferredServicesOutstanding() && aTimeoutUSecs > kCIPsterTimerTickInMicroSeconds )
+        aTimeoutUSecs = kCIPsterTimerTickInMicroSeconds;
+
+    int ready_count = selectRead( highest, &n.read_set, aTimeoutUSecs );
+
+    if( ready_count < 0 )
+        return kEipStatusError;
+
+    // not a TCP socket, keep it from handleExplicitSockets()
+    if( ready_count > 0 && wake >= 0 && FD_ISSET( wake, &n.read_set ) )
     {
-        SockAddr address(   kEIP_Reserved_Port,
-                            ntohl( c.ip_address | ~c.network_mask ) );
+        FD_CLR( wake, &n.read_set );
+        --ready_count;
 
-        if( bind( s_sockets.udp_local_broadcast_listener, address, SADDRZ ) )
-        {
-            CIPSTER_TRACE_ERR(
-                    "error with udp_local_broadcast_listener bind: %s\n",
-                    strerrno().c_str() );
-            goto error;
-        }
+        drainWake( n, 1 );
+        RunExplicitCommands();
     }
 
-    //-----<udp_unicast_listener>----------------------------------------------
-    // create a new UDP socket
-    s_sockets.udp_unicast_listener = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
-    if( s_sockets.udp_unicast_listener == -1 )
+    if( ready_count > 0 )
+        handleExplicitSockets( false );
+
+    RunDeferredCompletions();
+
+    // Close the sessions whose last CIP connection timed out on the I/O thread.
+    CipUdint    closes[DIM( n.deferred_closes )];
+    int         close_count;
+
     {
-        CIPSTER_TRACE_ERR( "error allocating UDP unicast listener socket, %d\n",
-                errno );
-        goto error;
+        IoLock  lock;
+
+        close_count = n.deferred_close_count;
+        memcpy( closes, n.deferred_closes, close_count * sizeof closes[0] );
+        n.deferred_close_count = 0;
     }
 
-    // Activates address reuse
-    if( setsockopt( s_sockets.udp_unicast_listener, SOL_SOCKET, SO_REUSEADDR,
-            (char*) &one, sizeof(one) ) )
+    for( int i = 0; i < close_count; ++i )
+        SessionMgr::CloseBySessionHandle( closes[i] );
+
+    unsigned now = usecs_now();
+    unsigned elapsed_usecs = now - n.sockets.explicit_last_usecs;
+
+    n.sockets.explicit_last_usecs = now;
+
+    n.sockets.explicit_elapsed_usecs += elapsed_usecs;
+    n.sockets.tcp_inactivity_usecs   += elapsed_usecs;
+
+    // ManageConnections() leaves this to us in the two thread mode.
+    while( n.sockets.explicit_elapsed_usecs >= kCIPsterTimerTickInMicroSeconds )
     {
-        CIPSTER_TRACE_ERR(
-                "error setting socket option SO_REUSEADDR on udp_unicast_listener\n" );
-        goto error;
+        ManageEncapsulationMessages();
+
+        n.sockets.explicit_elapsed_usecs -= kCIPsterTimerTickInMicroSeconds;
     }
 
+    const unsigned INACTIVITY_CHECK_PERIOD_USECS = 500000;
+
+    if( n.sockets.tcp_inactivity_usecs >= INACTIVITY_CHECK_PERIOD_USECS )
     {
-        SockAddr address( kEIP_Reserved_Port, ntohl( c.ip_address ) );
+        n.sockets.tcp_inactivity_usecs -= INACTIVITY_CHECK_PERIOD_USECS;
 
-        if( bind( s_sockets.udp_unicast_listener, address, SADDRZ ) )
-        {
-            CIPSTER_TRACE_ERR(
-                "error with udp_unicast_listener bind: %s\n",
-                strerrno().c_str() );
-            goto error;
-        }
+        SessionMgr::AgeInactivity();
     }
 
-    //-----</udp_unicast_listener>---------------------------------------------
+    return kEipStatusOk;
+}
 
-    // switch socket in listen mode
-    if( listen( s_sockets.tcp_listener, MAX_NO_OF_TCP_SOCKETS ) )
+
+/// Run what application threads posted since the last pass, and send the
+/// replies of completed deferred services.
+static void runPosted()
+{
     {
-        CIPSTER_TRACE_ERR( "%s: error with listen: %s\n",
-                __func__, strerrno().c_str() );
-        goto error;
+        IoLock  lock;
+
+        RunIoCommands();
     }
 
-    // add the listener socket to the master set
-    master_set_add( "TCP", s_sockets.tcp_listener );
-    master_set_add( "UDP", s_sockets.udp_unicast_listener );
-    master_set_add( "UDP", s_sockets.udp_local_broadcast_listener );
-    master_set_add( "UDP", s_sockets.udp_global_broadcast_listener );
+    RunExplicitCommands();
 
-    CIPSTER_TRACE_INFO( "%s:\n"
-        " tcp_listener                 :%d\n"
-        " udp_unicast_listener         :%d\n"
-        " udp_local_broadcast_listener :%d\n"
-        " udp_global_broadcast_listener:%d\n"
-        " added to master_set\n",
-        __func__,
-        s_sockets.tcp_listener,
-        s_sockets.udp_unicast_listener,
-        s_sockets.udp_local_broadcast_listener,
-        s_sockets.udp_global_broadcast_listener
-        );
+    RunDeferredCompletions();
+}
 
-    s_last_usecs = usecs_now();         // initialize time keeping
-    s_sockets.elapsed_time_usecs = 0;
-    s_sockets.tcp_inactivity_usecs = 0;
 
-    return kEipStatusOk;
+/// Account @a aElapsedUSecs to the TCP inactivity check of the single thread mode.
+static void ageSessions( unsigned aElapsedUSecs )
+{
+    NetworkState& n = net();
 
-error:
-    NetworkHandlerFinish();
-    return kEipStatusError;
+    n.sockets.tcp_inactivity_usecs += aElapsedUSecs;
+
+    // process AgeInactivity every 1/2 second.  This is fine because
+    // CipTCPIPInterfaceInstance::InactivityTimeoutSecs() is in seconds so
+    // respecting the timeout within 1/2 is sufficient.
+    const unsigned INACTIVITY_CHECK_PERIOD_USECS = 500000;
+
+    if( n.sockets.tcp_inactivity_usecs >= INACTIVITY_CHECK_PERIOD_USECS )
+    {
+        n.sockets.tcp_inactivity_usecs -= INACTIVITY_CHECK_PERIOD_USECS;
+
+        SessionMgr::AgeInactivity();
+    }
 }
 
 
 EipStatus NetworkHandlerProcessOnce()
 {
-    read_set = master_set;
+    NetworkState& n = net();
+
+    runPosted();
+
+    n.read_set = n.master_set;
 
     timeval tv;
 
@@ -801,7 +2199,7 @@ EipStatus NetworkHandlerProcessOnce()
     tv.tv_sec  = 0;
     tv.tv_usec = 0;
 
-    int ready_count = select( highest_socket_handle + 1, &read_set, 0, 0, &tv );
+    int ready_count = select( n.highest_socket_handle + 1, &n.read_set, 0, 0, &tv );
 
     if( ready_count == -1 )
     {
@@ -820,90 +2218,255 @@ EipStatus NetworkHandlerProcessOnce()
         }
     }
 
+    // The I/O sockets first, consumed frames feed the productions below.
+    if( ready_count > 0 )
+    {
+        IoLock  lock;
+
+        checkAndHandleUdpSockets( &n.read_set, n.buf );
+    }
+
+    // Due productions and watchdogs come before any explicit request, and
+    // handleExplicitSockets() services them again between requests.
+    unsigned elapsed_usecs = serviceTimers();
+
     if( ready_count > 0 )
+        elapsed_usecs += handleExplicitSockets( true );
+
+    ageSessions( elapsed_usecs );
+
+    return kEipStatusOk;
+}
+
+
+//-----<ExternalLoop>-----------------------------------------------------------
+
+void SetNetworkFdWatcher( NetworkFdWatcher aWatcher, void* aContext )
+{
+    NetworkState& n = net();
+
+    IoLock  lock;
+
+    n.fd_watcher = aWatcher;
+    n.fd_watcher_context = aContext;
+}
+
+
+int NetworkHandlerGetFds( NetworkFd* aFds, int aMaxCount )
+{
+    NetworkState& n = net();
+
+    IoLock  lock;
+
+    int count = 0;
+
+#if defined(_WIN32)
+    for( unsigned i = 0; i < n.master_set.fd_count; ++i )
+    {
+        int socket = (int) n.master_set.fd_array[i];
+#else
+    for( int socket = 0; socket <= n.highest_socket_handle; ++socket )
     {
-        // CIPSTER_TRACE_INFO( "%s: highest_socket_handle:%d ready_count:%d\n",
-        //   __func__, highest_socket_handle, ready_count );
+        if( !FD_ISSET( socket, &n.master_set ) )
+            continue;
+#endif
+        if( count < aMaxCount )
+        {
+            aFds[count].socket = socket;
+            aFds[count].events = kNetworkFdReadable;
+        }
+
+        ++count;
+    }
 
-        CheckAndHandleTcpListenerSocket();
-        CheckAndHandleUdpUnicastSocket();
-        CheckAndHandleUdpLocalBroadcastSocket();
-        CheckAndHandleUdpGlobalBroadcastSocket();
-        checkAndHandleUdpSockets();
+    for( int i = 0; i < 2; ++i )
+    {
+        if( n.wake_fds[i] < 0 )
+            continue;
 
-        // if it is still checked it is a TCP receive
-        for( int socket = 0; socket <= highest_socket_handle;  ++socket )
+        if( count < aMaxCount )
         {
-            if( checkSocketSet( socket ) )
-            {
-                if( kEipStatusError == HandleDataOnTcpSocket( socket ) )
-                {
-                    CIPSTER_TRACE_INFO( "%s[%d]: calling CloseBySocket()\n",
-                        __func__, socket );
-                    SessionMgr::CloseBySocket( socket );
-                }
-            }
+            aFds[count].socket = n.wake_fds[i];
+            aFds[count].events = kNetworkFdReadable;
         }
+
+        ++count;
     }
 
-    unsigned now = usecs_now();
-    unsigned elapsed_usecs = now - s_last_usecs;
+    return count;
+}
 
-    s_last_usecs = now;
 
-    s_sockets.elapsed_time_usecs    += elapsed_usecs;
-    s_sockets.tcp_inactivity_usecs  += elapsed_usecs;
+uint64_t NetworkHandlerNowUSecs()
+{
+    return monotonic_usecs();
+}
 
-    g_current_usecs += elapsed_usecs;   // accumulate into 64 bits.
 
-    /*  Call ManageConnections() if the elapsed_time_usecs is greater than
-        kCIPsterTimerTickInMicroSeconds.  If more than once cycle
-        was missed, call it more than once so internal time management
-        functions can expect each call to represent kCIPsterTimerTickInMicroSeconds.
-        This will compensate for jitter in how frequently NetworkHandlerProcessOnce()
-        is called.  But please try and call it at least slightly more frequently
-        than every kCIPsterTimerTickInMicroSeconds.
-    */
-    while( s_sockets.elapsed_time_usecs >= kCIPsterTimerTickInMicroSeconds )
+uint64_t NetworkHandlerNextDeadline()
+{
+    ShardTimer& timer = net().timers[0];
+
+    uint64_t now = monotonic_usecs();
+
+    // Deferred replies, session ageing and HandleApplication() ride on the
+    // timer tick.
+    unsigned pending = timer.elapsed_usecs + ( unsigned( now ) - timer.last_usecs );
+
+    if( pending >= kCIPsterTimerTickInMicroSeconds )
+        return now;
+
+    uint64_t deadline = now + kCIPsterTimerTickInMicroSeconds - pending;
+
+    // Watchdogs and productions may come due before it, the stack clock
+    // stood still since serviceTimers() last ran.
+    int32_t due_usecs;
+
     {
-        ManageConnections();
+        IoLock  lock;
 
-        // Since we qualified this in the while() test, this will never go
-        // below zero.
-        s_sockets.elapsed_time_usecs -= kCIPsterTimerTickInMicroSeconds;
+        due_usecs = CipConnMgrClass::ConnectionsDueInUSecs();
     }
 
-    // process AgeInactivity every 1/2 second.  This is fine because
-    // CipTCPIPInterfaceInstance::inactivity_timeout_secs is in seconds so
-    // respecting the timeout within 1/2 is sufficient.
-    const unsigned INACTIVITY_CHECK_PERIOD_USECS = 500000;
+    due_usecs -= int32_t( unsigned( now ) - timer.last_usecs );
+
+    if( due_usecs <= 0 )
+        return now;
+
+    if( now + due_usecs < deadline )
+        deadline = now + due_usecs;
 
-    if( s_sockets.tcp_inactivity_usecs >= INACTIVITY_CHECK_PERIOD_USECS )
+    return deadline;
+}
+
+
+EipStatus NetworkHandlerSocketReady( int aSocket )
+{
+    NetworkState& n = net();
+
+    CIPSTER_ASSERT( !n.threaded );
+
+    int wake = wakeIndex( n, aSocket );
+
+    if( wake >= 0 )
+    {
+        drainWake( n, wake );
+        runPosted();
+        return kEipStatusOk;
+    }
+
+    // A socket closed by an earlier callback of the same wakeup is stale.
+    if( aSocket < 0 || aSocket > n.highest_socket_handle ||
+        !FD_ISSET( aSocket, &n.master_set ) )
     {
-        s_sockets.tcp_inactivity_usecs -= INACTIVITY_CHECK_PERIOD_USECS;
+        return kEipStatusOk;
+    }
 
-        SessionMgr::AgeInactivity();
+    FD_ZERO( &n.read_set );
+    FD_SET( aSocket, &n.read_set );
+
+    {
+        IoLock  lock;
+
+        checkAndHandleUdpSockets( &n.read_set, n.buf );
     }
 
+    // Left in read_set only if it was not a UdpSocketMgr socket.
+    unsigned elapsed_usecs = serviceTimers();
+
+    elapsed_usecs += handleExplicitSockets( true );
+
+    ageSessions( elapsed_usecs );
+
+    return kEipStatusOk;
+}
+
+
+EipStatus NetworkHandlerTimerDue()
+{
+    CIPSTER_ASSERT( !net().threaded );
+
+    runPosted();
+
+    ageSessions( serviceTimers() );
+
     return kEipStatusOk;
 }
 
+//-----</ExternalLoop>----------------------------------------------------------
+
 
 EipStatus NetworkHandlerFinish()
 {
-    CloseSocket( s_sockets.tcp_listener );
-    CloseSocket( s_sockets.udp_unicast_listener );
-    CloseSocket( s_sockets.udp_local_broadcast_listener );
-    CloseSocket( s_sockets.udp_global_broadcast_listener );
+    NetworkState& n = net();
+
+    CloseSocket( n.sockets.tcp_listener );
+    CloseSocket( n.sockets.udp_unicast_listener );
+    CloseSocket( n.sockets.udp_local_broadcast_listener );
+    CloseSocket( n.sockets.udp_global_broadcast_listener );
+
+    for( int i = 0; i < 2; ++i )
+    {
+        if( n.wake_fds[i] < 0 )
+            continue;
+
+        if( n.fd_watcher )
+            n.fd_watcher( n.fd_watcher_context, n.wake_fds[i], 0 );
+
+#if defined(__linux__)
+        close( n.wake_fds[i] );
+#endif
+        n.wake_fds[i] = -1;
+    }
 
     return kEipStatusOk;
 }
 
 
-EipStatus SendUdpData( const SockAddr& aSockAddr, int aSocket, BufReader aOutput )
+EipStatus SendUdpData( const SockAddr& aSockAddr, int aSocket, BufReader aOutput,
+        uint64_t aLaunchNSecs )
 {
-    int sent_count = sendto( aSocket, (char*) aOutput.data(), aOutput.size(), 0,
+    int sent_count;
+
+#if defined(__linux__) && defined(SO_TXTIME)
+    if( aLaunchNSecs )
+    {
+        iovec   iov;
+        msghdr  msg;
+
+        union {
+            cmsghdr align;
+            uint8_t buf[CMSG_SPACE( sizeof(uint64_t) )];
+        } control;
+
+        iov.iov_base = (void*) aOutput.data();
+        iov.iov_len  = aOutput.size();
+
+        memset( &msg, 0, sizeof msg );
+        msg.msg_name       = (sockaddr*) aSockAddr;
+        msg.msg_namelen    = SADDRZ;
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+
+        cmsghdr* c = CMSG_FIRSTHDR( &msg );
+
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type  = SCM_TXTIME;
+        c->cmsg_len   = CMSG_LEN( sizeof(uint64_t) );
+        memcpy( CMSG_DATA( c ), &aLaunchNSecs, sizeof(uint64_t) );
+
+        sent_count = sendmsg( aSocket, &msg, 0 );
+    }
+    else
+#endif
+    {
+        (void) aLaunchNSecs;
+
+        sent_count = sendto( aSocket, (char*) aOutput.data(), aOutput.size(), 0,
                         aSockAddr, SADDRZ );
+    }
 
 #if 0
     CIPSTER_TRACE_INFO( "%s[%d]: %d bytes to:%s:%d\n",
@@ -939,7 +2502,9 @@ EipStatus SendUdpData( const SockAddr& aSockAddr, int aSocket, BufReader aOutput
 
 UdpSocket* UdpSocketMgr::GrabSocket( const SockAddr& aSockAddr, const SockAddr* aMulticast )
 {
-    UdpSocket* iface = find( aSockAddr, m_sockets );
+    NetworkState& n = net();
+
+    UdpSocket* iface = find( aSockAddr, n.udp_sockets );
 
     if( iface )
     {
@@ -958,14 +2523,14 @@ UdpSocket* UdpSocketMgr::GrabSocket( const SockAddr& aSockAddr, const SockAddr*
         }
 
         iface = alloc( aSockAddr, sock );
-        m_sockets.push_back( iface );
+        n.udp_sockets.push_back( iface );
 
         //CIPSTER_TRACE_INFO( "%s: alloc %s:%d\n", __func__, aSockAddr.AddrStr().c_str(), aSockAddr.Port() );
     }
 
     if( aMulticast )
     {
-        UdpSocket* group = find( *aMulticast, m_multicast );
+        UdpSocket* group = find( *aMulticast, n.udp_multicast );
 
         if( group )
         {
@@ -1011,7 +2576,7 @@ UdpSocket* UdpSocketMgr::GrabSocket( const SockAddr& aSockAddr, const SockAddr*
 
             group = alloc( *aMulticast, iface->m_socket );
             group->m_underlying = iface;
-            m_multicast.push_back( group );
+            n.udp_multicast.push_back( group );
         }
 
         return group;
@@ -1023,6 +2588,8 @@ UdpSocket* UdpSocketMgr::GrabSocket( const SockAddr& aSockAddr, const SockAddr*
 
 bool UdpSocketMgr::ReleaseSocket( UdpSocket* aUdpSocket )
 {
+    NetworkState& n = net();
+
     sock_iter   it;
     UdpSocket*  group = NULL;
     UdpSocket*  iface = NULL;
@@ -1037,7 +2604,7 @@ bool UdpSocketMgr::ReleaseSocket( UdpSocket* aUdpSocket )
 
     if( aUdpSocket->m_sockaddr.IsMulticast() )
     {
-        for( it = m_multicast.begin();  it != m_multicast.end();  ++it )
+        for( it = n.udp_multicast.begin();  it != n.udp_multicast.end();  ++it )
         {
             if( *it == aUdpSocket )
             {
@@ -1053,7 +2620,7 @@ bool UdpSocketMgr::ReleaseSocket( UdpSocket* aUdpSocket )
 
         if( --group->m_ref_count <= 0 )
         {
-            m_multicast.erase( it );
+            n.udp_multicast.erase( it );
             UdpSocketMgr::free( group );
 
             ip_mreq mreq;
@@ -1083,7 +2650,7 @@ bool UdpSocketMgr::ReleaseSocket( UdpSocket* aUdpSocket )
     }
     else
     {
-        for( it = m_sockets.begin();  it != m_sockets.end();  ++it )
+        for( it = n.udp_sockets.begin();  it != n.udp_sockets.end();  ++it )
         {
             if( *it == aUdpSocket )
             {
@@ -1108,7 +2675,7 @@ bool UdpSocketMgr::ReleaseSocket( UdpSocket* aUdpSocket )
 #if 0   // should work with or without this:
         master_set_rem( iface->m_socket );
         CloseSocket( iface->m_socket );
-        m_sockets.erase( it );
+        n.udp_sockets.erase( it );
         UdpSocketMgr::free( iface );
 #endif
     }
@@ -1189,6 +2756,25 @@ int UdpSocketMgr::createSocket( const SockAddr& aSockAddr )
         }
     }
 
+    ApplySocketProfile( udp_sock, kSocketClassIo );
+
+    if( TxTimeLeadUSecs() && !enableTxTime( udp_sock ) )
+        goto close_and_exit;
+
+#if defined(__linux__)
+    {
+        // kernel arrival time of consumed frames, see UdpSocket::Recv().
+        // Not fatal, Recv() falls back to the time it is called.
+        const int one = 1;
+
+        if( setsockopt( udp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one ) )
+        {
+            CIPSTER_TRACE_WARN( "%s[%d]: SO_TIMESTAMPNS errno: '%s'\n",
+                __func__, udp_sock, strerrno().c_str() );
+        }
+    }
+#endif
+
     master_set_add( "UDP", udp_sock );
 
 exit:
@@ -1203,13 +2789,15 @@ close_and_exit:
 
 UdpSocket* UdpSocketMgr::alloc( const SockAddr& aSockAddr, int aSocket )
 {
+    NetworkState& n = net();
+
     UdpSocket* result;
 
-    if( m_free.size() )
+    if( n.udp_free.size() )
     {
-        result = m_free.back();
+        result = n.udp_free.back();
 
-        m_free.pop_back();
+        n.udp_free.pop_back();
 
         //new (result)  UdpSocket( aSockAddr, aSocket );    // in place construction
         new(result) UdpSocket( aSockAddr, aSocket );    // in place construction
@@ -1225,13 +2813,41 @@ UdpSocket* UdpSocketMgr::alloc( const SockAddr& aSockAddr, int aSocket )
 
 void UdpSocketMgr::free( UdpSocket* aUdpSocket )
 {
-    m_free.push_back( aUdpSocket );
+    net().udp_free.push_back( aUdpSocket );
+}
+
+
+
+UdpSocketMgr::sockets& UdpSocketMgr::GetAllSockets()
+{
+    return net().udp_sockets;
 }
 
 
-UdpSocketMgr::sockets UdpSocketMgr::m_sockets;
-UdpSocketMgr::sockets UdpSocketMgr::m_multicast;
-UdpSocketMgr::sockets UdpSocketMgr::m_free;
+void UdpSocketMgr::DeleteAll()
+{
+    NetworkState& n = net();
+
+    // Multicast groups and recycled entries share or closed their socket.
+    for( sock_iter it = n.udp_multicast.begin();  it != n.udp_multicast.end();  ++it )
+    {
+        (*it)->m_socket = kSocketInvalid;
+        delete *it;
+    }
+
+    for( sock_iter it = n.udp_free.begin();  it != n.udp_free.end();  ++it )
+    {
+        (*it)->m_socket = kSocketInvalid;
+        delete *it;
+    }
+
+    for( sock_iter it = n.udp_sockets.begin();  it != n.udp_sockets.end();  ++it )
+        delete *it;
+
+    n.udp_multicast.clear();
+    n.udp_free.clear();
+    n.udp_sockets.clear();
+}
 
 //-----</UdpSocketMgr>---------------------------------------------------------
 
@@ -11,6 +11,13 @@
 
 #include "sockaddr.h"
 #include "../cip/ciptypes.h"
+#include "../stackcontext.h"
+
+
+#ifndef CIPSTER_MAX_IO_SHARDS
+/// Most I/O worker threads, see SetIoShardCount().
+#define CIPSTER_MAX_IO_SHARDS       4
+#endif
 
 
 /**
@@ -19,16 +26,262 @@
  */
 EipStatus NetworkHandlerInitialize();
 
+/**
+ * Function NetworkHandlerProcessOnce
+ * does one pass of the single thread event loop: it drains the I/O sockets,
+ * calls ManageConnections() for every timer tick which has come due, then
+ * serves explicit requests within the ExplicitBudget, checking the timers
+ * again after each request.
+ */
 EipStatus NetworkHandlerProcessOnce();
 
 EipStatus NetworkHandlerFinish();
 
+
+/**
+ * Struct ExplicitBudget
+ * limits the explicit requests served by one pass of the event loop.  What is
+ * left over stays queued in the kernel and is served first by the next pass.
+ * Zero in a field means no limit.
+ */
+struct ExplicitBudget
+{
+    ExplicitBudget() :
+        max_requests( 0 ),
+        max_usecs( kCIPsterTimerTickInMicroSeconds )
+    {}
+
+    unsigned    max_requests;   ///< TCP messages plus UDP listener datagrams
+    unsigned    max_usecs;      ///< no new request is started after this
+};
+
+void SetExplicitBudget( const ExplicitBudget& aBudget );
+
+const ExplicitBudget& GetExplicitBudget();
+
+
+/**
+ * Struct NetworkLoopStats
+ * counts how the event loop shared its time, see GetNetworkLoopStats().
+ */
+struct NetworkLoopStats
+{
+    NetworkLoopStats() :
+        explicit_handled( 0 ),
+        explicit_deferred( 0 ),
+        budget_exhausted( 0 ),
+        late_ticks( 0 )
+    {}
+
+    uint64_t    explicit_handled;   ///< explicit requests served
+    uint64_t    explicit_deferred;  ///< ready sockets left for a later pass
+    uint64_t    budget_exhausted;   ///< passes which ran out of ExplicitBudget
+    uint64_t    late_ticks;         ///< times ManageConnections() fell a tick or more behind
+};
+
+const NetworkLoopStats& GetNetworkLoopStats();
+
+void ResetNetworkLoopStats();
+
+
+/// Interest bits of a NetworkFd.
+enum NetworkFdEvents
+{
+    kNetworkFdReadable  = 1,
+};
+
+/**
+ * Struct NetworkFd
+ * is one socket of the stack and what it waits for, see NetworkHandlerGetFds().
+ */
+struct NetworkFd
+{
+    int         socket;
+    unsigned    events;     ///< NetworkFdEvents bits
+};
+
+/// Told of each socket the stack starts or stops waiting on, @a aEvents
+/// being 0 when it stops, which is just before it is closed.
+typedef void (*NetworkFdWatcher)( void* aContext, int aSocket, unsigned aEvents );
+
+/**
+ * Function SetNetworkFdWatcher
+ * registers the watcher of an external event loop, which then drives the
+ * stack with NetworkHandlerSocketReady() and NetworkHandlerTimerDue() in place
+ * of NetworkHandlerProcessOnce().  The watcher is called on the stack's thread,
+ * also from within those two, and may add or remove the socket from an epoll
+ * set or libuv poll handle right there.  Wait for sockets level triggered,
+ * each call serves one request or drains one I/O socket.
+ */
+void SetNetworkFdWatcher( NetworkFdWatcher aWatcher, void* aContext );
+
+/**
+ * Function NetworkHandlerGetFds
+ * fills @a aFds with up to @a aMaxCount sockets the stack waits on, for the
+ * external loop's first registration.  Call after NetworkHandlerInitialize().
+ * Besides the sockets these are the descriptors of NetworkHandlerWake(),
+ * which are handed to NetworkHandlerSocketReady() like any other.
+ *
+ * @return int - how many there are, which may be more than @a aMaxCount.
+ */
+int NetworkHandlerGetFds( NetworkFd* aFds, int aMaxCount );
+
+/// Return the monotonic clock of NetworkHandlerNextDeadline() in usecs.
+uint64_t NetworkHandlerNowUSecs();
+
+/**
+ * Function NetworkHandlerNextDeadline
+ * returns when NetworkHandlerTimerDue() must next be called, on the clock of
+ * NetworkHandlerNowUSecs().  That is the earliest of the next timer tick, at
+ * which completed deferred services are picked up, and the next connection
+ * watchdog or production, see CipConnMgrClass::ConnectionsDueInUSecs().
+ * Commands posted by application threads make a NetworkHandlerWake()
+ * descriptor readable.
+ */
+uint64_t NetworkHandlerNextDeadline();
+
+/**
+ * Function NetworkHandlerSocketReady
+ * serves @a aSocket, which the external loop found readable, then any timer
+ * ticks which came due.  A socket the stack closed meanwhile is ignored.
+ */
+EipStatus NetworkHandlerSocketReady( int aSocket );
+
+/**
+ * Function NetworkHandlerTimerDue
+ * runs posted commands, sends completed deferred replies and calls
+ * ManageConnections() for each timer tick which came due, or for the
+ * connections which came due between ticks.  Calling it early is harmless.
+ */
+EipStatus NetworkHandlerTimerDue();
+
+
+/**
+ * Function NetworkHandlerProcessIo
+ * is the body of a dedicated real-time I/O thread, an alternative to calling
+ * NetworkHandlerProcessOnce() from a single thread.  It waits on the
+ * UdpSocketMgr sockets only, hands consumed class 0/1 frames to their
+ * connections and calls ManageConnections() every timer tick, so productions
+ * and watchdogs never wait behind a slow explicit request.  HandleApplication()
+ * and the assembly callbacks then run on this thread.
+ *
+ * Once either this or NetworkHandlerProcessExplicit() has been called, both
+ * must be called repeatedly, each from its own thread, and
+ * NetworkHandlerProcessOnce() must no longer be used.
+ *
+ * @param aTimeoutUSecs is the longest to wait for a frame, it is cut short
+ *  at the next timer tick or connection watchdog or production.
+ */
+EipStatus NetworkHandlerProcessIo( unsigned aTimeoutUSecs = 0 );
+
+/**
+ * Function NetworkHandlerProcessShard
+ * is the body of I/O worker thread @a aShard when the I/O connections are
+ * spread over several threads, see SetIoShardCount().  It is
+ * NetworkHandlerProcessIo() for the connections and sockets of one shard
+ * only, shard 0 being the thread which also runs HandleApplication() and the
+ * posted commands.  Each shard needs its own thread, the assembly callbacks
+ * of different shards may run at the same time.
+ */
+EipStatus NetworkHandlerProcessShard( int aShard, unsigned aTimeoutUSecs = 0 );
+
+/**
+ * Function SetIoShardCount
+ * sets how many I/O worker threads serve the I/O connections.  Shard k
+ * consumes on UDP port kEIP_IoUdpPort + k and produces from it, a new
+ * point to point connection goes to the shard with the least packets per
+ * second, multicast connections stay on shard 0.  Call it before
+ * NetworkHandlerInitialize().
+ *
+ * @return bool - false if @a aCount is not 1 to CIPSTER_MAX_IO_SHARDS or
+ *  the workers are already running.
+ */
+bool SetIoShardCount( int aCount );
+
+int IoShardCount();
+
+/**
+ * Function NetworkHandlerProcessExplicit
+ * is the body of the explicit messaging thread which accompanies
+ * NetworkHandlerProcessIo().  It accepts and serves TCP sessions and the
+ * UDP encapsulation listeners, sends delayed ListIdentity replies and ages
+ * inactive sessions.
+ *
+ * @param aTimeoutUSecs is the longest to wait for a request.
+ */
+EipStatus NetworkHandlerProcessExplicit( unsigned aTimeoutUSecs = 0 );
+
+/// Return true once the stack runs in the two thread mode above.
+bool NetworkHandlerIsThreaded();
+
+/**
+ * Function NetworkHandlerWake
+ * cuts short the wait on sockets of the thread which runs the explicit
+ * commands if @a isExplicit, else of the one which runs the I/O commands, so
+ * a command posted from any thread runs now rather than at the next timer
+ * tick.  The command queues call it, the first call after the waiter last
+ * woke costs one write to an eventfd, later ones nothing.  Without eventfd,
+ * as on Windows, it does nothing.
+ */
+void NetworkHandlerWake( bool isExplicit );
+
+/**
+ * Function NetworkHandlerDeferSessionClose
+ * queues closing of the TCP session @a aSessionHandle for the explicit
+ * messaging thread, which owns the sessions in the two thread mode.
+ */
+void NetworkHandlerDeferSessionClose( CipUdint aSessionHandle );
+
+
+/**
+ * Class IoLock
+ * is held by the I/O thread while it works on connections and assemblies,
+ * and by the explicit messaging thread while it runs a service of the
+ * Connection Manager, Connection or Assembly class.  Nothing else is shared
+ * between the two threads, so other explicit requests run without it.  It is
+ * recursive and cheap when uncontended, so the single thread mode takes it too.
+ * With several I/O shards it takes the lock of every shard, in shard order.
+ */
+class IoLock
+{
+public:
+    IoLock( bool isLocking = true );
+    ~IoLock();
+
+private:
+    int     m_count;    // shard locks held
+
+    // not copyable
+    IoLock( const IoLock& );
+    IoLock& operator=( const IoLock& );
+};
+
+/**
+ * Class ShardLock
+ * is held by I/O worker @a aShard while it works on its own connections.
+ * A worker holding it must not take IoLock, which could deadlock against
+ * the explicit thread.
+ */
+class ShardLock
+{
+public:
+    ShardLock( int aShard );
+    ~ShardLock();
+
+private:
+    int     m_shard;
+
+    // not copyable
+    ShardLock( const ShardLock& );
+    ShardLock& operator=( const ShardLock& );
+};
+
 /**
  * Function strerrno
  * returns a string containing text generated by the OS for the last value
  * of errno or WSAGetLastError()
  */
-std::string strerrno();
+FixedStr<128> strerrno();
 
 /**
  * Function CloseSocket
@@ -39,6 +292,103 @@ void CloseSocket( int aSocket );
 bool SocketAsync( int aSocket, bool isAsync = true );
 
 
+/**
+ * Enum SocketClass
+ * distinguishes the sockets which may be tuned differently by a SocketProfile.
+ */
+enum SocketClass
+{
+    kSocketClassIo,             ///< UdpSocketMgr sockets carrying class 0/1 I/O
+    kSocketClassExplicit,       ///< TCP and UDP sockets on port 0xAF12
+};
+
+
+/**
+ * Struct SocketProfile
+ * is a set of kernel socket options applied to every socket of a SocketClass.
+ * A negative value in any field means leave the OS default alone.
+ */
+struct SocketProfile
+{
+    SocketProfile() :
+        rcvbuf( -1 ),
+        sndbuf( -1 ),
+        busy_poll_usecs( -1 ),
+        priority( -1 ),
+        tos( -1 )
+    {}
+
+    int     rcvbuf;             ///< SO_RCVBUF in bytes
+    int     sndbuf;             ///< SO_SNDBUF in bytes
+    int     busy_poll_usecs;    ///< SO_BUSY_POLL, linux only
+    int     priority;           ///< SO_PRIORITY, linux only, applied after tos which resets it
+    int     tos;                ///< IP_TOS byte, superseded by the QoS object's DSCP
+};
+
+
+/**
+ * Function SetSocketProfile
+ * sets the current StackContext's profile for @a aClass and applies it to
+ * that stack's already open listener or UdpSocketMgr sockets of that class.
+ * Sockets opened afterwards get it when created.  Call it before
+ * NetworkHandlerInitialize() to cover every socket.  It takes IoLock, so not
+ * while holding a ShardLock.
+ */
+void SetSocketProfile( SocketClass aClass, const SocketProfile& aProfile );
+
+const SocketProfile& GetSocketProfile( SocketClass aClass );
+
+/**
+ * Function ApplySocketProfile
+ * sets the options of the profile for @a aClass on @a aSocket.  A rejected
+ * option is traced and skipped, the socket stays usable.
+ *
+ * @return bool - true if every requested option was accepted by the OS.
+ */
+bool ApplySocketProfile( int aSocket, SocketClass aClass );
+
+/**
+ * Function ReadSocketProfile
+ * reports the values the OS is actually using on @a aSocket, which can
+ * differ from what was requested, e.g. linux doubles SO_RCVBUF and caps it
+ * at net.core.rmem_max.  Options not supported on this OS are returned as -1.
+ */
+bool ReadSocketProfile( int aSocket, SocketProfile* aResult );
+
+
+/**
+ * Function SetTxTimeMode
+ * turns launch time scheduling of the current StackContext's produced I/O
+ * frames on or off.  When on, ManageConnections() produces a frame up to
+ * @a aLeadUSecs before it is due and gives the kernel its launch time with
+ * SCM_TXTIME, the connection's first production plus a whole number of
+ * RPIs, see CipConn::NextLaunchNSecs().  So an etf or fq qdisc on the
+ * egress interface releases it on schedule regardless of when the loop
+ * happened to run, e.g.
+ *   tc qdisc replace dev eth0 parent root etf clockid CLOCK_TAI delta 200000
+ *
+ * @param aLeadUSecs should be at least one kCIPsterTimerTickInMicroSeconds,
+ *  which is what 0 selects, and less than the smallest producing RPI.
+ * @param isClockTai selects CLOCK_TAI as etf wants, else CLOCK_MONOTONIC for fq.
+ * @return bool - false if SO_TXTIME is not supported or was refused, then the
+ *  mode is off.
+ *
+ * It may be called from any thread, it takes IoLock to reach the open I/O
+ * sockets.  It must not be called while holding a ShardLock.
+ */
+bool SetTxTimeMode( bool isEnabled, unsigned aLeadUSecs = 0, bool isClockTai = true );
+
+/// Return the production lead in usecs, or 0 when SetTxTimeMode() is off.
+unsigned TxTimeLeadUSecs();
+
+/**
+ * Function TxTimeLaunchNSecs
+ * returns the launch time for a frame due @a aDueUSecs from now, in
+ * nanoseconds of the clock chosen by SetTxTimeMode().
+ */
+uint64_t TxTimeLaunchNSecs( int32_t aDueUSecs );
+
+
 /**
  * Function SendUdpData
  * sends the bytes provided in @a aOutput to the UDP node given by @a aSockAddr
@@ -47,9 +397,55 @@ bool SocketAsync( int aSocket, bool isAsync = true );
  * @param aSockAddr is the "send to" address
  * @param aSocket is the socket descriptor to send on
  * @param aOutput is the data to send and its length
+ * @param aLaunchNSecs if not 0 is a launch time from TxTimeLaunchNSecs().
  * @return  EipStatus - EipStatusSuccess on success
  */
-EipStatus SendUdpData( const SockAddr& aSockAddr, int aSocket, BufReader aOutput );
+EipStatus SendUdpData( const SockAddr& aSockAddr, int aSocket, BufReader aOutput,
+        uint64_t aLaunchNSecs = 0 );
+
+
+class UdpSocket;
+
+
+#ifndef CIPSTER_GSO_BATCHES
+/// Batches of distinct destination, TOS or frame size an I/O shard's pass keeps open.
+#define CIPSTER_GSO_BATCHES         8
+#endif
+
+/**
+ * Function SetUdpGsoMode
+ * turns batching of the current StackContext's produced I/O frames into
+ * UDP_SEGMENT (GSO) sends on or off.  When on, CipConn::SendConnectedData()
+ * queues its frame with UdpGsoQueue() and ManageConnections() calls
+ * UdpGsoFlush() after its pass, so frames of equal size to the same
+ * destination which fall due in the same pass, in any order, cross the stack
+ * as one send and are segmented by the kernel.  It may be called from any
+ * thread, it takes IoLock to flush what the shards have queued.  It must not
+ * be called while holding a ShardLock.
+ *
+ * @return bool - false if UDP_SEGMENT is not available here, then the mode is off.
+ */
+bool SetUdpGsoMode( bool isEnabled );
+
+bool UdpGsoMode();
+
+/**
+ * Function UdpGsoQueue
+ * appends @a aFrame to the pending batch of its socket, TOS, destination and
+ * frame size, opening one if there is none with room.  All of the shard's
+ * batches are flushed first when none can be opened or their frames would
+ * not fit.
+ */
+EipStatus UdpGsoQueue( UdpSocket* aSocket, int aTOS, const SockAddr& aAddr,
+        BufReader aFrame, int aShard = 0 );
+
+/**
+ * Function UdpGsoFlush
+ * sends the pending batches of I/O shard @a aShard, if any.  Should a send
+ * fail the frames are sent one by one, and if the kernel refused UDP_SEGMENT
+ * itself, with EINVAL, EOPNOTSUPP or EIO, the mode is turned off.
+ */
+EipStatus UdpGsoFlush( int aShard = 0 );
 
 
 class UdpSocket
@@ -61,7 +457,8 @@ public:
         m_sockaddr( aSockAddr ),
         m_socket( aSocket ),
         m_ref_count( 1 ),
-        m_underlying( 0 )
+        m_underlying( 0 ),
+        m_tos( -1 )
     {
     }
 
@@ -74,28 +471,48 @@ public:
         }
     }
 
-    EipStatus Send( const SockAddr& aAddr, const BufReader& aReader )
+    EipStatus Send( const SockAddr& aAddr, const BufReader& aReader, uint64_t aLaunchNSecs = 0 )
     {
-        return ::SendUdpData( aAddr, m_socket, aReader );
+        return ::SendUdpData( aAddr, m_socket, aReader, aLaunchNSecs );
     }
 
-    int Recv( SockAddr* aAddr, const BufWriter& aWriter )
-    {
-        socklen_t   from_addr_length = SADDRZ;
+    /**
+     * Function Recv
+     * receives one datagram into @a aWriter and the sender's address into @a aAddr.
+     *
+     * @param aRxNSecs if not NULL is where to put the arrival time in
+     *   nanoseconds since the epoch (CLOCK_REALTIME).  It comes from the kernel's
+     *   SO_TIMESTAMPNS when the socket has it, else it is the time of this call.
+     *   It is 0 where the OS gives no timestamps.
+     * @return int - the received byte count, or <= 0 if nothing or error.
+     */
+    int Recv( SockAddr* aAddr, const BufWriter& aWriter, uint64_t* aRxNSecs = NULL );
 
-        return recvfrom( m_socket, (char*) aWriter.data(), aWriter.capacity(), 0,
-                    *aAddr, &from_addr_length );
-    }
+    /**
+     * Function SetTOS
+     * sets IP_TOS for subsequent sends on this socket, and again the profile's
+     * SO_PRIORITY which that resets, skipping the system calls when @a aTOS
+     * is what the socket already has.  A socket is shared by
+     * connections of differing priority, so call this before each production.
+     */
+    bool SetTOS( int aTOS );
+
+    /// Make the next SetTOS() write IP_TOS, once ApplySocketProfile() changed it.
+    void ForgetTOS()                        { m_tos = -1; }
 
     const SockAddr& SocketAddress() const   { return m_sockaddr; }
     int h() const                           { return m_socket; }
     int RefCount() const                    { return m_ref_count; }
 
+    /// Return the I/O shard whose worker reads this socket, by its port.
+    int Shard() const;
+
 private:
     SockAddr    m_sockaddr; // what this socket is bound to with bind()
     int         m_socket;
     int         m_ref_count;
     UdpSocket*  m_underlying;   // used by Multicast only.
+    int         m_tos;          // last IP_TOS set, -1 for OS default
 };
 
 
@@ -115,8 +532,7 @@ public:
     typedef sockets::iterator           sock_iter;
     typedef sockets::const_iterator     sock_citer;
 
-#define DEFAULT_BIND_IPADDR             INADDR_ANY
-//#define DEFAULT_BIND_IPADDR           ntohl( CipTCPIPInterfaceClass::IpAddress( 1 ) )
+#define DEFAULT_BIND_IPADDR             StackContext::Current().IoBindAddress()
 
     /**
      * Function GrabSocket
@@ -137,7 +553,14 @@ public:
      * group's reference count goes to zero.
      */
     static bool             ReleaseSocket( UdpSocket* aUdpSocket );
-    static sockets&         GetAllSockets()  { return m_sockets; }
+    static sockets&         GetAllSockets();
+
+    /**
+     * Function DeleteAll
+     * closes and frees every UDP socket of the current stack.  Connections
+     * must no longer hold any of them.
+     */
+    static void             DeleteAll();
 
 protected:
 
@@ -157,10 +580,6 @@ protected:
 
     // find aSockAddr in aList, return it or NULL if not found.
     static UdpSocket* find( const SockAddr& aSockAddr, const sockets& aList );
-
-    static sockets      m_sockets;
-    static sockets      m_multicast;    // these piggyback on a m_socket entry
-    static sockets      m_free;         // recycling bin
 };
 
 
@@ -0,0 +1,326 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#include "realtime.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+
+#if defined(__linux__)
+ #include <alloca.h>
+ #include <pthread.h>
+ #include <sched.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/resource.h>
+ #if defined(__GLIBC__)
+  #include <malloc.h>
+ #endif
+#endif
+
+#include <cipster_api.h>
+#include <trace.h>
+
+
+// Trivially constructed, so operator new may use them on any thread at any time.
+static thread_local bool        t_watching;
+static thread_local uint64_t    t_allocations;
+
+static thread_local RealTimeStats   t_stats;
+static thread_local RealTimeStats   t_reported;     // as of the previous RealTimeCheck()
+
+#if defined(__linux__)
+static thread_local struct rusage   t_base;         // as of EnterRealTimeMode()
+#endif
+
+
+#if REALTIME_HEAP_WATCH
+
+void* operator new( size_t aSize )
+{
+    if( t_watching )
+        ++t_allocations;
+
+    for(;;)
+    {
+        void* p = malloc( aSize ? aSize : 1 );
+
+        if( p )
+            return p;
+
+        std::new_handler handler = std::get_new_handler();
+
+        if( !handler )
+            throw std::bad_alloc();
+
+        handler();
+    }
+}
+
+
+void* operator new[]( size_t aSize )
+{
+    return operator new( aSize );
+}
+
+
+void* operator new( size_t aSize, const std::nothrow_t& ) noexcept
+{
+    try
+    {
+        return operator new( aSize );
+    }
+    catch( const std::bad_alloc& )
+    {
+        return NULL;
+    }
+}
+
+
+void* operator new[]( size_t aSize, const std::nothrow_t& ) noexcept
+{
+    return operator new( aSize, std::nothrow );
+}
+
+
+void operator delete( void* aPtr ) noexcept
+{
+    free( aPtr );
+}
+
+
+void operator delete[]( void* aPtr ) noexcept
+{
+    free( aPtr );
+}
+
+#endif  // REALTIME_HEAP_WATCH
+
+
+#if defined(__linux__)
+
+/**
+ * Function prefaultPages
+ * makes every page of [@a aStart, @a aStart + @a aSize) resident and writable
+ * without changing its contents.
+ */
+static void prefaultPages( void* aStart, size_t aSize )
+{
+    size_t page = sysconf( _SC_PAGESIZE );
+
+#if defined(MADV_POPULATE_WRITE)
+    uintptr_t begin = uintptr_t( aStart ) & ~uintptr_t( page - 1 );
+    uintptr_t end   = ( uintptr_t( aStart ) + aSize + page - 1 ) & ~uintptr_t( page - 1 );
+
+    if( !madvise( (void*) begin, end - begin, MADV_POPULATE_WRITE ) )
+        return;
+#endif
+
+    // Older kernels: write back what each page holds, nothing else runs yet.
+    volatile uint8_t* p = (volatile uint8_t*) aStart;
+
+    for( size_t i = 0; i < aSize; i += page )
+        p[i] = p[i];
+
+    if( aSize )
+        p[aSize - 1] = p[aSize - 1];
+}
+
+
+/// Touch @a aBytes of the calling thread's stack below this frame.
+static void __attribute__((noinline)) prefaultStack( unsigned aBytes )
+{
+    volatile uint8_t* p = (volatile uint8_t*) alloca( aBytes );
+
+    for( unsigned i = 0; i < aBytes; i += 1024 )
+        p[i] = 0;
+}
+
+
+/// Keep freed heap in the process and fault in @a aBytes of it.
+static void reserveHeap( unsigned aBytes )
+{
+#if defined(__GLIBC__)
+    // Neither give memory back to the kernel nor serve big blocks by mmap(),
+    // either would fault again on the next use.
+    mallopt( M_TRIM_THRESHOLD, -1 );
+    mallopt( M_MMAP_MAX, 0 );
+#endif
+
+    if( !aBytes )
+        return;
+
+    void* block = malloc( aBytes );
+
+    if( block )
+    {
+        memset( block, 0, aBytes );
+        free( block );
+    }
+}
+
+
+static bool pinThread( int aCpu )
+{
+    cpu_set_t   set;
+
+    CPU_ZERO( &set );
+    CPU_SET( aCpu, &set );
+
+    int err = pthread_setaffinity_np( pthread_self(), sizeof set, &set );
+
+    if( err )
+    {
+        CIPSTER_TRACE_ERR( "%s: unable to pin to CPU %d: %s\n",
+            __func__, aCpu, strerror( err ) );
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool raisePriority( int aPriority )
+{
+    sched_param param;
+
+    memset( &param, 0, sizeof param );
+    param.sched_priority = aPriority;
+
+    int err = pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+
+    if( err )
+    {
+        CIPSTER_TRACE_ERR( "%s: unable to set SCHED_FIFO priority %d: %s\n",
+            __func__, aPriority, strerror( err ) );
+        return false;
+    }
+
+    return true;
+}
+
+#endif  // __linux__
+
+
+bool EnterRealTimeMode( const RealTimeConfig& aConfig )
+{
+#if defined(__linux__)
+    bool ok = true;
+
+    StackContext& stack = StackContext::Current();
+
+    if( aConfig.prefault || aConfig.lock_memory )
+        reserveHeap( aConfig.prefault ? aConfig.heap_reserve_bytes : 0 );
+
+    if( aConfig.prefault )
+    {
+        // e.g. the deferred services or the command queues, which are
+        // otherwise constructed by their first request.
+        stack.CreateStates();
+
+        for( int i = 0; i < kStackStateCount; ++i )
+        {
+            StackState* state = stack.Find<StackState>( StackStateId( i ) );
+
+            if( state )
+                prefaultPages( state, StackContext::StateSize( StackStateId( i ) ) );
+        }
+
+        prefaultStack( aConfig.stack_prefault_bytes );
+    }
+
+    if( aConfig.lock_memory && mlockall( MCL_CURRENT | MCL_FUTURE ) )
+    {
+        CIPSTER_TRACE_ERR( "%s: mlockall: %s\n", __func__, strerrno().c_str() );
+        ok = false;
+    }
+
+    if( aConfig.cpu >= 0 && !pinThread( aConfig.cpu ) )
+        ok = false;
+
+    if( aConfig.priority > 0 && !raisePriority( aConfig.priority ) )
+        ok = false;
+
+#if !REALTIME_HEAP_WATCH
+    if( aConfig.watch_heap )
+        CIPSTER_TRACE_WARN( "%s: built without REALTIME_HEAP_WATCH\n", __func__ );
+#endif
+
+    getrusage( RUSAGE_THREAD, &t_base );
+
+    t_stats    = RealTimeStats();
+    t_reported = RealTimeStats();
+
+    t_allocations = 0;
+    t_watching    = aConfig.watch_heap;
+
+    CIPSTER_TRACE_INFO( "%s: cpu:%d priority:%d lock:%d prefault:%d ok:%d\n",
+        __func__, aConfig.cpu, aConfig.priority, aConfig.lock_memory,
+        aConfig.prefault, ok );
+
+    return ok;
+
+#else
+    (void) aConfig;
+
+    CIPSTER_TRACE_ERR( "%s: not supported on this platform\n", __func__ );
+    return false;
+#endif
+}
+
+
+void LeaveRealTimeMode()
+{
+    t_watching = false;
+
+#if defined(__linux__)
+    munlockall();
+#endif
+}
+
+
+const RealTimeStats& RealTimeCheck()
+{
+#if defined(__linux__)
+    struct rusage now;
+
+    if( !getrusage( RUSAGE_THREAD, &now ) )
+    {
+        t_stats.minor_faults = now.ru_minflt - t_base.ru_minflt;
+        t_stats.major_faults = now.ru_majflt - t_base.ru_majflt;
+        t_stats.involuntary_switches = now.ru_nivcsw - t_base.ru_nivcsw;
+    }
+#endif
+
+    t_stats.heap_allocations = t_allocations;
+
+    if( t_stats.heap_allocations > t_reported.heap_allocations )
+    {
+        CIPSTER_TRACE_WARN( "%s: %u heap allocations on the real-time thread\n",
+            __func__, unsigned( t_stats.heap_allocations - t_reported.heap_allocations ) );
+    }
+
+    if( t_stats.minor_faults > t_reported.minor_faults ||
+        t_stats.major_faults > t_reported.major_faults )
+    {
+        CIPSTER_TRACE_WARN( "%s: %u minor and %u major page faults on the real-time thread\n",
+            __func__,
+            unsigned( t_stats.minor_faults - t_reported.minor_faults ),
+            unsigned( t_stats.major_faults - t_reported.major_faults ) );
+    }
+
+    if( t_stats.involuntary_switches > t_reported.involuntary_switches )
+    {
+        CIPSTER_TRACE_WARN( "%s: real-time thread preempted %u times\n",
+            __func__,
+            unsigned( t_stats.involuntary_switches - t_reported.involuntary_switches ) );
+    }
+
+    t_reported = t_stats;
+
+    return t_stats;
+}
@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_REALTIME_H_
+#define CIPSTER_REALTIME_H_
+
+/** @file realtime.h
+ * @brief Deterministic execution of the stack's loop thread
+ *
+ * The first touch of a page, a heap allocation or a preemption by an ordinary
+ * process each costs the loop thread milliseconds which then show up as a gap
+ * in the productions.  EnterRealTimeMode() is called by the thread which will
+ * run NetworkHandlerProcessOnce() or NetworkHandlerProcessIo(), once
+ * CipStackInit() and the application's own setup are done and before the
+ * stack's other threads start.  It constructs and prefaults everything the
+ * current StackContext will use, locks the process's memory, pins the thread
+ * and raises its scheduling class.  RealTimeCheck() then reports anything
+ * which broke those promises since.
+ */
+
+#include <typedefs.h>
+
+
+#ifndef CIPSTER_RT_STACK_PREFAULT
+/// Bytes of the loop thread's stack EnterRealTimeMode() touches by default.
+#define CIPSTER_RT_STACK_PREFAULT       (256*1024)
+#endif
+
+#ifndef CIPSTER_RT_HEAP_RESERVE
+/// Bytes of heap EnterRealTimeMode() faults in and keeps by default.
+#define CIPSTER_RT_HEAP_RESERVE         (1024*1024)
+#endif
+
+
+/**
+ * Struct RealTimeConfig
+ * tells EnterRealTimeMode() what to do, the defaults do everything but
+ * pinning and scheduling, which need a choice of CPU and priority.
+ */
+struct RealTimeConfig
+{
+    RealTimeConfig() :
+        cpu( -1 ),
+        priority( 0 ),
+        lock_memory( true ),
+        prefault( true ),
+        stack_prefault_bytes( CIPSTER_RT_STACK_PREFAULT ),
+        heap_reserve_bytes( CIPSTER_RT_HEAP_RESERVE ),
+        watch_heap( true )
+    {}
+
+    int         cpu;                    ///< to pin the thread to, -1 for none
+    int         priority;               ///< SCHED_FIFO priority 1..99, 0 to leave the policy
+    bool        lock_memory;            ///< mlockall() current and future pages
+    bool        prefault;               ///< construct and touch StackContext state, stack and heap
+    unsigned    stack_prefault_bytes;
+    unsigned    heap_reserve_bytes;     ///< malloc()ed, touched and freed but kept by the heap
+    bool        watch_heap;             ///< count operator new calls on this thread, needs REALTIME_HEAP_WATCH
+};
+
+
+/**
+ * Struct RealTimeStats
+ * counts violations on the real-time thread since EnterRealTimeMode().
+ */
+struct RealTimeStats
+{
+    RealTimeStats() :
+        heap_allocations( 0 ),
+        minor_faults( 0 ),
+        major_faults( 0 ),
+        involuntary_switches( 0 )
+    {}
+
+    uint64_t    heap_allocations;       ///< operator new calls, if watch_heap
+    uint64_t    minor_faults;           ///< pages first touched
+    uint64_t    major_faults;           ///< pages read back from disk
+    uint64_t    involuntary_switches;   ///< preemptions by other threads
+};
+
+
+/**
+ * Function EnterRealTimeMode
+ * makes the calling thread the stack's real-time thread as told by
+ * @a aConfig.  Every step is tried, each failure is traced.
+ *
+ * @return bool - true if every step succeeded, false e.g. when the process
+ *  lacks CAP_SYS_NICE or CAP_IPC_LOCK, or on a platform without support.
+ */
+bool EnterRealTimeMode( const RealTimeConfig& aConfig = RealTimeConfig() );
+
+/**
+ * Function LeaveRealTimeMode
+ * stops watching the heap and unlocks memory, before ShutdownCipStack().
+ * The thread keeps its affinity and scheduling class.
+ */
+void LeaveRealTimeMode();
+
+/**
+ * Function RealTimeCheck
+ * brings the counts of the calling real-time thread up to date and traces a
+ * warning for every kind which grew since the previous call.  Call it from
+ * the loop now and then, e.g. once a second.
+ */
+const RealTimeStats& RealTimeCheck();
+
+#endif // CIPSTER_REALTIME_H_
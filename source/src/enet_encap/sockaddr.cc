@@ -10,11 +10,11 @@
  #include <netdb.h>
 #endif
 
-std::string IpAddrStr( in_addr aIP )
+FixedStr<16> IpAddrStr( in_addr aIP )
 {
-    // inet_ntoa uses a static buffer, so capture that into a std::string
+    // inet_ntoa uses a static buffer, so capture that into a FixedStr
     // for safe keeping.
-    return inet_ntoa( aIP );
+    return FixedStr<16>( inet_ntoa( aIP ) );
 }
 
 
@@ -20,10 +20,13 @@
 
 #include <stdexcept>
 
+#include "../utils/fixedstr.h"
+
 
 const int SADDRZ = sizeof(sockaddr);
 
-std::string IpAddrStr( in_addr aIP );
+/// Return @a aIP in dotted decimal, held in place.
+FixedStr<16> IpAddrStr( in_addr aIP );
 
 
 class socket_error : public std::runtime_error
@@ -101,7 +104,7 @@ public:
     unsigned Port() const       { return ntohs( sa.sin_port ); }
     unsigned Addr() const       { return ntohl( sa.sin_addr.s_addr ); }
 
-    std::string AddrStr() const { return IpAddrStr( sa.sin_addr ); }
+    FixedStr<16> AddrStr() const    { return IpAddrStr( sa.sin_addr ); }
 
     /**
      * Function IsValid
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#include "stackcontext.h"
+
+#include "enet_encap/networkhandler.h"
+#include "cip/ciptcpipinterface.h"
+
+
+thread_local StackContext* StackContext::t_current;
+
+
+// Filled in by static construction, constant afterwards.
+static StackStateFactory    s_factories[kStackStateCount];
+static size_t               s_sizes[kStackStateCount];
+
+
+StackContext::StackContext( bool aBindToInterface ) :
+    current_usecs( 0 ),
+    run_idle_state( 0 ),
+    bind_to_interface( aBindToInterface )
+{
+    for( int i = 0; i < kStackStateCount; ++i )
+        states[i].store( NULL, std::memory_order_relaxed );
+}
+
+
+StackContext::~StackContext()
+{
+    StackContext* was = t_current;
+
+    // A module's destructors may reach into its neighbours' state, which
+    // must be this stack's.
+    t_current = this;
+
+    for( int i = kStackStateCount - 1; i >= 0; --i )
+        delete states[i].exchange( NULL );
+
+    t_current = was != this ? was : NULL;
+}
+
+
+void StackContext::Select()
+{
+    t_current = this;
+}
+
+
+void StackContext::SelectDefault()
+{
+    t_current = NULL;
+}
+
+
+StackContext& StackContext::Default()
+{
+    static StackContext s_default( false );
+
+    return s_default;
+}
+
+
+uint32_t StackContext::IoBindAddress() const
+{
+    if( !bind_to_interface )
+        return INADDR_ANY;
+
+    return ntohl( CipTCPIPInterfaceClass::IpAddress( 1 ) );
+}
+
+
+StackState* StackContext::create( StackStateId aId, StackState* aState )
+{
+    StackState* expected = NULL;
+
+    // Two threads of this stack may get here at once, the loser's is dropped.
+    if( !states[aId].compare_exchange_strong( expected, aState,
+            std::memory_order_acq_rel ) )
+    {
+        delete aState;
+        return expected;
+    }
+
+    return aState;
+}
+
+
+void StackContext::CreateStates()
+{
+    for( int i = 0; i < kStackStateCount; ++i )
+    {
+        if( s_factories[i] && !states[i].load( std::memory_order_acquire ) )
+            create( StackStateId( i ), s_factories[i]() );
+    }
+}
+
+
+size_t StackContext::StateSize( StackStateId aId )
+{
+    return s_sizes[aId];
+}
+
+
+void StackContext::RegisterStateType( StackStateId aId, StackStateFactory aFactory,
+        size_t aSize )
+{
+    s_factories[aId] = aFactory;
+    s_sizes[aId]     = aSize;
+}
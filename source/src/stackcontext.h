@@ -0,0 +1,188 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_STACKCONTEXT_H_
+#define CIPSTER_STACKCONTEXT_H_
+
+/** @file stackcontext.h
+ * @brief Several independent stacks in one process
+ *
+ * Everything one adapter owns, its sockets, sessions, connections, CIP
+ * classes and clocks, lives in a StackContext.  A process which needs only
+ * one adapter never sees this, every thread then drives a built in default
+ * stack.  One which emulates many devices, or serves several NICs as
+ * separate identities, constructs a StackContext per device and calls
+ * Select() on it before each call into the stack, starting with
+ * CipStackInit().  A thread drives one stack at a time, several threads may
+ * each drive their own.
+ *
+ * A stack made with aBindToInterface true binds its point to point UDP I/O
+ * sockets to the address given to ConfigureNetworkInterface() instead of
+ * INADDR_ANY, so many of them can share port 2222 on loopback aliases or
+ * separate NICs.  Sockets consuming O->T multicast stay on INADDR_ANY, as
+ * one bound to a unicast address receives no group traffic.
+ * The TCP and UDP encapsulation listeners are always bound to that address.
+ *
+ * Socket tuning, i.e. SetSocketProfile(), SetTxTimeMode() and SetUdpGsoMode(),
+ * is per stack too, so set it on each one.  The deferred service workers,
+ * g_my_io_udp_port and tracing stay process wide.
+ */
+
+#include <atomic>
+#include <stddef.h>
+
+#include <typedefs.h>
+
+
+/**
+ * Struct StackState
+ * is the base of a module's share of a StackContext, see StackContext::State().
+ */
+struct StackState
+{
+    virtual ~StackState() {}
+};
+
+
+/// Index of a module's StackState within a StackContext.
+enum StackStateId
+{
+    kStackStateNetwork,
+    kStackStateUdpGso,
+    kStackStateEncap,
+    kStackStateClasses,
+    kStackStateConnMgr,
+    kStackStateConnections,
+    kStackStateAppConnTypes,
+    kStackStateMessageRouter,
+    kStackStateAssemblies,
+    kStackStateIdentity,
+    kStackStateTcpIp,
+    kStackStateQos,
+    kStackStateDeferred,
+    kStackStateCommands,
+
+    kStackStateCount
+};
+
+
+/// Constructs a module's StackState, see StackStateType.
+typedef StackState* (*StackStateFactory)();
+
+
+/**
+ * Class StackContext
+ * is one independent instance of the stack.
+ */
+class StackContext
+{
+public:
+    StackContext( bool aBindToInterface = false );
+
+    /// Call ShutdownCipStack() with this selected first.
+    ~StackContext();
+
+    /**
+     * Function Select
+     * makes this the stack which the calling thread drives.
+     */
+    void Select();
+
+    /**
+     * Function SelectDefault
+     * makes the built in default stack the one the calling thread drives.
+     */
+    static void SelectDefault();
+
+    /// Return the stack the calling thread drives.
+    static StackContext& Current()
+    {
+        StackContext* c = t_current;
+        return c ? *c : Default();
+    }
+
+    /// Return the stack used by threads which selected none.
+    static StackContext& Default();
+
+    /**
+     * Function IoBindAddress
+     * returns the address in host byte order which UDP I/O sockets are bound
+     * to, INADDR_ANY unless this stack was constructed with aBindToInterface.
+     */
+    uint32_t IoBindAddress() const;
+
+    /**
+     * Function State
+     * returns the module's share of this stack, constructing it on first use.
+     * Modules call this only through their own accessor.
+     */
+    template< class T >
+    T& State( StackStateId aId )
+    {
+        StackState* s = states[aId].load( std::memory_order_acquire );
+
+        if( !s )
+            s = create( aId, new T() );
+
+        return *static_cast<T*>( s );
+    }
+
+    /// Return the module's share of this stack, or NULL if not yet constructed.
+    template< class T >
+    T* Find( StackStateId aId ) const
+    {
+        return static_cast<T*>( states[aId].load( std::memory_order_acquire ) );
+    }
+
+    /**
+     * Function CreateStates
+     * constructs the share of every module which registered a StackStateType
+     * and is not yet constructed, so none is allocated later on a hot path.
+     */
+    void CreateStates();
+
+    /// Return the size of module @a aId's share, 0 if it registered no StackStateType.
+    static size_t StateSize( StackStateId aId );
+
+    static void RegisterStateType( StackStateId aId, StackStateFactory aFactory,
+                    size_t aSize );
+
+    uint64_t    current_usecs;      ///< this stack's clock, advanced by the network handler
+
+    /// The run/idle mode sent when our producing half is kRealTimeFmt32BitHeader,
+    /// which is likely only when we are acting as a scanner.
+    uint32_t    run_idle_state;
+
+private:
+    StackState* create( StackStateId aId, StackState* aState );
+
+    bool        bind_to_interface;
+
+    std::atomic<StackState*>    states[kStackStateCount];
+
+    static thread_local StackContext* t_current;
+
+    // not copyable
+    StackContext( const StackContext& );
+    StackContext& operator=( const StackContext& );
+};
+
+
+/**
+ * Struct StackStateType
+ * tells StackContext::CreateStates() how to construct module state T.  A
+ * module defines one static instance next to its accessor.
+ */
+template< class T >
+struct StackStateType
+{
+    StackStateType( StackStateId aId )
+    {
+        StackContext::RegisterStateType( aId, make, sizeof(T) );
+    }
+
+    static StackState* make()   { return new T(); }
+};
+
+#endif // CIPSTER_STACKCONTEXT_H_
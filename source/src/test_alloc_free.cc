@@ -0,0 +1,384 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+/*
+    The CMake build target for this is "test_alloc_free", do "make help" in the
+    _library's_ build directory to see that.
+
+    It runs the stack on loopback and is its own originator: a class 1
+    exclusive owner connection, a class 3 connection and unconnected
+    requests.  After a warm up every heap allocation made while the stack
+    runs is counted, with a backtrace of the first few, and any makes the
+    test fail.  Stop other adapters on port 44818 and 2222 first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <new>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "test_common.h"
+
+
+//-----<Interception>-----------------------------------------------------------
+
+// Linked with -Wl,--wrap=malloc etc.  That misses libstdc++'s own operator
+// new, whose call to malloc() is already bound, so the one below counts it.
+// The global operator new of REALTIME_HEAP_WATCH calls malloc() from here.
+extern "C" void* __real_malloc( size_t aSize );
+extern "C" void* __real_calloc( size_t aCount, size_t aSize );
+extern "C" void* __real_realloc( void* aPtr, size_t aSize );
+
+static bool     s_warm;         // counting while the stack runs
+static bool     s_armed;        // the stack runs now
+static unsigned s_allocations;
+
+const unsigned  BACKTRACES = 5;
+
+
+static void count( const char* aFunc, size_t aSize )
+{
+    if( !s_armed )
+        return;
+
+    ++s_allocations;
+
+    if( s_allocations <= BACKTRACES )
+    {
+        void*   frames[24];
+
+        s_armed = false;
+
+        fprintf( stderr, "%s( %zu ) after warm up:\n", aFunc, aSize );
+
+        backtrace_symbols_fd( frames, backtrace( frames, 24 ), 2 );
+
+        s_armed = true;
+    }
+}
+
+
+extern "C" void* __wrap_malloc( size_t aSize )
+{
+    count( "malloc", aSize );
+    return __real_malloc( aSize );
+}
+
+
+extern "C" void* __wrap_calloc( size_t aCount, size_t aSize )
+{
+    count( "calloc", aCount * aSize );
+    return __real_calloc( aCount, aSize );
+}
+
+
+extern "C" void* __wrap_realloc( void* aPtr, size_t aSize )
+{
+    count( "realloc", aSize );
+    return __real_realloc( aPtr, aSize );
+}
+
+
+#if !REALTIME_HEAP_WATCH
+
+void* operator new( size_t aSize )
+{
+    count( "operator new", aSize );
+
+    void* p = __real_malloc( aSize ? aSize : 1 );
+
+    if( !p )
+        throw std::bad_alloc();
+
+    return p;
+}
+
+
+void* operator new[]( size_t aSize )
+{
+    return operator new( aSize );
+}
+
+
+void* operator new( size_t aSize, const std::nothrow_t& ) noexcept
+{
+    count( "operator new", aSize );
+    return __real_malloc( aSize ? aSize : 1 );
+}
+
+
+void* operator new[]( size_t aSize, const std::nothrow_t& ) noexcept
+{
+    return operator new( aSize, std::nothrow );
+}
+
+
+void operator delete( void* aPtr ) noexcept
+{
+    free( aPtr );
+}
+
+
+void operator delete[]( void* aPtr ) noexcept
+{
+    free( aPtr );
+}
+
+#endif  // !REALTIME_HEAP_WATCH
+
+//-----</Interception>----------------------------------------------------------
+
+
+//-----<Application>------------------------------------------------------------
+
+#define INPUT_ASSEMBLY      100
+#define OUTPUT_ASSEMBLY     150
+#define CONFIG_ASSEMBLY     151
+
+static uint8_t  s_input[128];
+static uint8_t  s_output[128];
+static uint8_t  s_config[64];
+
+
+static void createAssemblies()
+{
+    CreateAssemblyInstance( INPUT_ASSEMBLY,  ByteBuf( s_input,  sizeof s_input ) );
+    CreateAssemblyInstance( OUTPUT_ASSEMBLY, ByteBuf( s_output, sizeof s_output ) );
+    CreateAssemblyInstance( CONFIG_ASSEMBLY, ByteBuf( s_config, sizeof s_config ) );
+
+    // the forward open carries no configuration data
+    ConfigureExclusiveOwnerConnectionPoint( OUTPUT_ASSEMBLY, INPUT_ASSEMBLY, -1 );
+}
+
+
+static EipStatus echo( AssemblyInstance* aInstance, OpMode aMode, int aBytesReceivedCount )
+{
+    if( aInstance->Id() == OUTPUT_ASSEMBLY )
+        memcpy( s_input, s_output, sizeof s_input );
+
+    return kEipStatusOk;
+}
+
+//-----</Application>-----------------------------------------------------------
+
+
+//-----<Originator>-------------------------------------------------------------
+
+static int      s_udp;          // T->O class 1 frames
+static int      s_frames;
+
+
+static uint64_t now_usecs()
+{
+    timespec    now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return uint64_t( now.tv_sec ) * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/// Serve the stack, armed once warm, until it has nothing left to do.
+static void serve()
+{
+    for( int i = 0; i < 4; ++i )
+    {
+        s_armed = s_warm;
+
+        NetworkHandlerProcessOnce();
+
+        s_armed = false;
+    }
+}
+
+
+/// Open a connection with @a aPath and return the O->T and T->O ids, or false.
+static bool forwardOpen( uint16_t aSerial, uint8_t aTrigger, uint32_t aRpi,
+        uint16_t aOtParams, uint16_t aToParams, const uint8_t* aPath, int aPathLength,
+        uint32_t* aOtId, uint32_t* aToId )
+{
+    uint8_t     req[200];
+    BufWriter   w( req, sizeof req );
+
+    const uint8_t cm[] = { 0x54, 2, 0x20, 6, 0x24, 1 };
+
+    w.append( cm, sizeof cm );
+    w.put8( 0x0a ).put8( 0x0e ).put32( 0 ).put32( 0x1000 + aSerial );
+    w.put16( aSerial ).put16( 0x1234 ).put32( 0x5678 );
+    w.put8( 0 ).fill( 3 );
+    w.put32( aRpi ).put16( aOtParams ).put32( aRpi ).put16( aToParams );
+    w.put8( aTrigger ).put8( aPathLength / 2 ).append( aPath, aPathLength );
+
+    // our T->O port
+    sockaddr_in addr;
+    socklen_t   addrz = sizeof addr;
+
+    getsockname( s_udp, (sockaddr*) &addr, &addrz );
+
+    uint8_t     item[20];
+    BufWriter   i( item, sizeof item );
+
+    i.put16( kCpfIdSockAddrInfo_T_O ).put16( 16 );
+    i.put16BE( AF_INET ).put16BE( ntohs( addr.sin_port ) ).put32( 0 ).fill( 8 );
+
+    uint8_t reply[600];
+    int len = TestSendRRData( req, w.data() - req, reply, sizeof reply,
+                item, i.data() - item );
+
+    const int mr = TEST_MR_REPLY;
+
+    if( len < mr + 12 || reply[mr + 2] != 0 )
+    {
+        fprintf( stderr, "forward open failed\n" );
+        return false;
+    }
+
+    BufReader r( reply + mr + 4, 8 );
+
+    *aOtId = r.get32();
+    *aToId = r.get32();
+    return true;
+}
+
+//-----</Originator>------------------------------------------------------------
+
+
+int main( int argc, char** argv )
+{
+    void*   frames[2];
+
+    // dlopen()s libgcc on first use, so before arming
+    backtrace( frames, 2 );
+
+    CipStackInit( 0x4321 );
+
+    ConfigureNetworkInterface( "127.0.0.1", "255.0.0.0", "127.0.0.1" );
+    SetDeviceSerialNumber( 0x12345678 );
+
+    createAssemblies();
+    g_test_received = echo;
+    g_test_serve    = serve;
+
+    if( NetworkHandlerInitialize() != kEipStatusOk )
+    {
+        fprintf( stderr, "unable to start the stack\n" );
+        return 2;
+    }
+
+    sockaddr_in addr;
+
+    memset( &addr, 0, sizeof addr );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    s_udp = socket( AF_INET, SOCK_DGRAM, 0 );
+    bind( s_udp, (sockaddr*) &addr, sizeof addr );
+
+    if( !TestOpenSession() )
+        return 2;
+
+    uint8_t reply[600];
+
+    const uint8_t io_path[] = { 0x20, 0x04, 0x24, CONFIG_ASSEMBLY, 0x2c, OUTPUT_ASSEMBLY,
+                                0x2c, INPUT_ASSEMBLY };
+    const uint8_t mr_path[] = { 0x20, 0x02, 0x24, 0x01 };
+
+    uint32_t io_ot, io_to, mr_ot, mr_to;
+
+    // class 1 cyclic, 128 data + 2 sequence + 4 run/idle header O->T
+    if( !forwardOpen( 1, 0x01, 10000, 0x4000 | 134, 0x4000 | 130,
+            io_path, sizeof io_path, &io_ot, &io_to ) )
+        return 2;
+
+    // class 3 to the message router
+    if( !forwardOpen( 2, 0xa3, 1000000, 0x4000 | 500, 0x4000 | 500,
+            mr_path, sizeof mr_path, &mr_ot, &mr_to ) )
+        return 2;
+
+    addr.sin_port = htons( kEIP_IoUdpPort );
+
+    const uint8_t get_name[]  = { 0x0e, 3, 0x20, 1, 0x24, 1, 0x30, 7 };
+    const uint8_t get_all[]   = { 0x01, 2, 0x20, 1, 0x24, 1 };
+    const uint8_t get_input[] = { 0x0e, 3, 0x20, 4, 0x24, INPUT_ASSEMBLY, 0x30, 3 };
+
+    const uint8_t* const    connected[]  = { get_name, get_all };
+    const int               connectedz[] = { sizeof get_name, sizeof get_all };
+
+    uint32_t    io_seq = 0;
+    uint16_t    mr_seq = 0;
+
+    uint64_t    start = now_usecs();
+    uint64_t    next = start;
+
+    const uint64_t WARM_USECS = 1000000;
+    const uint64_t RUN_USECS  = 3000000;
+
+    while( now_usecs() - start < RUN_USECS )
+    {
+        s_warm = now_usecs() - start >= WARM_USECS;
+
+        if( now_usecs() < next )
+        {
+            serve();
+
+            uint8_t frame[200];
+
+            while( recv( s_udp, frame, sizeof frame, MSG_DONTWAIT ) > 0 )
+                ++s_frames;
+
+            continue;
+        }
+
+        next += 10000;
+
+        // a class 1 frame
+        uint8_t     frame[200];
+        BufWriter   w( frame, sizeof frame );
+
+        ++io_seq;
+
+        w.put16( 2 );
+        w.put16( kCpfIdSequencedAddress ).put16( 8 ).put32( io_ot ).put32( io_seq );
+        w.put16( kCpfIdConnectedDataItem ).put16( 134 ).put16( io_seq ).put32( 1 );
+        w.fill( 128 );
+
+        sendto( s_udp, frame, w.data() - frame, 0, (sockaddr*) &addr, sizeof addr );
+
+        // a class 3 request
+        uint8_t     cpf[100];
+        BufWriter   c( cpf, sizeof cpf );
+
+        c.put32( 0 ).put16( 0 ).put16( 2 );
+        c.put16( kCpfIdConnectedAddress ).put16( 4 ).put32( mr_ot );
+        int k = mr_seq & 1;
+
+        c.put16( kCpfIdConnectedDataItem ).put16( 2 + connectedz[k] );
+        c.put16( ++mr_seq ).append( connected[k], connectedz[k] );
+
+        TestTransact( 0x70, cpf, c.data() - cpf, reply, sizeof reply );
+
+        // an unconnected one
+        TestSendRRData( get_input, sizeof get_input, reply, sizeof reply );
+    }
+
+    printf( "replies:%d frames:%d allocations:%u\n", TestReplies(), s_frames, s_allocations );
+
+    NetworkHandlerFinish();
+    ShutdownCipStack();
+
+    if( !s_frames )
+    {
+        fprintf( stderr, "no class 1 traffic\n" );
+        return 2;
+    }
+
+    return s_allocations ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "test_common.h"
+
+
+//-----<Application>------------------------------------------------------------
+
+EipStatus (*g_test_received)( AssemblyInstance* aInstance,
+        OpMode aMode, int aBytesReceivedCount );
+
+
+EipStatus ApplicationInitialization()
+{
+    return kEipStatusOk;
+}
+
+
+void HandleApplication()
+{
+}
+
+
+void NotifyIoConnectionEvent( CipConn* aConn, IoConnectionEvent aEvent )
+{
+}
+
+
+EipStatus AfterAssemblyDataReceived( AssemblyInstance* aInstance,
+        OpMode aMode, int aBytesReceivedCount )
+{
+    if( g_test_received )
+        return g_test_received( aInstance, aMode, aBytesReceivedCount );
+
+    return kEipStatusOk;
+}
+
+
+bool BeforeAssemblyDataSend( AssemblyInstance* aInstance )
+{
+    return true;
+}
+
+
+EipStatus ResetDevice()
+{
+    return kEipStatusOk;
+}
+
+
+EipStatus ResetDeviceToInitialConfiguration( bool also_reset_comm_params )
+{
+    return kEipStatusOk;
+}
+
+
+void RunIdleChanged( uint32_t run_idle_value )
+{
+}
+
+//-----</Application>-----------------------------------------------------------
+
+
+//-----<Originator>-------------------------------------------------------------
+
+void (*g_test_serve)();
+
+static int      s_tcp = -1;
+static uint32_t s_session;
+static int      s_replies;
+
+
+bool TestOpenSession()
+{
+    sockaddr_in addr;
+
+    memset( &addr, 0, sizeof addr );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = htons( kEIP_Reserved_Port );
+
+    s_tcp = socket( AF_INET, SOCK_STREAM, 0 );
+    fcntl( s_tcp, F_SETFL, O_NONBLOCK );
+    connect( s_tcp, (sockaddr*) &addr, sizeof addr );
+
+    uint8_t reply[100];
+
+    const uint8_t reg[] = { 1, 0, 0, 0 };
+
+    if( TestTransact( 0x65, reg, sizeof reg, reply, sizeof reply ) < 8 )
+        return false;
+
+    s_session = BufReader( reply + 4, 4 ).get32();
+    return true;
+}
+
+
+int TestTransact( uint16_t aCommand, const uint8_t* aData, int aLength,
+        uint8_t* aReply, int aReplySize )
+{
+    uint8_t     frame[2000];
+    BufWriter   w( frame, sizeof frame );
+
+    w.put16( aCommand ).put16( aLength ).put32( s_session ).put32( 0 );
+    w.fill( 8 ).put32( 0 );
+    w.append( aData, aLength );
+
+    send( s_tcp, frame, w.data() - frame, 0 );
+
+    for( int tries = 0; tries < 1000; ++tries )
+    {
+        if( g_test_serve )
+            g_test_serve();
+        else
+            NetworkHandlerProcessOnce();
+
+        int len = recv( s_tcp, aReply, aReplySize, MSG_DONTWAIT );
+
+        if( len > 0 )
+        {
+            ++s_replies;
+            return len;
+        }
+    }
+
+    fprintf( stderr, "no reply to command 0x%x\n", aCommand );
+    return -1;
+}
+
+
+int TestSendRRData( const uint8_t* aRequest, int aLength, uint8_t* aReply,
+        int aReplySize, const uint8_t* aItem, int aItemLength )
+{
+    uint8_t     cpf[1900];
+    BufWriter   w( cpf, sizeof cpf );
+
+    w.put32( 0 ).put16( 0 ).put16( aItem ? 3 : 2 );
+    w.put16( kCpfIdNullAddress ).put16( 0 );
+    w.put16( kCpfIdUnconnectedDataItem ).put16( aLength ).append( aRequest, aLength );
+
+    if( aItem )
+        w.append( aItem, aItemLength );
+
+    return TestTransact( 0x6f, cpf, w.data() - cpf, aReply, aReplySize );
+}
+
+
+int TestReplies()
+{
+    return s_replies;
+}
+
+//-----</Originator>------------------------------------------------------------
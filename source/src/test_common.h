@@ -0,0 +1,68 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+#ifndef CIPSTER_TEST_COMMON_H_
+#define CIPSTER_TEST_COMMON_H_
+
+/*
+    What the test and bench programs share, linked into each of them: the
+    application callbacks the stack requires, and an originator which talks
+    to the stack over loopback TCP.  A program creates its own assemblies
+    before NetworkHandlerInitialize(), ApplicationInitialization() here does
+    nothing.
+*/
+
+#include <cipster_api.h>
+
+
+//-----<Application>------------------------------------------------------------
+
+/// Called by AfterAssemblyDataReceived() if not NULL.
+extern EipStatus (*g_test_received)( AssemblyInstance* aInstance,
+        OpMode aMode, int aBytesReceivedCount );
+
+//-----</Application>-----------------------------------------------------------
+
+
+//-----<Originator>-------------------------------------------------------------
+
+// encap 24, handle + timeout 6, count 2, null item 4, data item header 4
+const int TEST_MR_REPLY = 24 + 6 + 2 + 4 + 4;
+
+/// Run by TestTransact() while it waits, NetworkHandlerProcessOnce() if NULL.
+extern void (*g_test_serve)();
+
+/**
+ * Function TestOpenSession
+ * connects to the stack's TCP port on loopback and registers a session,
+ * which the other functions below use.
+ */
+bool TestOpenSession();
+
+/**
+ * Function TestTransact
+ * sends encapsulation @a aCommand carrying @a aData on the session and
+ * serves the stack until the reply arrives.
+ *
+ * @return int - the reply's length, or -1 if none came.
+ */
+int TestTransact( uint16_t aCommand, const uint8_t* aData, int aLength,
+        uint8_t* aReply, int aReplySize );
+
+/**
+ * Function TestSendRRData
+ * sends unconnected @a aRequest with SendRRData, plus @a aItem as a third
+ * item if not NULL, e.g. a sockaddr info item.
+ *
+ * @return int - the reply's length, or -1 if none came.
+ */
+int TestSendRRData( const uint8_t* aRequest, int aLength, uint8_t* aReply,
+        int aReplySize, const uint8_t* aItem = NULL, int aItemLength = 0 );
+
+/// Return how many replies TestTransact() received.
+int TestReplies();
+
+//-----</Originator>------------------------------------------------------------
+
+#endif  // CIPSTER_TEST_COMMON_H_
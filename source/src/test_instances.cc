@@ -0,0 +1,200 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+/*
+    The CMake build target for this is "test_instances", do "make help" in the
+    _library's_ build directory to see that.
+
+    It fills classes with more than ten thousand instances each, inserted in
+    ascending, descending, shuffled and bulk order, some with sparse ids in
+    between, then removes some and inserts others.  After every step each id
+    from 1 to 65535 is looked up and must be found exactly when it was
+    inserted.  CipClass::Instance() trusts the dense index for every id below
+    its size, so this also proves denseAdd() and denseRebuild() left no
+    instance out of it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "test_common.h"
+
+
+static int s_failures;
+
+const int COUNT = 12000;
+
+
+static void check( bool aOk, const char* aWhat, int aId )
+{
+    if( !aOk )
+    {
+        fprintf( stderr, "FAIL: %s, id:%d\n", aWhat, aId );
+        ++s_failures;
+    }
+}
+
+
+/// Compare @a aClass to the set of ids in @a aPresent.
+static void verify( CipClass* aClass, const std::vector<bool>& aPresent, const char* aWhat )
+{
+    int failures = s_failures;
+    int count = 0;
+    int last  = 0;
+
+    for( int id = 1; id <= 65535 && s_failures - failures < 10; ++id )
+    {
+        CipInstance* inst = aClass->Instance( id );
+
+        if( aPresent[id] )
+        {
+            ++count;
+            check( inst && inst->Id() == id, aWhat, id );
+        }
+        else
+            check( !inst, aWhat, id );
+    }
+
+    check( aClass->InstanceCount() == unsigned( count ), aWhat, count );
+
+    // and Instances() stays sorted by id
+    for( unsigned i = 0; i < aClass->Instances().size(); ++i )
+    {
+        int id = aClass->Instances()[i]->Id();
+
+        check( id > last, aWhat, id );
+        last = id;
+    }
+}
+
+
+/// Remove every seventh instance, then insert ids no longer in use.
+static void churn( CipClass* aClass, std::vector<bool>& aPresent, const char* aWhat )
+{
+    std::vector<int> ids;
+
+    for( unsigned i = 0; i < aClass->Instances().size(); ++i )
+        ids.push_back( aClass->Instances()[i]->Id() );
+
+    for( unsigned i = 0; i < ids.size(); i += 7 )
+    {
+        CipInstance* inst = aClass->InstanceRemove( ids[i] );
+
+        check( inst && inst->Id() == ids[i], "remove", ids[i] );
+        delete inst;
+
+        aPresent[ids[i]] = false;
+    }
+
+    check( !aClass->InstanceRemove( ids[0] ), "remove twice", ids[0] );
+
+    verify( aClass, aPresent, aWhat );
+
+    // some back where they were, some new ones past the end
+    for( int id = 1; id <= 65535; id += 997 )
+    {
+        if( aPresent[id] )
+            continue;
+
+        check( aClass->InstanceInsert( new CipInstance( id ) ), "reinsert", id );
+        aPresent[id] = true;
+    }
+
+    verify( aClass, aPresent, aWhat );
+}
+
+
+int main( int argc, char** argv )
+{
+    CipStackInit( 0x4321 );
+
+    enum { ASCENDING, DESCENDING, SHUFFLED, BULK, SPARSE_FIRST, MODES };
+
+    const char* names[MODES] = {
+        "ascending", "descending", "shuffled", "bulk", "sparse first"
+    };
+
+    for( int mode = 0; mode < MODES; ++mode )
+    {
+        CipClass* clazz = new CipClass( 0x300 + mode, names[mode],
+                            MASK7( 1,2,3,4,5,6,7 ), 1 );
+
+        RegisterCipClass( clazz );
+
+        std::vector<int>    ids;
+        std::vector<bool>   present( 65536, false );
+
+        // bulk spreads its ids out, the others are 1..COUNT
+        for( int i = 1; i <= COUNT; ++i )
+            ids.push_back( mode == BULK ? i * 5 : i );
+
+        if( mode == DESCENDING )
+            std::reverse( ids.begin(), ids.end() );
+        else if( mode == SHUFFLED )
+        {
+            srand( 1 );
+            std::random_shuffle( ids.begin(), ids.end() );
+        }
+        else if( mode == SPARSE_FIRST )
+        {
+            // too sparse for the dense index until the ids below fill in
+            const int sparse[] = { 60000, 30000, COUNT + 500, COUNT + 1 };
+
+            for( unsigned i = 0; i < sizeof sparse / sizeof sparse[0]; ++i )
+            {
+                check( clazz->InstanceInsert( new CipInstance( sparse[i] ) ),
+                    "insert sparse", sparse[i] );
+                present[sparse[i]] = true;
+            }
+        }
+
+        if( mode == BULK )
+        {
+            std::vector<CipInstance*> batch;
+
+            for( unsigned i = 0; i < ids.size(); ++i )
+                batch.push_back( new CipInstance( ids[i] ) );
+
+            check( clazz->InstanceInsert( &batch[0], batch.size() ), "bulk insert", 0 );
+
+            for( unsigned i = 0; i < ids.size(); ++i )
+                present[ids[i]] = true;
+
+            // a batch with a duplicate is refused whole
+            CipInstance*    dup[2] = { new CipInstance( 65001 ), new CipInstance( ids[3] ) };
+
+            check( !clazz->InstanceInsert( dup, 2 ), "bulk duplicate refused", ids[3] );
+            check( !clazz->Instance( 65001 ), "bulk duplicate left nothing", 65001 );
+
+            delete dup[0];
+            delete dup[1];
+        }
+        else
+        {
+            for( unsigned i = 0; i < ids.size(); ++i )
+            {
+                check( clazz->InstanceInsert( new CipInstance( ids[i] ) ), "insert", ids[i] );
+                present[ids[i]] = true;
+            }
+
+            CipInstance* dup = new CipInstance( ids[0] );
+
+            check( !clazz->InstanceInsert( dup ), "duplicate refused", ids[0] );
+            delete dup;
+        }
+
+        verify( clazz, present, names[mode] );
+
+        churn( clazz, present, names[mode] );
+    }
+
+    printf( "failures:%d\n", s_failures );
+
+    ShutdownCipStack();
+
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,290 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+/*
+    The CMake build target for this is "test_msp", do "make help" in the
+    _library's_ build directory to see that.
+
+    It runs the stack on loopback and sends it Multiple Service Packets:
+    one with more than a hundred embedded requests, ones embedding a
+    Forward_Open and a Forward_Close, ones embedding five of each, and ones
+    with malformed offset tables.  Every reply is checked and any mismatch
+    makes the test fail.
+    Stop other adapters on port 44818 first.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "test_common.h"
+
+
+//-----<Originator>-------------------------------------------------------------
+
+static int      s_failures;
+
+const uint8_t   MR_PATH[] = { 0x20, 0x02, 0x24, 0x01 };
+
+
+static void check( bool aOk, const char* aWhat )
+{
+    if( !aOk )
+    {
+        fprintf( stderr, "FAIL: %s\n", aWhat );
+        ++s_failures;
+    }
+}
+
+
+/// Build a Forward_Open of a class 3 connection to the message router.
+static int forwardOpen( BufWriter aOut, uint16_t aSerial )
+{
+    const uint8_t   cm_open[] = { 0x54, 2, 0x20, 6, 0x24, 1 };
+    uint8_t*        start = aOut.data();
+
+    aOut.append( cm_open, sizeof cm_open );
+    aOut.put8( 0x0a ).put8( 0x0e ).put32( 0 ).put32( 0x2000 + aSerial );
+    aOut.put16( aSerial ).put16( 0x1234 ).put32( 0x5678 );
+    aOut.put8( 0 ).fill( 3 );
+    aOut.put32( 1000000 ).put16( 0x4000 | 500 ).put32( 1000000 ).put16( 0x4000 | 500 );
+    aOut.put8( 0xa3 ).put8( sizeof MR_PATH / 2 ).append( MR_PATH, sizeof MR_PATH );
+
+    return aOut.data() - start;
+}
+
+
+/// Build the Forward_Close of what forwardOpen( @a aSerial ) opened.
+static int forwardClose( BufWriter aOut, uint16_t aSerial )
+{
+    const uint8_t   cm_close[] = { 0x4e, 2, 0x20, 6, 0x24, 1 };
+    uint8_t*        start = aOut.data();
+
+    aOut.append( cm_close, sizeof cm_close );
+    aOut.put8( 0x0a ).put8( 0x0e );
+    aOut.put16( aSerial ).put16( 0x1234 ).put32( 0x5678 );
+    aOut.put8( sizeof MR_PATH / 2 ).put8( 0 ).append( MR_PATH, sizeof MR_PATH );
+
+    return aOut.data() - start;
+}
+
+
+/// Build a Multiple Service Packet of @a aCount requests into @a aOut, with
+/// their offsets as given, and return its length.
+static int msp( BufWriter aOut, unsigned aCount, const uint16_t* aOffsets,
+        const uint8_t* aData, int aLength )
+{
+    const uint8_t   mr[] = { 0x0a, 2, 0x20, 2, 0x24, 1 };
+    uint8_t*        start = aOut.data();
+
+    aOut.append( mr, sizeof mr ).put16( aCount );
+
+    for( unsigned i = 0; i < aCount; ++i )
+        aOut.put16( aOffsets[i] );
+
+    aOut.append( aData, aLength );
+
+    return aOut.data() - start;
+}
+
+
+/// Build a Multiple Service Packet of @a aCount well formed requests.
+static int msp( BufWriter aOut, unsigned aCount, const uint8_t* const* aRequests,
+        const int* aLengths )
+{
+    uint16_t    offsets[200];
+    uint8_t     data[1800];
+    BufWriter   w( data, sizeof data );
+
+    for( unsigned i = 0; i < aCount; ++i )
+    {
+        offsets[i] = 2 + 2 * aCount + ( w.data() - data );
+        w.append( aRequests[i], aLengths[i] );
+    }
+
+    return msp( aOut, aCount, offsets, data, w.data() - data );
+}
+
+
+/// Check the reply to a Multiple Service Packet of @a aCount requests and
+/// return the general status of embedded reply @a aIndex, or -1.
+static int embedded( const uint8_t* aReply, int aLength, unsigned aCount, unsigned aIndex )
+{
+    if( aLength < TEST_MR_REPLY + 6 || aReply[TEST_MR_REPLY] != ( 0x0a | 0x80 ) )
+        return -1;
+
+    const uint8_t*  data = aReply + TEST_MR_REPLY + 4;
+    int             size = aLength - TEST_MR_REPLY - 4;
+
+    BufReader       r( data, size );
+
+    if( r.get16() != aCount || aIndex >= aCount )
+        return -1;
+
+    unsigned offset = BufReader( data + 2 + 2 * aIndex, 2 ).get16();
+
+    if( int( offset ) + 4 > size )
+        return -1;
+
+    return data[offset + 2];
+}
+
+//-----</Originator>------------------------------------------------------------
+
+
+int main( int argc, char** argv )
+{
+    CipStackInit( 0x4321 );
+
+    ConfigureNetworkInterface( "127.0.0.1", "255.0.0.0", "127.0.0.1" );
+
+    if( NetworkHandlerInitialize() != kEipStatusOk )
+    {
+        fprintf( stderr, "unable to start the stack\n" );
+        return 2;
+    }
+
+    if( !TestOpenSession() )
+        return 2;
+
+    uint8_t reply[2000];
+    uint8_t req[1900];
+    int     len;
+
+    const uint8_t get_vendor[] = { 0x0e, 3, 0x20, 1, 0x24, 1, 0x30, 1 };
+
+    // more than a hundred services
+    {
+        const unsigned  COUNT = 120;
+        const uint8_t*  requests[COUNT];
+        int             lengths[COUNT];
+
+        for( unsigned i = 0; i < COUNT; ++i )
+        {
+            requests[i] = get_vendor;
+            lengths[i]  = sizeof get_vendor;
+        }
+
+        len = msp( BufWriter( req, sizeof req ), COUNT, requests, lengths );
+        len = TestSendRRData( req, len, reply, sizeof reply );
+
+        check( len > TEST_MR_REPLY && reply[TEST_MR_REPLY + 2] == 0, "120 services: general status" );
+
+        for( unsigned i = 0; i < COUNT; ++i )
+        {
+            if( embedded( reply, len, COUNT, i ) != 0 )
+            {
+                check( false, "120 services: embedded reply" );
+                break;
+            }
+        }
+    }
+
+    // an embedded Forward_Open of a class 3 connection, then its Forward_Close
+    {
+        uint8_t     fo[100];
+        uint8_t     fc[40];
+
+        const uint8_t*  requests[] = { get_vendor, fo };
+        int             lengths[]  = { sizeof get_vendor,
+                                       forwardOpen( BufWriter( fo, sizeof fo ), 7 ) };
+
+        len = msp( BufWriter( req, sizeof req ), 2, requests, lengths );
+        len = TestSendRRData( req, len, reply, sizeof reply );
+
+        check( embedded( reply, len, 2, 0 ) == 0, "forward open: get" );
+        check( embedded( reply, len, 2, 1 ) == 0, "forward open: open" );
+
+        requests[1] = fc;
+        lengths[1]  = forwardClose( BufWriter( fc, sizeof fc ), 7 );
+
+        len = msp( BufWriter( req, sizeof req ), 2, requests, lengths );
+        len = TestSendRRData( req, len, reply, sizeof reply );
+
+        check( embedded( reply, len, 2, 1 ) == 0, "forward close" );
+    }
+
+    // More Connection Manager services in one packet than the request arena
+    // holds ConnectionData for at once, each must give its own back.
+    {
+        const unsigned  COUNT = 5;
+        uint8_t         cm[COUNT][100];
+        const uint8_t*  requests[COUNT];
+        int             lengths[COUNT];
+
+        for( unsigned i = 0; i < COUNT; ++i )
+        {
+            requests[i] = cm[i];
+            lengths[i]  = forwardOpen( BufWriter( cm[i], sizeof cm[i] ), 20 + i );
+        }
+
+        len = msp( BufWriter( req, sizeof req ), COUNT, requests, lengths );
+        len = TestSendRRData( req, len, reply, sizeof reply );
+
+        for( unsigned i = 0; i < COUNT; ++i )
+            check( embedded( reply, len, COUNT, i ) == 0, "5 forward opens" );
+
+        for( unsigned i = 0; i < COUNT; ++i )
+            lengths[i] = forwardClose( BufWriter( cm[i], sizeof cm[i] ), 20 + i );
+
+        len = msp( BufWriter( req, sizeof req ), COUNT, requests, lengths );
+        len = TestSendRRData( req, len, reply, sizeof reply );
+
+        for( unsigned i = 0; i < COUNT; ++i )
+            check( embedded( reply, len, COUNT, i ) == 0, "5 forward closes" );
+    }
+
+    // malformed offset tables
+    {
+        uint8_t data[2 * sizeof get_vendor];
+
+        memcpy( data, get_vendor, sizeof get_vendor );
+        memcpy( data + sizeof get_vendor, get_vendor, sizeof get_vendor );
+
+        const uint16_t dup[]     = { 6, 6 };
+        const uint16_t beyond[]  = { 6, 6 + 2 * sizeof get_vendor };
+        const uint16_t reverse[] = { 6 + sizeof get_vendor, 6 };
+
+        struct
+        {
+            const char*     what;
+            unsigned        count;
+            const uint16_t* offsets;
+            int             length;
+            int             status;
+        } cases[] = {
+            { "duplicate offsets",  2, dup,     sizeof data, kCipErrorInvalidParameter },
+            { "offset beyond data", 2, beyond,  sizeof data, kCipErrorInvalidParameter },
+            { "offsets backwards",  2, reverse, sizeof data, kCipErrorInvalidParameter },
+            { "count too large",    200, dup,   0,           kCipErrorNotEnoughData },
+        };
+
+        for( unsigned i = 0; i < sizeof cases / sizeof cases[0]; ++i )
+        {
+            // too large a count has no table behind it
+            len = cases[i].length ?
+                msp( BufWriter( req, sizeof req ), cases[i].count, cases[i].offsets,
+                    data, cases[i].length ) :
+                msp( BufWriter( req, sizeof req ), 0, NULL, NULL, 0 );
+
+            if( !cases[i].length )
+                BufWriter( req + 6, 2 ).put16( cases[i].count );
+
+            len = TestSendRRData( req, len, reply, sizeof reply );
+
+            check( len > TEST_MR_REPLY + 2 && reply[TEST_MR_REPLY + 2] == cases[i].status, cases[i].what );
+        }
+    }
+
+    // still serving after all that
+    len = TestSendRRData( get_vendor, sizeof get_vendor, reply, sizeof reply );
+    check( len > TEST_MR_REPLY + 2 && reply[TEST_MR_REPLY + 2] == 0, "adapter alive" );
+
+    printf( "failures:%d\n", s_failures );
+
+    NetworkHandlerFinish();
+    ShutdownCipStack();
+
+    return s_failures ? 1 : 0;
+}
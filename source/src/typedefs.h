@@ -62,6 +62,7 @@ enum EipStatus
 {
     kEipStatusOk      = 0,
     kEipStatusOkSend  = 1,
+    kEipStatusPending = 2,      ///< a service's reply follows, see DeferService()
     kEipStatusError   = -1,
 };
 
@@ -0,0 +1,130 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#ifndef CIPSTER_ARENA_H_
+#define CIPSTER_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+
+
+/**
+ * Class Arena
+ * hands out memory from a fixed buffer by bumping a pointer and takes it all
+ * back at once with Reset(), so a temporary costs a few instructions and never
+ * touches the heap.  Nothing obtained from it is destroyed, hence New() only
+ * accepts trivially destructible types.  Use FixedArena to get one.
+ */
+class Arena
+{
+public:
+    /**
+     * Function Alloc
+     * returns @a aSize bytes aligned to @a aAlign, a power of two, or NULL
+     * if the arena is exhausted.
+     */
+    void* Alloc( size_t aSize, size_t aAlign = sizeof(void*) )
+    {
+        size_t start = ( used + aAlign - 1 ) & ~( aAlign - 1 );
+
+        if( start + aSize > capacity )
+            return NULL;
+
+        used = start + aSize;
+
+        if( used > high_water )
+            high_water = used;
+
+        return buf + start;
+    }
+
+    /// Default construct a T in the arena, or return NULL if exhausted.
+    template< typename T >
+    T* New()
+    {
+        static_assert( std::is_trivially_destructible<T>::value,
+            "Arena never runs destructors" );
+
+        void* p = Alloc( sizeof(T), alignof(T) );
+
+        return p ? new( p ) T() : NULL;
+    }
+
+    /// Take back everything handed out so far.
+    void Reset()                    { used = 0; }
+
+    /// Take back everything handed out since Used() returned @a aUsed.
+    void Rewind( size_t aUsed )     { if( aUsed < used ) used = aUsed; }
+
+    size_t  Used() const            { return used; }
+    size_t  Capacity() const        { return capacity; }
+
+    /// Most bytes ever in use at once, to size the arena.
+    size_t  HighWater() const       { return high_water; }
+
+protected:
+    Arena( uint8_t* aBuf, size_t aCapacity ) :
+        buf( aBuf ),
+        capacity( aCapacity ),
+        used( 0 ),
+        high_water( 0 )
+    {}
+
+    uint8_t*    buf;
+    size_t      capacity;
+    size_t      used;
+    size_t      high_water;
+
+private:
+    // only through FixedArena, and never copied
+    Arena( const Arena& );
+    Arena& operator=( const Arena& );
+};
+
+
+/**
+ * Class FixedArena
+ * is an Arena over N bytes of its own.
+ */
+template< size_t N >
+class FixedArena : public Arena
+{
+public:
+    FixedArena() :
+        Arena( storage, N )
+    {}
+
+private:
+    alignas( max_align_t ) uint8_t storage[N];
+};
+
+
+/**
+ * Class ArenaScope
+ * takes back what was handed out from an Arena during its lifetime when it
+ * goes out of scope, however the scope is left.  What was in use before it
+ * stays in use, so scopes nest.
+ */
+class ArenaScope
+{
+public:
+    ArenaScope( Arena& aArena ) :
+        arena( aArena ),
+        mark( aArena.Used() )
+    {}
+
+    ~ArenaScope()                   { arena.Rewind( mark ); }
+
+private:
+    Arena&  arena;
+    size_t  mark;
+
+    ArenaScope( const ArenaScope& );
+    ArenaScope& operator=( const ArenaScope& );
+};
+
+#endif  // CIPSTER_ARENA_H_
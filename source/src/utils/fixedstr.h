@@ -0,0 +1,92 @@
+/*******************************************************************************
+ * Copyright (c) 2016-2018, SoftPLC Corporation.
+ *
+ ******************************************************************************/
+
+#ifndef CIPSTER_FIXEDSTR_H_
+#define CIPSTER_FIXEDSTR_H_
+
+/**
+ * Class StrBuf
+ * is text held in a buffer of fixed capacity, never on the heap, so it may
+ * be built on a hot path, e.g. for a trace argument.  Appending past the
+ * capacity truncates.  Use FixedStr to get one.
+ */
+class StrBuf
+{
+public:
+    const char* c_str() const   { return buf; }
+    int         size() const    { return len; }
+    bool        empty() const   { return !len; }
+
+    StrBuf& operator += ( const char* aText );
+    StrBuf& operator += ( const StrBuf& aText )     { return *this += aText.c_str(); }
+    StrBuf& operator += ( char aChar );
+
+    /// Append printf() style, return how many chars were appended.
+    int Printf( const char* aFormat, ... )
+#if defined(__GNUC__)
+        __attribute__(( format( printf, 2, 3 ) ))
+#endif
+        ;
+
+protected:
+    StrBuf( char* aBuf, int aCapacity ) :
+        buf( aBuf ),
+        capacity( aCapacity ),
+        len( 0 )
+    {
+        buf[0] = 0;
+    }
+
+    char*   buf;
+    int     capacity;   // including the terminating nul
+    int     len;
+
+private:
+    // only through FixedStr
+    StrBuf( const StrBuf& );
+    StrBuf& operator=( const StrBuf& );
+};
+
+
+/**
+ * Class FixedStr
+ * is a StrBuf of up to N - 1 chars, cheap enough to return by value.
+ */
+template< int N >
+class FixedStr : public StrBuf
+{
+public:
+    FixedStr() :
+        StrBuf( storage, N )
+    {}
+
+    FixedStr( const char* aText ) :
+        StrBuf( storage, N )
+    {
+        *this += aText;
+    }
+
+    FixedStr( const FixedStr& aOther ) :
+        StrBuf( storage, N )
+    {
+        *this += aOther.c_str();
+    }
+
+    FixedStr& operator=( const FixedStr& aOther )
+    {
+        if( this != &aOther )
+        {
+            len = 0;
+            buf[0] = 0;
+            *this += aOther.c_str();
+        }
+        return *this;
+    }
+
+private:
+    char    storage[N];
+};
+
+#endif  // CIPSTER_FIXEDSTR_H_
@@ -5,6 +5,7 @@
  ******************************************************************************/
 
 #include <stdarg.h>
+#include <stdio.h>
 
 #include "../cip/cipcommon.h"
 
@@ -49,3 +50,46 @@ std::string StrPrintf( const char* aFormat, ... )
     return ret;
 }
 
+
+
+StrBuf& StrBuf::operator += ( const char* aText )
+{
+    while( *aText && len < capacity - 1 )
+        buf[len++] = *aText++;
+
+    buf[len] = 0;
+    return *this;
+}
+
+
+StrBuf& StrBuf::operator += ( char aChar )
+{
+    if( len < capacity - 1 )
+        buf[len++] = aChar;
+
+    buf[len] = 0;
+    return *this;
+}
+
+
+int StrBuf::Printf( const char* aFormat, ... )
+{
+    va_list     args;
+    int         room = capacity - len;
+
+    va_start( args, aFormat );
+    int wanted = vsnprintf( buf + len, room, aFormat, args );
+    va_end( args );
+
+    if( wanted < 0 )
+    {
+        buf[len] = 0;
+        return 0;
+    }
+
+    // truncated output still fills the room
+    int added = wanted < room ? wanted : room - 1;
+
+    len += added;
+    return added;
+}